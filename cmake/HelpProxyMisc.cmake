@@ -1,5 +1,6 @@
 include(CheckFunctionExists)
 include(CheckLibraryExists)
+include(CheckSymbolExists)
 
 if (MINGW)
     get_filename_component(PROXY_MINGW_PREFIX "$ENV{MINGW_PREFIX}/$ENV{MINGW_CHOST}" REALPATH BASE_DIR "")
@@ -39,6 +40,21 @@ function(proxy_require_lib_with_func FUNC_NAME LIB_NAME VAR_NAME LIBS_LISTNAME D
     endif ()
 endfunction(proxy_require_lib_with_func)
 
+function(proxy_optional_lib_with_func FUNC_NAME LIB_NAME VAR_NAME LIBS_LISTNAME DEFS_LISTNAME)
+    check_library_exists("${LIB_NAME}" "${FUNC_NAME}" "" ${VAR_NAME})
+    if (${${VAR_NAME}})
+        global_proxy_list_append(${LIBS_LISTNAME} ${LIB_NAME})
+        global_proxy_list_append(${DEFS_LISTNAME} ${VAR_NAME})
+    endif ()
+endfunction(proxy_optional_lib_with_func)
+
+function(proxy_optional_symbol SYMBOL_NAME HEADER_NAME VAR_NAME DEFS_LISTNAME)
+    check_symbol_exists("${SYMBOL_NAME}" "${HEADER_NAME}" "${VAR_NAME}")
+    if (${${VAR_NAME}})
+        global_proxy_list_append(${DEFS_LISTNAME} ${VAR_NAME})
+    endif ()
+endfunction(proxy_optional_symbol)
+
 function(proxy_option_to_definition _OPTION _DEFINITION DEFS_LISTNAME)
     if (${${_OPTION}})
         global_proxy_list_append(${DEFS_LISTNAME} ${_DEFINITION})
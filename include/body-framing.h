@@ -0,0 +1,35 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_BODY_FRAMING_H
+#define CMAKE_TINYPROXY_BODY_FRAMING_H
+
+#include <stddef.h>
+
+// how the end of a message body is found
+#define BODY_NONE        0 // there is no body at all
+#define BODY_LENGTH      1 // after Content-Length bytes
+#define BODY_CHUNKED     2 // after the last chunk and the trailers
+#define BODY_UNTIL_CLOSE 3 // when the connection is closed
+
+// Follows a message body while it is relayed, to tell where it ends without buffering it.
+struct body_framing_s
+{
+  int mode;
+  int state;                    // position in the chunked syntax
+  unsigned long long remaining; // bytes left in the body (BODY_LENGTH) or in the chunk
+  unsigned int complete;        // boolean
+};
+
+// A negative length stands for an unknown one, and is only valid with BODY_UNTIL_CLOSE.
+extern void body_framing_init(struct body_framing_s *body, int mode, long long length);
+
+// Account for the next "len" bytes of the body. A malformed chunked body falls back to
+// BODY_UNTIL_CLOSE.
+//
+// Returns: the number of bytes which belong to the body, less than "len" when the body ended
+//          within the data
+extern size_t body_framing_feed(struct body_framing_s *body, const char *data, size_t len);
+
+#endif // CMAKE_TINYPROXY_BODY_FRAMING_H
@@ -34,6 +34,12 @@ extern size_t buffer_size(struct buffer_s *buffptr);
 // add a new line to the given buffer. The data IS copied into the structure
 extern int add_to_buffer(struct buffer_s *buffptr, unsigned char *data, size_t length);
 
+// move up to "length" bytes from the top of the buffer into "data", returns the number moved
+extern size_t take_from_buffer(struct buffer_s *buffptr, unsigned char *data, size_t length);
+
+// the last "length" bytes of the buffer, at most what the last read_buffer() returned
+extern const unsigned char *buffer_tail(struct buffer_s *buffptr, size_t length);
+
 extern ssize_t read_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr);
 extern ssize_t write_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr);
 extern ssize_t write_websocket_buffer(pproxy_t proxy, struct lws *wsi, struct buffer_s *buffptr);
@@ -30,7 +30,10 @@ typedef enum
   CHILD_MAXSPARESERVERS,
   CHILD_MINSPARESERVERS,
   CHILD_STARTSERVERS,
-  CHILD_MAXREQUESTSPERCHILD
+  CHILD_MAXREQUESTSPERCHILD,
+  CHILD_EVENTLOOP,
+  CHILD_MAXCONNECTIONSPERCHILD,
+  CHILD_REUSEPORT
 } child_config_t;
 
 extern short int child_pool_create(pproxy_t proxy);
@@ -74,6 +74,22 @@ struct config_s
 #endif // UPSTREAM_SUPPORT
   char *pidpath;
   unsigned int idletimeout;
+
+  // idle connections to the servers kept open by each child for reuse (0 disables), and for how
+  // many seconds
+  unsigned int server_keepalive;
+  unsigned int server_keepalive_timeout;
+
+  // persistent client connections, and how many seconds they may stay idle between requests
+  unsigned int client_keepalive; // boolean
+  unsigned int client_keepalive_timeout;
+
+  // seconds to connect to a server, all of its addresses together
+  unsigned int connect_timeout;
+
+  // names cached in the memory shared by the children, 0 leaves the lookups to getaddrinfo()
+  unsigned int dns_cache;
+
   char *bind_address;
   unsigned int bindsame;
 
@@ -101,6 +117,9 @@ struct config_s
 extern int try_load_config_file(const char *config_fname, struct config_s *conf,
                                 struct config_s *defaults);
 
+// Release everything the config holds, and zero it.
+extern void free_config(struct config_s *conf);
+
 int config_compile_regex(void);
 
 #endif // TINYPROXY_CONF_H
@@ -16,12 +16,14 @@ typedef struct
   acl_access_t access;
 } conf_acl_rule_t;
 
-#define MAX_ACL_RULES ((size_t) 1000)
+#define MAX_ACL_RULES ((size_t) 1000000)
 
 typedef struct
 {
-  conf_acl_rule_t rules[MAX_ACL_RULES];
+  conf_acl_rule_t *rules; // grows as the rules are added
   size_t count;
+  size_t size;
+  unsigned int cache; // ACLCache: the clients whose verdict is kept, 0 for none
 } *pconf_acl_t;
 
 CREATE_DECL(pconf_acl_t);
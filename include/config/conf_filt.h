@@ -21,6 +21,8 @@ typedef struct
   bool does_full_url_filtering; // full url filtering if true, else by host
   bool is_extended;             // extended regexp in filter list
   bool is_case_sensitive;       // case sensitive regexp in filter list
+
+  unsigned int cache; // FilterCache: the verdicts kept by each child, 0 for none
 } *pconf_filt_t;
 
 CREATE_DECL(pconf_filt_t);
@@ -20,9 +20,13 @@
 #define TINYPROXY_CONNS_H
 
 #include "main.h"
+#include "body-framing.h"
 #include "misc/hashmap.h"
 #include "tinyproxy.h"
 
+// default of ClientKeepAliveTimeout, in seconds
+#define CLIENT_KEEPALIVE_TIMEOUT 15
+
 // connection Definition
 struct conn_s
 {
@@ -52,6 +56,24 @@ struct conn_s
     long int client;
   } content_length;
 
+  // where the response body from the remote server ends
+  struct body_framing_s response_body;
+
+  // the server was asked to keep the connection open (ServerKeepAlive). It is cleared as soon as
+  // the connection can't be reused, for it then goes back to the pool under the host and port
+  // below once the response has been relayed.
+  unsigned int server_keepalive; // boolean
+  char *server_host;
+  int server_port;
+
+  // the connection to the server came out of the pool, and the server may have closed it since
+  // (server_reused), or it is the new one the request was sent again on (server_retried)
+  unsigned int server_reused, server_retried; // booleans
+
+  // the client keeps the connection open for another request (ClientKeepAlive), cleared as soon
+  // as the response can't be delimited
+  unsigned int client_keepalive; // boolean
+
   // store the server's IP (for BindSame)
   char *server_ip_addr;
 
@@ -81,4 +103,8 @@ extern struct conn_s *initialize_conn(int client_fd, const char *ipaddr, const c
 
 extern void destroy_conn(pproxy_t proxy, struct conn_s *connptr);
 
+// Get a persistent connection ready for the next request of the client. What the client sent
+// past the previous request stays in the client buffer.
+extern void reset_conn(pproxy_t proxy, struct conn_s *connptr);
+
 #endif // TINYPROXY_CONNS_H
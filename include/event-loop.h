@@ -0,0 +1,52 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_EVENT_LOOP_H
+#define CMAKE_TINYPROXY_EVENT_LOOP_H
+
+#include <stddef.h>
+
+// interest and readiness flags passed to and from the loop
+#define EVENT_READ    (1u << 0)
+#define EVENT_WRITE   (1u << 1)
+#define EVENT_HUP     (1u << 2) // error or hang up, reported even if not requested
+#define EVENT_TIMEOUT (1u << 3) // the idle deadline set by event_loop_set_timeout() expired
+
+// The loop is opaque, use it like a cookie.
+typedef struct event_loop_s *pevent_loop_t;
+
+// Called once per ready descriptor with the union of the ready flags. The callback may add, modify
+// or remove any descriptor (including its own) while the loop is dispatching.
+typedef void (*event_callback_t)(pevent_loop_t loop, int fd, unsigned int events, void *data);
+
+// Create a loop backed by epoll where available and by select() elsewhere.
+//
+// Returns NULL if memory or the kernel object could not be allocated.
+extern pevent_loop_t event_loop_create(void);
+extern void event_loop_delete(pevent_loop_t loop);
+
+// Register a descriptor.  A descriptor can be registered only once.
+//
+// Returns: 0 on success
+//          negative on error (already registered, out of memory, fd not supported by the backend)
+extern int event_loop_add(pevent_loop_t loop, int fd, unsigned int events, event_callback_t callback,
+                          void *data);
+extern int event_loop_modify(pevent_loop_t loop, int fd, unsigned int events);
+extern int event_loop_remove(pevent_loop_t loop, int fd);
+
+// Arm (or with 0 seconds disarm) the idle deadline of a registered descriptor. When it expires the
+// callback is invoked with EVENT_TIMEOUT and the deadline is disarmed.
+extern int event_loop_set_timeout(pevent_loop_t loop, int fd, unsigned int seconds);
+
+// Wait at most timeout_ms milliseconds (-1 waits forever) and dispatch the ready descriptors and
+// the expired deadlines.
+//
+// Returns: the number of callbacks invoked
+//          negative on error
+extern int event_loop_run_once(pevent_loop_t loop, int timeout_ms);
+
+// Number of registered descriptors.
+extern size_t event_loop_count(pevent_loop_t loop);
+
+#endif // CMAKE_TINYPROXY_EVENT_LOOP_H
@@ -0,0 +1,66 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_HEAD_WRITER_H
+#define CMAKE_TINYPROXY_HEAD_WRITER_H
+
+#include <stddef.h>
+
+#ifndef MINGW
+#include <sys/uio.h>
+#endif
+
+// the most pieces, and bytes of formatted text, gathered before some have to be sent
+#define HEAD_WRITER_PIECES 256
+#define HEAD_WRITER_TEXT   4096
+
+#ifdef MINGW
+// there is no writev(), the pieces are copied together when sent
+typedef struct
+{
+  void *iov_base;
+  size_t iov_len;
+} head_piece_t;
+#else
+typedef struct iovec head_piece_t;
+#endif
+
+// A message head being forwarded: the request or status line, the header lines and the blank line
+// ending them. They are gathered instead of being written one by one, and go out with a single
+// sendmsg() when the writer is flushed. Pieces only go out sooner when the writer is full, and the
+// kernel is then told that more is coming (MSG_MORE).
+struct head_writer_s
+{
+  size_t count;    // pieces gathered
+  size_t text_len; // bytes of text used by them
+  head_piece_t pieces[HEAD_WRITER_PIECES];
+  char text[HEAD_WRITER_TEXT]; // the formatted pieces
+};
+
+// Empty the writer, dropping what was gathered.
+extern void head_writer_init(struct head_writer_s *writer);
+
+// Add bytes to the head. They are NOT copied, and must stay until the writer is flushed.
+//
+// Returns: 0 on success
+//          negative if the writer was full and could not be emptied into fd
+extern int head_writer_add(struct head_writer_s *writer, int fd, const void *buf, size_t len);
+
+// Add a "name: value" header line, see head_writer_add(). Neither is copied.
+extern int head_writer_header(struct head_writer_s *writer, int fd, const char *name,
+                              const char *value);
+
+// Add text formatted as write_message() does. It is copied into the writer.
+//
+// Returns: 0 on success
+//          negative on error
+extern int head_writer_message(struct head_writer_s *writer, int fd, const char *fmt, ...);
+
+// Send everything gathered to fd. The writer is empty afterwards, whatever happens.
+//
+// Returns: 0 on success
+//          negative on error
+extern int head_writer_flush(struct head_writer_s *writer, int fd);
+
+#endif // CMAKE_TINYPROXY_HEAD_WRITER_H
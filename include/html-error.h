@@ -24,6 +24,7 @@ struct conn_s;
 extern int add_new_errorpage(char *filepath, unsigned int errornum);
 extern int send_http_error_message(struct conn_s *connptr);
 extern int indicate_http_error(struct conn_s *connptr, int number, const char *message, ...);
+extern void forget_http_error(struct conn_s *connptr);
 extern int add_error_variable(struct conn_s *connptr, const char *key, const char *val);
 extern int send_html_file(FILE *infile, struct conn_s *connptr);
 extern int send_http_headers(struct conn_s *connptr, int code, const char *message);
@@ -28,6 +28,7 @@
 
 // global structures used in the program
 extern struct config_s config;
+extern struct config_s config_defaults; // the command line, under the config file
 extern unsigned int received_sighup; // boolean
 
 #endif // TINYPROXY_MAIN_H
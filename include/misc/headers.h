@@ -0,0 +1,114 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_HEADERS_H
+#define CMAKE_TINYPROXY_HEADERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// The headers of a request or a response. They are kept in the order they were added, in a dense
+// array, and found by their case-insensitive name through an open-addressing index of it. A name
+// can be added more than once. Just use the pheaders_t like a cookie.
+typedef struct headers_s *pheaders_t;
+typedef size_t headers_iter;
+
+// The well-known headers, those the proxy itself looks at, get an id when they are added (like the
+// static table of HPACK). They are found by id without hashing their name, and sets of them are
+// bitmasks of HEADER_BIT(). The other headers are HEADER_OTHER.
+typedef enum
+{
+  HEADER_OTHER = 0,
+  HEADER_CONNECTION,
+  HEADER_CONTENT_LENGTH,
+  HEADER_CONTENT_TYPE,
+  HEADER_COOKIE,
+  HEADER_HOST,
+  HEADER_KEEP_ALIVE,
+  HEADER_LOCATION,
+  HEADER_PROXY_AUTHENTICATE,
+  HEADER_PROXY_AUTHORIZATION,
+  HEADER_PROXY_CONNECTION,
+  HEADER_TE,
+  HEADER_TRAILERS,
+  HEADER_TRANSFER_ENCODING,
+  HEADER_UPGRADE,
+  HEADER_VIA,
+  HEADER_ID_COUNT
+} header_id_t;
+
+#define HEADER_BIT(id) ((uint32_t)1 << (id))
+
+// The id of a header name, whatever its case, through a perfect hash of the well-known names.
+//
+// Returns: HEADER_OTHER if the name is not a well-known one
+extern header_id_t header_id_of(const char *name);
+
+// Create an empty set of headers.
+//
+// Returns: NULL if memory could not be allocated.
+extern pheaders_t headers_create(void);
+
+// Deletes the headers, with the names and values they copied.
+//
+// Returns: 0 on success
+//          negative if a NULL "headers" was supplied
+extern int headers_delete(pheaders_t headers);
+
+// Add a header after the others. The name and the NULL terminated value are copied, for the headers
+// which are not in the received message.
+//
+// Returns: negative on error
+//          0 upon successful insert
+extern int headers_insert(pheaders_t headers, const char *name, const char *value);
+
+// Add a header after the others without copying it: the name and the value are NULL terminated
+// slices of a buffer which outlives the headers, such as the one the message was received into.
+// The value may be modified in place through headers_entry_by_name(), "len" is its length with the
+// NULL.
+//
+// Returns: negative on error
+//          0 upon successful insert
+extern int headers_insert_view(pheaders_t headers, char *name, char *value, size_t len);
+
+// Get the value of the first header with the well-known id, as headers_entry_by_name() does.
+extern ssize_t headers_entry_by_id(pheaders_t headers, header_id_t id, char **value);
+
+// Get the value of the first header with the name. The value belongs to the headers (or to the
+// buffer of a view), it can be modified in place but not freed.
+//
+// Returns: negative upon error
+//          0 if no header is found
+//          length of the value, with its NULL
+extern ssize_t headers_entry_by_name(pheaders_t headers, const char *name, char **value);
+
+// Count the headers with the name.
+//
+// Returns: negative upon an error
+//          zero if no header is found
+//          count found (positive value)
+extern ssize_t headers_search(pheaders_t headers, const char *name);
+
+// Count the headers with the well-known id, as headers_search() does.
+extern ssize_t headers_search_id(pheaders_t headers, header_id_t id);
+
+// Remove every header whose well-known id is in the bitmask "ids", see headers_remove().
+extern ssize_t headers_remove_ids(pheaders_t headers, uint32_t ids);
+
+// Remove every header with the name. The values got before stay valid until headers_delete().
+//
+// Returns: negative upon error
+//          0 if the name was not found
+//          positive count of headers removed
+extern ssize_t headers_remove(pheaders_t headers, const char *name);
+
+// Get the next header in the order they were added, "iter" starts at 0. "id" may be NULL.
+//
+// Returns: 1 with the name, the value and the id of the header
+//          0 after the last one
+extern int headers_next(pheaders_t headers, headers_iter *iter, char **name, char **value,
+                        header_id_t *id);
+
+#endif // CMAKE_TINYPROXY_HEADERS_H
@@ -48,5 +48,6 @@ extern char *debugging_strdup(const char *s, const char *file, unsigned long lin
 // allocate memory from the "shared" region of memory.
 extern void *malloc_shared_memory(size_t size);
 extern void *calloc_shared_memory(size_t nmemb, size_t size);
+extern void free_shared_memory(void *ptr, size_t size);
 
 #endif // TINYPROXY_HEAP_H
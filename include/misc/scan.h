@@ -0,0 +1,29 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_SCAN_H
+#define CMAKE_TINYPROXY_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// set in a mark of scan_head() for a colon, clear for a line feed
+#define SCAN_COLON ((uint32_t)1 << 31)
+
+// Find the line feeds and the colons of data[from, len), in one pass over the block. They are
+// stored in order into marks as their offset in data, with SCAN_COLON set for the colons. The
+// first colon of every line is always among them, the others may or may not be (the vector
+// kernels report all of them, the memchr() one does not look past the first). The offsets must
+// fit in 31 bits. The kernel (AVX2, SSE2 or plain C) is chosen at runtime, by what the processor
+// supports.
+//
+// Returns: the number of marks stored; if it is "max", the scan stopped at the last of them and
+//          should resume right past it
+extern size_t scan_head(const char *data, size_t from, size_t len, uint32_t *marks, size_t max);
+
+// Break a header value apart into its tokens, in place: every separator of RFC 2616 (and white
+// space) becomes a NULL.
+extern void scan_split_tokens(char *value);
+
+#endif // CMAKE_TINYPROXY_SCAN_H
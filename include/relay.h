@@ -0,0 +1,34 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_RELAY_H
+#define CMAKE_TINYPROXY_RELAY_H
+
+#include "conns.h"
+#include "event-loop.h"
+#include "tinyproxy.h"
+
+// Relay the bytes between the client and the server until one of them closes the connection or
+// the idle timeout expires. Blocks the caller for the whole lifetime of the connection. When the
+// client keeps its connection, the relay stops as soon as the response is complete and leaves
+// connptr->client_keepalive set.
+extern void relay_connection(pproxy_t proxy, struct conn_s *connptr);
+
+// Called by the loop once a response was relayed to a client which keeps its connection. The
+// callee takes the connection over, already reset for the next request.
+typedef void (*relay_kept_t)(pevent_loop_t loop, struct conn_s *connptr, void *data);
+
+// Hand the connection over to the loop, which relays it without blocking and destroys it once
+// the relay is over (or passes it to "kept").
+//
+// Returns: 0 on success, the loop owns the connection now
+//          -EPIPE if the connection broke already, the caller still owns it but can only destroy it
+//          another negative on error, the caller still owns the connection and may relay it itself
+extern int relay_connection_in_loop(pproxy_t proxy, pevent_loop_t loop, struct conn_s *connptr,
+                                    relay_kept_t kept, void *data);
+
+// Number of connections currently relayed by the loops of this process.
+extern size_t relay_active_count(void);
+
+#endif // CMAKE_TINYPROXY_RELAY_H
@@ -21,6 +21,11 @@
 #define TINYPROXY_REQS_H
 
 #include "common.h"
+#include "conns.h"
+#include "event-loop.h"
+#include "relay.h"
+#include "request-parser.h"
+#include "subservice/acl.h"
 #include "tinyproxy.h"
 
 // port constants for HTTP (80) and SSL (443)
@@ -39,7 +44,29 @@ struct request_s
   char *path;
 };
 
+// Take the client of fd on, if the ACL lets it in. Its name, when a rule needs it, is asked of
+// lookup, see check_acl(). If lookup answers -EINPROGRESS nothing is done: open the connection
+// again once the name is known.
+//
+// Returns: 0 with the connection in *connptr
+//          -EINPROGRESS
+//          -1 if the client was turned away (and its socket closed)
+extern int open_connection(pproxy_t proxy, int fd, acl_lookup_t lookup, void *data,
+                           struct conn_s **connptr);
+
 extern void handle_connection(pproxy_t proxy, int fd);
+extern void handle_connection_in_loop(pproxy_t proxy, struct conn_s *connptr, pevent_loop_t loop,
+                                      prequest_parser_t parser, relay_kept_t kept, void *data);
+
+// Number of requests sent by the loops of this process whose response they still wait for.
+extern size_t request_wait_count(void);
+
+// Start the next request of a persistent client over: the parser is reset and gets whatever
+// the client already sent past the previous request (taken out of the client buffer).
+//
+// Returns: REQUEST_PARSER_DONE if the whole head is there, REQUEST_PARSER_MORE, or a negative
+//          errno value
+extern int pipelined_request_head(struct conn_s *connptr, prequest_parser_t parser);
 extern void handle_websocket_connection(pproxy_t proxy, int fd);
 
 #endif // TINYPROXY_REQS_H
@@ -0,0 +1,73 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_REQUEST_PARSER_H
+#define CMAKE_TINYPROXY_REQUEST_PARSER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Limits of the request head (request line plus headers) we accept from a client. They should be
+// big enough to handle legitimate cases, but limited to avoid DoS.
+#define REQUEST_HEAD_MAX_LENGTH (512 * 1024)
+#define REQUEST_HEAD_MAX_LINES  10000
+
+// return values of request_parser_read()
+#define REQUEST_PARSER_DONE 1 // the head is complete
+#define REQUEST_PARSER_MORE 0 // the head is not complete yet, wait until the socket is readable
+
+// The parser is opaque, use it like a cookie.
+typedef struct request_parser_s *prequest_parser_t;
+
+extern prequest_parser_t request_parser_create(void);
+extern void request_parser_delete(prequest_parser_t parser);
+
+// Forget the head parsed so far, to parse the next request of a persistent connection. The
+// buffer is kept.
+extern void request_parser_reset(prequest_parser_t parser);
+
+// Receive whatever the client has sent so far (a single recv()) and parse it. Blocking and
+// non-blocking sockets are both fine: on the latter EAGAIN just means "more".
+//
+// Returns: REQUEST_PARSER_DONE or REQUEST_PARSER_MORE
+//          -ECONNRESET if the client closed the connection before the head was complete
+//          -ERANGE if the head exceeds the limits above
+//          -ETIMEDOUT if the socket is blocking and its read timeout expired
+//          other negative errno values on socket errors
+//          Errors are sticky, later calls return the same value without touching the socket.
+extern int request_parser_read(prequest_parser_t parser, int fd);
+
+// Like request_parser_read(), but nothing past the end of the head is taken off the socket: the
+// bytes are peeked at first, and only those of the head are received. For the response heads of
+// the servers, whose bodies are left to the relay.
+//
+// Returns: same as request_parser_read(), there is never any leftover
+extern int request_parser_read_head(prequest_parser_t parser, int fd);
+
+// Parse bytes which were already received from the client, such as pipelined requests which
+// arrived along with the previous one.
+//
+// Returns: same as request_parser_read(), except that the socket is not involved
+extern int request_parser_push(prequest_parser_t parser, const char *data, size_t len);
+
+// The request line (without the line ending) of a complete head.
+extern const char *request_parser_request_line(prequest_parser_t parser);
+
+// Walk the header fields of a complete head, continuation lines included. Start with *iter set to
+// zero. The field is NOT NUL terminated and keeps its line endings, the caller may modify it in
+// place. *colon is its first colon, which ends the name, or NULL if it has none.
+//
+// Returns: the length of the field
+//          0 once there are no more fields
+extern size_t request_parser_next_header(prequest_parser_t parser, size_t *iter, char **field,
+                                         char **colon);
+
+// The bytes which were received past the end of the head (the beginning of the body, or of the
+// tunnelled data for CONNECT).
+extern const char *request_parser_leftover(prequest_parser_t parser, size_t *len);
+
+// The bytes of the head received so far, complete or not.
+extern size_t request_parser_received(prequest_parser_t parser);
+
+#endif // CMAKE_TINYPROXY_REQUEST_PARSER_H
@@ -0,0 +1,78 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_RESOLVER_H
+#define CMAKE_TINYPROXY_RESOLVER_H
+
+#include "subservice/network.h"
+#include "tinyproxy.h"
+
+// how long a lookup waits for the nameservers, in seconds
+#define RESOLVER_TIMEOUT 5
+
+// Set up the resolver, in the parent before the children are created: the nameservers of
+// /etc/resolv.conf, the names of /etc/hosts, and the cache shared by all the children (DNSCache).
+extern void init_resolver(pproxy_t proxy);
+
+// Look up the addresses of host, of the given family (or AF_UNSPEC), with the port filled in.
+// Without DNSCache, this is getaddrinfo().
+//
+// Returns: 0, or an EAI_* error code. The list must be released with resolve_free().
+extern int resolve_host(pproxy_t proxy, const char *host, int port, int family,
+                        struct addrinfo **res);
+
+extern void resolve_free(struct addrinfo *res);
+
+// Look up the name of the numeric address ip (reverse DNS), cached by address.
+//
+// Returns: 0 with the name copied into name, or -1 if the address has none
+extern int resolve_addr(pproxy_t proxy, const char *ip, char *name, size_t len);
+
+#ifndef MINGW
+// A lookup (of the name of an address, or of the addresses of a host) which an event loop waits
+// for instead of the caller. The query is opaque, use it like a cookie.
+typedef struct resolver_query_s *presolver_query_t;
+
+// Same as resolve_addr(), but when the name has to be asked of the nameservers (DNSCache), the
+// query is only sent. The loop is to wait for resolve_query_fd() to be readable, for at most
+// resolve_query_timeout() seconds, and then call resolve_query_event(). Without DNSCache, the
+// lookup is resolve_addr() and blocks.
+//
+// Returns: 0 with the name copied into name
+//          -1 if the address has none
+//          -EINPROGRESS with the query in *query
+extern int resolve_addr_start(pproxy_t proxy, const char *ip, char *name, size_t len,
+                              presolver_query_t *query);
+
+// The socket the answers of the query arrive on. It changes when the next nameserver is asked.
+extern int resolve_query_fd(presolver_query_t query);
+extern unsigned int resolve_query_timeout(presolver_query_t query);
+
+// Take in the answers, or with timed_out move on to the next nameserver. The name is cached once
+// it is known.
+//
+// Returns: as resolve_addr_start(), -EINPROGRESS if the query is still waiting
+extern int resolve_query_event(pproxy_t proxy, presolver_query_t query, unsigned int timed_out,
+                               char *name, size_t len);
+
+// Same as resolve_host(), but when the addresses have to be asked of the nameservers (DNSCache),
+// the queries are only sent, and the loop waits for them as for resolve_addr_start(). Otherwise
+// (no DNSCache, a name of /etc/hosts or without a dot), the lookup is getaddrinfo() and blocks.
+//
+// Returns: as resolve_host(), or -EINPROGRESS with the query in *query
+extern int resolve_host_start(pproxy_t proxy, const char *host, int port, int family,
+                              struct addrinfo **res, presolver_query_t *query);
+
+// Same as resolve_query_event(), for a query of resolve_host_start(). When no nameserver
+// answered, getaddrinfo() is not tried.
+//
+// Returns: as resolve_host_start(), -EINPROGRESS if the query is still waiting
+extern int resolve_host_event(pproxy_t proxy, presolver_query_t query, unsigned int timed_out,
+                              struct addrinfo **res);
+
+// Close the socket of the query, and release it.
+extern void resolve_query_free(presolver_query_t query);
+#endif /* MINGW */
+
+#endif // CMAKE_TINYPROXY_RESOLVER_H
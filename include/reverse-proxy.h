@@ -20,6 +20,7 @@
 #define TINYPROXY_REVERSE_PROXY_H
 
 #include "conns.h"
+#include "misc/headers.h"
 #include "subservice/acl.h"
 #include "tinyproxy.h"
 
@@ -36,7 +37,7 @@ extern int reversepath_add(const char *path, const char *url,
                             struct reversepath **reversepath_list);
 extern struct reversepath *reversepath_get(char *url, struct reversepath *reverse);
 void free_reversepath_list(struct reversepath *reverse);
-extern char *reverse_rewrite_url(pproxy_t proxy, struct conn_s *connptr, phashmap_t hashofheaders,
+extern char *reverse_rewrite_url(pproxy_t proxy, struct conn_s *connptr, pheaders_t hashofheaders,
                                  char *url);
 
 #endif // TINYPROXY_REVERSE_PROXY_H
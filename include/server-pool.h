@@ -0,0 +1,34 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+#ifndef CMAKE_TINYPROXY_SERVER_POOL_H
+#define CMAKE_TINYPROXY_SERVER_POOL_H
+
+#include "upstream.h"
+
+// default of ServerKeepAliveTimeout, in seconds
+#define SERVER_KEEPALIVE_TIMEOUT 4
+
+// Is ServerKeepAlive enabled (and supported on this platform)?
+extern unsigned int server_pool_enabled(void);
+
+// Take an idle connection to host:port, made through the upstream proxy "up" (or directly if
+// NULL) from the local address "bind_addr" (BindSame, or NULL), out of the pool of this process.
+// The connection is in blocking mode.
+//
+// Returns: the socket, or -1 if there is none
+extern int server_pool_get(const char *host, int port, struct upstream *up,
+                           const char *bind_addr);
+
+// Keep the connection for a later request to host:port through "up" from "bind_addr".
+//
+// Returns: 0 if the pool owns the socket now
+//          -1 if it was not taken, the caller still owns the socket
+extern int server_pool_put(int fd, const char *host, int port, struct upstream *up,
+                           const char *bind_addr);
+
+// Close the connections which were idle for longer than ServerKeepAliveTimeout.
+extern void server_pool_expire(void);
+
+#endif // CMAKE_TINYPROXY_SERVER_POOL_H
@@ -25,15 +25,43 @@
 #define HOSTNAME_LENGTH 1024
 #define MAXLINE         (1024 * 4)
 
+// default of ConnectTimeout, in seconds
+#define CONNECT_TIMEOUT 10
+
+// milliseconds before the next address is tried while the previous attempts keep going
+#define CONNECT_ATTEMPT_DELAY 250
+
+// addresses of a host tried at most
+#define OPENSOCK_MAX_ADDRS 16
+
+#include "event-loop.h"
 #include "misc/list.h"
 #include "tinyproxy.h"
 
 extern int opensock(pproxy_t proxy, const char *host, int port, const char *bind_to);
-extern int listen_sock(pproxy_t proxy, const char *addr, uint16_t port, plist_t listen_fds);
+
+// Called by the loop once the connection of opensock_start() is made, with its socket, or could
+// not be, with -1 (errno set).
+typedef void (*opensock_done_t)(int sockfd, void *data);
+
+// Same as opensock(), but the lookup (as resolve_host_start()) and the connection attempts are
+// waited for by the event loop, which calls done at the end. The next address is tried after a
+// second instead of CONNECT_ATTEMPT_DELAY, the loop having no finer deadlines.
+//
+// Returns: the socket, or -1 (errno set), if it was over at once, without calling done
+//          -EINPROGRESS if done is to be called
+extern int opensock_start(pproxy_t proxy, pevent_loop_t loop, const char *host, int port,
+                          const char *bind_to, opensock_done_t done, void *data);
+extern int listen_sock(pproxy_t proxy, const char *addr, uint16_t port, plist_t listen_fds,
+                       unsigned int reuseport);
+extern int listen_sock_reuseport(pproxy_t proxy, int fd);
 
 extern int socket_nonblocking(int sock);
 extern int socket_blocking(int sock);
 
+// Bound the blocking reads and writes of the socket, in seconds (0 waits forever).
+extern int socket_timeout(int sock, unsigned int seconds);
+
 extern int getsock_ip(pproxy_t proxy, int fd, char *ipaddr);
 extern int getpeer_information(int fd, char *ipaddr, char *string_addr);
 
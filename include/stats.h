@@ -24,11 +24,13 @@
 // various logable statistics
 typedef enum
 {
-  STAT_BADCONN, // bad connection, for unknown reason
-  STAT_OPEN,    // connection opened
-  STAT_CLOSE,   // connection closed
-  STAT_REFUSE,  // connection refused (to outside world)
-  STAT_DENIED   // connection denied to tinyproxy itself
+  STAT_BADCONN,    // bad connection, for unknown reason
+  STAT_OPEN,       // connection opened
+  STAT_CLOSE,      // connection closed
+  STAT_REFUSE,     // connection refused (to outside world)
+  STAT_DENIED,     // connection denied to tinyproxy itself
+  STAT_FILTER_HIT, // filter verdict found in the cache of the child
+  STAT_FILTER_MISS // filter verdict not cached yet
 } status_t;
 
 // public API to the statistics for tinyproxy
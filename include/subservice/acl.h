@@ -31,6 +31,23 @@ DELETE_DECL(pacl_t);
 
 extern pacl_t create_configured_acl(pconf_acl_t acl_config);
 
-extern int check_acl(plog_t log, pacl_t acl, const char *ip, const char *host);
+// Looks up the name of the client at ip into host (of size len), for the string rules.
+//
+// Returns: 0, or -1 if it has none (host is left alone)
+//          -EINPROGRESS if the name is being looked up without waiting for it
+typedef int (*acl_lookup_t)(const char *ip, char *host, size_t len, void *data);
+
+// Checks whether the client at ip is allowed. host holds its address, or the name of it once
+// lookup (called with data, at most once) has found it because a string rule needed it.
+//
+// Returns: 1 if allowed
+//          0 if denied
+//          -EINPROGRESS if lookup said so: nothing was decided, check again once the name is known
+extern int check_acl(plog_t log, pacl_t acl, const char *ip, char *host, size_t hostlen,
+                     acl_lookup_t lookup, void *data);
+
+// Looks up the names of the rules again if it is time to, in the parent (the children share
+// the addresses).
+extern void refresh_acl_hosts(plog_t log, pacl_t acl);
 
 #endif // TINYPROXY_ACL_H
@@ -19,9 +19,12 @@
 #ifndef TINYPROXY_ANONYMOUS_H
 #define TINYPROXY_ANONYMOUS_H
 
+#include <stdbool.h>
+
 #include "self_contained/object.h"
 #include "config/conf_anon.h"
 #include "log.h"
+#include "misc/headers.h"
 
 typedef struct anon_s *panon_t;
 
@@ -33,4 +36,7 @@ extern panon_t create_configured_anon(pconf_anon_t anon_config);
 extern short int is_anonymous_enabled(panon_t anon);
 extern ssize_t anonymous_search(plog_t log, panon_t anon, const char *s);
 
+// Is the header with the well-known id (or HEADER_OTHER) and the name let through?
+extern bool is_anonymous_allowed(plog_t log, panon_t anon, header_id_t id, const char *name);
+
 #endif // TINYPROXY_ANONYMOUS_H
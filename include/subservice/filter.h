@@ -35,7 +35,20 @@ extern pfilter_t create_configured_filter(pconf_filt_t filt_config);
 extern bool is_enabled(pfilter_t filter);
 extern int activate_filtering(plog_t log, pfilter_t filter);
 
-// return true to allow, false to block
-extern bool does_pass_filter(plog_t log, pfilter_t filter, const char *host, const char *url);
+// Write the activated filter into the database at path, which activate_filtering() maps
+// instead of parsing the rules when it is given as the filter file (see tinyproxy-filtc).
+extern int save_filtering(plog_t log, pfilter_t filter, const char *path);
+
+// where the verdict of does_pass_filter() comes from
+typedef enum
+{
+  FILTER_CACHE_OFF,  // the host or url is not cached (FilterCache 0, or too long)
+  FILTER_CACHE_HIT,  // the verdict was cached
+  FILTER_CACHE_MISS  // the rules were checked, and the verdict cached
+} filter_cache_result_t;
+
+// return true to allow, false to block; cached (may be NULL) tells where the verdict comes from
+extern bool does_pass_filter(plog_t log, pfilter_t filter, const char *host, const char *url,
+                             filter_cache_result_t *cached);
 
 #endif // TINYPROXY_FILTER_H
@@ -36,13 +36,17 @@
 #include <windows.h> // order does matter
 typedef unsigned long in_addr_t;
 
+#define poll WSAPoll
+
 static WSADATA wsa;
 #else
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #define closesocket close
 #endif
 
@@ -19,6 +19,11 @@ typedef struct
   pacl_t acl;
   pauth_t auth;
   pfilter_t filter;
+
+  // the reload the objects above come from, and the last reload of the parent (shared by the
+  // children): a child whose generation is older than the published one is outdated
+  unsigned int generation;
+  volatile unsigned int *published;
 } *pproxy_t;
 
 CREATE_DECL(pproxy_t);
@@ -28,4 +33,15 @@ extern int configure_proxy(pproxy_t proxy, pconf_log_t log_config, pconf_anon_t
                            pconf_acl_t acl_config, pconf_auth_t auth_config,
                            pconf_filt_t filt_config);
 
+// Replace the anon headers, the access list, the basicauth creds and the filter rules of the proxy
+// with new ones built from the given configurations, and publish them under a new generation. The
+// log is kept. Only the parent reconfigures: the children get the new objects by being forked.
+//
+// Returns: 0, or -1 if the new objects could not be built (the proxy keeps the old ones)
+extern int reconfigure_proxy(pproxy_t proxy, pconf_anon_t anon_config, pconf_acl_t acl_config,
+                             pconf_auth_t auth_config, pconf_filt_t filt_config);
+
+// Has the parent reconfigured the proxy since this process got its objects?
+extern unsigned int is_proxy_outdated(pproxy_t proxy);
+
 #endif // CMAKE_TINYPROXY_TINYPROXY_H
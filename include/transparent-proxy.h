@@ -23,10 +23,10 @@
 #include "common.h"
 
 #include "conns.h"
-#include "misc/hashmap.h"
+#include "misc/headers.h"
 #include "reqs.h"
 
-extern int do_transparent_proxy(pproxy_t proxy, struct conn_s *connptr, phashmap_t hashofheaders,
+extern int do_transparent_proxy(pproxy_t proxy, struct conn_s *connptr, pheaders_t hashofheaders,
                                 struct request_s *request, struct config_s *conf, char **url);
 
 #endif // TRANSPARENT_PROXY
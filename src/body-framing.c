@@ -0,0 +1,189 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* Tracking of the end of a message body. The relay hands every block of the
+ * body to body_framing_feed() as it goes through the buffers, which counts
+ * down a Content-Length, or walks the chunked syntax one state at a time, so
+ * a chunk size or a trailer split over two reads is not a problem. Nothing is
+ * copied: the chunk data itself is skipped over in a single step.
+ */
+
+#include "main.h"
+
+#include "body-framing.h"
+
+// positions in the chunked syntax
+#define CHUNK_SIZE_START    0 // the first hex digit of a chunk size
+#define CHUNK_SIZE          1 // more hex digits
+#define CHUNK_EXT           2 // chunk extensions, up to the end of the line
+#define CHUNK_SIZE_LF       3 // the LF ending the size line
+#define CHUNK_DATA          4 // the chunk data
+#define CHUNK_DATA_CR       5 // the CRLF following the chunk data
+#define CHUNK_DATA_LF       6
+#define CHUNK_TRAILER_START 7 // the beginning of a trailer line, or of the final blank line
+#define CHUNK_TRAILER       8 // the rest of a trailer line
+#define CHUNK_FINAL_LF      9 // the LF of the final blank line
+
+void body_framing_init(struct body_framing_s *body, int mode, long long length)
+{
+  assert(body != NULL);
+  assert(mode == BODY_UNTIL_CLOSE || mode == BODY_CHUNKED || length >= 0);
+
+  body->mode = mode;
+  body->state = CHUNK_SIZE_START;
+  body->remaining = mode == BODY_LENGTH ? (unsigned long long)length : 0;
+  body->complete = mode == BODY_NONE || (mode == BODY_LENGTH && length == 0);
+}
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+/*
+ * The size line is over: either the data or, after the last chunk, the
+ * trailers follow.
+ */
+static void chunk_size_done(struct body_framing_s *body)
+{
+  body->state = body->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER_START;
+}
+
+static size_t feed_chunked(struct body_framing_s *body, const char *data, size_t len)
+{
+  size_t pos = 0, n;
+  int digit;
+  char c;
+
+  while (pos < len && !body->complete)
+  {
+    if (body->state == CHUNK_DATA)
+    {
+      n = (size_t)min(body->remaining, (unsigned long long)(len - pos));
+      body->remaining -= n;
+      pos += n;
+
+      if (body->remaining == 0)
+        body->state = CHUNK_DATA_CR;
+      continue;
+    }
+
+    c = data[pos++];
+
+    switch (body->state)
+    {
+    case CHUNK_SIZE_START:
+    case CHUNK_SIZE:
+      digit = hex_value(c);
+      if (digit >= 0)
+      {
+        /* Refuse a size which does not fit */
+        if (body->remaining > (~0ULL >> 4))
+          goto malformed;
+
+        body->remaining = body->remaining * 16 + (unsigned long long)digit;
+        body->state = CHUNK_SIZE;
+      }
+      else if (body->state == CHUNK_SIZE_START)
+        goto malformed;
+      else if (c == ';' || c == ' ' || c == '\t')
+        body->state = CHUNK_EXT;
+      else if (c == '\r')
+        body->state = CHUNK_SIZE_LF;
+      else if (c == '\n')
+        chunk_size_done(body);
+      else
+        goto malformed;
+      break;
+
+    case CHUNK_EXT:
+      if (c == '\r')
+        body->state = CHUNK_SIZE_LF;
+      else if (c == '\n')
+        chunk_size_done(body);
+      break;
+
+    case CHUNK_SIZE_LF:
+      if (c != '\n')
+        goto malformed;
+      chunk_size_done(body);
+      break;
+
+    case CHUNK_DATA_CR:
+      if (c == '\r')
+        body->state = CHUNK_DATA_LF;
+      else if (c == '\n')
+        body->state = CHUNK_SIZE_START;
+      else
+        goto malformed;
+      break;
+
+    case CHUNK_DATA_LF:
+      if (c != '\n')
+        goto malformed;
+      body->state = CHUNK_SIZE_START;
+      break;
+
+    case CHUNK_TRAILER_START:
+      if (c == '\r')
+        body->state = CHUNK_FINAL_LF;
+      else if (c == '\n')
+        body->complete = TRUE;
+      else
+        body->state = CHUNK_TRAILER;
+      break;
+
+    case CHUNK_TRAILER:
+      if (c == '\n')
+        body->state = CHUNK_TRAILER_START;
+      break;
+
+    case CHUNK_FINAL_LF:
+      if (c != '\n')
+        goto malformed;
+      body->complete = TRUE;
+      break;
+    }
+  }
+
+  return pos;
+
+malformed:
+  /* We can't tell where it ends, so let the connection tell */
+  body->mode = BODY_UNTIL_CLOSE;
+  return len;
+}
+
+size_t body_framing_feed(struct body_framing_s *body, const char *data, size_t len)
+{
+  size_t n;
+
+  assert(body != NULL);
+  assert(data != NULL || len == 0);
+
+  if (body->complete)
+    return 0;
+
+  switch (body->mode)
+  {
+  case BODY_LENGTH:
+    n = (size_t)min(body->remaining, (unsigned long long)len);
+    body->remaining -= n;
+    body->complete = body->remaining == 0;
+    return n;
+
+  case BODY_CHUNKED:
+    return feed_chunked(body, data, len);
+
+  default:
+    return len;
+  }
+}
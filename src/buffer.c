@@ -16,13 +16,14 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-/* The buffer used in each connection is a linked list of lines. As the lines
- * are read in and written out the buffer expands and contracts. Basically,
- * by using this method we can increase the buffer size dynamically. However,
- * we have a hard limit of 64 KB for the size of the buffer. The buffer can be
- * thought of as a queue were we act on both the head and tail. The various
- * functions act on each end (the names are taken from what Perl uses to act on
- * the ends of an array. :)
+/* The buffer used in each connection is a queue of fixed size segments.
+ * The sockets are read straight into the free space of the last segment,
+ * and written out of as many segments as writev() takes at once, so the
+ * relayed bytes are copied neither on the way in nor on the way out. The
+ * drained segments are kept in a small pool for reuse instead of being
+ * freed. We have a hard limit of MAXBUFFSIZE for the size of the buffer.
+ * The buffer can be thought of as a queue were we act on both the head and
+ * tail.
  */
 
 #include "main.h"
@@ -35,73 +36,139 @@
 #define BUFFER_HEAD(x) (x)->head
 #define BUFFER_TAIL(x) (x)->tail
 
-struct bufline_s
+// the size of a segment
+#define BUFFER_SEGMENT_SIZE (16 * 1024)
+
+// a read goes into a fresh segment when there is less room left in the last one
+#define BUFFER_SEGMENT_LOW (BUFFER_SEGMENT_SIZE / 4)
+
+// the most segments handed to a single writev()
+#define BUFFER_IOV_MAX 16
+
+// the most drained segments kept for reuse
+#ifdef MINGW
+#define BUFFER_POOL_MAX 0 /* the children are threads, the pool is not locked */
+#else
+#define BUFFER_POOL_MAX 64
+#endif
+
+struct bufseg_s
 {
-  unsigned char *string;  /* the actual string of data */
-  struct bufline_s *next; /* pointer to next in linked list */
-  size_t length;          /* length of the string of data */
-  size_t pos;             /* start sending from this offset */
+  struct bufseg_s *next; /* pointer to next in the queue */
+  size_t start;          /* start sending from this offset */
+  size_t end;            /* the data ends here, the rest is free */
+  unsigned char data[BUFFER_SEGMENT_SIZE];
 };
 
 /*
- * The buffer structure points to the beginning and end of the buffer list
- * (and includes the total size)
+ * The buffer structure points to the beginning and end of the segment queue
+ * (and includes the total number of unsent bytes)
  */
 struct buffer_s
 {
-  struct bufline_s *head; /* top of the buffer */
-  struct bufline_s *tail; /* bottom of the buffer */
-  size_t size;            /* total size of the buffer */
+  struct bufseg_s *head; /* top of the buffer */
+  struct bufseg_s *tail; /* bottom of the buffer */
+  size_t size;           /* total size of the buffer */
 };
 
+static struct bufseg_s *segment_pool = NULL;
+static size_t segment_pool_len = 0;
+
 /*
- * Take a string of data and a length and make a new line which can be added
- * to the buffer. The data IS copied, so make sure if you allocated your
- * data buffer on the heap, delete it because you now have TWO copies.
+ * Get an empty segment, from the pool if possible.
  */
-static struct bufline_s *makenewline(unsigned char *data, size_t length)
+static struct bufseg_s *new_segment(void)
 {
-  struct bufline_s *newline;
+  struct bufseg_s *seg;
 
-  assert(data != NULL);
-  assert(length > 0);
+  if (segment_pool)
+  {
+    seg = segment_pool;
+    segment_pool = seg->next;
+    segment_pool_len--;
+  }
+  else
+  {
+    seg = (struct bufseg_s *)safemalloc(sizeof(struct bufseg_s));
+    if (!seg)
+      return NULL;
+  }
 
-  newline = (struct bufline_s *)safemalloc(sizeof(struct bufline_s));
-  if (!newline)
-    return NULL;
+  seg->next = NULL;
+  seg->start = seg->end = 0;
+
+  return seg;
+}
+
+/*
+ * Give the segment back to the pool, or free it if the pool is full.
+ */
+static void free_segment(struct bufseg_s *seg)
+{
+  assert(seg != NULL);
 
-  newline->string = (unsigned char *)safemalloc(length);
-  if (!newline->string)
+  if (segment_pool_len < BUFFER_POOL_MAX)
   {
-    safefree(newline);
-    return NULL;
+    seg->next = segment_pool;
+    segment_pool = seg;
+    segment_pool_len++;
   }
+  else
+  {
+    safefree(seg);
+  }
+}
 
-  memcpy(newline->string, data, length);
+/*
+ * Link an empty segment at the bottom of the buffer.
+ */
+static struct bufseg_s *append_segment(struct buffer_s *buffptr)
+{
+  struct bufseg_s *seg;
+
+  if (!(seg = new_segment()))
+    return NULL;
 
-  newline->next = NULL;
-  newline->length = length;
+  if (BUFFER_TAIL(buffptr))
+    BUFFER_TAIL(buffptr)->next = seg;
+  else
+    BUFFER_HEAD(buffptr) = seg;
 
-  /* Position our "read" pointer at the beginning of the data */
-  newline->pos = 0;
+  BUFFER_TAIL(buffptr) = seg;
 
-  return newline;
+  return seg;
 }
 
 /*
- * Free the allocated buffer line
+ * The first "length" bytes of the buffer were sent or taken: drop them,
+ * together with the segments they emptied.
  */
-static void free_line(struct bufline_s *line)
+static void consume_buffer(struct buffer_s *buffptr, size_t length)
 {
-  assert(line != NULL);
+  struct bufseg_s *seg;
+  size_t chunk;
+
+  assert(length <= buffptr->size);
+
+  buffptr->size -= length;
+
+  while (length > 0)
+  {
+    seg = BUFFER_HEAD(buffptr);
 
-  if (!line)
-    return;
+    chunk = min(length, seg->end - seg->start);
+    seg->start += chunk;
+    length -= chunk;
 
-  if (line->string)
-    safefree(line->string);
+    if (seg->start == seg->end)
+    {
+      BUFFER_HEAD(buffptr) = seg->next;
+      if (!BUFFER_HEAD(buffptr))
+        BUFFER_TAIL(buffptr) = NULL;
 
-  safefree(line);
+      free_segment(seg);
+    }
+  }
 }
 
 /*
@@ -127,18 +194,18 @@ struct buffer_s *new_buffer(void)
 }
 
 /*
- * Delete all the lines in the buffer and the buffer itself
+ * Delete all the segments in the buffer and the buffer itself
  */
 void delete_buffer(struct buffer_s *buffptr)
 {
-  struct bufline_s *next;
+  struct bufseg_s *next;
 
   assert(buffptr != NULL);
 
   while (BUFFER_HEAD(buffptr))
   {
     next = BUFFER_HEAD(buffptr)->next;
-    free_line(BUFFER_HEAD(buffptr));
+    free_segment(BUFFER_HEAD(buffptr));
     BUFFER_HEAD(buffptr) = next;
   }
 
@@ -154,75 +221,89 @@ size_t buffer_size(struct buffer_s *buffptr)
 }
 
 /*
- * Push a new line on to the end of the buffer.
+ * Copy the data on to the end of the buffer.
  */
 int add_to_buffer(struct buffer_s *buffptr, unsigned char *data, size_t length)
 {
-  struct bufline_s *newline;
+  struct bufseg_s *seg;
+  size_t chunk;
 
   assert(buffptr != NULL);
   assert(data != NULL);
   assert(length > 0);
 
-  /*
-   * Sanity check here. A buffer with a non-NULL head pointer must
-   * have a size greater than zero, and vice-versa.
-   */
-  if (BUFFER_HEAD(buffptr) == NULL)
+  while (length > 0)
   {
-    assert(buffptr->size == 0);
-  }
-  else
-  {
-    assert(buffptr->size > 0);
+    seg = BUFFER_TAIL(buffptr);
+    if (!seg || seg->end == BUFFER_SEGMENT_SIZE)
+    {
+      if (!(seg = append_segment(buffptr)))
+        return -1;
+    }
+
+    chunk = min(length, BUFFER_SEGMENT_SIZE - seg->end);
+    memcpy(seg->data + seg->end, data, chunk);
+
+    seg->end += chunk;
+    buffptr->size += chunk;
+    data += chunk;
+    length -= chunk;
   }
 
-  /*
-   * Make a new line so we can add it to the buffer.
-   */
-  if (!(newline = makenewline(data, length)))
-    return -1;
+  return 0;
+}
 
-  if (buffptr->size == 0)
-    BUFFER_HEAD(buffptr) = BUFFER_TAIL(buffptr) = newline;
-  else
+/*
+ * Move up to "length" bytes from the top of the buffer into "data".
+ * Returns the number of bytes moved.
+ */
+size_t take_from_buffer(struct buffer_s *buffptr, unsigned char *data, size_t length)
+{
+  struct bufseg_s *seg;
+  size_t taken = 0, chunk;
+
+  assert(buffptr != NULL);
+  assert(data != NULL);
+
+  length = min(length, buffptr->size);
+
+  for (seg = BUFFER_HEAD(buffptr); taken < length; seg = seg->next)
   {
-    BUFFER_TAIL(buffptr)->next = newline;
-    BUFFER_TAIL(buffptr) = newline;
+    chunk = min(length - taken, seg->end - seg->start);
+    memcpy(data + taken, seg->data + seg->start, chunk);
+    taken += chunk;
   }
 
-  buffptr->size += length;
+  consume_buffer(buffptr, taken);
 
-  return 0;
+  return taken;
 }
 
 /*
- * Remove the first line from the top of the buffer
+ * The last "length" bytes of the buffer. A single read_buffer() always lands
+ * in one segment, so the bytes it just added can be looked at in place.
  */
-static struct bufline_s *remove_from_buffer(struct buffer_s *buffptr)
+const unsigned char *buffer_tail(struct buffer_s *buffptr, size_t length)
 {
-  struct bufline_s *line;
+  struct bufseg_s *seg;
 
   assert(buffptr != NULL);
-  assert(BUFFER_HEAD(buffptr) != NULL);
-
-  line = BUFFER_HEAD(buffptr);
-  BUFFER_HEAD(buffptr) = line->next;
 
-  buffptr->size -= line->length;
+  seg = BUFFER_TAIL(buffptr);
+  assert(seg != NULL && seg->end - seg->start >= length);
 
-  return line;
+  return seg->data + seg->end - length;
 }
 
 /*
  * Reads the bytes from the socket, and adds them to the buffer.
  * Takes a connection and returns the number of bytes read.
  */
-#define READ_BUFFER_SIZE (1024 * 2)
 ssize_t read_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr)
 {
   ssize_t bytesin;
-  unsigned char *buffer;
+  struct bufseg_s *seg;
+  unsigned int fresh = FALSE;
 
   log_message(proxy->log, LOG_INFO, "%s %s:%d", __func__, __FILE__, __LINE__);
 
@@ -235,21 +316,33 @@ ssize_t read_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr)
   if (buffptr->size >= MAXBUFFSIZE)
     return 0;
 
-  buffer = (unsigned char *)safemalloc(READ_BUFFER_SIZE);
-  if (!buffer)
+  /*
+   * Read straight into the last segment, unless it is (nearly) full.
+   */
+  seg = BUFFER_TAIL(buffptr);
+  if (!seg || BUFFER_SEGMENT_SIZE - seg->end < BUFFER_SEGMENT_LOW)
   {
-    return -ENOMEM;
+    if (!(seg = new_segment()))
+      return -ENOMEM;
+    fresh = TRUE;
   }
 
-  bytesin = readsocket(fd, buffer, READ_BUFFER_SIZE);
+  bytesin = readsocket(fd, seg->data + seg->end, BUFFER_SEGMENT_SIZE - seg->end);
 
   if (bytesin > 0)
   {
-    if (add_to_buffer(buffptr, buffer, bytesin) < 0)
+    if (fresh)
     {
-      log_message(proxy->log, LOG_ERR, "readbuff: add_to_buffer() error.");
-      bytesin = -1;
+      if (BUFFER_TAIL(buffptr))
+        BUFFER_TAIL(buffptr)->next = seg;
+      else
+        BUFFER_HEAD(buffptr) = seg;
+      BUFFER_TAIL(buffptr) = seg;
+      fresh = FALSE;
     }
+
+    seg->end += bytesin;
+    buffptr->size += bytesin;
   }
   else if (bytesin == 0)
   {
@@ -278,7 +371,9 @@ ssize_t read_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr)
     }
   }
 
-  safefree(buffer);
+  if (fresh)
+    free_segment(seg);
+
   return bytesin;
 }
 
@@ -289,7 +384,7 @@ ssize_t read_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr)
 ssize_t write_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr)
 {
   ssize_t bytessent;
-  struct bufline_s *line;
+  struct bufseg_s *seg;
 
   log_message(proxy->log, LOG_INFO, "%s %s:%d", __func__, __FILE__, __LINE__);
 
@@ -301,16 +396,35 @@ ssize_t write_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr)
 
   /* Sanity check. It would be bad to be using a NULL pointer! */
   assert(BUFFER_HEAD(buffptr) != NULL);
-  line = BUFFER_HEAD(buffptr);
+  seg = BUFFER_HEAD(buffptr);
+
+#ifdef MINGW
+  bytessent = writesocket(fd, seg->data + seg->start, seg->end - seg->start, MSG_NOSIGNAL);
+#else
+  {
+    struct iovec iov[BUFFER_IOV_MAX];
+    struct msghdr msg;
+    int iovcnt = 0;
+
+    for (; seg && iovcnt < BUFFER_IOV_MAX; seg = seg->next, iovcnt++)
+    {
+      iov[iovcnt].iov_base = seg->data + seg->start;
+      iov[iovcnt].iov_len = seg->end - seg->start;
+    }
 
-  bytessent = writesocket(fd, line->string + line->pos, line->length - line->pos, MSG_NOSIGNAL);
+    /* sendmsg() is writev() with the flags of send() */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    bytessent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  }
+#endif /* MINGW */
 
   if (bytessent >= 0)
   {
     /* bytes sent, adjust buffer */
-    line->pos += bytessent;
-    if (line->pos == line->length)
-      free_line(remove_from_buffer(buffptr));
+    consume_buffer(buffptr, bytessent);
     return bytessent;
   }
   else
@@ -344,7 +458,7 @@ ssize_t write_buffer(pproxy_t proxy, int fd, struct buffer_s *buffptr)
 ssize_t write_websocket_buffer(pproxy_t proxy, struct lws *wsi, struct buffer_s *buffptr)
 {
   ssize_t bytessent;
-  struct bufline_s *line;
+  struct bufseg_s *seg;
 
   log_message(proxy->log, LOG_INFO, "%s %s:%d", __func__, __FILE__, __LINE__);
 
@@ -356,17 +470,17 @@ ssize_t write_websocket_buffer(pproxy_t proxy, struct lws *wsi, struct buffer_s
 
   /* Sanity check. It would be bad to be using a NULL pointer! */
   assert(BUFFER_HEAD(buffptr) != NULL);
-  line = BUFFER_HEAD(buffptr);
+  seg = BUFFER_HEAD(buffptr);
 
   // todo allocate new
-  if (line->length - line->pos > 0)
+  if (seg->end - seg->start > 0)
   {
-    size_t nc = line->length - line->pos + LWS_PRE + LWS_SEND_BUFFER_POST_PADDING;
+    size_t nc = seg->end - seg->start + LWS_PRE + LWS_SEND_BUFFER_POST_PADDING;
     unsigned char *bmem = safemalloc(nc);
     memset(bmem, 0, nc);
-    memcpy(bmem + LWS_PRE, line->string + line->pos, line->length - line->pos);
+    memcpy(bmem + LWS_PRE, seg->data + seg->start, seg->end - seg->start);
 
-    bytessent = lws_write(wsi, bmem + LWS_PRE, line->length - line->pos, LWS_WRITE_BINARY);
+    bytessent = lws_write(wsi, bmem + LWS_PRE, seg->end - seg->start, LWS_WRITE_BINARY);
 
     safefree(bmem);
   }
@@ -375,12 +489,10 @@ ssize_t write_websocket_buffer(pproxy_t proxy, struct lws *wsi, struct buffer_s
     bytessent = 0;
   }
 
-  if (bytessent == ((ssize_t)(line->length - line->pos)))
+  if (bytessent == ((ssize_t)(seg->end - seg->start)))
   {
     /* bytes sent, adjust buffer */
-    line->pos += bytessent;
-    if (line->pos == line->length)
-      free_line(remove_from_buffer(buffptr));
+    consume_buffer(buffptr, bytessent);
     return bytessent;
   }
   else
@@ -411,6 +523,7 @@ ssize_t write_websocket_buffer(pproxy_t proxy, struct lws *wsi, struct buffer_s
   }
 }
 
+#define READ_BUFFER_SIZE (1024 * 2)
 ssize_t read_ws_buffer(pproxy_t proxy, struct buffer_s *buffptr, unsigned char *data, size_t len)
 {
   ssize_t bytesin;
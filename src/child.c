@@ -24,14 +24,22 @@
 
 #include "child.h"
 #include "config/conf.h"
+#include "conns.h"
 #include "daemon.h"
+#include "event-loop.h"
 #include "misc/heap.h"
+#include "misc/text.h"
+#include "relay.h"
 #include "reqs.h"
+#include "request-parser.h"
+#include "resolver.h"
 #include "self_contained/debugtrace.h"
+#include "server-pool.h"
 #include "sock.h"
 #include "subservice/filter.h"
 #include "subservice/log.h"
 #include "subservice/network.h"
+#include "upstream.h"
 #include "utils.h"
 
 static plist_t listen_fds;
@@ -63,6 +71,9 @@ static struct child_config_s
 {
   unsigned int maxclients, maxrequestsperchild;
   unsigned int maxspareservers, minspareservers, startservers;
+  unsigned int eventloop; // boolean
+  unsigned int maxconnectionsperchild;
+  unsigned int reuseport; // boolean
 } child_config;
 
 static unsigned int *servers_waiting; /* servers waiting for a connection */
@@ -215,6 +226,15 @@ short int child_configure(child_config_t type, unsigned int val)
   case CHILD_MAXREQUESTSPERCHILD:
     child_config.maxrequestsperchild = val;
     break;
+  case CHILD_EVENTLOOP:
+    child_config.eventloop = val;
+    break;
+  case CHILD_MAXCONNECTIONSPERCHILD:
+    child_config.maxconnectionsperchild = val;
+    break;
+  case CHILD_REUSEPORT:
+    child_config.reuseport = val;
+    break;
   default:
     TRACE_RETURN_X(-1, "Invalid policy (%d)", type);
   }
@@ -224,11 +244,547 @@ short int child_configure(child_config_t type, unsigned int val)
 
 /**
  * child signal handler for sighup
+ *
+ * The parent sends it once it has reloaded the rules. It only wakes the child
+ * up: the select (or the event loop) returns, and the child sees that its
+ * proxy is outdated.
  */
 #ifndef MINGW
 static void child_sighup_handler(int sig)
 {
-  // todo: delete me
+  (void)sig;
+}
+#endif /* MINGW */
+
+#ifndef MINGW
+/*
+ * State of a child serving its connections from an event loop.
+ */
+struct child_loop_s
+{
+  struct child_s *ptr;
+  pevent_loop_t loop;
+  plist_t listen_fds; // the shared listen fds, or our own ones with ReusePort
+  size_t pending;     // accepted connections still waiting for their request
+
+  // booleans
+  unsigned int accepting; // the listen fds are registered in the loop
+  unsigned int counted;   // we are counted in servers_waiting
+  unsigned int retiring;  // no more accepts, leave once the connections are over
+};
+
+/*
+ * Update our contribution to the "servers_waiting" counter.
+ */
+static void child_loop_count(struct child_loop_s *cl, unsigned int counted)
+{
+  if (cl->counted == counted)
+    return;
+
+  if (counted)
+    SERVER_INC(cl->ptr->proxy->log);
+  else
+    SERVER_DEC(cl->ptr->proxy->log);
+
+  cl->counted = counted;
+}
+
+static void child_accept_event(pevent_loop_t loop, int fd, unsigned int events, void *data);
+
+/*
+ * Start or stop accepting new connections, depending on whether the child
+ * is retiring and on how many connections it is already carrying.
+ */
+static void child_loop_refresh(struct child_loop_s *cl)
+{
+  unsigned int accepting;
+  size_t active;
+  ssize_t i;
+
+  active = relay_active_count() + request_wait_count() + cl->pending;
+  accepting = !cl->retiring && (child_config.maxconnectionsperchild == 0 ||
+                                active < child_config.maxconnectionsperchild);
+
+  if (cl->accepting != accepting)
+  {
+    for (i = 0; i < list_length(cl->listen_fds); i++)
+    {
+      int *fd = (int *)list_getentry(cl->listen_fds, i, NULL);
+
+      if (accepting)
+        event_loop_add(cl->loop, *fd, EVENT_READ, child_accept_event, cl);
+      else
+        event_loop_remove(cl->loop, *fd);
+    }
+
+    if (!accepting && !cl->retiring)
+    {
+      DEBUG_LOG_EX(cl->ptr->proxy->log, "%lu connections carried, pausing accept.",
+                   (unsigned long)active);
+    }
+
+    cl->accepting = accepting;
+  }
+
+  /* Our own listeners would keep getting connections nobody accepts */
+  if (cl->retiring && cl->listen_fds != listen_fds && list_length(cl->listen_fds) > 0)
+  {
+    for (i = 0; i < list_length(cl->listen_fds); i++)
+      closesocket(*(int *)list_getentry(cl->listen_fds, i, NULL));
+
+    list_delete(cl->listen_fds);
+    cl->listen_fds = list_create();
+  }
+
+  child_loop_count(cl, accepting);
+}
+
+/*
+ * An accepted connection whose request head is still arriving.
+ */
+struct child_request_s
+{
+  struct child_loop_s *cl;
+  prequest_parser_t parser;
+  struct conn_s *connptr; // a persistent client between two requests, or NULL
+  int fd;                 // of the client
+
+  /* the name of a new client, when the ACL needs it */
+  presolver_query_t query; // in flight, or NULL
+  int named;               // 1 until it was asked for, then as resolve_addr()
+  char name[HOSTNAME_LENGTH];
+};
+
+/*
+ * Returns NULL if memory could not be allocated.
+ */
+static struct child_request_s *child_request_create(struct child_loop_s *cl, int fd,
+                                                    struct conn_s *connptr)
+{
+  struct child_request_s *req;
+
+  req = (struct child_request_s *)safecalloc(1, sizeof(struct child_request_s));
+  if (!req)
+    return NULL;
+
+  req->cl = cl;
+  req->connptr = connptr;
+  req->fd = fd;
+  req->named = 1;
+
+  req->parser = request_parser_create();
+  if (!req->parser)
+  {
+    safefree(req);
+    return NULL;
+  }
+
+  return req;
+}
+
+static void child_request_delete(struct child_request_s *req)
+{
+  request_parser_delete(req->parser);
+  resolve_query_free(req->query);
+  safefree(req);
+}
+
+/*
+ * Drop the client along with the request it did not finish.
+ */
+static void child_request_drop(struct child_request_s *req, int fd)
+{
+  struct child_loop_s *cl = req->cl;
+
+  if (req->connptr)
+    destroy_conn(cl->ptr->proxy, req->connptr);
+  else
+    closesocket(fd);
+
+  child_request_delete(req);
+  child_loop_refresh(cl);
+}
+
+static void child_request_event(pevent_loop_t loop, int fd, unsigned int events, void *data);
+static void child_request_ready(pevent_loop_t loop, struct child_request_s *req);
+
+/*
+ * The response went through and the client keeps its connection: wait (in
+ * the loop) for its next request, which may have been pipelined already.
+ */
+static void child_kept(pevent_loop_t loop, struct conn_s *connptr, void *data)
+{
+  struct child_loop_s *cl = (struct child_loop_s *)data;
+  struct child_request_s *req = NULL;
+  unsigned int events = EVENT_READ;
+  int ret = REQUEST_PARSER_MORE;
+
+  if (!cl->retiring && !is_proxy_outdated(cl->ptr->proxy))
+    req = child_request_create(cl, connptr->client_fd, connptr);
+
+  if (req)
+    ret = pipelined_request_head(connptr, req->parser);
+
+  /* The whole head is there, a writable socket gets the loop to call us at once */
+  if (ret == REQUEST_PARSER_DONE)
+    events = EVENT_WRITE;
+
+  if (!req || ret < 0 ||
+      event_loop_add(loop, connptr->client_fd, events, child_request_event, req) < 0)
+  {
+    if (req)
+      child_request_delete(req);
+    destroy_conn(cl->ptr->proxy, connptr);
+    child_loop_refresh(cl);
+    return;
+  }
+  event_loop_set_timeout(loop, connptr->client_fd, config.client_keepalive_timeout);
+  cl->pending++;
+
+  child_loop_refresh(cl);
+}
+
+/*
+ * The client sent something (or gave up waiting). Once the head of the
+ * request is complete, process the request and hand the rest over to the
+ * loop.
+ */
+static void child_request_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct child_request_s *req = (struct child_request_s *)data;
+  struct child_loop_s *cl = req->cl;
+  struct child_s *ptr = cl->ptr;
+  int ret = REQUEST_PARSER_MORE;
+
+  /* Errors are kept by the parser and answered by handle_connection_in_loop() */
+  if (!(events & EVENT_TIMEOUT))
+  {
+    ret = request_parser_read(req->parser, fd);
+    if (ret == REQUEST_PARSER_MORE)
+      return;
+  }
+
+  event_loop_remove(loop, fd);
+  cl->pending--;
+
+  if (events & EVENT_TIMEOUT)
+  {
+    log_message(ptr->proxy->log, LOG_INFO,
+                "Client (file descriptor: %d) sent no request within %u seconds.", fd,
+                req->connptr ? config.client_keepalive_timeout : config.idletimeout);
+    child_request_drop(req, fd);
+    return;
+  }
+
+  /* Closing the connection is how a persistent client says it is done */
+  if (req->connptr && ret == -ECONNRESET)
+  {
+    log_message(ptr->proxy->log, LOG_INFO, "Client (file descriptor: %d) closed the connection.",
+                fd);
+    child_request_drop(req, fd);
+    return;
+  }
+
+  child_request_ready(loop, req);
+}
+
+/*
+ * The name of a new client, looked up for the ACL without blocking the loop:
+ * the first time it is asked for, the query is sent.
+ */
+static int child_lookup_name(const char *ip, char *host, size_t len, void *data)
+{
+  struct child_request_s *req = (struct child_request_s *)data;
+
+  if (req->named == 1)
+    return resolve_addr_start(req->cl->ptr->proxy, ip, host, len, &req->query);
+
+  if (req->named == 0)
+    safe_string_copy(host, req->name, len);
+
+  return req->named;
+}
+
+/*
+ * The nameserver answered the lookup of the name of a new client, or is too
+ * slow: take the client on, or wait again.
+ */
+static void child_lookup_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct child_request_s *req = (struct child_request_s *)data;
+  struct child_loop_s *cl = req->cl;
+  int ret;
+
+  event_loop_remove(loop, fd);
+
+  ret = resolve_query_event(cl->ptr->proxy, req->query, (events & EVENT_TIMEOUT) != 0, req->name,
+                            sizeof(req->name));
+  if (ret == -EINPROGRESS)
+  {
+    /* The next nameserver is asked on a socket of its own */
+    fd = resolve_query_fd(req->query);
+    if (event_loop_add(loop, fd, EVENT_READ, child_lookup_event, req) < 0)
+    {
+      cl->pending--;
+      child_request_drop(req, req->fd);
+      return;
+    }
+    event_loop_set_timeout(loop, fd, resolve_query_timeout(req->query));
+    return;
+  }
+
+  resolve_query_free(req->query);
+  req->query = NULL;
+  req->named = ret;
+  cl->pending--;
+
+  child_request_ready(loop, req);
+}
+
+/*
+ * The whole head of the request is there: process the request, and hand
+ * the rest over to the loop (see handle_connection_in_loop()). A new client
+ * is checked against the ACL first, which may have to wait (in the loop)
+ * for its name.
+ */
+static void child_request_ready(pevent_loop_t loop, struct child_request_s *req)
+{
+  struct child_loop_s *cl = req->cl;
+  struct child_s *ptr = cl->ptr;
+  int fd = req->fd, ret;
+
+  /* Bounded by Timeout, for the heads and error pages still written in place */
+  if (socket_blocking(fd) != 0 || socket_timeout(fd, config.idletimeout) != 0)
+  {
+    log_message(ptr->proxy->log, LOG_ERR, "Failed to set client socket %d to blocking: %s", fd,
+                strerror(errno));
+    child_request_drop(req, fd);
+    return;
+  }
+
+  if (!req->connptr)
+  {
+    ret = open_connection(ptr->proxy, fd, child_lookup_name, req, &req->connptr);
+    if (ret == -EINPROGRESS)
+    {
+      if (event_loop_add(loop, resolve_query_fd(req->query), EVENT_READ, child_lookup_event,
+                         req) < 0)
+      {
+        child_request_drop(req, fd);
+        return;
+      }
+      event_loop_set_timeout(loop, resolve_query_fd(req->query),
+                             resolve_query_timeout(req->query));
+      cl->pending++;
+      child_loop_refresh(cl);
+      return;
+    }
+  }
+
+  /* We are busy while the headers are exchanged */
+  ptr->status = T_CONNECTED;
+  child_loop_count(cl, FALSE);
+
+  /* Unless the client was turned away */
+  if (req->connptr)
+    handle_connection_in_loop(ptr->proxy, req->connptr, loop, req->parser, child_kept, cl);
+  child_request_delete(req);
+  ptr->connects++;
+  ptr->status = T_WAITING;
+
+  if (child_config.maxrequestsperchild != 0)
+  {
+    DEBUG_LOG_EX(ptr->proxy->log, "%u connections so far...", ptr->connects);
+
+    if (ptr->connects == child_config.maxrequestsperchild)
+    {
+      log_message(ptr->proxy->log, LOG_NOTICE,
+                  "Child has reached MaxRequestsPerChild (%u). "
+                  "Retiring child.",
+                  ptr->connects);
+      cl->retiring = TRUE;
+    }
+  }
+
+  if (!cl->retiring)
+  {
+    SERVER_COUNT_LOCK();
+    if (*servers_waiting > child_config.maxspareservers)
+    {
+      log_message(ptr->proxy->log, LOG_NOTICE,
+                  "Waiting servers (%d) exceeds MaxSpareServers (%d). "
+                  "Retiring child.",
+                  *servers_waiting, child_config.maxspareservers);
+      cl->retiring = TRUE;
+    }
+    SERVER_COUNT_UNLOCK();
+  }
+
+  child_loop_refresh(cl);
+}
+
+/*
+ * One of the listen fds is readable. Accept what is there and wait (in the
+ * loop) for the clients to send their requests.
+ */
+static void child_accept_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct child_loop_s *cl = (struct child_loop_s *)data;
+  struct child_request_s *req;
+  struct sockaddr_storage cliaddr;
+  socklen_t clilen;
+  int connfd;
+
+  (void)events;
+
+  while (cl->accepting)
+  {
+    clilen = sizeof(cliaddr);
+    connfd = accept(fd, (struct sockaddr *)&cliaddr, &clilen);
+    if (connfd < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        log_message(cl->ptr->proxy->log, LOG_ERR, "Accept returned an error (%s) ... retrying.",
+                    strerror(errno));
+      }
+      break;
+    }
+
+    req = child_request_create(cl, connfd, NULL);
+
+    if (!req || socket_nonblocking(connfd) != 0 ||
+        event_loop_add(loop, connfd, EVENT_READ, child_request_event, req) < 0)
+    {
+      log_message(cl->ptr->proxy->log, LOG_ERR,
+                  "Could not add the client socket %d to the event loop.", connfd);
+      if (req)
+        child_request_delete(req);
+      closesocket(connfd);
+      break;
+    }
+    event_loop_set_timeout(loop, connfd, config.idletimeout);
+    cl->pending++;
+
+    child_loop_refresh(cl);
+  }
+}
+
+/*
+ * With ReusePort the listen fds of the parent are only bound. Open a
+ * listening socket of our own next to each of them, so that the kernel
+ * hands every connection to exactly one child.
+ */
+static plist_t child_reuseport_sockets(pproxy_t proxy)
+{
+  plist_t own_fds;
+  ssize_t i;
+
+  own_fds = list_create();
+  if (!own_fds)
+  {
+    log_message(proxy->log, LOG_ERR, "Could not create the list of listening fds");
+    return NULL;
+  }
+
+  for (i = 0; i < list_length(listen_fds); i++)
+  {
+    int *fd = (int *)list_getentry(listen_fds, i, NULL);
+    int listenfd;
+
+    listenfd = listen_sock_reuseport(proxy, *fd);
+    if (listenfd < 0)
+    {
+      log_message(proxy->log, LOG_ERR, "Could not listen next to the socket %d.", *fd);
+      continue;
+    }
+
+    list_append(own_fds, &listenfd, sizeof(int));
+  }
+
+  if (list_length(own_fds) == 0)
+  {
+    list_delete(own_fds);
+    return NULL;
+  }
+
+  return own_fds;
+}
+
+/*
+ * This is the main (per child) loop for the "EventLoop" mode. Rather than
+ * being blocked by one connection at a time, the child keeps accepting while
+ * its earlier connections are relayed by the loop.
+ */
+static void child_event_main(struct child_s *ptr)
+{
+  struct child_loop_s cl;
+  ssize_t i;
+  int ret;
+
+  memset(&cl, 0, sizeof(cl));
+  cl.ptr = ptr;
+  cl.counted = TRUE; /* the parent counted us when we were created */
+
+  cl.loop = event_loop_create();
+  if (!cl.loop)
+  {
+    log_message(ptr->proxy->log, LOG_CRIT, "Could not create the event loop.");
+    exit(0);
+  }
+
+  cl.listen_fds = child_config.reuseport ? child_reuseport_sockets(ptr->proxy) : listen_fds;
+  if (!cl.listen_fds)
+    exit(1);
+
+  for (i = 0; i < list_length(cl.listen_fds); i++)
+  {
+    int *fd = (int *)list_getentry(cl.listen_fds, i, NULL);
+
+    if (socket_nonblocking(*fd) != 0)
+    {
+      log_message(ptr->proxy->log, LOG_ERR,
+                  "Failed to set the listening "
+                  "socket %d to non-blocking: %s",
+                  *fd, strerror(errno));
+      exit(1);
+    }
+  }
+
+  ptr->connects = 0;
+  ptr->status = T_WAITING;
+  child_loop_refresh(&cl);
+
+  while (!config.quit)
+  {
+    if (cl.retiring && cl.pending == 0 && relay_active_count() == 0 && request_wait_count() == 0)
+      break;
+
+    ret = event_loop_run_once(cl.loop, 1000);
+    if (ret < 0)
+    {
+      log_message(ptr->proxy->log, LOG_ERR, "error waiting for events: %s", strerror(-ret));
+      exit(1);
+    }
+
+    /* The parent reloaded the rules, the new connections are for its new children */
+    if (!cl.retiring && is_proxy_outdated(ptr->proxy))
+    {
+      log_message(ptr->proxy->log, LOG_NOTICE, "Child has outdated rules. Retiring child.");
+      cl.retiring = TRUE;
+    }
+
+    /* Relays which are over may let us accept again */
+    child_loop_refresh(&cl);
+
+    /* The loop wakes up at least once a second, close the stale connections */
+    server_pool_expire();
+  }
+
+  ptr->status = T_EMPTY;
+
+  event_loop_delete(cl.loop);
+  exit(0);
 }
 #endif /* MINGW */
 
@@ -251,6 +807,11 @@ static
   ssize_t i;
   int ret;
 
+#ifndef MINGW
+  if (child_config.eventloop)
+    child_event_main(ptr); /* never returns */
+#endif
+
   cliaddr = (struct sockaddr *)safemalloc(sizeof(struct sockaddr_storage));
   if (!cliaddr)
   {
@@ -290,6 +851,14 @@ static
   {
     int listenfd = -1;
 
+    /* The parent reloaded the rules, leave the new connections to its new children */
+    if (is_proxy_outdated(ptr->proxy))
+    {
+      log_message(ptr->proxy->log, LOG_NOTICE, "Child has outdated rules. Killing child.");
+      SERVER_DEC(ptr->proxy->log);
+      break;
+    }
+
     ptr->status = T_WAITING;
 
     clilen = sizeof(struct sockaddr_storage);
@@ -568,14 +1137,113 @@ short int child_pool_create(pproxy_t proxy)
   return 0;
 }
 
+/*
+ * Create one more child in an empty slot, returns -1 if none is left or the
+ * child could not be created.
+ */
+static int child_spawn(pproxy_t proxy)
+{
+  unsigned int i;
+
+  for (i = 0; i != child_config.maxclients; i++)
+  {
+    if (child_ptr[i].status == T_EMPTY)
+    {
+      child_ptr[i].status = T_WAITING;
+      child_ptr[i].proxy = proxy;
+      child_ptr[i].tid = child_make(&child_ptr[i]);
+      if (child_ptr[i].tid < 0)
+      {
+        log_message(proxy->log, LOG_NOTICE, "Could not create child");
+
+        child_ptr[i].status = T_EMPTY;
+        return -1;
+      }
+
+      SERVER_INC(proxy->log);
+
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+#ifndef MINGW
+/*
+ * Reload the rules of the config file (Allow, Deny, BasicAuth, Anonymous,
+ * Filter and Upstream) and publish them under a new generation. The children
+ * cannot take over the objects of the parent, so the new generation is made
+ * of new children, while the older ones finish their connections and leave.
+ * The other options only change with a restart.
+ */
+static void child_reload(pproxy_t proxy)
+{
+  struct child_config_s pool = child_config;
+  struct config_s conf;
+  unsigned int i;
+  int ret;
+
+  log_message(proxy->log, LOG_NOTICE, "Reloading the rules of \"%s\".", config.config_file);
+
+  memset(&conf, 0, sizeof(conf));
+  ret = try_load_config_file(config.config_file, &conf, &config_defaults);
+
+  /* The file sets the child options as it is read, keep those of the pool */
+  child_config = pool;
+
+  if (ret || reconfigure_proxy(proxy, conf.anon, conf.acl, conf.auth, conf.filt))
+  {
+    log_message(proxy->log, LOG_ERR, "Could not reload \"%s\", keeping the old rules.",
+                config.config_file);
+    free_config(&conf);
+    return;
+  }
+
+  delete_pconf_anon_t(&config.anon);
+  config.anon = conf.anon;
+  conf.anon = NULL;
+
+  delete_pconf_acl_t(&config.acl);
+  config.acl = conf.acl;
+  conf.acl = NULL;
+
+  delete_pconf_auth_t(&config.auth);
+  config.auth = conf.auth;
+  conf.auth = NULL;
+
+  delete_pconf_filt_t(&config.filt);
+  config.filt = conf.filt;
+  conf.filt = NULL;
+
+#ifdef UPSTREAM_SUPPORT
+  free_upstream_list(config.upstream_list);
+  config.upstream_list = conf.upstream_list;
+  conf.upstream_list = NULL;
+#endif /* UPSTREAM_SUPPORT */
+
+  free_config(&conf);
+
+  /* Wake the waiting children up, so that they leave at once */
+  child_kill_children(proxy, SIGHUP);
+
+  /* Those were counted as waiting until now, do not wait for the loop to replace them */
+  for (i = 0; i != child_config.startservers; i++)
+  {
+    if (child_spawn(proxy))
+      break;
+  }
+
+  log_message(proxy->log, LOG_NOTICE, "Rules of generation %u published.", proxy->generation);
+}
+#endif /* MINGW */
+
 /*
  * Keep the proper number of servers running. This is the birth of the
  * servers. It monitors this at least once a second.
  */
 void child_main_loop(pproxy_t proxy)
 {
-  unsigned int i;
-
   while (1)
   {
     if (config.quit)
@@ -592,26 +1260,7 @@ void child_main_loop(pproxy_t proxy)
 
       SERVER_COUNT_UNLOCK();
 
-      for (i = 0; i != child_config.maxclients; i++)
-      {
-        if (child_ptr[i].status == T_EMPTY)
-        {
-          child_ptr[i].status = T_WAITING;
-          child_ptr[i].proxy = proxy;
-          child_ptr[i].tid = child_make(&child_ptr[i]);
-          if (child_ptr[i].tid < 0)
-          {
-            log_message(proxy->log, LOG_NOTICE, "Could not create child");
-
-            child_ptr[i].status = T_EMPTY;
-            break;
-          }
-
-          SERVER_INC(proxy->log);
-
-          break;
-        }
-      }
+      child_spawn(proxy);
     }
     else
     {
@@ -620,20 +1269,14 @@ void child_main_loop(pproxy_t proxy)
 
     sleep(5);
 
+    refresh_acl_hosts(proxy->log, proxy->acl);
+
 #ifndef MINGW
-    /* Handle log rotation if it was requested */
+    /* Reload the rules if it was requested */
     if (received_sighup)
     {
-      /*
-       * Ignore the return value of reload_config for now.
-       * This should actually be handled somehow...
-       */
-      // todo: delete this branch
-
-      /* propagate filter reload to all children */
-      child_kill_children(proxy, SIGHUP);
-
       received_sighup = FALSE;
+      child_reload(proxy);
     }
 #endif /* MINGW */
   }
@@ -704,13 +1347,27 @@ int child_listening_sockets(pproxy_t proxy, plist_t listen_addrs, uint16_t port)
     }
   }
 
+  if (child_config.reuseport && !child_config.eventloop)
+  {
+    log_message(proxy->log, LOG_WARNING, "ReusePort requires EventLoop, ignoring it.");
+    child_config.reuseport = FALSE;
+  }
+
+#if defined(MINGW) || !defined(SO_REUSEPORT)
+  if (child_config.reuseport)
+  {
+    log_message(proxy->log, LOG_WARNING, "ReusePort is not supported on this system, ignoring it.");
+    child_config.reuseport = FALSE;
+  }
+#endif
+
   if ((listen_addrs == NULL) || (list_length(listen_addrs) == 0))
   {
     /*
      * no Listen directive:
      * listen on the wildcard address(es)
      */
-    ret = listen_sock(proxy, NULL, port, listen_fds);
+    ret = listen_sock(proxy, NULL, port, listen_fds, child_config.reuseport);
     return ret;
   }
 
@@ -725,7 +1382,7 @@ int child_listening_sockets(pproxy_t proxy, plist_t listen_addrs, uint16_t port)
       continue;
     }
 
-    ret = listen_sock(proxy, addr, port, listen_fds);
+    ret = listen_sock(proxy, addr, port, listen_fds, child_config.reuseport);
     if (ret != 0)
     {
       return ret;
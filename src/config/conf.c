@@ -30,12 +30,15 @@
 
 #include "child.h"
 #include "connect-ports.h"
+#include "conns.h"
 #include "html-error.h"
 #include "misc/heap.h"
 #include "misc/list.h"
 #include "reqs.h"
 #include "reverse-proxy.h"
 #include "self_contained/safecall.h"
+#include "server-pool.h"
+#include "sock.h"
 #include "subservice/acl.h"
 #include "subservice/anonymous.h"
 #include "subservice/basicauth.h"
@@ -165,6 +168,7 @@ static HANDLE_FUNC(handle_filtercasesensitive);
 static HANDLE_FUNC(handle_filterwithwhitelist);
 static HANDLE_FUNC(handle_filterextended);
 static HANDLE_FUNC(handle_filterurls);
+static HANDLE_FUNC(handle_filtercache);
 
 static HANDLE_FUNC(handle_group);
 static HANDLE_FUNC(handle_listen);
@@ -172,6 +176,16 @@ static HANDLE_FUNC(handle_logfile);
 static HANDLE_FUNC(handle_loglevel);
 static HANDLE_FUNC(handle_maxclients);
 static HANDLE_FUNC(handle_maxrequestsperchild);
+static HANDLE_FUNC(handle_eventloop);
+static HANDLE_FUNC(handle_maxconnectionsperchild);
+static HANDLE_FUNC(handle_reuseport);
+static HANDLE_FUNC(handle_serverkeepalive);
+static HANDLE_FUNC(handle_serverkeepalivetimeout);
+static HANDLE_FUNC(handle_clientkeepalive);
+static HANDLE_FUNC(handle_clientkeepalivetimeout);
+static HANDLE_FUNC(handle_dnscache);
+static HANDLE_FUNC(handle_connecttimeout);
+static HANDLE_FUNC(handle_aclcache);
 static HANDLE_FUNC(handle_maxspareservers);
 static HANDLE_FUNC(handle_minspareservers);
 static HANDLE_FUNC(handle_pidfile);
@@ -243,6 +257,9 @@ struct
     /* boolean arguments */
     STDCONF("bindsame", BOOL, handle_bindsame),
     STDCONF("disableviaheader", BOOL, handle_disableviaheader),
+    STDCONF("eventloop", BOOL, handle_eventloop),
+    STDCONF("reuseport", BOOL, handle_reuseport),
+    STDCONF("clientkeepalive", BOOL, handle_clientkeepalive),
     /* integer arguments */
     STDCONF("port", INT, handle_port),
     STDCONF("maxclients", INT, handle_maxclients),
@@ -250,7 +267,14 @@ struct
     STDCONF("minspareservers", INT, handle_minspareservers),
     STDCONF("startservers", INT, handle_startservers),
     STDCONF("maxrequestsperchild", INT, handle_maxrequestsperchild),
+    STDCONF("maxconnectionsperchild", INT, handle_maxconnectionsperchild),
     STDCONF("timeout", INT, handle_timeout),
+    STDCONF("serverkeepalive", INT, handle_serverkeepalive),
+    STDCONF("serverkeepalivetimeout", INT, handle_serverkeepalivetimeout),
+    STDCONF("clientkeepalivetimeout", INT, handle_clientkeepalivetimeout),
+    STDCONF("dnscache", INT, handle_dnscache),
+    STDCONF("connecttimeout", INT, handle_connecttimeout),
+    STDCONF("aclcache", INT, handle_aclcache),
     STDCONF("connectport", INT, handle_connectport),
     /* alphanumeric arguments */
     STDCONF("user", ALNUM, handle_user),
@@ -303,6 +327,7 @@ struct
     STDCONF("filterextended", BOOL, handle_filterextended),
     STDCONF("filterwithwhitelist", BOOL, handle_filterwithwhitelist),
     STDCONF("filtercasesensitive", BOOL, handle_filtercasesensitive),
+    STDCONF("filtercache", INT, handle_filtercache),
 
 #ifdef REVERSE_SUPPORT
     /* Reverse proxy arguments */
@@ -343,7 +368,7 @@ static void free_added_headers(plist_t add_headers)
   TRACE_RET_VOID;
 }
 
-static void free_config(struct config_s *conf)
+void free_config(struct config_s *conf)
 {
   TRACE_CALL_X(free_config, "%p", (void *)conf);
 
@@ -551,6 +576,12 @@ static int initialize_with_defaults(struct config_s *conf, struct config_s *defa
   conf->port = defaults->port;
   conf->quit = defaults->quit;
   conf->idletimeout = defaults->idletimeout;
+  conf->server_keepalive = defaults->server_keepalive;
+  conf->server_keepalive_timeout = defaults->server_keepalive_timeout;
+  conf->client_keepalive = defaults->client_keepalive;
+  conf->client_keepalive_timeout = defaults->client_keepalive_timeout;
+  conf->connect_timeout = defaults->connect_timeout;
+  conf->dns_cache = defaults->dns_cache;
   conf->bindsame = defaults->bindsame;
   conf->disable_viaheader = defaults->disable_viaheader;
 
@@ -599,6 +630,11 @@ int try_load_config_file(const char *config_fname, struct config_s *conf, struct
 
   // set the default values if they were not set in the config file
   conf->idletimeout = conf->idletimeout ? conf->idletimeout : MAX_IDLE_TIME;
+  conf->server_keepalive_timeout =
+      conf->server_keepalive_timeout ? conf->server_keepalive_timeout : SERVER_KEEPALIVE_TIMEOUT;
+  conf->client_keepalive_timeout =
+      conf->client_keepalive_timeout ? conf->client_keepalive_timeout : CLIENT_KEEPALIVE_TIMEOUT;
+  conf->connect_timeout = conf->connect_timeout ? conf->connect_timeout : CONNECT_TIMEOUT;
 
   TRACE_SUCCESS;
 }
@@ -879,11 +915,64 @@ static HANDLE_FUNC(handle_maxrequestsperchild)
   return 0;
 }
 
+static HANDLE_FUNC(handle_eventloop)
+{
+  child_configure(CHILD_EVENTLOOP, get_int_bool_arg(line, &match[2]));
+  return 0;
+}
+
+static HANDLE_FUNC(handle_maxconnectionsperchild)
+{
+  child_configure(CHILD_MAXCONNECTIONSPERCHILD, get_long_arg(line, &match[2]));
+  return 0;
+}
+
+static HANDLE_FUNC(handle_reuseport)
+{
+  child_configure(CHILD_REUSEPORT, get_int_bool_arg(line, &match[2]));
+  return 0;
+}
+
 static HANDLE_FUNC(handle_timeout)
 {
   return set_int_arg(&conf->idletimeout, line, &match[2]);
 }
 
+static HANDLE_FUNC(handle_serverkeepalive)
+{
+  return set_int_arg(&conf->server_keepalive, line, &match[2]);
+}
+
+static HANDLE_FUNC(handle_serverkeepalivetimeout)
+{
+  return set_int_arg(&conf->server_keepalive_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC(handle_clientkeepalive)
+{
+  return set_int_bool_arg(&conf->client_keepalive, line, &match[2]);
+}
+
+static HANDLE_FUNC(handle_clientkeepalivetimeout)
+{
+  return set_int_arg(&conf->client_keepalive_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC(handle_dnscache)
+{
+  return set_int_arg(&conf->dns_cache, line, &match[2]);
+}
+
+static HANDLE_FUNC(handle_connecttimeout)
+{
+  return set_int_arg(&conf->connect_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC(handle_aclcache)
+{
+  return set_int_arg(&conf->acl->cache, line, &match[2]);
+}
+
 static HANDLE_FUNC(handle_connectport)
 {
   add_connect_port_allowed(get_long_arg(line, &match[2]), &conf->connect_ports);
@@ -1097,6 +1186,11 @@ static HANDLE_FUNC(handle_filtercasesensitive)
   return set_bool_arg(&conf->filt->is_case_sensitive, line, &match[2]);
 }
 
+static HANDLE_FUNC(handle_filtercache)
+{
+  return set_int_arg(&conf->filt->cache, line, &match[2]);
+}
+
 #ifdef REVERSE_SUPPORT
 static HANDLE_FUNC(handle_reverseonly)
 {
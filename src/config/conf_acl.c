@@ -47,7 +47,30 @@ int assign_acl_rule_t(conf_acl_rule_t *dst, conf_acl_rule_t *src)
   TRACE_SUCCESS;
 }
 
-CREATE_IMPL(pconf_acl_t, { obj->count = 0; })
+// Makes room for at least size rules.
+static int reserve_conf_acl(pconf_acl_t acl_config, size_t size)
+{
+  TRACE_CALL(reserve_conf_acl);
+
+  if (size <= acl_config->size)
+  {
+    TRACE_SUCCESS;
+  }
+
+  conf_acl_rule_t *rules;
+  TRACE_SAFE(NULL == (rules = saferealloc(acl_config->rules, size * sizeof(conf_acl_rule_t))));
+  acl_config->rules = rules;
+  acl_config->size = size;
+
+  TRACE_SUCCESS;
+}
+
+CREATE_IMPL(pconf_acl_t, {
+  obj->rules = NULL;
+  obj->count = 0;
+  obj->size = 0;
+  obj->cache = 0;
+})
 
 DELETE_IMPL(pconf_acl_t, {
   for (size_t i = 0; i < obj->count; ++i)
@@ -55,9 +78,18 @@ DELETE_IMPL(pconf_acl_t, {
     TRACE_SAFE(clean_acl_rule_t(obj->rules + i));
   }
   obj->count = 0;
+  safefree(obj->rules);
 })
 
 CLONE_IMPL(pconf_acl_t, {
+  if (NULL == dst || reserve_conf_acl(dst, src->count))
+  {
+    delete_pconf_acl_t(&dst);
+    TRACE_NULL;
+  }
+
+  dst->cache = src->cache;
+
   for (dst->count = 0; dst->count < src->count; ++(dst->count))
   {
     const size_t i = dst->count;
@@ -83,6 +115,11 @@ int add_rule_conf_acl(pconf_acl_t acl_config, const char *location, acl_access_t
   TRACE_SAFE_X(MAX_ACL_RULES <= acl_config->count, -1, "exceedes acl rules count limit (%zu)",
                MAX_ACL_RULES);
 
+  if (acl_config->count == acl_config->size)
+  {
+    TRACE_SAFE(reserve_conf_acl(acl_config, acl_config->size ? acl_config->size * 2 : 16));
+  }
+
   const size_t i = acl_config->count;
   TRACE_SAFE(init_acl_rule_t(acl_config->rules + i, location, access_type));
 
@@ -13,6 +13,7 @@ CREATE_IMPL(pconf_filt_t, {
   obj->is_case_sensitive = false;
   obj->is_extended = false;
   obj->policy = FILTER_WHITE_LIST;
+  obj->cache = 0;
 })
 
 DELETE_IMPL(pconf_filt_t, { safefree(obj->file_path); })
@@ -29,4 +30,5 @@ CLONE_IMPL(pconf_filt_t, {
   dst->is_extended = src->is_extended;
   dst->is_case_sensitive = src->is_case_sensitive;
   dst->policy = src->policy;
+  dst->cache = src->cache;
 })
@@ -31,6 +31,82 @@
 #include "subservice/log.h"
 #include "subservice/network.h"
 
+/*
+ * The part of the connection which only lasts for one request.
+ */
+static void init_request(struct conn_s *connptr)
+{
+  connptr->request_line = NULL;
+
+  /* These store any error strings */
+  connptr->error_variables = NULL;
+  connptr->error_string = NULL;
+  connptr->error_number = -1;
+
+  connptr->connect_method = FALSE;
+  connptr->show_stats = FALSE;
+
+  connptr->protocol.major = connptr->protocol.minor = 0;
+
+  /* There is _no_ content length initially */
+  connptr->content_length.server = connptr->content_length.client = -1;
+
+  /* Until the server tells otherwise, its response lasts as long as the connection */
+  body_framing_init(&connptr->response_body, BODY_UNTIL_CLOSE, -1);
+
+  connptr->server_keepalive = FALSE;
+  connptr->server_host = NULL;
+  connptr->server_port = 0;
+  connptr->server_reused = connptr->server_retried = FALSE;
+  connptr->client_keepalive = FALSE;
+
+  connptr->upstream_proxy = NULL;
+
+#ifdef REVERSE_SUPPORT
+  connptr->reversepath = NULL;
+#endif
+}
+
+static void free_request(pproxy_t proxy, struct conn_s *connptr)
+{
+  if (connptr->server_fd != -1)
+  {
+    if (closesocket(connptr->server_fd) < 0)
+    {
+      log_message(proxy->log, LOG_INFO, "Server (%d) close message: %s", connptr->server_fd,
+                  strerror(errno));
+    }
+    connptr->server_fd = -1;
+  }
+
+  if (connptr->request_line)
+  {
+    safefree(connptr->request_line);
+  }
+
+  if (connptr->error_variables)
+  {
+    hashmap_delete(connptr->error_variables);
+  }
+
+  if (connptr->error_string)
+  {
+    safefree(connptr->error_string);
+  }
+
+  if (connptr->server_host)
+  {
+    safefree(connptr->server_host);
+  }
+
+#ifdef REVERSE_SUPPORT
+  if (connptr->reversepath)
+  {
+    safefree(connptr->reversepath);
+  }
+#endif
+}
+
 struct conn_s *initialize_conn(int client_fd, const char *ipaddr, const char *string_addr,
                                const char *sock_ipaddr)
 {
@@ -61,33 +137,14 @@ struct conn_s *initialize_conn(int client_fd, const char *ipaddr, const char *st
   connptr->cbuffer = cbuffer;
   connptr->sbuffer = sbuffer;
 
-  connptr->request_line = NULL;
-
-  /* These store any error strings */
-  connptr->error_variables = NULL;
-  connptr->error_string = NULL;
-  connptr->error_number = -1;
-
-  connptr->connect_method = FALSE;
-  connptr->show_stats = FALSE;
-
-  connptr->protocol.major = connptr->protocol.minor = 0;
-
-  /* There is _no_ content length initially */
-  connptr->content_length.server = connptr->content_length.client = -1;
+  init_request(connptr);
 
   connptr->server_ip_addr = (sock_ipaddr ? safestrdup(sock_ipaddr) : NULL);
   connptr->client_ip_addr = safestrdup(ipaddr);
   connptr->client_string_addr = safestrdup(string_addr);
 
-  connptr->upstream_proxy = NULL;
-
   update_stats(STAT_OPEN);
 
-#ifdef REVERSE_SUPPORT
-  connptr->reversepath = NULL;
-#endif
-
   return connptr;
 
 error_exit:
@@ -118,14 +175,7 @@ void destroy_conn(pproxy_t proxy, struct conn_s *connptr)
                   strerror(errno));
     }
   }
-  if (connptr->server_fd != -1)
-  {
-    if (closesocket(connptr->server_fd) < 0)
-    {
-      log_message(proxy->log, LOG_INFO, "Server (%d) close message: %s", connptr->server_fd,
-                  strerror(errno));
-    }
-  }
+  free_request(proxy, connptr);
 
   if (connptr->cbuffer)
   {
@@ -136,21 +186,6 @@ void destroy_conn(pproxy_t proxy, struct conn_s *connptr)
     delete_buffer(connptr->sbuffer);
   }
 
-  if (connptr->request_line)
-  {
-    safefree(connptr->request_line);
-  }
-
-  if (connptr->error_variables)
-  {
-    hashmap_delete(connptr->error_variables);
-  }
-
-  if (connptr->error_string)
-  {
-    safefree(connptr->error_string);
-  }
-
   if (connptr->server_ip_addr)
   {
     safefree(connptr->server_ip_addr);
@@ -164,14 +199,15 @@ void destroy_conn(pproxy_t proxy, struct conn_s *connptr)
     safefree(connptr->client_string_addr);
   }
 
-#ifdef REVERSE_SUPPORT
-  if (connptr->reversepath)
-  {
-    safefree(connptr->reversepath);
-  }
-#endif
-
   safefree(connptr);
 
   update_stats(STAT_CLOSE);
 }
+
+void reset_conn(pproxy_t proxy, struct conn_s *connptr)
+{
+  assert(connptr != NULL);
+
+  free_request(proxy, connptr);
+  init_request(connptr);
+}
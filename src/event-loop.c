@@ -0,0 +1,427 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* A small readiness loop used by the children in "EventLoop" mode. Every
+ * registered descriptor owns a slot (indexed by the descriptor itself) with
+ * its callback, interest set and optional idle deadline. On Linux the kernel
+ * side is epoll, everywhere else it falls back to select().
+ *
+ * Callbacks are free to close and re-register descriptors while a batch is
+ * being dispatched, so every registration gets a serial number and stale
+ * events (for a slot that was removed, or removed and reused) are dropped.
+ */
+
+#include "main.h"
+
+#include "event-loop.h"
+#include "misc/heap.h"
+#include "subservice/network.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+// how many ready descriptors are fetched from the kernel at once
+#define EVENT_LOOP_BATCH 256
+
+struct event_slot_s
+{
+  event_callback_t callback;
+  void *data;
+  unsigned int events; // requested interest
+  unsigned int serial; // zero marks a free slot
+  time_t deadline;     // zero when no idle deadline is armed
+};
+
+struct event_loop_s
+{
+  struct event_slot_s *slots;
+  size_t capacity;
+  size_t count;
+  size_t armed; // number of slots with an armed deadline
+  unsigned int next_serial;
+  time_t last_sweep;
+
+#ifdef HAVE_EPOLL
+  int epfd;
+  struct epoll_event ready[EVENT_LOOP_BATCH];
+#else
+  // snapshot of the ready descriptors taken before dispatching
+  struct
+  {
+    int fd;
+    unsigned int serial;
+    unsigned int events;
+  } * ready;
+#endif
+};
+
+static struct event_slot_s *get_slot(pevent_loop_t loop, int fd)
+{
+  if (fd < 0 || (size_t)fd >= loop->capacity || loop->slots[fd].serial == 0)
+    return NULL;
+
+  return &loop->slots[fd];
+}
+
+/*
+ * Make sure there is a slot for the descriptor.
+ */
+static int reserve_slot(pevent_loop_t loop, int fd)
+{
+  struct event_slot_s *slots;
+  size_t capacity;
+
+  if ((size_t)fd < loop->capacity)
+    return 0;
+
+  capacity = loop->capacity ? loop->capacity : 64;
+  while (capacity <= (size_t)fd)
+    capacity *= 2;
+
+  slots = (struct event_slot_s *)saferealloc(loop->slots, capacity * sizeof(*slots));
+  if (!slots)
+    return -ENOMEM;
+
+  memset(slots + loop->capacity, 0, (capacity - loop->capacity) * sizeof(*slots));
+
+#ifndef HAVE_EPOLL
+  {
+    void *ready = saferealloc(loop->ready, capacity * sizeof(*loop->ready));
+    if (!ready)
+    {
+      loop->slots = slots;
+      return -ENOMEM;
+    }
+    loop->ready = ready;
+  }
+#endif
+
+  loop->slots = slots;
+  loop->capacity = capacity;
+
+  return 0;
+}
+
+#ifdef HAVE_EPOLL
+static uint32_t to_epoll_events(unsigned int events)
+{
+  uint32_t ev = 0;
+
+  if (events & EVENT_READ)
+    ev |= EPOLLIN | EPOLLRDHUP;
+  if (events & EVENT_WRITE)
+    ev |= EPOLLOUT;
+
+  return ev;
+}
+
+static int epoll_update(pevent_loop_t loop, int op, int fd, struct event_slot_s *slot)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = to_epoll_events(slot->events);
+  ev.data.u64 = ((uint64_t)slot->serial << 32) | (uint32_t)fd;
+
+  return epoll_ctl(loop->epfd, op, fd, &ev);
+}
+#endif /* HAVE_EPOLL */
+
+pevent_loop_t event_loop_create(void)
+{
+  pevent_loop_t loop;
+
+  loop = (pevent_loop_t)safecalloc(1, sizeof(struct event_loop_s));
+  if (!loop)
+    return NULL;
+
+  loop->next_serial = 1;
+  loop->last_sweep = time(NULL);
+
+#ifdef HAVE_EPOLL
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0)
+  {
+    safefree(loop);
+    return NULL;
+  }
+#endif
+
+  return loop;
+}
+
+/*
+ * Delete the loop. The registered descriptors are NOT closed, they belong
+ * to whoever registered them.
+ */
+void event_loop_delete(pevent_loop_t loop)
+{
+  if (!loop)
+    return;
+
+#ifdef HAVE_EPOLL
+  close(loop->epfd);
+#else
+  safefree(loop->ready);
+#endif
+
+  safefree(loop->slots);
+  safefree(loop);
+}
+
+int event_loop_add(pevent_loop_t loop, int fd, unsigned int events, event_callback_t callback,
+                   void *data)
+{
+  struct event_slot_s *slot;
+
+  assert(loop != NULL);
+  assert(callback != NULL);
+
+  if (fd < 0 || get_slot(loop, fd))
+    return -EINVAL;
+
+#if !defined(HAVE_EPOLL) && !defined(HAVE_WSOCK32)
+  if (fd >= FD_SETSIZE)
+    return -EMFILE;
+#endif
+
+  if (reserve_slot(loop, fd) < 0)
+    return -ENOMEM;
+
+  slot = &loop->slots[fd];
+  slot->callback = callback;
+  slot->data = data;
+  slot->events = events & (EVENT_READ | EVENT_WRITE);
+  slot->deadline = 0;
+  slot->serial = loop->next_serial++;
+  if (loop->next_serial == 0)
+    loop->next_serial = 1;
+
+#ifdef HAVE_EPOLL
+  if (epoll_update(loop, EPOLL_CTL_ADD, fd, slot) < 0)
+  {
+    slot->serial = 0;
+    return -errno;
+  }
+#endif
+
+  loop->count++;
+
+  return 0;
+}
+
+int event_loop_modify(pevent_loop_t loop, int fd, unsigned int events)
+{
+  struct event_slot_s *slot;
+
+  assert(loop != NULL);
+
+  if (!(slot = get_slot(loop, fd)))
+    return -EINVAL;
+
+  events &= EVENT_READ | EVENT_WRITE;
+  if (slot->events == events)
+    return 0;
+
+  slot->events = events;
+
+#ifdef HAVE_EPOLL
+  if (epoll_update(loop, EPOLL_CTL_MOD, fd, slot) < 0)
+    return -errno;
+#endif
+
+  return 0;
+}
+
+int event_loop_remove(pevent_loop_t loop, int fd)
+{
+  struct event_slot_s *slot;
+
+  assert(loop != NULL);
+
+  if (!(slot = get_slot(loop, fd)))
+    return -EINVAL;
+
+#ifdef HAVE_EPOLL
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+  if (slot->deadline)
+    loop->armed--;
+
+  memset(slot, 0, sizeof(*slot));
+  loop->count--;
+
+  return 0;
+}
+
+int event_loop_set_timeout(pevent_loop_t loop, int fd, unsigned int seconds)
+{
+  struct event_slot_s *slot;
+
+  assert(loop != NULL);
+
+  if (!(slot = get_slot(loop, fd)))
+    return -EINVAL;
+
+  if (slot->deadline)
+    loop->armed--;
+
+  slot->deadline = seconds ? time(NULL) + seconds : 0;
+
+  if (slot->deadline)
+    loop->armed++;
+
+  return 0;
+}
+
+size_t event_loop_count(pevent_loop_t loop)
+{
+  return loop->count;
+}
+
+/*
+ * Invoke the callback of a descriptor if it is still the registration the
+ * event was meant for.
+ */
+static int dispatch(pevent_loop_t loop, int fd, unsigned int serial, unsigned int events)
+{
+  struct event_slot_s *slot = get_slot(loop, fd);
+
+  if (!slot || slot->serial != serial)
+    return 0;
+
+  slot->callback(loop, fd, events, slot->data);
+  return 1;
+}
+
+/*
+ * Fire the callbacks of the expired idle deadlines. This runs at most once a
+ * second since the deadlines have a one second resolution anyway.
+ */
+static int sweep_deadlines(pevent_loop_t loop)
+{
+  time_t now = time(NULL);
+  int fired = 0;
+  size_t fd;
+
+  if (loop->armed == 0 || now == loop->last_sweep)
+    return 0;
+
+  loop->last_sweep = now;
+
+  for (fd = 0; fd != loop->capacity && loop->armed > 0; ++fd)
+  {
+    struct event_slot_s *slot = &loop->slots[fd];
+
+    if (slot->serial == 0 || slot->deadline == 0 || slot->deadline > now)
+      continue;
+
+    slot->deadline = 0;
+    loop->armed--;
+
+    fired += dispatch(loop, (int)fd, slot->serial, EVENT_TIMEOUT);
+  }
+
+  return fired;
+}
+
+#ifdef HAVE_EPOLL
+int event_loop_run_once(pevent_loop_t loop, int timeout_ms)
+{
+  int n, i, fired = 0;
+
+  assert(loop != NULL);
+
+  if (loop->armed > 0 && (timeout_ms < 0 || timeout_ms > 1000))
+    timeout_ms = 1000;
+
+  n = epoll_wait(loop->epfd, loop->ready, EVENT_LOOP_BATCH, timeout_ms);
+  if (n < 0)
+    return errno == EINTR ? 0 : -errno;
+
+  for (i = 0; i != n; ++i)
+  {
+    uint32_t ev = loop->ready[i].events;
+    unsigned int events = 0;
+
+    if (ev & EPOLLIN)
+      events |= EVENT_READ;
+    if (ev & EPOLLOUT)
+      events |= EVENT_WRITE;
+    if (ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+      events |= EVENT_HUP;
+
+    fired += dispatch(loop, (int)(loop->ready[i].data.u64 & 0xffffffffu),
+                      (unsigned int)(loop->ready[i].data.u64 >> 32), events);
+  }
+
+  return fired + sweep_deadlines(loop);
+}
+#else  /* HAVE_EPOLL */
+int event_loop_run_once(pevent_loop_t loop, int timeout_ms)
+{
+  fd_set rset, wset;
+  struct timeval tv;
+  size_t fd, nready = 0, i;
+  int maxfd = -1, n, fired = 0;
+
+  assert(loop != NULL);
+
+  if (loop->armed > 0 && (timeout_ms < 0 || timeout_ms > 1000))
+    timeout_ms = 1000;
+
+  FD_ZERO(&rset);
+  FD_ZERO(&wset);
+
+  for (fd = 0; fd != loop->capacity; ++fd)
+  {
+    struct event_slot_s *slot = &loop->slots[fd];
+
+    if (slot->serial == 0)
+      continue;
+
+    if (slot->events & EVENT_READ)
+      FD_SET(fd, &rset);
+    if (slot->events & EVENT_WRITE)
+      FD_SET(fd, &wset);
+
+    maxfd = max(maxfd, (int)fd);
+  }
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+  n = select(maxfd + 1, &rset, &wset, NULL, timeout_ms < 0 ? NULL : &tv);
+  if (n < 0)
+    return errno == EINTR ? 0 : -errno;
+
+  for (fd = 0; n > 0 && fd != loop->capacity; ++fd)
+  {
+    unsigned int events = 0;
+
+    if (loop->slots[fd].serial == 0)
+      continue;
+
+    if (FD_ISSET(fd, &rset))
+      events |= EVENT_READ;
+    if (FD_ISSET(fd, &wset))
+      events |= EVENT_WRITE;
+
+    if (events)
+    {
+      loop->ready[nready].fd = (int)fd;
+      loop->ready[nready].serial = loop->slots[fd].serial;
+      loop->ready[nready].events = events;
+      nready++;
+    }
+  }
+
+  for (i = 0; i != nready; ++i)
+    fired += dispatch(loop, loop->ready[i].fd, loop->ready[i].serial, loop->ready[i].events);
+
+  return fired + sweep_deadlines(loop);
+}
+#endif /* HAVE_EPOLL */
@@ -0,0 +1,113 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* tinyproxy-filtc compiles a filter file into a filter database, which
+ * tinyproxy maps at startup instead of parsing and compiling every rule.
+ * The database holds the matchers of the rules as they are in memory, so
+ * it has to be made with the FilterURLs, FilterExtended and
+ * FilterCaseSensitive options of the config which uses it.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "config/conf_filt.h"
+#include "config/conf_log.h"
+#include "custom_sysexits.h"
+#include "misc/heap.h"
+#include "subservice/filter.h"
+#include "subservice/log.h"
+
+static void display_usage(void)
+{
+  printf("Usage: tinyproxy-filtc [options] RULES DATABASE\n");
+  printf("\n"
+         "Compiles the filter file RULES into DATABASE, to be used as Filter.\n"
+         "\n"
+         "Options are (those of the config which uses the database):\n"
+         "  -u        FilterURLs On.\n"
+         "  -E        FilterExtended On.\n"
+         "  -C        FilterCaseSensitive On.\n"
+         "  -h        Display this usage information.\n");
+}
+
+int main(int argc, char **argv)
+{
+  pconf_filt_t filt_config;
+  pconf_log_t log_config;
+  pfilter_t filter;
+  plog_t log;
+  int opt, ret;
+
+  if (NULL == (filt_config = create_pconf_filt_t()))
+  {
+    fprintf(stderr, "%s: Could not allocate memory.\n", argv[0]);
+    return EX_SOFTWARE;
+  }
+  filt_config->enabled = true;
+
+  while ((opt = getopt(argc, argv, "uECh")) != EOF)
+  {
+    switch (opt)
+    {
+    case 'u':
+      filt_config->does_full_url_filtering = true;
+      break;
+
+    case 'E':
+      filt_config->is_extended = true;
+      break;
+
+    case 'C':
+      filt_config->is_case_sensitive = true;
+      break;
+
+    case 'h':
+      display_usage();
+      return EX_OK;
+
+    default:
+      display_usage();
+      return EX_USAGE;
+    }
+  }
+
+  if (argc - optind != 2)
+  {
+    display_usage();
+    return EX_USAGE;
+  }
+
+  if (NULL == (filt_config->file_path = safestrdup(argv[optind])) ||
+      NULL == (log_config = create_pconf_log_t()))
+  {
+    fprintf(stderr, "%s: Could not allocate memory.\n", argv[0]);
+    return EX_SOFTWARE;
+  }
+  log_config->log_level = LOG_INFO;
+
+  // the messages go to stdout
+  if (NULL == (log = create_configured_log(log_config)) || open_log_file(log) < 0 ||
+      NULL == (filter = create_configured_filter(filt_config)))
+  {
+    fprintf(stderr, "%s: Could not allocate memory.\n", argv[0]);
+    return EX_SOFTWARE;
+  }
+
+  if (activate_filtering(log, filter))
+  {
+    ret = EX_DATAERR;
+  }
+  else
+  {
+    ret = save_filtering(log, filter, argv[optind + 1]) ? EX_CANTCREAT : EX_OK;
+  }
+
+  delete_pfilter_t(&filter);
+  delete_plog_t(&log);
+  delete_pconf_log_t(&log_config);
+  delete_pconf_filt_t(&filt_config);
+
+  return ret;
+}
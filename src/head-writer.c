@@ -0,0 +1,205 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* Writer of the message heads the proxy forwards. The request line (or
+ * status line) and the header lines used to go out with a send() each,
+ * and a malloc() and vsnprintf() for every formatted one. They are now
+ * gathered as pieces: the names and values of the headers are pointed to
+ * where they already are, the few formatted lines are printed into the
+ * text of the writer, and the whole head is sent with one sendmsg().
+ */
+
+#include "main.h"
+
+#include "head-writer.h"
+#include "misc/heap.h"
+#include "subservice/network.h"
+
+/*
+ * If MSG_MORE is not defined, define it to be zero: the pieces sent early
+ * are then pushed right away.
+ */
+#ifndef MSG_MORE
+#define MSG_MORE (0)
+#endif
+
+void head_writer_init(struct head_writer_s *writer)
+{
+  assert(writer != NULL);
+
+  writer->count = 0;
+  writer->text_len = 0;
+}
+
+/*
+ * Send the pieces gathered and empty the writer.
+ */
+static int head_writer_send(struct head_writer_s *writer, int fd, int flags)
+{
+  head_piece_t *piece = writer->pieces;
+  size_t count = writer->count;
+
+  writer->count = 0;
+  writer->text_len = 0;
+
+  if (count == 0)
+    return 0;
+
+  assert(fd >= 0);
+
+#ifdef MINGW
+  {
+    size_t i, total = 0;
+    char *buf, *p;
+    ssize_t ret;
+
+    (void)flags;
+
+    for (i = 0; i != count; ++i)
+      total += piece[i].iov_len;
+
+    if ((buf = (char *)safemalloc(total)) == NULL)
+      return -1;
+
+    for (p = buf, i = 0; i != count; p += piece[i].iov_len, ++i)
+      memcpy(p, piece[i].iov_base, piece[i].iov_len);
+
+    ret = safe_write(fd, buf, total);
+    safefree(buf);
+
+    return ret < 0 ? -1 : 0;
+  }
+#else
+  {
+    struct msghdr msg;
+    ssize_t len;
+
+    while (count > 0)
+    {
+      /* sendmsg() is writev() with the flags of send() */
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = piece;
+      msg.msg_iovlen = count;
+
+      len = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+      if (len < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+
+      /* Skip what was sent, and go on with the rest */
+      while (count > 0 && (size_t)len >= piece->iov_len)
+      {
+        len -= piece->iov_len;
+        ++piece;
+        --count;
+      }
+
+      if (count > 0)
+      {
+        piece->iov_base = (char *)piece->iov_base + len;
+        piece->iov_len -= len;
+      }
+    }
+
+    return 0;
+  }
+#endif /* MINGW */
+}
+
+int head_writer_add(struct head_writer_s *writer, int fd, const void *buf, size_t len)
+{
+  assert(writer != NULL);
+  assert(buf != NULL);
+
+  if (writer->count == HEAD_WRITER_PIECES && head_writer_send(writer, fd, MSG_MORE) < 0)
+    return -1;
+
+  writer->pieces[writer->count].iov_base = (void *)buf;
+  writer->pieces[writer->count].iov_len = len;
+  ++writer->count;
+
+  return 0;
+}
+
+int head_writer_header(struct head_writer_s *writer, int fd, const char *name, const char *value)
+{
+  if (head_writer_add(writer, fd, name, strlen(name)) < 0 ||
+      head_writer_add(writer, fd, ": ", 2) < 0 ||
+      head_writer_add(writer, fd, value, strlen(value)) < 0 ||
+      head_writer_add(writer, fd, "\r\n", 2) < 0)
+    return -1;
+
+  return 0;
+}
+
+int head_writer_message(struct head_writer_s *writer, int fd, const char *fmt, ...)
+{
+  va_list ap;
+  size_t room;
+  char *buf;
+  int n, ret;
+
+  assert(writer != NULL);
+
+  /*
+   * Sending the pieces frees the text too, so make room for the piece
+   * before the text is formatted, not while it is added.
+   */
+  if (writer->count == HEAD_WRITER_PIECES && head_writer_send(writer, fd, MSG_MORE) < 0)
+    return -1;
+
+  room = HEAD_WRITER_TEXT - writer->text_len;
+
+  va_start(ap, fmt);
+  n = vsnprintf(writer->text + writer->text_len, room, fmt, ap);
+  va_end(ap);
+
+  if (n < 0)
+    return -1;
+
+  if ((size_t)n < room)
+  {
+    ret = head_writer_add(writer, fd, writer->text + writer->text_len, n);
+    writer->text_len += n;
+    return ret;
+  }
+
+  /* Make room by sending what was gathered */
+  if (head_writer_send(writer, fd, MSG_MORE) < 0)
+    return -1;
+
+  if ((size_t)n < HEAD_WRITER_TEXT)
+  {
+    va_start(ap, fmt);
+    vsnprintf(writer->text, HEAD_WRITER_TEXT, fmt, ap);
+    va_end(ap);
+
+    writer->text_len = n;
+    return head_writer_add(writer, fd, writer->text, n);
+  }
+
+  /* Too long for the text of the writer, it goes out on its own */
+  if ((buf = (char *)safemalloc(n + 1)) == NULL)
+    return -1;
+
+  va_start(ap, fmt);
+  vsnprintf(buf, n + 1, fmt, ap);
+  va_end(ap);
+
+  head_writer_add(writer, fd, buf, n);
+  ret = head_writer_send(writer, fd, MSG_MORE);
+
+  safefree(buf);
+  return ret;
+}
+
+int head_writer_flush(struct head_writer_s *writer, int fd)
+{
+  assert(writer != NULL);
+
+  return head_writer_send(writer, fd, 0);
+}
@@ -295,3 +295,23 @@ int indicate_http_error(struct conn_s *connptr, int number, const char *message,
 
   return (add_standard_vars(connptr));
 }
+
+/*
+ * Drop the error indicated, when the request is tried again.
+ */
+void forget_http_error(struct conn_s *connptr)
+{
+  if (connptr->error_variables)
+  {
+    hashmap_delete(connptr->error_variables);
+    connptr->error_variables = NULL;
+  }
+
+  if (connptr->error_string)
+  {
+    safefree(connptr->error_string);
+    connptr->error_string = NULL;
+  }
+
+  connptr->error_number = -1;
+}
@@ -35,11 +35,14 @@
 #include "child.h"
 #include "config/conf.h"
 #include "config/conf_log.h"
+#include "conns.h"
 #include "daemon.h"
 #include "misc/file_api.h"
 #include "misc/heap.h"
 #include "reqs.h"
+#include "resolver.h"
 #include "self_contained/safecall.h"
+#include "server-pool.h"
 #include "sock.h"
 #include "stats.h"
 #include "subservice/anonymous.h"
@@ -236,6 +239,9 @@ static int initialize_config_defaults(struct config_s *conf)
 
   conf->errorpages = NULL;
   conf->idletimeout = MAX_IDLE_TIME;
+  conf->server_keepalive_timeout = SERVER_KEEPALIVE_TIMEOUT;
+  conf->client_keepalive_timeout = CLIENT_KEEPALIVE_TIMEOUT;
+  conf->connect_timeout = CONNECT_TIMEOUT;
   conf->pidpath = NULL;
 
   // setup log
@@ -310,6 +316,8 @@ int main(int argc, char **argv)
   }
 
   init_stats();
+  init_resolver(proxy);
+  refresh_acl_hosts(proxy->log, proxy->acl);
   activate_filtering(proxy->log, proxy->filter);
 
   /* Start listening on the selected port. */
@@ -442,6 +450,8 @@ int run_proxy(void *nothing)
   }
 
   init_stats();
+  init_resolver(proxy);
+  refresh_acl_hosts(proxy->log, proxy->acl);
 
   /* Start listening on the selected port. */
   if (child_listening_sockets(proxy, config.listen_addrs, config.port) < 0)
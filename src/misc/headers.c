@@ -0,0 +1,521 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* The headers of a request or a response. They are appended to a dense
+ * array in the order they come, which is the order they are written out
+ * again, so going through them is a walk along the array. The names are
+ * found through an open-addressing index of the array (linear probing, at
+ * most half full), where the first header of a name is always probed
+ * before the later ones.
+ *
+ * A removed header stays in the array and in the index, marked, until the
+ * index is rebuilt. The headers of a received message are slices of the
+ * buffer it was received into, split in place, and are not copied. The
+ * others (added by the config) are copied, name and value together, into
+ * chunks of text that are only released with the headers. Either way a
+ * value stays valid after its header is removed.
+ *
+ * The well-known headers are not in the index: their id is looked up once,
+ * when they are added, and the first of each id is remembered.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "misc/headers.h"
+#include "misc/heap.h"
+
+#define HEADERS_INITIAL_SIZE 32   // headers before the array grows, half the slots of the index
+#define HEADERS_TEXT_SIZE    4096 // bytes of a chunk of text, unless a header needs more
+
+struct header_s
+{
+  char *name;
+  char *value;
+  size_t len; // of the value, with its NULL
+  uint32_t hash;
+  header_id_t id;
+  bool removed;
+};
+
+// the names and values of the headers are copied one after the other into the chunks
+struct header_text_s
+{
+  struct header_text_s *next;
+  size_t used, size;
+  char data[];
+};
+
+struct headers_s
+{
+  uint32_t seed;
+
+  struct header_s *headers; // in the order they were added
+  size_t count, size;
+
+  uint32_t *slots; // each is the index in headers plus one, or 0 if free
+  size_t slot_count; // a power of two, at least twice the size
+
+  // for each well-known id, the index in headers plus one of the first header, and the count
+  size_t first[HEADER_ID_COUNT];
+  size_t counts[HEADER_ID_COUNT];
+
+  struct header_text_s *text;
+};
+
+// The well-known names at the slot of their perfect hash, see header_id_of().
+#define KNOWN_HEADER_SLOTS 32
+#define KNOWN_HEADER(name, id) {name, sizeof(name) - 1, id}
+
+static const struct
+{
+  const char *name;
+  size_t len;
+  header_id_t id;
+} known_headers[KNOWN_HEADER_SLOTS] = {
+    [1] = KNOWN_HEADER("content-type", HEADER_CONTENT_TYPE),
+    [2] = KNOWN_HEADER("connection", HEADER_CONNECTION),
+    [3] = KNOWN_HEADER("trailers", HEADER_TRAILERS),
+    [4] = KNOWN_HEADER("host", HEADER_HOST),
+    [5] = KNOWN_HEADER("via", HEADER_VIA),
+    [9] = KNOWN_HEADER("cookie", HEADER_COOKIE),
+    [12] = KNOWN_HEADER("content-length", HEADER_CONTENT_LENGTH),
+    [13] = KNOWN_HEADER("proxy-authenticate", HEADER_PROXY_AUTHENTICATE),
+    [14] = KNOWN_HEADER("proxy-connection", HEADER_PROXY_CONNECTION),
+    [21] = KNOWN_HEADER("upgrade", HEADER_UPGRADE),
+    [25] = KNOWN_HEADER("keep-alive", HEADER_KEEP_ALIVE),
+    [26] = KNOWN_HEADER("proxy-authorization", HEADER_PROXY_AUTHORIZATION),
+    [27] = KNOWN_HEADER("transfer-encoding", HEADER_TRANSFER_ENCODING),
+    [29] = KNOWN_HEADER("te", HEADER_TE),
+    [30] = KNOWN_HEADER("location", HEADER_LOCATION),
+};
+
+/*
+ * The slot is a function of the length, the first and the last letters of
+ * the name, lower cased, which happens to be different for every one of the
+ * well-known names. A name landing on one of them still has to be it.
+ */
+header_id_t header_id_of(const char *name)
+{
+  size_t len = strlen(name);
+  size_t slot;
+
+  if (len == 0)
+  {
+    return HEADER_OTHER;
+  }
+
+  slot = (4 * len + 4 * (unsigned char)(name[0] | 0x20) + (unsigned char)(name[len - 1] | 0x20)) &
+         (KNOWN_HEADER_SLOTS - 1);
+  if (known_headers[slot].len == len && strcasecmp(known_headers[slot].name, name) == 0)
+  {
+    return known_headers[slot].id;
+  }
+
+  return HEADER_OTHER;
+}
+
+// Case-insensitive FNV-1a of the name, seeded per headers like the hashmap.
+static uint32_t hash_name(const char *name, uint32_t seed)
+{
+  uint32_t hash = 2166136261u ^ seed;
+  unsigned char c;
+
+  while ((c = (unsigned char)*name++) != '\0')
+  {
+    if (c >= 'A' && c <= 'Z')
+    {
+      c |= 0x20;
+    }
+    hash = (hash ^ c) * 16777619u;
+  }
+
+  return hash;
+}
+
+pheaders_t headers_create(void)
+{
+  struct headers_s *headers;
+
+  headers = (struct headers_s *)safecalloc(1, sizeof(struct headers_s));
+  if (!headers)
+  {
+    return NULL;
+  }
+
+  headers->seed = (uint32_t)rand();
+  headers->size = HEADERS_INITIAL_SIZE;
+  headers->slot_count = 2 * HEADERS_INITIAL_SIZE;
+  headers->headers = (struct header_s *)safemalloc(headers->size * sizeof(struct header_s));
+  headers->slots = (uint32_t *)safecalloc(headers->slot_count, sizeof(uint32_t));
+  if (!headers->headers || !headers->slots)
+  {
+    safefree(headers->headers);
+    safefree(headers->slots);
+    safefree(headers);
+    return NULL;
+  }
+
+  return headers;
+}
+
+int headers_delete(pheaders_t headers)
+{
+  struct header_text_s *text, *next;
+
+  if (headers == NULL)
+  {
+    return -EINVAL;
+  }
+
+  for (text = headers->text; text; text = next)
+  {
+    next = text->next;
+    safefree(text);
+  }
+
+  safefree(headers->headers);
+  safefree(headers->slots);
+  safefree(headers);
+
+  return 0;
+}
+
+// Room for len bytes of text, which stay where they are until the headers are deleted.
+static char *keep_text(pheaders_t headers, size_t len)
+{
+  struct header_text_s *text = headers->text;
+
+  if (!text || text->size - text->used < len)
+  {
+    size_t size = len > HEADERS_TEXT_SIZE ? len : HEADERS_TEXT_SIZE;
+
+    text = (struct header_text_s *)safemalloc(sizeof(struct header_text_s) + size);
+    if (!text)
+    {
+      return NULL;
+    }
+    text->used = 0;
+    text->size = size;
+    text->next = headers->text;
+    headers->text = text;
+  }
+
+  text->used += len;
+  return text->data + text->used - len;
+}
+
+static void index_header(pheaders_t headers, size_t i)
+{
+  size_t mask = headers->slot_count - 1;
+  size_t slot = headers->headers[i].hash & mask;
+
+  while (headers->slots[slot])
+  {
+    slot = (slot + 1) & mask;
+  }
+  headers->slots[slot] = (uint32_t)(i + 1);
+}
+
+// Make room for twice as many headers, the index is built again without the removed ones.
+static int grow_headers(pheaders_t headers)
+{
+  struct header_s *grown;
+  uint32_t *slots;
+  size_t i;
+
+  grown = (struct header_s *)saferealloc(headers->headers,
+                                         2 * headers->size * sizeof(struct header_s));
+  if (!grown)
+  {
+    return -ENOMEM;
+  }
+  headers->headers = grown;
+
+  slots = (uint32_t *)safecalloc(2 * headers->slot_count, sizeof(uint32_t));
+  if (!slots)
+  {
+    return -ENOMEM;
+  }
+  safefree(headers->slots);
+  headers->slots = slots;
+  headers->slot_count *= 2;
+  headers->size *= 2;
+
+  for (i = 0; i != headers->count; ++i)
+  {
+    if (!headers->headers[i].removed && headers->headers[i].id == HEADER_OTHER)
+    {
+      index_header(headers, i);
+    }
+  }
+
+  return 0;
+}
+
+int headers_insert_view(pheaders_t headers, char *name, char *value, size_t len)
+{
+  struct header_s *header;
+
+  if (headers == NULL || name == NULL || value == NULL)
+  {
+    return -EINVAL;
+  }
+
+  if (headers->count == headers->size && grow_headers(headers) < 0)
+  {
+    return -ENOMEM;
+  }
+
+  header = &headers->headers[headers->count];
+  header->name = name;
+  header->value = value;
+  header->len = len;
+  header->id = header_id_of(name);
+  header->removed = false;
+
+  if (header->id == HEADER_OTHER)
+  {
+    header->hash = hash_name(name, headers->seed);
+    index_header(headers, headers->count);
+  }
+  else if (headers->counts[header->id]++ == 0)
+  {
+    headers->first[header->id] = headers->count + 1;
+  }
+  ++headers->count;
+
+  return 0;
+}
+
+int headers_insert(pheaders_t headers, const char *name, const char *value)
+{
+  size_t name_len, value_len;
+  char *text;
+
+  if (headers == NULL || name == NULL || value == NULL)
+  {
+    return -EINVAL;
+  }
+
+  name_len = strlen(name) + 1;
+  value_len = strlen(value) + 1;
+  text = keep_text(headers, name_len + value_len);
+  if (!text)
+  {
+    return -ENOMEM;
+  }
+
+  memcpy(text, name, name_len);
+  memcpy(text + name_len, value, value_len);
+
+  return headers_insert_view(headers, text, text + name_len, value_len);
+}
+
+// The first header with the name which is not removed after the slot, or NULL.
+static struct header_s *find_header(pheaders_t headers, const char *name, uint32_t hash,
+                                    size_t *slot)
+{
+  size_t mask = headers->slot_count - 1;
+  struct header_s *header;
+
+  for (; headers->slots[*slot]; *slot = (*slot + 1) & mask)
+  {
+    header = &headers->headers[headers->slots[*slot] - 1];
+    if (header->hash == hash && !header->removed && strcasecmp(header->name, name) == 0)
+    {
+      return header;
+    }
+  }
+
+  return NULL;
+}
+
+ssize_t headers_entry_by_id(pheaders_t headers, header_id_t id, char **value)
+{
+  struct header_s *header;
+
+  if (!headers || id <= HEADER_OTHER || id >= HEADER_ID_COUNT || !value)
+  {
+    return -EINVAL;
+  }
+
+  if (headers->counts[id] == 0)
+  {
+    return 0;
+  }
+
+  header = &headers->headers[headers->first[id] - 1];
+  *value = header->value;
+  return (ssize_t)header->len;
+}
+
+ssize_t headers_entry_by_name(pheaders_t headers, const char *name, char **value)
+{
+  struct header_s *header;
+  header_id_t id;
+  uint32_t hash;
+  size_t slot;
+
+  if (!headers || !name || !value)
+  {
+    return -EINVAL;
+  }
+
+  if ((id = header_id_of(name)) != HEADER_OTHER)
+  {
+    return headers_entry_by_id(headers, id, value);
+  }
+
+  hash = hash_name(name, headers->seed);
+  slot = hash & (headers->slot_count - 1);
+  header = find_header(headers, name, hash, &slot);
+  if (!header)
+  {
+    return 0;
+  }
+
+  *value = header->value;
+  return (ssize_t)header->len;
+}
+
+ssize_t headers_search_id(pheaders_t headers, header_id_t id)
+{
+  if (!headers || id <= HEADER_OTHER || id >= HEADER_ID_COUNT)
+  {
+    return -EINVAL;
+  }
+
+  return (ssize_t)headers->counts[id];
+}
+
+ssize_t headers_search(pheaders_t headers, const char *name)
+{
+  header_id_t id;
+  uint32_t hash;
+  size_t slot;
+  ssize_t count = 0;
+
+  if (!headers || !name)
+  {
+    return -EINVAL;
+  }
+
+  if ((id = header_id_of(name)) != HEADER_OTHER)
+  {
+    return headers_search_id(headers, id);
+  }
+
+  hash = hash_name(name, headers->seed);
+  slot = hash & (headers->slot_count - 1);
+  while (find_header(headers, name, hash, &slot))
+  {
+    ++count;
+    slot = (slot + 1) & (headers->slot_count - 1);
+  }
+
+  return count;
+}
+
+ssize_t headers_remove_ids(pheaders_t headers, uint32_t ids)
+{
+  size_t i, from, count = 0;
+  int id;
+
+  if (!headers)
+  {
+    return -EINVAL;
+  }
+
+  /* Only the ids which are there, from the first header of any of them */
+  from = headers->count;
+  ids &= ~HEADER_BIT(HEADER_OTHER);
+  for (id = HEADER_OTHER + 1; id != HEADER_ID_COUNT; ++id)
+  {
+    if (!(ids & HEADER_BIT(id)) || headers->counts[id] == 0)
+    {
+      ids &= ~HEADER_BIT(id);
+      continue;
+    }
+    if (headers->first[id] - 1 < from)
+    {
+      from = headers->first[id] - 1;
+    }
+    count += headers->counts[id];
+    headers->counts[id] = 0;
+  }
+
+  for (i = from; i < headers->count; ++i)
+  {
+    if (ids & HEADER_BIT(headers->headers[i].id))
+    {
+      headers->headers[i].removed = true;
+    }
+  }
+
+  return (ssize_t)count;
+}
+
+ssize_t headers_remove(pheaders_t headers, const char *name)
+{
+  struct header_s *header;
+  header_id_t id;
+  uint32_t hash;
+  size_t slot;
+  ssize_t count = 0;
+
+  if (!headers || !name)
+  {
+    return -EINVAL;
+  }
+
+  if ((id = header_id_of(name)) != HEADER_OTHER)
+  {
+    return headers_remove_ids(headers, HEADER_BIT(id));
+  }
+
+  hash = hash_name(name, headers->seed);
+  slot = hash & (headers->slot_count - 1);
+  while ((header = find_header(headers, name, hash, &slot)))
+  {
+    header->removed = true;
+    ++count;
+    slot = (slot + 1) & (headers->slot_count - 1);
+  }
+
+  return count;
+}
+
+int headers_next(pheaders_t headers, headers_iter *iter, char **name, char **value,
+                 header_id_t *id)
+{
+  struct header_s *header;
+
+  if (!headers || !iter || !name || !value)
+  {
+    return 0;
+  }
+
+  for (; *iter < headers->count; ++*iter)
+  {
+    header = &headers->headers[*iter];
+    if (!header->removed)
+    {
+      ++*iter;
+      *name = header->name;
+      *value = header->value;
+      if (id)
+      {
+        *id = header->id;
+      }
+      return 1;
+    }
+  }
+
+  return 0;
+}
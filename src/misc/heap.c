@@ -128,6 +128,11 @@ void *calloc_shared_memory(size_t nmemb, size_t size)
 {
   return calloc(nmemb, size);
 }
+void free_shared_memory(void *ptr, size_t size)
+{
+  (void)size;
+  free(ptr);
+}
 #else // MINGW
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -158,10 +163,14 @@ void *malloc_shared_memory(size_t size)
 
   if (ftruncate(fd, size) == -1)
   {
+    close(fd);
     return MAP_FAILED;
   }
   ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
+  /* The mapping outlives the descriptor, which would leak at every reload */
+  close(fd);
+
   return ptr;
 }
 
@@ -189,4 +198,12 @@ void *calloc_shared_memory(size_t nmemb, size_t size)
 
   return ptr;
 }
+
+/*
+ * Release a block of memory from the "shared" region.
+ */
+void free_shared_memory(void *ptr, size_t size)
+{
+  munmap(ptr, size);
+}
 #endif /* MINGW */
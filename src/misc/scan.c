@@ -0,0 +1,180 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* Scanning of the heads of the HTTP messages. scan_head() reports the
+ * line feeds and the colons of a whole block at once, from which the
+ * parser gets the boundaries of the lines and of the header names. On x86
+ * it compares 32 (AVX2) or 16 (SSE2) bytes at a time against both, and
+ * walks the bits of the matches. The kernel is picked the first time,
+ * according to the processor, and the one built on memchr() is used
+ * everywhere else.
+ */
+
+#include "misc/scan.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t (*scan_head_f)(const char *data, size_t from, size_t len, uint32_t *marks,
+                              size_t max);
+
+/*
+ * The plain C kernel, on top of memchr() (vectorized by the C library
+ * where it can be): the line feed ending each line, and the first colon
+ * before it, the only one the parser looks at.
+ */
+static size_t scan_head_scalar(const char *data, size_t from, size_t len, uint32_t *marks,
+                               size_t max)
+{
+  const char *p = data + from, *end = data + len, *lf, *colon;
+  size_t n = 0;
+
+  while (p < end && n < max)
+  {
+    lf = (const char *)memchr(p, '\n', (size_t)(end - p));
+    if (NULL == lf)
+    {
+      lf = end;
+    }
+
+    colon = (const char *)memchr(p, ':', (size_t)(lf - p));
+    if (colon != NULL)
+    {
+      marks[n++] = (uint32_t)(colon - data) | SCAN_COLON;
+    }
+
+    if (n == max || lf == end)
+    {
+      break;
+    }
+    marks[n++] = (uint32_t)(lf - data);
+    p = lf + 1;
+  }
+
+  return n;
+}
+
+#ifdef SCAN_X86
+/*
+ * Store the marks of a block at "base": "found" has a bit per byte which
+ * is a line feed or a colon, and "colons" those of the colons.
+ */
+static inline size_t scan_store_marks(size_t base, uint32_t found, uint32_t colons,
+                                      uint32_t *marks, size_t n, size_t max)
+{
+  unsigned int bit;
+
+  while (found && n < max)
+  {
+    bit = (unsigned int)__builtin_ctz(found);
+    marks[n++] = (uint32_t)(base + bit) | ((colons >> bit) & 1 ? SCAN_COLON : 0);
+    found &= found - 1;
+  }
+
+  return n;
+}
+
+__attribute__((target("sse2"))) static size_t scan_head_sse2(const char *data, size_t from,
+                                                              size_t len, uint32_t *marks,
+                                                              size_t max)
+{
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i colon = _mm_set1_epi8(':');
+  __m128i block;
+  uint32_t lfs, colons;
+  size_t i, n = 0;
+
+  for (i = from; i + 16 <= len && n < max; i += 16)
+  {
+    block = _mm_loadu_si128((const __m128i *)(data + i));
+    lfs = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+    colons = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, colon));
+    n = scan_store_marks(i, lfs | colons, colons, marks, n, max);
+  }
+
+  if (n == max)
+  {
+    return n;
+  }
+  return n + scan_head_scalar(data, i, len, marks + n, max - n);
+}
+
+__attribute__((target("avx2"))) static size_t scan_head_avx2(const char *data, size_t from,
+                                                              size_t len, uint32_t *marks,
+                                                              size_t max)
+{
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i colon = _mm256_set1_epi8(':');
+  __m256i block;
+  uint32_t lfs, colons;
+  size_t i, n = 0;
+
+  for (i = from; i + 32 <= len && n < max; i += 32)
+  {
+    block = _mm256_loadu_si256((const __m256i *)(data + i));
+    lfs = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+    colons = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, colon));
+    n = scan_store_marks(i, lfs | colons, colons, marks, n, max);
+  }
+
+  if (n == max)
+  {
+    return n;
+  }
+  return n + scan_head_scalar(data, i, len, marks + n, max - n);
+}
+#endif
+
+static scan_head_f pick_scan_head(void)
+{
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return scan_head_avx2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    return scan_head_sse2;
+  }
+#endif
+  return scan_head_scalar;
+}
+
+size_t scan_head(const char *data, size_t from, size_t len, uint32_t *marks, size_t max)
+{
+  // every thread picks the same one, they may as well race for it
+  static scan_head_f kernel = NULL;
+
+  if (NULL == kernel)
+  {
+    kernel = pick_scan_head();
+  }
+
+  return kernel(data, from, len, marks, max);
+}
+
+// the separators of RFC 2616, section 2.2, and the white space
+static const unsigned char token_separators[256] = {
+    ['('] = 1, [')'] = 1, ['<'] = 1, ['>'] = 1,  ['@'] = 1, [','] = 1,  [';'] = 1,
+    [':'] = 1, ['\\'] = 1, ['"'] = 1, ['/'] = 1, ['['] = 1, [']'] = 1,  ['?'] = 1,
+    ['='] = 1, ['{'] = 1, ['}'] = 1, [' '] = 1,  ['\t'] = 1,
+};
+
+void scan_split_tokens(char *value)
+{
+  unsigned char *p;
+
+  for (p = (unsigned char *)value; *p; ++p)
+  {
+    if (token_separators[*p])
+    {
+      *p = '\0';
+    }
+  }
+}
@@ -0,0 +1,803 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* Relaying of the bytes between the client and the server once the headers
+ * have been exchanged. relay_connection() is the classic blocking poll()
+ * loop which keeps a child busy for the whole life of the connection, while
+ * relay_connection_in_loop() registers both sockets in the child's event loop
+ * so that a single child can carry thousands of connections at once.
+ *
+ * On Linux the CONNECT tunnels do not go through the buffers at all: the
+ * bytes are moved with splice() from one socket into a pipe and from the
+ * pipe into the other socket, so the (TLS) traffic never enters user space.
+ *
+ * The response body is followed on its way to the client, so the relay
+ * stops as soon as it is complete, and with ServerKeepAlive the connection
+ * to the server then goes back to the pool instead of being closed.
+ */
+
+#ifdef HAVE_SPLICE
+#define _GNU_SOURCE
+#endif
+
+#include "main.h"
+
+#include "buffer.h"
+#include "config/conf.h"
+#include "misc/heap.h"
+#include "relay.h"
+#include "server-pool.h"
+#include "sock.h"
+#include "subservice/log.h"
+#include "subservice/network.h"
+
+/*
+ * Wait for "events" on fd, the way a select() set would: an fd with
+ * nothing to wait for is left out, so that its hang up is not reported.
+ */
+static void relay_poll_set(struct pollfd *pfd, int fd, short events)
+{
+  pfd->fd = events ? fd : -1;
+  pfd->events = events;
+  pfd->revents = 0;
+}
+
+/*
+ * Is the fd ready for "event" (POLLIN or POLLOUT)? An error or a hang up
+ * is, the read or write then tells what happened.
+ */
+static unsigned int relay_poll_ready(const struct pollfd *pfd, short event)
+{
+  return (pfd->events & event) && (pfd->revents & (event | POLLERR | POLLHUP));
+}
+
+#ifdef HAVE_SPLICE
+// what we ask the kernel for, the default pipe only holds 64 KB
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+/*
+ * One direction of a spliced tunnel.
+ */
+struct splice_dir_s
+{
+  int src, dst;
+  int pipefd[2];
+  size_t pending; // bytes sitting in the pipe
+
+  // booleans
+  unsigned int eof;  // the source is at its end of file
+  unsigned int shut; // SHUT_WR was sent to the destination
+};
+
+static int splice_dir_open(struct splice_dir_s *dir, int src, int dst)
+{
+  memset(dir, 0, sizeof(*dir));
+  dir->src = src;
+  dir->dst = dst;
+
+  if (pipe2(dir->pipefd, O_NONBLOCK | O_CLOEXEC) != 0)
+    return -1;
+
+#ifdef F_SETPIPE_SZ
+  /* Only a hint: stay with the default size if this is refused */
+  fcntl(dir->pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+
+  return 0;
+}
+
+static void splice_dir_close(struct splice_dir_s *dir)
+{
+  close(dir->pipefd[0]);
+  close(dir->pipefd[1]);
+}
+
+/*
+ * The source is only read once the pipe has been emptied, the kernel
+ * does not tell how much room is left in a pipe.
+ */
+static unsigned int splice_dir_wants_read(struct splice_dir_s *dir)
+{
+  return !dir->eof && dir->pending == 0;
+}
+
+static unsigned int splice_dir_wants_write(struct splice_dir_s *dir)
+{
+  return dir->pending > 0;
+}
+
+/*
+ * Move what we can: from the source into the pipe when "readable" is set,
+ * then from the pipe into the destination. Both sockets are non-blocking.
+ *
+ * Returns 0, or -1 when the tunnel is broken.
+ */
+static int splice_dir_step(struct splice_dir_s *dir, unsigned int readable)
+{
+  ssize_t n;
+
+  if (readable && splice_dir_wants_read(dir))
+  {
+    n = splice(dir->src, NULL, dir->pipefd[1], NULL, SPLICE_PIPE_SIZE,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+      dir->pending += (size_t)n;
+    else if (n == 0)
+      dir->eof = TRUE;
+    else if (errno != EAGAIN && errno != EINTR)
+      return -1;
+  }
+
+  if (dir->pending > 0)
+  {
+    n = splice(dir->pipefd[0], NULL, dir->dst, NULL, dir->pending,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+      dir->pending -= (size_t)n;
+    else if (n < 0 && errno != EAGAIN && errno != EINTR)
+      return -1;
+  }
+
+  /* Pass the end of file along, the other direction may still be going */
+  if (dir->eof && dir->pending == 0 && !dir->shut)
+  {
+    shutdown(dir->dst, SHUT_WR);
+    dir->shut = TRUE;
+  }
+
+  return 0;
+}
+
+/*
+ * The bytes which arrived along with the headers are still in the buffers,
+ * deliver them before the tunnel bypasses the buffers. The sockets are
+ * still blocking at this point.
+ */
+static int relay_flush_buffers(pproxy_t proxy, struct conn_s *connptr)
+{
+  while (buffer_size(connptr->cbuffer) > 0)
+  {
+    if (write_buffer(proxy, connptr->server_fd, connptr->cbuffer) < 0)
+      return -1;
+  }
+
+  while (buffer_size(connptr->sbuffer) > 0)
+  {
+    if (write_buffer(proxy, connptr->client_fd, connptr->sbuffer) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Blocking relay of a CONNECT tunnel with splice().
+ *
+ * Returns 0 once the tunnel is over, or -1 if it could not be set up, in
+ * which case the buffered relay should be used.
+ */
+static int relay_tunnel(pproxy_t proxy, struct conn_s *connptr)
+{
+  struct splice_dir_s up, down; /* client -> server, server -> client */
+  struct pollfd pfd[2];         /* client, server */
+  int ret;
+
+  if (splice_dir_open(&up, connptr->client_fd, connptr->server_fd) < 0)
+    return -1;
+
+  if (splice_dir_open(&down, connptr->server_fd, connptr->client_fd) < 0)
+  {
+    splice_dir_close(&up);
+    return -1;
+  }
+
+  if (relay_flush_buffers(proxy, connptr) < 0 || socket_nonblocking(connptr->client_fd) != 0 ||
+      socket_nonblocking(connptr->server_fd) != 0)
+  {
+    log_message(proxy->log, LOG_ERR, "Could not start the tunnel (client_fd:%d, server_fd:%d)",
+                connptr->client_fd, connptr->server_fd);
+    goto done;
+  }
+
+  while (!up.shut || !down.shut)
+  {
+    relay_poll_set(&pfd[0], connptr->client_fd,
+                   (splice_dir_wants_read(&up) ? POLLIN : 0) |
+                       (splice_dir_wants_write(&down) ? POLLOUT : 0));
+    relay_poll_set(&pfd[1], connptr->server_fd,
+                   (splice_dir_wants_read(&down) ? POLLIN : 0) |
+                       (splice_dir_wants_write(&up) ? POLLOUT : 0));
+
+    ret = poll(pfd, 2, config.idletimeout * 1000);
+    if (ret == 0)
+    {
+      log_message(proxy->log, LOG_INFO, "Idle Timeout (in tunnel) after %u seconds.",
+                  config.idletimeout);
+      break;
+    }
+    else if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      log_message(proxy->log, LOG_ERR,
+                  "relay_tunnel: poll() error \"%s\". "
+                  "Closing connection (client_fd:%d, server_fd:%d)",
+                  strerror(errno), connptr->client_fd, connptr->server_fd);
+      break;
+    }
+
+    if (splice_dir_step(&up, relay_poll_ready(&pfd[0], POLLIN)) < 0 ||
+        splice_dir_step(&down, relay_poll_ready(&pfd[1], POLLIN)) < 0)
+    {
+      break;
+    }
+  }
+
+done:
+  splice_dir_close(&up);
+  splice_dir_close(&down);
+  return 0;
+}
+#endif /* HAVE_SPLICE */
+
+/*
+ * Follow the response body through the bytes just read from the server.
+ * Returns TRUE once it is complete.
+ */
+static unsigned int relay_response_data(struct conn_s *connptr, ssize_t bytes)
+{
+  const char *data = (const char *)buffer_tail(connptr->sbuffer, (size_t)bytes);
+
+  /* Anything past the end of the response makes both connections unusable */
+  if (body_framing_feed(&connptr->response_body, data, (size_t)bytes) != (size_t)bytes ||
+      connptr->response_body.mode == BODY_UNTIL_CLOSE)
+  {
+    connptr->server_keepalive = FALSE;
+    connptr->client_keepalive = FALSE;
+  }
+
+  return connptr->response_body.complete;
+}
+
+/*
+ * Anything the client sends once the request is over also reaches the
+ * server, which would answer it on this connection. A client keeping its
+ * connection is not read from at all, what it sends is its next request.
+ */
+static void relay_request_data(struct conn_s *connptr, ssize_t bytes)
+{
+  if (bytes > 0)
+    connptr->server_keepalive = FALSE;
+}
+
+/*
+ * Once the whole response was relayed, give the connection to the server
+ * to the pool for the next request.
+ */
+static void relay_keep_server(pproxy_t proxy, struct conn_s *connptr)
+{
+  if (!connptr->server_keepalive || !connptr->response_body.complete)
+    return;
+
+  if (server_pool_put(connptr->server_fd, connptr->server_host, connptr->server_port,
+                      connptr->upstream_proxy, connptr->server_ip_addr) < 0)
+  {
+    return;
+  }
+
+  log_message(proxy->log, LOG_CONN, "Keeping the connection to \"%s\" (fd:%d) for reuse.",
+              connptr->server_host, connptr->server_fd);
+  connptr->server_fd = -1;
+}
+
+/*
+ * Switch the sockets into nonblocking mode and begin relaying the bytes
+ * between the two connections. We continue to use the buffering code
+ * since we want to be able to buffer a certain amount for slower
+ * connections (as this was the reason why I originally modified
+ * tinyproxy oh so long ago...)
+ *	- rjkaes
+ */
+void relay_connection(pproxy_t proxy, struct conn_s *connptr)
+{
+  struct pollfd pfd[2]; /* client, server */
+  time_t last_access;
+  int ret;
+  double tdiff;
+  ssize_t bytes_received;
+  unsigned int client_kept = connptr->client_keepalive;
+
+#ifdef HAVE_SPLICE
+  if (connptr->connect_method && relay_tunnel(proxy, connptr) == 0)
+    return;
+#endif
+
+  ret = socket_nonblocking(connptr->client_fd);
+  if (ret != 0)
+  {
+    log_message(proxy->log, LOG_ERR,
+                "Failed to set the client socket "
+                "to non-blocking: %s",
+                strerror(errno));
+    goto fail;
+  }
+
+  ret = socket_nonblocking(connptr->server_fd);
+  if (ret != 0)
+  {
+    log_message(proxy->log, LOG_ERR,
+                "Failed to set the server socket "
+                "to non-blocking: %s",
+                strerror(errno));
+    goto fail;
+  }
+
+  /* Leftovers of the client would be sent to the server */
+  if (!client_kept)
+    relay_request_data(connptr, (ssize_t)buffer_size(connptr->cbuffer));
+
+  last_access = time(NULL);
+
+  while (!connptr->response_body.complete)
+  {
+    relay_poll_set(&pfd[0], connptr->client_fd,
+                   (buffer_size(connptr->sbuffer) > 0 ? POLLOUT : 0) |
+                       (buffer_size(connptr->cbuffer) < MAXBUFFSIZE && !client_kept ? POLLIN : 0));
+    relay_poll_set(&pfd[1], connptr->server_fd,
+                   (buffer_size(connptr->cbuffer) > 0 && !client_kept ? POLLOUT : 0) |
+                       (buffer_size(connptr->sbuffer) < MAXBUFFSIZE ? POLLIN : 0));
+
+    ret = poll(pfd, 2,
+               (int)max(config.idletimeout - difftime(time(NULL), last_access), 0.0) * 1000);
+
+    if (ret == 0)
+    {
+      tdiff = difftime(time(NULL), last_access);
+      if (tdiff >= config.idletimeout)
+      {
+        log_message(proxy->log, LOG_INFO, "Idle Timeout (after poll) as %g >= %u.", tdiff,
+                    config.idletimeout);
+        goto fail;
+      }
+      else
+      {
+        continue;
+      }
+    }
+    else if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      log_message(proxy->log, LOG_ERR,
+                  "relay_connection: poll() error \"%s\". "
+                  "Closing connection (client_fd:%d, server_fd:%d)",
+                  strerror(errno), connptr->client_fd, connptr->server_fd);
+      goto fail;
+    }
+    else
+    {
+      /*
+       * All right, something was actually selected so mark it.
+       */
+      last_access = time(NULL);
+    }
+
+    if (relay_poll_ready(&pfd[1], POLLIN))
+    {
+      bytes_received = read_buffer(proxy, connptr->server_fd, connptr->sbuffer);
+      if (bytes_received < 0)
+        break;
+
+      if (bytes_received > 0 && relay_response_data(connptr, bytes_received))
+        break;
+    }
+    if (relay_poll_ready(&pfd[0], POLLIN))
+    {
+      bytes_received = read_buffer(proxy, connptr->client_fd, connptr->cbuffer);
+      if (bytes_received < 0)
+        break;
+
+      relay_request_data(connptr, bytes_received);
+    }
+    if (relay_poll_ready(&pfd[1], POLLOUT) &&
+        write_buffer(proxy, connptr->server_fd, connptr->cbuffer) < 0)
+    {
+      break;
+    }
+    if (relay_poll_ready(&pfd[0], POLLOUT) &&
+        write_buffer(proxy, connptr->client_fd, connptr->sbuffer) < 0)
+    {
+      break;
+    }
+  }
+
+  /*
+   * Here the server has closed the connection... write the
+   * remainder to the client and then exit.
+   */
+  ret = socket_blocking(connptr->client_fd);
+  if (ret != 0)
+  {
+    log_message(proxy->log, LOG_ERR, "Failed to set client socket to blocking: %s",
+                strerror(errno));
+    goto fail;
+  }
+
+  while (buffer_size(connptr->sbuffer) > 0)
+  {
+    if (write_buffer(proxy, connptr->client_fd, connptr->sbuffer) < 0)
+      break;
+  }
+
+  /* The client stays for its next request once it has the whole response */
+  if (!connptr->response_body.complete || buffer_size(connptr->sbuffer) > 0)
+    connptr->client_keepalive = FALSE;
+
+  if (!connptr->client_keepalive)
+    shutdown(connptr->client_fd, SHUT_WR);
+
+  /*
+   * Try to send any remaining data to the server if we can. What a client
+   * keeping its connection sent is its next request, not for this server.
+   */
+  if (!client_kept)
+  {
+    ret = socket_blocking(connptr->server_fd);
+    if (ret != 0)
+    {
+      log_message(proxy->log, LOG_ERR, "Failed to set server socket to blocking: %s",
+                  strerror(errno));
+      return;
+    }
+
+    while (buffer_size(connptr->cbuffer) > 0)
+    {
+      if (write_buffer(proxy, connptr->server_fd, connptr->cbuffer) < 0)
+        break;
+    }
+  }
+
+  relay_keep_server(proxy, connptr);
+  return;
+
+fail:
+  /* The client missed (part of) the response */
+  connptr->client_keepalive = FALSE;
+}
+
+
+/*
+ * State of a connection relayed by an event loop.
+ */
+struct relay_s
+{
+  pproxy_t proxy;
+  pevent_loop_t loop;
+  struct conn_s *connptr;
+
+  // takes over a client which keeps its connection
+  relay_kept_t kept;
+  void *data;
+
+  // booleans
+  unsigned int draining;    // no more reads, only flush what is buffered
+  unsigned int client_dead; // writing to the client failed
+  unsigned int server_dead; // writing to the server failed
+  unsigned int client_shut; // SHUT_WR was already sent to the client
+  unsigned int client_kept; // the request is over, the client is not read from any more
+
+#ifdef HAVE_SPLICE
+  unsigned int spliced; // boolean, a CONNECT tunnel relayed with splice()
+  struct splice_dir_s up, down;
+#endif
+};
+
+static size_t active_relays = 0;
+
+size_t relay_active_count(void)
+{
+  return active_relays;
+}
+
+/*
+ * Does the client keep its connection for another request? Only once the
+ * whole response was delivered.
+ */
+static unsigned int relay_client_stays(struct relay_s *relay)
+{
+  struct conn_s *connptr = relay->connptr;
+
+  return relay->client_kept && connptr->client_keepalive && connptr->response_body.complete &&
+         buffer_size(connptr->sbuffer) == 0 && !relay->client_dead;
+}
+
+static void relay_finish(struct relay_s *relay)
+{
+  struct conn_s *connptr = relay->connptr;
+  pproxy_t proxy = relay->proxy;
+  pevent_loop_t loop = relay->loop;
+  relay_kept_t kept = relay->kept;
+  void *data = relay->data;
+  unsigned int stays;
+
+  event_loop_remove(loop, connptr->client_fd);
+  event_loop_remove(loop, connptr->server_fd);
+
+#ifdef HAVE_SPLICE
+  if (relay->spliced)
+  {
+    splice_dir_close(&relay->up);
+    splice_dir_close(&relay->down);
+  }
+#endif
+
+  stays = relay_client_stays(relay);
+  relay_keep_server(proxy, connptr);
+
+  safefree(relay);
+  active_relays--;
+
+  if (stays)
+  {
+    reset_conn(proxy, connptr);
+    kept(loop, connptr, data);
+    return;
+  }
+
+  log_message(proxy->log, LOG_INFO,
+              "Closed connection between local client (fd:%d) "
+              "and remote client (fd:%d)",
+              connptr->client_fd, connptr->server_fd);
+
+  destroy_conn(proxy, connptr);
+}
+
+/*
+ * Is there still something buffered which can be delivered?
+ */
+static int relay_has_pending(struct relay_s *relay)
+{
+  return (buffer_size(relay->connptr->sbuffer) > 0 && !relay->client_dead) ||
+         (buffer_size(relay->connptr->cbuffer) > 0 && !relay->server_dead && !relay->client_kept);
+}
+
+/*
+ * Recompute the interest of both sockets from the state of the buffers,
+ * the same way the poll() loop of relay_connection() does.
+ */
+static void relay_update_interest(struct relay_s *relay)
+{
+  struct conn_s *connptr = relay->connptr;
+  unsigned int client_events = 0, server_events = 0;
+
+  if (!relay->draining)
+  {
+    if (buffer_size(connptr->sbuffer) < MAXBUFFSIZE)
+      server_events |= EVENT_READ;
+    if (buffer_size(connptr->cbuffer) < MAXBUFFSIZE && !relay->client_kept)
+      client_events |= EVENT_READ;
+  }
+
+  if (buffer_size(connptr->sbuffer) > 0 && !relay->client_dead)
+    client_events |= EVENT_WRITE;
+  if (buffer_size(connptr->cbuffer) > 0 && !relay->server_dead && !relay->client_kept)
+    server_events |= EVENT_WRITE;
+
+  event_loop_modify(relay->loop, connptr->client_fd, client_events);
+  event_loop_modify(relay->loop, connptr->server_fd, server_events);
+}
+
+#ifdef HAVE_SPLICE
+static void relay_tunnel_event(struct relay_s *relay, int fd, unsigned int events)
+{
+  struct conn_s *connptr = relay->connptr;
+  unsigned int readable = (events & (EVENT_READ | EVENT_HUP)) != 0;
+  int ret;
+
+  if (fd == connptr->client_fd)
+    ret = splice_dir_step(&relay->up, readable) | splice_dir_step(&relay->down, FALSE);
+  else
+    ret = splice_dir_step(&relay->down, readable) | splice_dir_step(&relay->up, FALSE);
+
+  /* See relay_event() about a hang up we are not waiting for */
+  if (ret < 0 || (relay->up.shut && relay->down.shut) ||
+      ((events & EVENT_HUP) && !(events & (EVENT_READ | EVENT_WRITE))))
+  {
+    relay_finish(relay);
+    return;
+  }
+
+  event_loop_modify(relay->loop, connptr->client_fd,
+                    (splice_dir_wants_read(&relay->up) ? EVENT_READ : 0) |
+                        (splice_dir_wants_write(&relay->down) ? EVENT_WRITE : 0));
+  event_loop_modify(relay->loop, connptr->server_fd,
+                    (splice_dir_wants_read(&relay->down) ? EVENT_READ : 0) |
+                        (splice_dir_wants_write(&relay->up) ? EVENT_WRITE : 0));
+  event_loop_set_timeout(relay->loop, connptr->client_fd, config.idletimeout);
+}
+#endif /* HAVE_SPLICE */
+
+static void relay_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct relay_s *relay = (struct relay_s *)data;
+  struct conn_s *connptr = relay->connptr;
+  ssize_t bytes;
+
+  if (events & EVENT_TIMEOUT)
+  {
+    log_message(relay->proxy->log, LOG_INFO, "Idle Timeout (in event loop) after %u seconds.",
+                config.idletimeout);
+    relay_finish(relay);
+    return;
+  }
+
+#ifdef HAVE_SPLICE
+  if (relay->spliced)
+  {
+    relay_tunnel_event(relay, fd, events);
+    return;
+  }
+#endif
+
+  if (fd == connptr->server_fd)
+  {
+    if ((events & (EVENT_READ | EVENT_HUP)) && !relay->draining)
+    {
+      bytes = read_buffer(relay->proxy, connptr->server_fd, connptr->sbuffer);
+      if (bytes < 0 || (bytes > 0 && relay_response_data(connptr, bytes)))
+        relay->draining = TRUE;
+    }
+    if ((events & EVENT_WRITE) && !relay->server_dead &&
+        write_buffer(relay->proxy, connptr->server_fd, connptr->cbuffer) < 0)
+    {
+      relay->server_dead = TRUE;
+      relay->draining = TRUE;
+      connptr->server_keepalive = FALSE;
+    }
+  }
+  else
+  {
+    if ((events & (EVENT_READ | EVENT_HUP)) && !relay->draining)
+    {
+      bytes = read_buffer(relay->proxy, connptr->client_fd, connptr->cbuffer);
+      if (bytes < 0)
+        relay->draining = TRUE;
+      else
+        relay_request_data(connptr, bytes);
+    }
+    if ((events & EVENT_WRITE) && !relay->client_dead &&
+        write_buffer(relay->proxy, connptr->client_fd, connptr->sbuffer) < 0)
+    {
+      relay->client_dead = TRUE;
+      relay->draining = TRUE;
+    }
+  }
+
+  /*
+   * A hang up on a socket we are not reading from any more would be
+   * reported again and again, so treat it as the end of the relay.
+   */
+  if ((events & EVENT_HUP) && !(events & (EVENT_READ | EVENT_WRITE)))
+    relay->draining = TRUE;
+
+  if (relay->draining)
+  {
+    /*
+     * Same order as relay_connection(): once everything from the server
+     * has been delivered, tell the client that no more data is coming.
+     */
+    if (!relay->client_shut && !relay_client_stays(relay) &&
+        (buffer_size(connptr->sbuffer) == 0 || relay->client_dead))
+    {
+      shutdown(connptr->client_fd, SHUT_WR);
+      relay->client_shut = TRUE;
+    }
+
+    if (!relay_has_pending(relay))
+    {
+      relay_finish(relay);
+      return;
+    }
+  }
+
+  relay_update_interest(relay);
+  event_loop_set_timeout(loop, connptr->client_fd, config.idletimeout);
+}
+
+int relay_connection_in_loop(pproxy_t proxy, pevent_loop_t loop, struct conn_s *connptr,
+                             relay_kept_t kept, void *data)
+{
+  struct relay_s *relay;
+
+  assert(loop != NULL);
+  assert(connptr != NULL);
+
+  relay = (struct relay_s *)safecalloc(1, sizeof(struct relay_s));
+  if (!relay)
+    return -ENOMEM;
+
+  relay->proxy = proxy;
+  relay->loop = loop;
+  relay->connptr = connptr;
+  relay->kept = kept;
+  relay->data = data;
+  relay->client_kept = connptr->client_keepalive && kept != NULL;
+
+#ifdef HAVE_SPLICE
+  if (connptr->connect_method)
+  {
+    if (splice_dir_open(&relay->up, connptr->client_fd, connptr->server_fd) == 0)
+    {
+      if (splice_dir_open(&relay->down, connptr->server_fd, connptr->client_fd) == 0)
+        relay->spliced = TRUE;
+      else
+        splice_dir_close(&relay->up);
+    }
+
+    if (relay->spliced && relay_flush_buffers(proxy, connptr) < 0)
+    {
+      splice_dir_close(&relay->up);
+      splice_dir_close(&relay->down);
+      safefree(relay);
+      return -EPIPE;
+    }
+  }
+#endif
+
+  if (socket_nonblocking(connptr->client_fd) != 0 || socket_nonblocking(connptr->server_fd) != 0)
+  {
+    log_message(proxy->log, LOG_ERR, "Failed to set the relayed sockets to non-blocking: %s",
+                strerror(errno));
+    goto fail;
+  }
+
+  if (event_loop_add(loop, connptr->client_fd, 0, relay_event, relay) < 0)
+    goto fail;
+
+  if (event_loop_add(loop, connptr->server_fd, 0, relay_event, relay) < 0)
+  {
+    event_loop_remove(loop, connptr->client_fd);
+    goto fail;
+  }
+
+  active_relays++;
+
+#ifdef HAVE_SPLICE
+  if (relay->spliced)
+  {
+    /* Nothing is in the pipes yet, this only sets the interest */
+    relay_tunnel_event(relay, connptr->client_fd, 0);
+    return 0;
+  }
+#endif
+
+  if (!relay->client_kept)
+    relay_request_data(connptr, (ssize_t)buffer_size(connptr->cbuffer));
+
+  /* A response without a body is already over, only the buffers are left */
+  if (connptr->response_body.complete)
+  {
+    relay->draining = TRUE;
+    relay_event(loop, connptr->client_fd, 0, relay);
+    return 0;
+  }
+
+  relay_update_interest(relay);
+  event_loop_set_timeout(loop, connptr->client_fd, config.idletimeout);
+
+  return 0;
+
+fail:
+#ifdef HAVE_SPLICE
+  if (relay->spliced)
+  {
+    splice_dir_close(&relay->up);
+    splice_dir_close(&relay->down);
+  }
+#endif
+  safefree(relay);
+  return -1;
+}
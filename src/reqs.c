@@ -29,19 +29,26 @@
 
 #include <child.h>
 #include <libwebsockets.h>
+#include <limits.h>
 #include <stdbool.h>
 
 #include "buffer.h"
 #include "config/conf.h"
 #include "connect-ports.h"
 #include "conns.h"
+#include "head-writer.h"
 #include "html-error.h"
-#include "misc/hashmap.h"
+#include "misc/headers.h"
 #include "misc/heap.h"
 #include "misc/list.h"
+#include "misc/scan.h"
 #include "misc/text.h"
+#include "relay.h"
 #include "reqs.h"
+#include "request-parser.h"
+#include "resolver.h"
 #include "reverse-proxy.h"
+#include "server-pool.h"
 #include "sock.h"
 #include "stats.h"
 #include "subservice/acl.h"
@@ -90,44 +97,46 @@ struct my_ws_conn
   (((len) == 1 && header[0] == '\n') || ((len) == 2 && header[0] == '\r' && header[1] == '\n'))
 
 /*
- * Codify the test for header fields folded over multiple lines.
+ * What get_content_length() returns when the length of a body can't be
+ * trusted.
  */
-#define CHECK_LWS(header, len) ((len) > 0 && (header[0] == ' ' || header[0] == '\t'))
+#define CONTENT_LENGTH_INVALID (-2)
 
 /*
- * Read in the first line from the client (the request line for HTTP
- * connections. The request line is allocated from the heap, but it must
- * be freed in another function.
+ * Read in the head (request line and headers) from the client. A parser
+ * which already holds the complete head (EventLoop mode) is used as is.
+ * The request line is copied to the heap, but it must be freed in another
+ * function. Whatever the client sent past the head is queued in the
+ * client buffer.
  */
-static int read_request_line(pproxy_t proxy, struct conn_s *connptr)
+static int read_request_head(pproxy_t proxy, struct conn_s *connptr, prequest_parser_t parser)
 {
-  ssize_t len;
+  const char *leftover;
+  size_t len;
+  int ret;
 
-retry:
-  len = readline(connptr->client_fd, &connptr->request_line);
-  if (len <= 0)
+  do
+  {
+    ret = request_parser_read(parser, connptr->client_fd);
+  } while (ret == REQUEST_PARSER_MORE);
+
+  if (ret < 0)
   {
     log_message(proxy->log, LOG_ERR,
-                "read_request_line: Client (file descriptor: %d) "
-                "closed socket before read.",
-                connptr->client_fd);
+                "read_request_head: Client (file descriptor: %d) "
+                "closed socket before read: %s",
+                connptr->client_fd, strerror(-ret));
 
-    return -1;
+    return ret;
   }
 
-  /*
-   * Strip the new line and carriage return from the string.
-   */
-  if (trim_ending_newlines(connptr->request_line, len) == len)
-  {
-    /*
-     * If the number of characters removed is the same as the
-     * length then it was a blank line. Free the buffer and
-     * try again (since we're looking for a request line.)
-     */
-    safefree(connptr->request_line);
-    goto retry;
-  }
+  connptr->request_line = safestrdup(request_parser_request_line(parser));
+  if (!connptr->request_line)
+    return -ENOMEM;
+
+  leftover = request_parser_leftover(parser, &len);
+  if (len > 0 && add_to_buffer(connptr->cbuffer, (unsigned char *)leftover, len) < 0)
+    return -ENOMEM;
 
   log_message(proxy->log, LOG_CONN, "Request (file descriptor %d): %s", connptr->client_fd,
               connptr->request_line);
@@ -264,12 +273,16 @@ ERROR_EXIT:
 }
 
 /*
- * Create a connection for HTTP connections.
+ * Create a connection for HTTP connections. The request line and the
+ * headers made here are only gathered into "head", they are sent along
+ * with the rest of the headers by process_client_headers().
  */
-static int establish_http_connection(struct conn_s *connptr, struct request_s *request)
+static int establish_http_connection(struct conn_s *connptr, struct request_s *request,
+                                     struct head_writer_s *head)
 {
   char portbuff[7];
   char dst[sizeof(struct in6_addr)];
+  const char *version, *connection;
 
   /* Build a port string if it's not a standard port */
   if (request->port != HTTP_PORT && request->port != HTTP_PORT_SSL)
@@ -277,34 +290,48 @@ static int establish_http_connection(struct conn_s *connptr, struct request_s *r
   else
     portbuff[0] = '\0';
 
+  /* A persistent connection needs HTTP/1.1 to delimit the response */
+  if (connptr->server_keepalive)
+  {
+    version = "HTTP/1.1";
+    connection = "keep-alive";
+  }
+  else
+  {
+    version = "HTTP/1.0";
+    connection = "close";
+  }
+
   if (inet_pton(AF_INET6, request->host, dst) > 0)
   {
     /* host is an IPv6 address literal, so surround it with
      * [] */
-    return write_message(connptr->server_fd,
-                         "%s %s HTTP/1.0\r\n"
-                         "Host: [%s]%s\r\n"
-                         "Connection: close\r\n",
-                         request->method, request->path, request->host, portbuff);
+    return head_writer_message(head, connptr->server_fd,
+                               "%s %s %s\r\n"
+                               "Host: [%s]%s\r\n"
+                               "Connection: %s\r\n",
+                               request->method, request->path, version, request->host, portbuff,
+                               connection);
   }
   else if (connptr->upstream_proxy && connptr->upstream_proxy->type == PT_HTTP &&
            connptr->upstream_proxy->ua.authstr)
   {
-    return write_message(connptr->server_fd,
-                         "%s %s HTTP/1.0\r\n"
-                         "Host: %s%s\r\n"
-                         "Connection: close\r\n"
-                         "Proxy-Authorization: Basic %s\r\n",
-                         request->method, request->path, request->host, portbuff,
-                         connptr->upstream_proxy->ua.authstr);
+    return head_writer_message(head, connptr->server_fd,
+                               "%s %s %s\r\n"
+                               "Host: %s%s\r\n"
+                               "Connection: %s\r\n"
+                               "Proxy-Authorization: Basic %s\r\n",
+                               request->method, request->path, version, request->host, portbuff,
+                               connection, connptr->upstream_proxy->ua.authstr);
   }
   else
   {
-    return write_message(connptr->server_fd,
-                         "%s %s HTTP/1.0\r\n"
-                         "Host: %s%s\r\n"
-                         "Connection: close\r\n",
-                         request->method, request->path, request->host, portbuff);
+    return head_writer_message(head, connptr->server_fd,
+                               "%s %s %s\r\n"
+                               "Host: %s%s\r\n"
+                               "Connection: %s\r\n",
+                               request->method, request->path, version, request->host, portbuff,
+                               connection);
   }
 }
 
@@ -332,7 +359,7 @@ static int send_ssl_response(struct conn_s *connptr)
  * build a new request line. Finally connect to the remote server.
  */
 static struct request_s *process_request(pproxy_t proxy, struct conn_s *connptr,
-                                         phashmap_t hashofheaders)
+                                         pheaders_t hashofheaders)
 {
   char *url;
   struct request_s *request;
@@ -476,7 +503,13 @@ static struct request_s *process_request(pproxy_t proxy, struct conn_s *connptr,
   // filter restricted domains/urls
   if (is_enabled(proxy->filter))
   {
-    if (!does_pass_filter(proxy->log, proxy->filter, request->host, url))
+    filter_cache_result_t cached;
+    bool pass = does_pass_filter(proxy->log, proxy->filter, request->host, url, &cached);
+
+    if (cached != FILTER_CACHE_OFF)
+      update_stats(cached == FILTER_CACHE_HIT ? STAT_FILTER_HIT : STAT_FILTER_MISS);
+
+    if (!pass)
     {
       update_stats(STAT_DENIED);
 
@@ -510,41 +543,28 @@ fail:
 }
 
 /*
- * pull_client_data is used to pull across any client data (like in a
- * POST) which needs to be handled before an error can be reported, or
- * server headers can be processed.
- *	- rjkaes
+ * BUG FIX: Internet Explorer will leave two bytes (carriage
+ * return and line feed) at the end of a POST message.  These
+ * need to be eaten for tinyproxy to work correctly.
  */
-static int pull_client_data(pproxy_t proxy, struct conn_s *connptr, long int length)
+static int eat_trailing_crlf(pproxy_t proxy, struct conn_s *connptr)
 {
-  char *buffer;
+  char buffer[2];
   ssize_t len;
   int ret;
 
-  buffer = (char *)safemalloc(min(MAXBUFFSIZE, (unsigned long int)length));
-  if (!buffer)
-    return -1;
-
-  do
+  if (buffer_size(connptr->cbuffer) > 0)
   {
-    len = safe_read(connptr->client_fd, buffer, min(MAXBUFFSIZE, (unsigned long int)length));
-    if (len <= 0)
-      goto ERROR_EXIT;
-
-    if (!connptr->error_variables)
+    if (buffer_size(connptr->cbuffer) == 2)
     {
-      if (safe_write(connptr->server_fd, buffer, len) < 0)
-        goto ERROR_EXIT;
+      len = (ssize_t)take_from_buffer(connptr->cbuffer, (unsigned char *)buffer, 2);
+      if (!CHECK_CRLF(buffer, len))
+        add_to_buffer(connptr->cbuffer, (unsigned char *)buffer, len);
     }
 
-    length -= len;
-  } while (length > 0);
+    return 0;
+  }
 
-  /*
-   * BUG FIX: Internet Explorer will leave two bytes (carriage
-   * return and line feed) at the end of a POST message.  These
-   * need to be eaten for tinyproxy to work correctly.
-   */
   ret = socket_nonblocking(connptr->client_fd);
   if (ret != 0)
   {
@@ -552,7 +572,7 @@ static int pull_client_data(pproxy_t proxy, struct conn_s *connptr, long int len
                 "Failed to set the client socket "
                 "to non-blocking: %s",
                 strerror(errno));
-    goto ERROR_EXIT;
+    return -1;
   }
 
   len = recv(connptr->client_fd, buffer, 2, MSG_PEEK);
@@ -564,11 +584,11 @@ static int pull_client_data(pproxy_t proxy, struct conn_s *connptr, long int len
                 "Failed to set the client socket "
                 "to blocking: %s",
                 strerror(errno));
-    goto ERROR_EXIT;
+    return -1;
   }
 
   if (len < 0 && errno != EAGAIN)
-    goto ERROR_EXIT;
+    return -1;
 
   if ((len == 2) && CHECK_CRLF(buffer, len))
   {
@@ -581,8 +601,58 @@ static int pull_client_data(pproxy_t proxy, struct conn_s *connptr, long int len
     }
   }
 
-  safefree(buffer);
   return 0;
+}
+
+/*
+ * pull_client_data is used to pull across any client data (like in a
+ * POST) which needs to be handled before an error can be reported, or
+ * server headers can be processed.
+ *	- rjkaes
+ */
+static int pull_client_data(pproxy_t proxy, struct conn_s *connptr, long int length)
+{
+  char *buffer;
+  ssize_t len;
+  int ret;
+
+  buffer = (char *)safemalloc(min(MAXBUFFSIZE, (unsigned long int)length));
+  if (!buffer)
+    return -1;
+
+  /* The beginning of the body may have arrived along with the headers */
+  while (length > 0 && buffer_size(connptr->cbuffer) > 0)
+  {
+    len = (ssize_t)take_from_buffer(connptr->cbuffer, (unsigned char *)buffer,
+                                    min(MAXBUFFSIZE, (unsigned long int)length));
+
+    if (!connptr->error_variables)
+    {
+      if (safe_write(connptr->server_fd, buffer, len) < 0)
+        goto ERROR_EXIT;
+    }
+
+    length -= len;
+  }
+
+  while (length > 0)
+  {
+    len = safe_read(connptr->client_fd, buffer, min(MAXBUFFSIZE, (unsigned long int)length));
+    if (len <= 0)
+      goto ERROR_EXIT;
+
+    if (!connptr->error_variables)
+    {
+      if (safe_write(connptr->server_fd, buffer, len) < 0)
+        goto ERROR_EXIT;
+    }
+
+    length -= len;
+  }
+
+  ret = eat_trailing_crlf(proxy, connptr);
+  safefree(buffer);
+  return ret;
 
 ERROR_EXIT:
   safefree(buffer);
@@ -595,29 +665,29 @@ ERROR_EXIT:
  * the server.
  *	-rjkaes
  */
-static int add_xtinyproxy_header(struct conn_s *connptr)
+static int add_xtinyproxy_header(struct conn_s *connptr, struct head_writer_s *head)
 {
   assert(connptr && connptr->server_fd >= 0);
-  return write_message(connptr->server_fd, "X-Tinyproxy: %s\r\n", connptr->client_ip_addr);
+  return head_writer_message(head, connptr->server_fd, "X-Tinyproxy: %s\r\n",
+                             connptr->client_ip_addr);
 }
 #endif /* XTINYPROXY */
 
 /*
- * Take a complete header line and break it apart (into a key and the data.)
- * Now insert this information into the hashmap for the connection so it
- * can be retrieved and manipulated later.
+ * Take a complete header line and break it apart (into a key and the data)
+ * at "sep", the colon the parser found in it. Now insert this information
+ * into the headers of the connection so it can be retrieved and
+ * manipulated later. The line is broken apart in place, and the headers
+ * keep pointing into it.
  */
-static int add_header_to_connection(phashmap_t hashofheaders, char *header, size_t len)
+static int add_header_to_connection(pheaders_t hashofheaders, char *header, size_t len, char *sep)
 {
-  char *sep;
+  if (!sep)
+    return -1;
 
   /* Get rid of the new line and return at the end */
   len -= trim_ending_newlines(header, len);
 
-  sep = strchr(header, ':');
-  if (!sep)
-    return -1;
-
   /* Blank out colons, spaces, and tabs. */
   while (*sep == ':' || *sep == ' ' || *sep == '\t')
     *sep++ = '\0';
@@ -625,129 +695,70 @@ static int add_header_to_connection(phashmap_t hashofheaders, char *header, size
   /* Calculate the new length of just the data */
   len -= sep - header - 1;
 
-  return hashmap_insert(hashofheaders, header, sep, len);
+  return headers_insert_view(hashofheaders, header, sep, len);
 }
 
 /*
- * Define maximum number of headers that we accept.
- * This should be big enough to handle legitimate cases,
- * but limited to avoid DoS.
- */
-#define MAX_HEADERS 10000
-
-/*
- * Read all the headers from the stream
+ * Put the headers of the head parsed by the parser (a client request or
+ * a server response) into the table. The fields are broken apart in
+ * place, in the buffer of the parser, which must outlive the table.
  */
-static int get_all_headers(int fd, phashmap_t hashofheaders)
+static int get_all_headers(prequest_parser_t parser, pheaders_t hashofheaders)
 {
-  char *line = NULL;
-  char *header = NULL;
-  int count;
-  char *tmp;
-  ssize_t linelen;
-  ssize_t len = 0;
+  size_t iter = 0;
+  size_t len;
+  char *field, *colon;
   unsigned int double_cgi = FALSE; /* boolean */
 
-  assert(fd >= 0);
   assert(hashofheaders != NULL);
 
-  for (count = 0; count < MAX_HEADERS; count++)
+  while ((len = request_parser_next_header(parser, &iter, &field, &colon)) > 0)
   {
-    if ((linelen = readline(fd, &line)) <= 0)
-    {
-      safefree(header);
-      safefree(line);
-      return -1;
-    }
-
-    /*
-     * If we received a CR LF or a non-continuation line, then add
-     * the accumulated header field, if any, to the hashmap, and
-     * reset it.
-     */
-    if (CHECK_CRLF(line, linelen) || !CHECK_LWS(line, linelen))
-    {
-      if (!double_cgi && len > 0 && add_header_to_connection(hashofheaders, header, len) < 0)
-      {
-        safefree(header);
-        safefree(line);
-        return -1;
-      }
-
-      len = 0;
-    }
-
-    /*
-     * If we received just a CR LF on a line, the headers are
-     * finished.
-     */
-    if (CHECK_CRLF(line, linelen))
-    {
-      safefree(header);
-      safefree(line);
-      return 0;
-    }
-
     /*
      * BUG FIX: The following code detects a "Double CGI"
      * situation so that we can handle the nonconforming system.
      * This problem was found when accessing cgi.ebay.com, and it
      * turns out to be a wider spread problem as well.
      *
-     * If "Double CGI" is in effect, duplicate headers are
+     * Once a status line shows up, the remaining headers are
      * ignored.
      *
      * FIXME: Might need to change this to a more robust check.
      */
-    if (linelen >= 5 && strncasecmp(line, "HTTP/", 5) == 0)
-    {
+    if (!double_cgi && len >= 5 && strncasecmp(field, "HTTP/", 5) == 0)
       double_cgi = TRUE;
-    }
-
-    /*
-     * Append the new line to the current header field.
-     */
-    tmp = (char *)saferealloc(header, len + linelen);
-    if (tmp == NULL)
-    {
-      safefree(header);
-      safefree(line);
-      return -1;
-    }
 
-    header = tmp;
-    memcpy(header + len, line, linelen);
-    len += linelen;
+    if (double_cgi)
+      continue;
 
-    safefree(line);
+    if (add_header_to_connection(hashofheaders, field, len, colon) < 0)
+      return -1;
   }
 
-  /*
-   * If we get here, this means we reached MAX_HEADERS count.
-   * Bail out with error.
-   */
-  safefree(header);
-  safefree(line);
-  return -1;
+  return 0;
 }
 
 /*
  * Extract the headers to remove.  These headers were listed in the Connection
- * and Proxy-Connection headers.
+ * and Proxy-Connection headers.  The headers which frame the message are left
+ * alone: the body forwarded after them would otherwise be read by the next hop
+ * as another message on a kept connection (request smuggling).
  */
-static int remove_connection_headers(phashmap_t hashofheaders)
+static int remove_connection_headers(pheaders_t hashofheaders)
 {
-  static const char *headers[] = {"connection", "proxy-connection"};
+  static const header_id_t headers[] = {HEADER_CONNECTION, HEADER_PROXY_CONNECTION};
+  static const uint32_t framing = HEADER_BIT(HEADER_CONTENT_LENGTH) |
+                                  HEADER_BIT(HEADER_TRANSFER_ENCODING) | HEADER_BIT(HEADER_HOST);
 
   char *data;
   char *ptr;
   ssize_t len;
   int i;
 
-  for (i = 0; i != (sizeof(headers) / sizeof(char *)); ++i)
+  for (i = 0; i != (sizeof(headers) / sizeof(headers[0])); ++i)
   {
     /* Look for the connection header.  If it's not found, return. */
-    len = hashmap_entry_by_key(hashofheaders, headers[i], (void **)&data);
+    len = headers_entry_by_id(hashofheaders, headers[i], &data);
     if (len <= 0)
       return 0;
 
@@ -755,9 +766,7 @@ static int remove_connection_headers(phashmap_t hashofheaders)
      * Go through the data line and replace any special characters
      * with a NULL.
      */
-    ptr = data;
-    while ((ptr = strpbrk(ptr, "()<>@,;:\\\"/[]?={} \t")))
-      *ptr++ = '\0';
+    scan_split_tokens(data);
 
     /*
      * All the tokens are separated by NULLs.  Now go through the
@@ -766,7 +775,8 @@ static int remove_connection_headers(phashmap_t hashofheaders)
     ptr = data;
     while (ptr < data + len)
     {
-      hashmap_remove(hashofheaders, ptr);
+      if (!(HEADER_BIT(header_id_of(ptr)) & framing))
+        headers_remove(hashofheaders, ptr);
 
       /* Advance ptr to the next token */
       ptr += strlen(ptr) + 1;
@@ -775,7 +785,7 @@ static int remove_connection_headers(phashmap_t hashofheaders)
     }
 
     /* Now remove the connection header it self. */
-    hashmap_remove(hashofheaders, headers[i]);
+    headers_remove_ids(hashofheaders, HEADER_BIT(headers[i]));
   }
 
   return 0;
@@ -783,30 +793,197 @@ static int remove_connection_headers(phashmap_t hashofheaders)
 
 /*
  * If there is a Content-Length header, then return the value; otherwise, return
- * a negative number.
+ * -1. The length has to be certain (RFC 7230, 3.3.3): CONTENT_LENGTH_INVALID is
+ * returned if a value is not made of digits only, or if the values disagree,
+ * since the body could then end elsewhere for the next hop. Several values that
+ * agree are left as a single header, the only one forwarded.
  */
-static long get_content_length(phashmap_t hashofheaders)
+static long get_content_length(pheaders_t hashofheaders)
 {
-  ssize_t len;
-  char *data;
-  long content_length = -1;
+  headers_iter iter = 0;
+  header_id_t id;
+  char *name, *data, *ptr;
+  long content_length = -1, value;
+  unsigned int values = 0;
+  char buf[32];
 
-  len = hashmap_entry_by_key(hashofheaders, "content-length", (void **)&data);
-  if (len > 0)
-    content_length = atol(data);
+  while (headers_next(hashofheaders, &iter, &name, &data, &id))
+  {
+    if (id != HEADER_CONTENT_LENGTH)
+      continue;
+
+    /* A comma separated list of the same value is allowed, too */
+    for (ptr = data;;)
+    {
+      ptr += strspn(ptr, " \t");
+      if (!isdigit((unsigned char)*ptr))
+        return CONTENT_LENGTH_INVALID;
+
+      for (value = 0; isdigit((unsigned char)*ptr); ptr++)
+      {
+        if (value > (LONG_MAX - (*ptr - '0')) / 10)
+          return CONTENT_LENGTH_INVALID;
+        value = value * 10 + (*ptr - '0');
+      }
+
+      if (content_length >= 0 && value != content_length)
+        return CONTENT_LENGTH_INVALID;
+      content_length = value;
+      ++values;
+
+      ptr += strspn(ptr, " \t");
+      if (*ptr == '\0')
+        break;
+      if (*ptr++ != ',')
+        return CONTENT_LENGTH_INVALID;
+    }
+  }
+
+  if (values > 1)
+  {
+    snprintf(buf, sizeof(buf), "%ld", content_length);
+    headers_remove_ids(hashofheaders, HEADER_BIT(HEADER_CONTENT_LENGTH));
+    headers_insert(hashofheaders, "Content-Length", buf);
+  }
 
   return content_length;
 }
 
+/*
+ * Is the token in the comma separated list of the header?
+ */
+static int header_has_token(pheaders_t hashofheaders, header_id_t header, const char *token)
+{
+  size_t toklen = strlen(token);
+  char *data, *ptr, *end;
+
+  if (headers_entry_by_id(hashofheaders, header, &data) <= 0)
+    return FALSE;
+
+  for (ptr = data; *ptr; ptr = end)
+  {
+    ptr += strspn(ptr, " \t,");
+    end = ptr + strcspn(ptr, " \t,");
+
+    if ((size_t)(end - ptr) == toklen && strncasecmp(ptr, token, toklen) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Can the connection to the server be kept for the next request? Only if
+ * the client speaks HTTP/1.1 itself, because the response is passed along
+ * as it is (chunked included), and if the end of the request is known.
+ */
+static unsigned int wants_server_keepalive(struct conn_s *connptr, pheaders_t hashofheaders)
+{
+  if (!server_pool_enabled() || connptr->connect_method)
+    return FALSE;
+
+  if (connptr->protocol.major != 1 || connptr->protocol.minor < 1)
+    return FALSE;
+
+  return headers_search_id(hashofheaders, HEADER_TRANSFER_ENCODING) <= 0;
+}
+
+/*
+ * Can the connection to the client be kept for its next request? Only for
+ * HTTP/1.1 clients, which read the end of a response from its framing, and
+ * only if the end of the request itself is known. Not by a child whose rules
+ * were reloaded since: the next request belongs to the new children.
+ */
+static unsigned int wants_client_keepalive(pproxy_t proxy, struct conn_s *connptr,
+                                           pheaders_t hashofheaders)
+{
+  if (!config.client_keepalive || connptr->connect_method || connptr->show_stats ||
+      is_proxy_outdated(proxy))
+  {
+    return FALSE;
+  }
+
+  if (connptr->protocol.major != 1 || connptr->protocol.minor < 1)
+    return FALSE;
+
+  if (header_has_token(hashofheaders, HEADER_CONNECTION, "close") ||
+      header_has_token(hashofheaders, HEADER_PROXY_CONNECTION, "close"))
+  {
+    return FALSE;
+  }
+
+  return headers_search_id(hashofheaders, HEADER_TRANSFER_ENCODING) <= 0;
+}
+
+/*
+ * Figure out from the response line and headers where the response body
+ * ends, and whether the server keeps the connection open after it.
+ * Returns the status code, or -1 if the end of the body can't be known.
+ */
+static int frame_response(struct conn_s *connptr, struct request_s *request,
+                          const char *response_line, pheaders_t hashofheaders)
+{
+  unsigned int major = 0, minor = 0;
+  int status = 0;
+  long length;
+
+  sscanf(response_line, "HTTP/%u.%u %d", &major, &minor, &status);
+  length = get_content_length(hashofheaders);
+
+  /* The final response follows an interim one, it decides */
+  if (status >= 100 && status < 200 && status != 101)
+    return status;
+
+  if (header_has_token(hashofheaders, HEADER_TRANSFER_ENCODING, "chunked"))
+  {
+    /* The chunks decide, a length beside them is a smuggling attempt: not forwarded, not trusted */
+    if (length != -1)
+    {
+      headers_remove_ids(hashofheaders, HEADER_BIT(HEADER_CONTENT_LENGTH));
+      connptr->server_keepalive = FALSE;
+    }
+  }
+  else if (length == CONTENT_LENGTH_INVALID)
+  {
+    return -1;
+  }
+
+  if (status == 101)
+    body_framing_init(&connptr->response_body, BODY_UNTIL_CLOSE, -1);
+  else if (!strcasecmp(request->method, "HEAD") || status == 204 || status == 304)
+    body_framing_init(&connptr->response_body, BODY_NONE, 0);
+  else if (header_has_token(hashofheaders, HEADER_TRANSFER_ENCODING, "chunked"))
+    body_framing_init(&connptr->response_body, BODY_CHUNKED, 0);
+  else if (length >= 0)
+    body_framing_init(&connptr->response_body, BODY_LENGTH, length);
+  else
+    body_framing_init(&connptr->response_body, BODY_UNTIL_CLOSE, -1);
+
+  if (connptr->response_body.mode == BODY_UNTIL_CLOSE || major != 1 || minor < 1 ||
+      header_has_token(hashofheaders, HEADER_CONNECTION, "close"))
+  {
+    connptr->server_keepalive = FALSE;
+  }
+
+  /* The client can only tell the end of the response by the connection closing */
+  if (connptr->response_body.mode == BODY_UNTIL_CLOSE)
+    connptr->client_keepalive = FALSE;
+
+  return status;
+}
+
 /*
  * Search for Via header in a hash of headers and either write a new Via
  * header, or append our information to the end of an existing Via header.
+ * The header is added to the head being written to fd. The Via headers
+ * received stay, since the head may have to be written again: the callers
+ * skip them.
  *
  * FIXME: Need to add code to "hide" our internal information for security
  * purposes.
  */
-static int write_via_header(int fd, phashmap_t hashofheaders, unsigned int major,
-                            unsigned int minor)
+static int write_via_header(struct head_writer_s *head, int fd, pheaders_t hashofheaders,
+                            unsigned int major, unsigned int minor)
 {
   ssize_t len;
   char hostname[512];
@@ -832,45 +1009,45 @@ static int write_via_header(int fd, phashmap_t hashofheaders, unsigned int major
    * See if there is a "Via" header.  If so, again we need to do a bit
    * of processing.
    */
-  len = hashmap_entry_by_key(hashofheaders, "via", (void **)&data);
+  len = headers_entry_by_id(hashofheaders, HEADER_VIA, &data);
   if (len > 0)
   {
-    ret = write_message(fd, "Via: %s, %hu.%hu %s (%s/%s)\r\n", data, major, minor, hostname,
-                        PACKAGE, VERSION);
-
-    hashmap_remove(hashofheaders, "via");
+    ret = head_writer_message(head, fd, "Via: %s, %hu.%hu %s (%s/%s)\r\n", data, major, minor,
+                              hostname, PACKAGE, VERSION);
   }
   else
   {
-    ret =
-        write_message(fd, "Via: %hu.%hu %s (%s/%s)\r\n", major, minor, hostname, PACKAGE, VERSION);
+    ret = head_writer_message(head, fd, "Via: %hu.%hu %s (%s/%s)\r\n", major, minor, hostname,
+                              PACKAGE, VERSION);
   }
 
 done:
   return ret;
 }
 
-/*
- * Number of buckets to use internally in the hashmap.
- */
-#define HEADER_BUCKETS 256
-
 /*
  * Here we loop through all the headers the client is sending. If we
  * are running in anonymous mode, we will _only_ send the headers listed
  * (plus a few which are required for various methods).
+ * With "body" set, the body of the request is not pulled across but left
+ * to the caller, its length stored there (0 when there is none to copy).
  *	- rjkaes
  */
-static int process_client_headers(pproxy_t proxy, struct conn_s *connptr, phashmap_t hashofheaders)
+static int process_client_headers(pproxy_t proxy, struct conn_s *connptr, pheaders_t hashofheaders,
+                                  struct head_writer_s *head, long int *body)
 {
-  static const char *skipheaders[] = {"host", "keep-alive", "proxy-connection",
-                                      "te",   "trailers",   "upgrade"};
-  int i;
-  hashmap_iter iter;
+  static const uint32_t skipheaders = HEADER_BIT(HEADER_HOST) | HEADER_BIT(HEADER_KEEP_ALIVE) |
+                                      HEADER_BIT(HEADER_PROXY_CONNECTION) | HEADER_BIT(HEADER_TE) |
+                                      HEADER_BIT(HEADER_TRAILERS) | HEADER_BIT(HEADER_UPGRADE);
+  headers_iter iter;
+  header_id_t id;
   int ret = 0;
 
   char *data, *header;
 
+  if (body)
+    *body = 0;
+
   /*
    * Don't send headers if there's already an error, if the request was
    * a stats request, or if this was a CONNECT method (unless upstream
@@ -883,12 +1060,6 @@ static int process_client_headers(pproxy_t proxy, struct conn_s *connptr, phashm
     return 0;
   }
 
-  /*
-   * See if there is a "Content-Length" header.  If so, again we need
-   * to do a bit of processing.
-   */
-  connptr->content_length.client = get_content_length(hashofheaders);
-
   /*
    * See if there is a "Connection" header.  If so, we need to do a bit
    * of processing. :)
@@ -898,14 +1069,11 @@ static int process_client_headers(pproxy_t proxy, struct conn_s *connptr, phashm
   /*
    * Delete the headers listed in the skipheaders list
    */
-  for (i = 0; i != (sizeof(skipheaders) / sizeof(char *)); i++)
-  {
-    hashmap_remove(hashofheaders, skipheaders[i]);
-  }
+  headers_remove_ids(hashofheaders, skipheaders);
 
   /* Send, or add the Via header */
-  ret = write_via_header(connptr->server_fd, hashofheaders, connptr->protocol.major,
-                         connptr->protocol.minor);
+  ret = write_via_header(head, connptr->server_fd, hashofheaders,
+                         connptr->protocol.major, connptr->protocol.minor);
   if (ret < 0)
   {
     indicate_http_error(connptr, 503, "Could not send data to remote server", "detail",
@@ -918,35 +1086,38 @@ static int process_client_headers(pproxy_t proxy, struct conn_s *connptr, phashm
   /*
    * Output all the remaining headers to the remote machine.
    */
-  iter = hashmap_first(hashofheaders);
-  if (iter >= 0)
+  iter = 0;
+  while (headers_next(hashofheaders, &iter, &data, &header, &id))
   {
-    for (; !hashmap_is_end(hashofheaders, iter); ++iter)
-    {
-      hashmap_return_entry(hashofheaders, iter, &data, (void **)&header);
+    if (id == HEADER_VIA && !config.disable_viaheader)
+      continue;
 
-      if (!is_anonymous_enabled(proxy->anon) || anonymous_search(proxy->log, proxy->anon, data) > 0)
+    if (!is_anonymous_enabled(proxy->anon) ||
+        is_anonymous_allowed(proxy->log, proxy->anon, id, data))
+    {
+      ret = head_writer_header(head, connptr->server_fd, data, header);
+      if (ret < 0)
       {
-        ret = write_message(connptr->server_fd, "%s: %s\r\n", data, header);
-        if (ret < 0)
-        {
-          indicate_http_error(connptr, 503, "Could not send data to remote server", "detail",
-                              "A network error occurred while "
-                              "trying to write data to the "
-                              "remote web server.",
-                              NULL);
-          goto PULL_CLIENT_DATA;
-        }
+        indicate_http_error(connptr, 503, "Could not send data to remote server", "detail",
+                            "A network error occurred while "
+                            "trying to write data to the "
+                            "remote web server.",
+                            NULL);
+        goto PULL_CLIENT_DATA;
       }
     }
   }
 #if defined(XTINYPROXY_ENABLE)
   if (config.add_xtinyproxy)
-    add_xtinyproxy_header(connptr);
+    add_xtinyproxy_header(connptr, head);
 #endif
 
-  /* Write the final "blank" line to signify the end of the headers */
-  if (safe_write(connptr->server_fd, "\r\n", 2) < 0)
+  /*
+   * Write the final "blank" line to signify the end of the headers, and
+   * send the whole head at once.
+   */
+  if (head_writer_add(head, connptr->server_fd, "\r\n", 2) < 0 ||
+      head_writer_flush(head, connptr->server_fd) < 0)
     return -1;
 
   /*
@@ -955,81 +1126,109 @@ static int process_client_headers(pproxy_t proxy, struct conn_s *connptr, phashm
 PULL_CLIENT_DATA:
   if (connptr->content_length.client > 0)
   {
-    ret = pull_client_data(proxy, connptr, connptr->content_length.client);
+    if (body)
+    {
+      *body = connptr->content_length.client;
+      ret = 0;
+    }
+    else
+      ret = pull_client_data(proxy, connptr, connptr->content_length.client);
   }
 
   return ret;
 }
 
+/*
+ * The server sent nothing for Timeout seconds after the request.
+ */
+static void indicate_no_response(pproxy_t proxy, struct conn_s *connptr)
+{
+  log_message(proxy->log, LOG_WARNING,
+              "The remote server (fd:%d) sent no response within %u seconds.", connptr->server_fd,
+              config.idletimeout);
+
+  /* The response may still come, the connection can't be reused */
+  connptr->server_keepalive = FALSE;
+  indicate_http_error(connptr, 504, "Gateway Timeout", "detail",
+                      "The remote web server did not answer in time.", NULL);
+}
+
 /*
  * Loop through all the headers (including the response code) from the
- * server.
+ * server. Returns -ECONNRESET if the server closed the connection without
+ * sending a single byte of a response.
  */
-static int process_server_headers(pproxy_t proxy, struct conn_s *connptr)
+static int process_server_headers(pproxy_t proxy, struct conn_s *connptr,
+                                  struct request_s *request)
 {
-  static const char *skipheaders[] = {
-      "keep-alive",
-      "proxy-authenticate",
-      "proxy-authorization",
-      "proxy-connection",
-  };
+  static const uint32_t skipheaders =
+      HEADER_BIT(HEADER_KEEP_ALIVE) | HEADER_BIT(HEADER_PROXY_AUTHENTICATE) |
+      HEADER_BIT(HEADER_PROXY_AUTHORIZATION) | HEADER_BIT(HEADER_PROXY_CONNECTION);
 
-  char *response_line;
+  prequest_parser_t parser;
+  const char *response_line;
+  struct head_writer_s head;
 
-  phashmap_t hashofheaders;
-  hashmap_iter iter;
+  pheaders_t hashofheaders;
+  headers_iter iter;
+  header_id_t id;
   char *data, *header;
   ssize_t len;
-  int i;
   int ret;
+  int status = 0;
 
 #ifdef REVERSE_SUPPORT
   struct reversepath *reverse = config.reversepath_list;
 #endif
 
-  /* Get the response line from the remote server. */
-retry:
-  len = readline(connptr->server_fd, &response_line);
-  if (len <= 0)
-    return -1;
-
   /*
-   * Strip the new line and character return from the string.
+   * The response line and the headers are read into the buffer of the
+   * parser, which the headers point into. Nothing past them is taken off
+   * the socket, the body is left to the relay.
    */
-  if (trim_ending_newlines(response_line, len) == len)
+  parser = request_parser_create();
+  if (!parser)
+    return -1;
+
+retry:
+  head_writer_init(&head);
+  hashofheaders = headers_create();
+  if (!hashofheaders)
   {
-    /*
-     * If the number of characters removed is the same as the
-     * length then it was a blank line. Free the buffer and
-     * try again (since we're looking for a request line.)
-     */
-    safefree(response_line);
-    goto retry;
+    request_parser_delete(parser);
+    return -1;
   }
 
-  hashofheaders = hashmap_create(HEADER_BUCKETS);
-  if (!hashofheaders)
+  do
   {
-    safefree(response_line);
+    ret = request_parser_read_head(parser, connptr->server_fd);
+  } while (ret == REQUEST_PARSER_MORE);
+
+  if (ret == -ETIMEDOUT)
+  {
+    headers_delete(hashofheaders);
+    request_parser_delete(parser);
+    indicate_no_response(proxy, connptr);
     return -1;
   }
 
-  /*
-   * Get all the headers from the remote server in a big hash
-   */
-  if (get_all_headers(connptr->server_fd, hashofheaders) < 0)
+  if (ret < 0 || get_all_headers(parser, hashofheaders) < 0)
   {
     log_message(proxy->log, LOG_WARNING,
                 "Could not retrieve all the headers from the remote server.");
-    hashmap_delete(hashofheaders);
-    safefree(response_line);
+
+    /* Not even an interim response came, the request may be sent again */
+    ret = ret < 0 && status == 0 && request_parser_received(parser) == 0 ? -ECONNRESET : -1;
+
+    headers_delete(hashofheaders);
+    request_parser_delete(parser);
 
     indicate_http_error(connptr, 503, "Could not retrieve all the headers", "detail",
                         PACKAGE_NAME " "
                                      "was unable to retrieve and process headers from "
                                      "the remote web server.",
                         NULL);
-    return -1;
+    return ret;
   }
 
   /*
@@ -1040,15 +1239,39 @@ retry:
    */
   if (connptr->protocol.major < 1)
   {
-    hashmap_delete(hashofheaders);
-    safefree(response_line);
+    headers_delete(hashofheaders);
+    request_parser_delete(parser);
     return 0;
   }
 
-  /* Send the saved response line first */
-  ret = write_message(connptr->client_fd, "%s\r\n", response_line);
-  safefree(response_line);
-  if (ret < 0)
+  response_line = request_parser_request_line(parser);
+
+  /* The answer to a CONNECT through an upstream proxy opens the tunnel */
+  if (!connptr->connect_method)
+    status = frame_response(connptr, request, response_line, hashofheaders);
+
+  if (status < 0)
+  {
+    log_message(proxy->log, LOG_WARNING,
+                "The remote server sent an invalid Content-Length, the response is dropped.");
+    headers_delete(hashofheaders);
+    request_parser_delete(parser);
+
+    /* What is left of the response is unknown, the connection can't be reused */
+    connptr->server_keepalive = FALSE;
+    indicate_http_error(connptr, 502, "Bad Gateway", "detail",
+                        "The remote web server sent a response whose length "
+                        "can't be known.",
+                        NULL);
+    return -1;
+  }
+
+  /*
+   * The response line goes first. The head is gathered and sent at once,
+   * after its blank line.
+   */
+  ret = head_writer_add(&head, connptr->client_fd, response_line, strlen(response_line));
+  if (ret < 0 || (ret = head_writer_add(&head, connptr->client_fd, "\r\n", 2)) < 0)
     goto ERROR_EXIT;
 
   /*
@@ -1066,30 +1289,36 @@ retry:
   /*
    * Delete the headers listed in the skipheaders list
    */
-  for (i = 0; i != (sizeof(skipheaders) / sizeof(char *)); i++)
-  {
-    hashmap_remove(hashofheaders, skipheaders[i]);
-  }
+  headers_remove_ids(hashofheaders, skipheaders);
 
   /* Send, or add the Via header */
-  ret = write_via_header(connptr->client_fd, hashofheaders, connptr->protocol.major,
+  ret = write_via_header(&head, connptr->client_fd, hashofheaders, connptr->protocol.major,
                          connptr->protocol.minor);
   if (ret < 0)
     goto ERROR_EXIT;
 
+  /* Tell the client when its connection ends with this response */
+  if (status >= 200 && !connptr->client_keepalive)
+  {
+    ret = head_writer_add(&head, connptr->client_fd, "Connection: close\r\n", 19);
+    if (ret < 0)
+      goto ERROR_EXIT;
+  }
+
 #ifdef REVERSE_SUPPORT
   /* Write tracking cookie for the magical reverse proxy path hack */
   if (config.reversemagic && connptr->reversepath)
   {
-    ret = write_message(connptr->client_fd, "Set-Cookie: " REVERSE_COOKIE "=%s; path=/\r\n",
-                        connptr->reversepath);
+    ret = head_writer_message(&head, connptr->client_fd,
+                              "Set-Cookie: " REVERSE_COOKIE "=%s; path=/\r\n",
+                              connptr->reversepath);
     if (ret < 0)
       goto ERROR_EXIT;
   }
 
   /* Rewrite the HTTP redirect if needed */
   if (config.reversebaseurl &&
-      hashmap_entry_by_key(hashofheaders, "location", (void **)&header) > 0)
+      headers_entry_by_id(hashofheaders, HEADER_LOCATION, &header) > 0)
   {
 
     /* Look for a matching entry in the reversepath list */
@@ -1102,14 +1331,14 @@ retry:
 
     if (reverse)
     {
-      ret = write_message(connptr->client_fd, "Location: %s%s%s\r\n", config.reversebaseurl,
-                          (reverse->path + 1), (header + len));
+      ret = head_writer_message(&head, connptr->client_fd, "Location: %s%s%s\r\n",
+                                config.reversebaseurl, (reverse->path + 1), (header + len));
       if (ret < 0)
         goto ERROR_EXIT;
 
       log_message(proxy->log, LOG_INFO, "Rewriting HTTP redirect: %s -> %s%s%s", header,
                   config.reversebaseurl, (reverse->path + 1), (header + len));
-      hashmap_remove(hashofheaders, "location");
+      headers_remove_ids(hashofheaders, HEADER_BIT(HEADER_LOCATION));
     }
   }
 #endif
@@ -1117,184 +1346,50 @@ retry:
   /*
    * All right, output all the remaining headers to the client.
    */
-  iter = hashmap_first(hashofheaders);
-  if (iter >= 0)
-  {
-    for (; !hashmap_is_end(hashofheaders, iter); ++iter)
-    {
-      hashmap_return_entry(hashofheaders, iter, &data, (void **)&header);
-
-      ret = write_message(connptr->client_fd, "%s: %s\r\n", data, header);
-      if (ret < 0)
-        goto ERROR_EXIT;
-    }
-  }
-  hashmap_delete(hashofheaders);
-
-  /* Write the final blank line to signify the end of the headers */
-  if (safe_write(connptr->client_fd, "\r\n", 2) < 0)
-    return -1;
-
-  return 0;
-
-ERROR_EXIT:
-  hashmap_delete(hashofheaders);
-  return -1;
-}
-
-/*
- * Switch the sockets into nonblocking mode and begin relaying the bytes
- * between the two connections. We continue to use the buffering code
- * since we want to be able to buffer a certain amount for slower
- * connections (as this was the reason why I originally modified
- * tinyproxy oh so long ago...)
- *	- rjkaes
- */
-static void relay_connection(pproxy_t proxy, struct conn_s *connptr)
-{
-  fd_set rset, wset;
-  struct timeval tv;
-  time_t last_access;
-  int ret;
-  double tdiff;
-  int maxfd = max(connptr->client_fd, connptr->server_fd) + 1;
-  ssize_t bytes_received;
-
-  ret = socket_nonblocking(connptr->client_fd);
-  if (ret != 0)
-  {
-    log_message(proxy->log, LOG_ERR,
-                "Failed to set the client socket "
-                "to non-blocking: %s",
-                strerror(errno));
-    return;
-  }
-
-  ret = socket_nonblocking(connptr->server_fd);
-  if (ret != 0)
-  {
-    log_message(proxy->log, LOG_ERR,
-                "Failed to set the server socket "
-                "to non-blocking: %s",
-                strerror(errno));
-    return;
-  }
-
-  last_access = time(NULL);
-
-  for (;;)
+  iter = 0;
+  while (headers_next(hashofheaders, &iter, &data, &header, &id))
   {
-    FD_ZERO(&rset);
-    FD_ZERO(&wset);
-
-    tv.tv_sec = config.idletimeout - difftime(time(NULL), last_access);
-    tv.tv_usec = 0;
-
-    if (buffer_size(connptr->sbuffer) > 0)
-      FD_SET(connptr->client_fd, &wset);
-    if (buffer_size(connptr->cbuffer) > 0)
-      FD_SET(connptr->server_fd, &wset);
-    if (buffer_size(connptr->sbuffer) < MAXBUFFSIZE)
-      FD_SET(connptr->server_fd, &rset);
-    if (buffer_size(connptr->cbuffer) < MAXBUFFSIZE)
-      FD_SET(connptr->client_fd, &rset);
-
-    ret = select(maxfd, &rset, &wset, NULL, &tv);
-
-    if (ret == 0)
-    {
-      tdiff = difftime(time(NULL), last_access);
-      if (tdiff > config.idletimeout)
-      {
-        log_message(proxy->log, LOG_INFO, "Idle Timeout (after select) as %g > %u.", tdiff,
-                    config.idletimeout);
-        return;
-      }
-      else
-      {
-        continue;
-      }
-    }
-    else if (ret < 0)
-    {
-      log_message(proxy->log, LOG_ERR,
-                  "relay_connection: select() error \"%s\". "
-                  "Closing connection (client_fd:%d, server_fd:%d)",
-                  strerror(errno), connptr->client_fd, connptr->server_fd);
-      return;
-    }
-    else
-    {
-      /*
-       * All right, something was actually selected so mark it.
-       */
-      last_access = time(NULL);
-    }
+    if (id == HEADER_VIA && !config.disable_viaheader)
+      continue;
 
-    if (FD_ISSET(connptr->server_fd, &rset))
-    {
-      bytes_received = read_buffer(proxy, connptr->server_fd, connptr->sbuffer);
-      if (bytes_received < 0)
-        break;
-
-      connptr->content_length.server -= bytes_received;
-      if (connptr->content_length.server == 0)
-        break;
-    }
-    if (FD_ISSET(connptr->client_fd, &rset) &&
-        read_buffer(proxy, connptr->client_fd, connptr->cbuffer) < 0)
-    {
-      break;
-    }
-    if (FD_ISSET(connptr->server_fd, &wset) &&
-        write_buffer(proxy, connptr->server_fd, connptr->cbuffer) < 0)
-    {
-      break;
-    }
-    if (FD_ISSET(connptr->client_fd, &wset) &&
-        write_buffer(proxy, connptr->client_fd, connptr->sbuffer) < 0)
-    {
-      break;
-    }
+    ret = head_writer_header(&head, connptr->client_fd, data, header);
+    if (ret < 0)
+      goto ERROR_EXIT;
   }
 
   /*
-   * Here the server has closed the connection... write the
-   * remainder to the client and then exit.
+   * Write the final blank line to signify the end of the headers, and send
+   * the whole head before the headers it points into are deleted.
    */
-  ret = socket_blocking(connptr->client_fd);
-  if (ret != 0)
-  {
-    log_message(proxy->log, LOG_ERR, "Failed to set client socket to blocking: %s",
-                strerror(errno));
-    return;
-  }
-
-  while (buffer_size(connptr->sbuffer) > 0)
+  if (head_writer_add(&head, connptr->client_fd, "\r\n", 2) < 0 ||
+      head_writer_flush(&head, connptr->client_fd) < 0)
   {
-    if (write_buffer(proxy, connptr->client_fd, connptr->sbuffer) < 0)
-      break;
+    headers_delete(hashofheaders);
+    request_parser_delete(parser);
+    return -1;
   }
-  shutdown(connptr->client_fd, SHUT_WR);
+  headers_delete(hashofheaders);
 
   /*
-   * Try to send any remaining data to the server if we can.
+   * An interim response is followed by the final one, unless it switches
+   * the connection to another protocol.
    */
-  ret = socket_blocking(connptr->server_fd);
-  if (ret != 0)
+  if (status >= 100 && status < 200 && status != 101)
   {
-    log_message(proxy->log, LOG_ERR, "Failed to set server socket to blocking: %s",
-                strerror(errno));
-    return;
+#ifdef REVERSE_SUPPORT
+    reverse = config.reversepath_list;
+#endif
+    request_parser_reset(parser);
+    goto retry;
   }
 
-  while (buffer_size(connptr->cbuffer) > 0)
-  {
-    if (write_buffer(proxy, connptr->server_fd, connptr->cbuffer) < 0)
-      break;
-  }
+  request_parser_delete(parser);
+  return 0;
 
-  return;
+ERROR_EXIT:
+  headers_delete(hashofheaders);
+  request_parser_delete(parser);
+  return -1;
 }
 
 static int callback_minimal(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in,
@@ -1580,14 +1675,14 @@ static void relay_websocket_connection(pproxy_t proxy, struct conn_s *connptr)
 }
 
 static int connect_to_upstream_proxy(pproxy_t proxy, struct conn_s *connptr,
-                                     struct request_s *request)
+                                     struct request_s *request, struct head_writer_s *head)
 {
   unsigned len;
   unsigned char buff[512]; /* won't use more than 7 + 255 */
   unsigned short port;
   size_t ulen, passlen;
 
-  struct hostent *host;
+  struct addrinfo *res;
   struct upstream *cur_upstream = connptr->upstream_proxy;
 
   ulen = cur_upstream->ua.user ? strlen(cur_upstream->ua.user) : 0;
@@ -1604,9 +1699,14 @@ static int connect_to_upstream_proxy(pproxy_t proxy, struct conn_s *connptr,
     buff[1] = 1; /* connect command */
     port = htons(request->port);
     memcpy(&buff[2], &port, 2); /* dest port */
-    host = gethostbyname(request->host);
-    memcpy(&buff[4], host->h_addr_list[0], 4); /* dest ip */
-    buff[8] = 0;                               /* user */
+    if (resolve_host(proxy, request->host, request->port, AF_INET, &res) != 0)
+    {
+      log_message(proxy->log, LOG_ERR, "Could not resolve \"%s\" for SOCKS4.", request->host);
+      return -1;
+    }
+    memcpy(&buff[4], &((struct sockaddr_in *)res->ai_addr)->sin_addr, 4); /* dest ip */
+    resolve_free(res);
+    buff[8] = 0; /* user */
     if (9 != safe_write(connptr->server_fd, buff, 9))
       return -1;
     if (8 != safe_read(connptr->server_fd, buff, 8))
@@ -1703,13 +1803,15 @@ static int connect_to_upstream_proxy(pproxy_t proxy, struct conn_s *connptr,
   if (connptr->connect_method)
     return 0;
 
-  return establish_http_connection(connptr, request);
+  return establish_http_connection(connptr, request, head);
 }
 
 /*
- * Establish a connection to the upstream proxy server.
+ * The connection to the upstream proxy is made (or reused): do the SOCKS
+ * handshake of a new one, and start the head of the request.
  */
-static int connect_to_upstream(pproxy_t proxy, struct conn_s *connptr, struct request_s *request)
+static int connect_to_upstream(pproxy_t proxy, struct conn_s *connptr, struct request_s *request,
+                               struct head_writer_s *head)
 {
 #ifndef UPSTREAM_SUPPORT
   /*
@@ -1730,33 +1832,33 @@ static int connect_to_upstream(pproxy_t proxy, struct conn_s *connptr, struct re
     return -1;
   }
 
-  connptr->server_fd =
-      opensock(proxy, cur_upstream->host, cur_upstream->port, connptr->server_ip_addr);
-
-  if (connptr->server_fd < 0)
+  if (connptr->server_reused)
   {
-    log_message(proxy->log, LOG_WARNING, "Could not connect to upstream proxy.");
-    indicate_http_error(connptr, 404, "Unable to connect to upstream proxy", "detail",
-                        "A network error occurred while trying to "
-                        "connect to the upstream web proxy.",
-                        NULL);
-    return -1;
+    /* The SOCKS handshake was done when the connection was made */
+    if (cur_upstream->type != PT_HTTP)
+      return establish_http_connection(connptr, request, head);
   }
+  else
+  {
+    if (cur_upstream->type != PT_HTTP)
+      return connect_to_upstream_proxy(proxy, connptr, request, head);
 
-  if (cur_upstream->type != PT_HTTP)
-    return connect_to_upstream_proxy(proxy, connptr, request);
-
-  log_message(proxy->log, LOG_CONN,
-              "Established connection to upstream proxy \"%s\" "
-              "using file descriptor %d.",
-              cur_upstream->host, connptr->server_fd);
+    log_message(proxy->log, LOG_CONN,
+                "Established connection to upstream proxy \"%s\" "
+                "using file descriptor %d.",
+                cur_upstream->host, connptr->server_fd);
+  }
 
   /*
    * We need to re-write the "path" part of the request so that we
    * can reuse the establish_http_connection() function. It expects a
-   * method and path.
+   * method and path. A request sent again has it rewritten already.
    */
-  if (connptr->connect_method)
+  if (connptr->server_retried)
+  {
+    return establish_http_connection(connptr, request, head);
+  }
+  else if (connptr->connect_method)
   {
     len = strlen(request->host) + 7;
 
@@ -1784,32 +1886,31 @@ static int connect_to_upstream(pproxy_t proxy, struct conn_s *connptr, struct re
     safefree(request->path);
   request->path = combined_string;
 
-  return establish_http_connection(connptr, request);
+  return establish_http_connection(connptr, request, head);
 #endif
 }
 
 static int get_request_entity(pproxy_t proxy, struct conn_s *connptr)
 {
   int ret;
-  fd_set rset;
-  struct timeval tv;
+  struct pollfd pfd;
 
-  FD_ZERO(&rset);
-  FD_SET(connptr->client_fd, &rset);
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
-  ret = select(connptr->client_fd + 1, &rset, NULL, NULL, &tv);
+  /* poll(), not select(): the client fd can be past FD_SETSIZE in an EventLoop child */
+  pfd.fd = connptr->client_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  ret = poll(&pfd, 1, 0);
 
   if (ret == -1)
   {
-    log_message(proxy->log, LOG_ERR, "Error calling select on client fd %d: %s", connptr->client_fd,
+    log_message(proxy->log, LOG_ERR, "Error calling poll on client fd %d: %s", connptr->client_fd,
                 strerror(errno));
   }
   else if (ret == 0)
   {
     log_message(proxy->log, LOG_INFO, "no entity");
   }
-  else if (ret == 1 && FD_ISSET(connptr->client_fd, &rset))
+  else if (ret == 1 && (pfd.revents & (POLLIN | POLLERR | POLLHUP)))
   {
     ssize_t nread;
     nread = read_buffer(proxy, connptr->client_fd, connptr->cbuffer);
@@ -1827,7 +1928,7 @@ static int get_request_entity(pproxy_t proxy, struct conn_s *connptr)
   else
   {
     log_message(proxy->log, LOG_ERR,
-                "strange situation after select: "
+                "strange situation after poll: "
                 "ret = %d, but client_fd (%d) is not readable...",
                 ret, connptr->client_fd);
     ret = -1;
@@ -1836,6 +1937,14 @@ static int get_request_entity(pproxy_t proxy, struct conn_s *connptr)
   return ret;
 }
 
+/*
+ * The name of the client, for the ACL rules which need it.
+ */
+static int lookup_peer_name(const char *ip, char *host, size_t len, void *data)
+{
+  return resolve_addr((pproxy_t)data, ip, host, len);
+}
+
 /*
  * This is the main drive for each connection. As you can tell, for the
  * first few steps we are using a blocking socket. If you remember the
@@ -1844,14 +1953,14 @@ static int get_request_entity(pproxy_t proxy, struct conn_s *connptr)
  * when we start the relay portion. This makes most of the original
  * tinyproxy code, which was confusing, redundant. Hail progress.
  * 	- rjkaes
+ *
+ * open_connection() accepts the client, then prepare_request() handles each
+ * of its requests up to the relay.
  */
-void handle_connection(pproxy_t proxy, int fd)
+int open_connection(pproxy_t proxy, int fd, acl_lookup_t lookup, void *data,
+                    struct conn_s **connptr)
 {
-  // todo: put libwebsocket here
-  ssize_t i;
-  struct conn_s *connptr;
-  struct request_s *request = NULL;
-  phashmap_t hashofheaders = NULL;
+  int allowed;
 
   char sock_ipaddr[IP_LENGTH];
   char peer_ipaddr[IP_LENGTH];
@@ -1859,6 +1968,12 @@ void handle_connection(pproxy_t proxy, int fd)
 
   getpeer_information(fd, peer_ipaddr, peer_string);
 
+  /* Before the connection is made, so that it gets the name if one was looked up */
+  allowed = check_acl(proxy->log, proxy->acl, peer_ipaddr, peer_string, sizeof(peer_string),
+                      lookup, data);
+  if (allowed == -EINPROGRESS)
+    return allowed;
+
   if (config.bindsame)
     getsock_ip(proxy, fd, sock_ipaddr);
 
@@ -1867,77 +1982,429 @@ void handle_connection(pproxy_t proxy, int fd)
                               : "Connect (file descriptor %d): %s [%s]",
               fd, peer_string, peer_ipaddr, sock_ipaddr);
 
-  connptr = initialize_conn(fd, peer_ipaddr, peer_string, config.bindsame ? sock_ipaddr : NULL);
-  if (!connptr)
+  *connptr = initialize_conn(fd, peer_ipaddr, peer_string, config.bindsame ? sock_ipaddr : NULL);
+  if (!*connptr)
   {
     closesocket(fd);
-    return;
+    return -1;
   }
 
-  if (check_acl(proxy->log, proxy->acl, peer_ipaddr, peer_string) <= 0)
+  if (allowed <= 0)
   {
     update_stats(STAT_DENIED);
-    indicate_http_error(connptr, 403, "Access denied", "detail",
+    indicate_http_error(*connptr, 403, "Access denied", "detail",
                         "The administrator of this proxy has not configured "
                         "it to service requests from your host.",
                         NULL);
-    goto fail;
+    send_http_error_message(*connptr);
+    destroy_conn(proxy, *connptr);
+    *connptr = NULL;
+    return -1;
   }
 
-  if (read_request_line(proxy, connptr) < 0)
-  {
-    update_stats(STAT_BADCONN);
-    indicate_http_error(connptr, 408, "Timeout", "detail",
-                        "Server timeout waiting for the HTTP request "
-                        "from the client.",
-                        NULL);
-    goto fail;
-  }
+  return 0;
+}
 
-  /*
-   * The "hashofheaders" store the client's headers.
-   */
-  hashofheaders = hashmap_create(HEADER_BUCKETS);
-  if (hashofheaders == NULL)
+/*
+ * Can the request be sent again on a new connection, after the one taken
+ * from the pool failed? The server may have closed that one just before it
+ * was reused. Only an idempotent request (RFC 7231, 4.2.2) is, only once,
+ * and only without a body, which was consumed by the first attempt.
+ */
+static unsigned int can_send_again(struct conn_s *connptr, struct request_s *request)
+{
+  static const char *const methods[] = {"GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE"};
+  size_t i;
+
+  if (!connptr->server_reused || connptr->content_length.client > 0)
+    return FALSE;
+
+  for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
   {
-    update_stats(STAT_BADCONN);
-    indicate_http_error(connptr, 503, "Internal error", "detail",
-                        "An internal server error occurred while processing "
-                        "your request. Please contact the administrator.",
-                        NULL);
-    goto fail;
+    if (strcmp(request->method, methods[i]) == 0)
+      return TRUE;
   }
 
+  return FALSE;
+}
+
+/*
+ * Drop the reused connection the request failed on, see can_send_again().
+ */
+static void send_again(pproxy_t proxy, struct conn_s *connptr, struct request_s *request)
+{
+  log_message(proxy->log, LOG_CONN,
+              "The reused connection to \"%s\" was closed, sending the request again "
+              "on a new one.",
+              request->host);
+
+  closesocket(connptr->server_fd);
+  connptr->server_fd = -1;
+  connptr->server_reused = FALSE;
+  connptr->server_retried = TRUE;
+
+  forget_http_error(connptr);
+}
+
+/*
+ * A request sent to the server by a child running an event loop, whose
+ * response the loop waits for.
+ */
+struct request_wait_s
+{
+  pproxy_t proxy;
+  pevent_loop_t loop;
+  struct conn_s *connptr;
+  struct request_s *request;
+  pheaders_t hashofheaders; // to send the request again
+  relay_kept_t kept;
+  void *data;
+
+  long int body;    // what is left to read of the body of the request
+  char *buffer;     // the part of the body read from the client
+  size_t buffered;  // how much of it is in the buffer
+  size_t written;   // and already went to the server
+};
+
+static size_t waiting_requests = 0;
+
+size_t request_wait_count(void)
+{
+  return waiting_requests;
+}
+
+/*
+ * The request could not be sent, or its response not received. Take what
+ * is left of the request off the client, answer it with the error (or the
+ * stats page), and release the request. Returns -1.
+ */
+static int request_failed(pproxy_t proxy, struct conn_s *connptr, struct request_s *request,
+                          pheaders_t hashofheaders)
+{
   /*
-   * Get all the headers from the client in a big hash.
+   * First, get the body if there is one.
+   * If we don't read all there is from the socket first,
+   * it is still marked for reading and we won't be able
+   * to send our data properly.
    */
-  if (get_all_headers(connptr->client_fd, hashofheaders) < 0)
+  if (get_request_entity(proxy, connptr) < 0)
   {
-    log_message(proxy->log, LOG_WARNING, "Could not retrieve all the headers from the client");
+    log_message(proxy->log, LOG_WARNING, "Could not retrieve request entity");
     indicate_http_error(connptr, 400, "Bad Request", "detail",
-                        "Could not retrieve all the headers from "
+                        "Could not retrieve the request entity "
                         "the client.",
                         NULL);
     update_stats(STAT_BADCONN);
-    goto fail;
   }
 
-  if (is_basicauth_required(proxy->auth))
+  if (connptr->error_variables)
   {
-    ssize_t len;
-    char *authstring;
-    int failure = 1;
-    len = hashmap_entry_by_key(hashofheaders, "proxy-authorization", (void **)&authstring);
+    send_http_error_message(connptr);
+  }
+  else if (connptr->show_stats)
+  {
+    showstats(connptr);
+  }
 
-    if (len == 0)
-    {
-      update_stats(STAT_DENIED);
-      indicate_http_error(connptr, 407, "Proxy Authentication Required", "detail",
-                          "This proxy requires authentication.", NULL);
-      goto fail;
-    }
-    // currently only "basic" auth supported
-    if ((strncmp(authstring, "Basic ", 6) == 0 || strncmp(authstring, "basic ", 6) == 0) &&
+  free_request_struct(request);
+  headers_delete(hashofheaders);
+  return -1;
+}
+
+/*
+ * Take a connection to the server (or upstream proxy) from the pool, if one
+ * is kept there. Returns TRUE if there was one.
+ */
+static unsigned int reuse_server(pproxy_t proxy, struct conn_s *connptr, struct request_s *request)
+{
+  struct upstream *cur_upstream = connptr->upstream_proxy;
+
+  if (!connptr->server_keepalive || connptr->server_retried)
+    return FALSE;
+
+  connptr->server_fd =
+      server_pool_get(request->host, request->port, cur_upstream, connptr->server_ip_addr);
+  connptr->server_reused = connptr->server_fd >= 0;
+  if (!connptr->server_reused)
+    return FALSE;
+
+  if (cur_upstream)
+  {
+    log_message(proxy->log, LOG_CONN,
+                "Reusing the connection to %s proxy \"%s\" on file descriptor %d.",
+                proxy_type_name(cur_upstream->type), cur_upstream->host, connptr->server_fd);
+  }
+  else
+  {
+    log_message(proxy->log, LOG_CONN,
+                "Reusing the connection to host \"%s\" on file descriptor %d.", request->host,
+                connptr->server_fd);
+  }
+
+  return TRUE;
+}
+
+/*
+ * Where a new connection for the request goes: to the upstream proxy, or to
+ * the server itself.
+ */
+static const char *server_host(struct conn_s *connptr, struct request_s *request, int *port)
+{
+  if (connptr->upstream_proxy)
+  {
+    *port = connptr->upstream_proxy->port;
+    return connptr->upstream_proxy->host;
+  }
+
+  *port = request->port;
+  return request->host;
+}
+
+/*
+ * No connection to the server (or upstream proxy) could be made, errno
+ * tells why.
+ */
+static void indicate_no_connection(pproxy_t proxy, struct conn_s *connptr)
+{
+  if (connptr->upstream_proxy)
+  {
+    log_message(proxy->log, LOG_WARNING, "Could not connect to upstream proxy.");
+    indicate_http_error(connptr, 404, "Unable to connect to upstream proxy", "detail",
+                        "A network error occurred while trying to "
+                        "connect to the upstream web proxy.",
+                        NULL);
+    return;
+  }
+
+  indicate_http_error(connptr, 500, "Unable to connect", "detail",
+                      PACKAGE_NAME " "
+                                   "was unable to connect to the remote web server.",
+                      "error", strerror(errno), NULL);
+}
+
+/*
+ * The connection to the server (or upstream proxy) is made, or reused:
+ * start the head of the request.
+ */
+static int server_connected(pproxy_t proxy, struct conn_s *connptr, struct request_s *request,
+                            struct head_writer_s *head)
+{
+  if (connptr->upstream_proxy != NULL)
+    return connect_to_upstream(proxy, connptr, request, head);
+
+  if (!connptr->server_reused)
+  {
+    log_message(proxy->log, LOG_CONN,
+                "Established connection to host \"%s\" using "
+                "file descriptor %d.",
+                request->host, connptr->server_fd);
+  }
+
+  if (!connptr->connect_method)
+    establish_http_connection(connptr, request, head);
+
+  return 0;
+}
+
+/*
+ * Connect to the server (or upstream proxy), or take a connection from
+ * the pool, and send the request. A request which could not be written to
+ * a reused connection is sent again on a new one.
+ *
+ * Returns 0, or -1 with the error indicated.
+ */
+static int send_request(pproxy_t proxy, struct conn_s *connptr, struct request_s *request,
+                        pheaders_t hashofheaders)
+{
+  struct head_writer_s head; // the head forwarded to the server, only needed until it is sent
+  const char *host;
+  int port;
+
+connect:
+  head_writer_init(&head);
+
+  if (!reuse_server(proxy, connptr, request))
+  {
+    host = server_host(connptr, request, &port);
+    connptr->server_fd = opensock(proxy, host, port, connptr->server_ip_addr);
+    if (connptr->server_fd < 0)
+    {
+      indicate_no_connection(proxy, connptr);
+      return -1;
+    }
+  }
+
+  if (server_connected(proxy, connptr, request, &head) < 0)
+    return -1;
+
+  if (process_client_headers(proxy, connptr, hashofheaders, &head, NULL) < 0)
+  {
+    if (can_send_again(connptr, request))
+    {
+      send_again(proxy, connptr, request);
+      goto connect;
+    }
+
+    update_stats(STAT_BADCONN);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Does the server answer the request, rather than the proxy opening the
+ * tunnel of a CONNECT by itself?
+ */
+static unsigned int expects_response(struct conn_s *connptr)
+{
+  return !connptr->connect_method || UPSTREAM_IS_HTTP(connptr);
+}
+
+/*
+ * Read the head of the response and forward it to the client, or for a
+ * CONNECT answer it ourselves. When the reused connection the request went
+ * on was closed instead, the request is sent again on a new one, or with
+ * "again" set it is left to the caller to send it.
+ *
+ * Returns 0 once the response can be relayed, 1 if the request is to be
+ * sent again (only with "again" set), or -1 with the error indicated.
+ */
+static int receive_response(pproxy_t proxy, struct conn_s *connptr, struct request_s *request,
+                            pheaders_t hashofheaders, unsigned int again)
+{
+  int ret;
+
+  if (!expects_response(connptr))
+  {
+    if (send_ssl_response(connptr) < 0)
+    {
+      log_message(proxy->log, LOG_ERR,
+                  "handle_connection: Could not send SSL greeting "
+                  "to client.");
+      update_stats(STAT_BADCONN);
+      return -1;
+    }
+    return 0;
+  }
+
+  while ((ret = process_server_headers(proxy, connptr, request)) == -ECONNRESET &&
+         can_send_again(connptr, request))
+  {
+    send_again(proxy, connptr, request);
+    if (again)
+      return 1;
+    if (send_request(proxy, connptr, request, hashofheaders) < 0)
+      return -1;
+  }
+
+  if (ret < 0)
+  {
+    update_stats(STAT_BADCONN);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Returns 0 once the request is ready to be relayed, or -1 when it has
+ * already been answered (error page, stats page): the connection is done
+ * and must be destroyed.
+ *
+ * With "sent" given, the request is not sent: 1 is returned with it handed
+ * over in "sent", for the event loop to connect, send it and wait for the
+ * response.
+ */
+static int prepare_request(pproxy_t proxy, struct conn_s *connptr, prequest_parser_t parser,
+                           struct request_wait_s *sent)
+{
+  // todo: put libwebsocket here
+  ssize_t i;
+  int ret;
+  struct request_s *request = NULL;
+  pheaders_t hashofheaders = NULL;
+
+  ret = read_request_head(proxy, connptr, parser);
+  if (ret == -ERANGE)
+  {
+    update_stats(STAT_BADCONN);
+    indicate_http_error(connptr, 400, "Bad Request", "detail",
+                        "The request headers sent by the client "
+                        "are too large.",
+                        NULL);
+    goto fail;
+  }
+  else if (ret < 0)
+  {
+    update_stats(STAT_BADCONN);
+    indicate_http_error(connptr, 408, "Timeout", "detail",
+                        "Server timeout waiting for the HTTP request "
+                        "from the client.",
+                        NULL);
+    goto fail;
+  }
+
+  /*
+   * The "hashofheaders" store the client's headers.
+   */
+  hashofheaders = headers_create();
+  if (hashofheaders == NULL)
+  {
+    update_stats(STAT_BADCONN);
+    indicate_http_error(connptr, 503, "Internal error", "detail",
+                        "An internal server error occurred while processing "
+                        "your request. Please contact the administrator.",
+                        NULL);
+    goto fail;
+  }
+
+  /*
+   * Get all the headers from the client in a big hash.
+   */
+  if (get_all_headers(parser, hashofheaders) < 0)
+  {
+    log_message(proxy->log, LOG_WARNING, "Could not retrieve all the headers from the client");
+    indicate_http_error(connptr, 400, "Bad Request", "detail",
+                        "Could not retrieve all the headers from "
+                        "the client.",
+                        NULL);
+    update_stats(STAT_BADCONN);
+    goto fail;
+  }
+
+  /*
+   * The body must end where the server will think it ends, or what follows
+   * it would be read as another request (RFC 7230, 3.3.3).
+   */
+  connptr->content_length.client = get_content_length(hashofheaders);
+  if (connptr->content_length.client == CONTENT_LENGTH_INVALID ||
+      (connptr->content_length.client >= 0 &&
+       headers_search_id(hashofheaders, HEADER_TRANSFER_ENCODING) > 0))
+  {
+    log_message(proxy->log, LOG_WARNING, "The client sent an invalid Content-Length");
+    indicate_http_error(connptr, 400, "Bad Request", "detail",
+                        "The length of the request body is invalid.", NULL);
+    update_stats(STAT_BADCONN);
+    goto fail;
+  }
+
+  if (is_basicauth_required(proxy->auth))
+  {
+    ssize_t len;
+    char *authstring;
+    int failure = 1;
+    len = headers_entry_by_id(hashofheaders, HEADER_PROXY_AUTHORIZATION, &authstring);
+
+    if (len == 0)
+    {
+      update_stats(STAT_DENIED);
+      indicate_http_error(connptr, 407, "Proxy Authentication Required", "detail",
+                          "This proxy requires authentication.", NULL);
+      goto fail;
+    }
+    // currently only "basic" auth supported
+    if ((strncmp(authstring, "Basic ", 6) == 0 || strncmp(authstring, "basic ", 6) == 0) &&
         does_pass_auth_chek(proxy->log, proxy->auth, authstring + 6))
     {
       failure = 0;
@@ -1952,7 +2419,7 @@ void handle_connection(pproxy_t proxy, int fd)
                           NULL);
       goto fail;
     }
-    hashmap_remove(hashofheaders, "proxy-authorization");
+    headers_remove_ids(hashofheaders, HEADER_BIT(HEADER_PROXY_AUTHORIZATION));
   }
 
   /*
@@ -1963,7 +2430,7 @@ void handle_connection(pproxy_t proxy, int fd)
   {
     http_header_t *header = (http_header_t *)list_getentry(config.add_headers, i, NULL);
 
-    hashmap_insert(hashofheaders, header->name, header->value, strlen(header->value) + 1);
+    headers_insert(hashofheaders, header->name, header->value);
   }
 
   request = process_request(proxy, connptr, hashofheaders);
@@ -1976,110 +2443,513 @@ void handle_connection(pproxy_t proxy, int fd)
     goto fail;
   }
 
+  if (wants_server_keepalive(connptr, hashofheaders))
+  {
+    connptr->server_host = safestrdup(request->host);
+    connptr->server_port = request->port;
+    connptr->server_keepalive = connptr->server_host != NULL;
+  }
+
+  connptr->client_keepalive = wants_client_keepalive(proxy, connptr, hashofheaders);
+
   connptr->upstream_proxy = UPSTREAM_HOST(proxy, request->host);
-  if (connptr->upstream_proxy != NULL)
+
+  if (sent)
   {
-    if (connect_to_upstream(proxy, connptr, request) < 0)
+    sent->request = request;
+    sent->hashofheaders = hashofheaders;
+    return 1;
+  }
+
+  if (send_request(proxy, connptr, request, hashofheaders) < 0)
+    goto fail;
+
+  if (receive_response(proxy, connptr, request, hashofheaders, FALSE) < 0)
+    goto fail;
+
+  free_request_struct(request);
+  headers_delete(hashofheaders);
+  return 0;
+
+fail:
+  return request_failed(proxy, connptr, request, hashofheaders);
+}
+
+int pipelined_request_head(struct conn_s *connptr, prequest_parser_t parser)
+{
+  unsigned char data[1024 * 4];
+  size_t len;
+  int ret = REQUEST_PARSER_MORE;
+
+  request_parser_reset(parser);
+
+  /* The parser hands back whatever follows the head */
+  while (buffer_size(connptr->cbuffer) > 0)
+  {
+    len = take_from_buffer(connptr->cbuffer, data, sizeof(data));
+    ret = request_parser_push(parser, (const char *)data, len);
+    if (ret < 0)
+      break;
+  }
+
+  return ret;
+}
+
+/*
+ * Wait for the next request of a persistent client, at most for
+ * ClientKeepAliveTimeout. Returns TRUE once something arrived.
+ */
+static unsigned int wait_next_request(struct conn_s *connptr)
+{
+  fd_set rset;
+  struct timeval tv;
+  char c;
+
+  FD_ZERO(&rset);
+  FD_SET(connptr->client_fd, &rset);
+  tv.tv_sec = config.client_keepalive_timeout;
+  tv.tv_usec = 0;
+
+  if (select(connptr->client_fd + 1, &rset, NULL, NULL, &tv) <= 0)
+    return FALSE;
+
+  /* Closing the connection is how the client says it is done */
+  return recv(connptr->client_fd, &c, 1, MSG_PEEK) > 0;
+}
+
+void handle_connection(pproxy_t proxy, int fd)
+{
+  struct conn_s *connptr;
+  prequest_parser_t parser;
+  unsigned int idle;
+  int ret;
+
+  parser = request_parser_create();
+  if (!parser)
+  {
+    log_message(proxy->log, LOG_ERR, "Could not allocate the request parser.");
+    closesocket(fd);
+    return;
+  }
+
+  if (open_connection(proxy, fd, lookup_peer_name, proxy, &connptr) < 0)
+  {
+    request_parser_delete(parser);
+    return;
+  }
+
+  while (prepare_request(proxy, connptr, parser, NULL) == 0)
+  {
+    relay_connection(proxy, connptr);
+
+    if (!connptr->client_keepalive || is_proxy_outdated(proxy))
     {
-      goto fail;
+      log_message(proxy->log, LOG_INFO,
+                  "Closed connection between local client (fd:%d) "
+                  "and remote client (fd:%d)",
+                  connptr->client_fd, connptr->server_fd);
+      break;
     }
+
+    reset_conn(proxy, connptr);
+
+    /* Nothing pipelined yet, the client may be done */
+    idle = buffer_size(connptr->cbuffer) == 0;
+
+    ret = pipelined_request_head(connptr, parser);
+    if (ret < 0 || (idle && !wait_next_request(connptr)))
+      break;
+  }
+
+  request_parser_delete(parser);
+  destroy_conn(proxy, connptr);
+}
+
+/*
+ * The head of the response went to the client: hand the relay portion
+ * over to the loop.
+ */
+static void relay_in_loop(pproxy_t proxy, pevent_loop_t loop, struct conn_s *connptr,
+                          relay_kept_t kept, void *data)
+{
+  int ret;
+
+  ret = relay_connection_in_loop(proxy, loop, connptr, kept, data);
+  if (ret == 0)
+    return;
+
+  /* Nothing left to relay, a peer is gone */
+  if (ret == -EPIPE)
+  {
+    log_message(proxy->log, LOG_INFO,
+                "Connection (client_fd:%d, server_fd:%d) broke before it could be relayed.",
+                connptr->client_fd, connptr->server_fd);
+    destroy_conn(proxy, connptr);
+    return;
+  }
+
+  log_message(proxy->log, LOG_WARNING,
+              "Could not hand the connection (fd:%d) over to the event loop, "
+              "relaying it in place.",
+              connptr->client_fd);
+
+  relay_connection(proxy, connptr);
+  destroy_conn(proxy, connptr);
+}
+
+static void response_event(pevent_loop_t loop, int fd, unsigned int events, void *data);
+static void request_connect(struct request_wait_s *wait);
+
+/*
+ * The loop is done with the request: answer the error, or hand the
+ * connection over to the relay.
+ */
+static void request_finish(struct request_wait_s *wait, int ret)
+{
+  struct conn_s *connptr = wait->connptr;
+  pproxy_t proxy = wait->proxy;
+
+  waiting_requests--;
+
+  if (ret < 0)
+  {
+    request_failed(proxy, connptr, wait->request, wait->hashofheaders);
+    destroy_conn(proxy, connptr);
   }
   else
   {
-    connptr->server_fd = opensock(proxy, request->host, request->port, connptr->server_ip_addr);
-    if (connptr->server_fd < 0)
+    free_request_struct(wait->request);
+    headers_delete(wait->hashofheaders);
+    relay_in_loop(proxy, wait->loop, connptr, wait->kept, wait->data);
+  }
+
+  safefree(wait);
+}
+
+/*
+ * Wait (in the loop) for the server to answer, at most Timeout seconds.
+ */
+static int wait_response(struct request_wait_s *wait)
+{
+  int fd = wait->connptr->server_fd;
+
+  if (event_loop_add(wait->loop, fd, EVENT_READ, response_event, wait) < 0)
+    return -1;
+
+  event_loop_set_timeout(wait->loop, fd, config.idletimeout);
+  return 0;
+}
+
+/*
+ * The server began to answer the request (or gave up, or took too long):
+ * forward the head of the response, and hand the connection over to the
+ * relay.
+ */
+static void response_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct request_wait_s *wait = (struct request_wait_s *)data;
+  struct conn_s *connptr = wait->connptr;
+  int ret;
+
+  event_loop_remove(loop, fd);
+
+  if (events & EVENT_TIMEOUT)
+  {
+    indicate_no_response(wait->proxy, connptr);
+    update_stats(STAT_BADCONN);
+    request_finish(wait, -1);
+    return;
+  }
+
+  ret = receive_response(wait->proxy, connptr, wait->request, wait->hashofheaders, TRUE);
+
+  /* The reused connection was closed, the request goes on a new one */
+  if (ret > 0)
+  {
+    request_connect(wait);
+    return;
+  }
+
+  request_finish(wait, ret);
+}
+
+/*
+ * The request is sent: wait (in the loop) for the response.
+ */
+static void request_sent(struct request_wait_s *wait)
+{
+  /* Wait in place if the loop can't */
+  if (!expects_response(wait->connptr) || wait_response(wait) < 0)
+    request_finish(wait, receive_response(wait->proxy, wait->connptr, wait->request,
+                                          wait->hashofheaders, FALSE));
+}
+
+static void body_event(pevent_loop_t loop, int fd, unsigned int events, void *data);
+
+/*
+ * Wait (in the loop) for fd to be ready for events, at most Timeout
+ * seconds.
+ */
+static int body_wait(struct request_wait_s *wait, int fd, unsigned int events)
+{
+  if (event_loop_add(wait->loop, fd, events, body_event, wait) < 0)
+    return -1;
+
+  event_loop_set_timeout(wait->loop, fd, config.idletimeout);
+  return -EINPROGRESS;
+}
+
+/*
+ * Copy what can be of the body of the request, from the client to the
+ * server (or nowhere, when an error is to be answered instead). Same as
+ * pull_client_data(), but the sockets are non-blocking.
+ *
+ * Returns 0 once the body is copied, -EINPROGRESS while the loop waits for
+ * one of the sockets, or -1.
+ */
+static int body_copy(struct request_wait_s *wait)
+{
+  struct conn_s *connptr = wait->connptr;
+  size_t len;
+  ssize_t n;
+
+  for (;;)
+  {
+    if (connptr->error_variables)
+      wait->written = wait->buffered;
+
+    if (wait->written < wait->buffered)
     {
-      indicate_http_error(connptr, 500, "Unable to connect", "detail",
-                          PACKAGE_NAME " "
-                                       "was unable to connect to the remote web server.",
-                          "error", strerror(errno), NULL);
-      goto fail;
+      n = writesocket(connptr->server_fd, wait->buffer + wait->written,
+                      wait->buffered - wait->written, MSG_NOSIGNAL);
+      if (n < 0 && errno == EAGAIN)
+        return body_wait(wait, connptr->server_fd, EVENT_WRITE);
+      if (n < 0 && errno != EINTR)
+        return -1;
+      if (n > 0)
+        wait->written += (size_t)n;
+      continue;
     }
 
-    log_message(proxy->log, LOG_CONN,
-                "Established connection to host \"%s\" using "
-                "file descriptor %d.",
-                request->host, connptr->server_fd);
+    if (wait->body == 0)
+      return 0;
 
-    if (!connptr->connect_method)
-      establish_http_connection(connptr, request);
+    wait->buffered = wait->written = 0;
+    len = min(MAXBUFFSIZE, (unsigned long int)wait->body);
+
+    /* The beginning of the body may have arrived along with the headers */
+    if (buffer_size(connptr->cbuffer) > 0)
+      n = (ssize_t)take_from_buffer(connptr->cbuffer, (unsigned char *)wait->buffer, len);
+    else
+    {
+      n = readsocket(connptr->client_fd, wait->buffer, len);
+      if (n < 0 && errno == EAGAIN)
+        return body_wait(wait, connptr->client_fd, EVENT_READ);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+    }
+
+    wait->buffered = (size_t)n;
+    wait->body -= n;
   }
+}
 
-  if (process_client_headers(proxy, connptr, hashofheaders) < 0)
+/*
+ * The body of the request is copied, or could not be: put the sockets back
+ * as the rest expects them, and wait for the response.
+ */
+static void body_copied(struct request_wait_s *wait, int ret)
+{
+  struct conn_s *connptr = wait->connptr;
+
+  safefree(wait->buffer);
+
+  if (socket_blocking(connptr->client_fd) != 0 || socket_blocking(connptr->server_fd) != 0)
+    ret = -1;
+
+  if (ret < 0 || eat_trailing_crlf(wait->proxy, connptr) < 0)
   {
     update_stats(STAT_BADCONN);
-    goto fail;
+    request_finish(wait, -1);
+    return;
   }
 
-  if (!connptr->connect_method || UPSTREAM_IS_HTTP(connptr))
+  request_sent(wait);
+}
+
+/*
+ * A socket the body of the request waited for is ready (or took too long).
+ */
+static void body_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct request_wait_s *wait = (struct request_wait_s *)data;
+  int ret;
+
+  event_loop_remove(loop, fd);
+
+  if (events & EVENT_TIMEOUT)
   {
-    if (process_server_headers(proxy, connptr) < 0)
-    {
-      update_stats(STAT_BADCONN);
-      goto fail;
-    }
+    log_message(wait->proxy->log, LOG_WARNING,
+                "The body of the request (fd:%d) stalled for %u seconds.",
+                wait->connptr->client_fd, config.idletimeout);
+    body_copied(wait, -1);
+    return;
   }
-  else
+
+  ret = body_copy(wait);
+  if (ret != -EINPROGRESS)
+    body_copied(wait, ret);
+}
+
+/*
+ * The connection to the server is there: send the head of the request,
+ * then its body and wait for the response, both in the loop.
+ */
+static void request_send(struct request_wait_s *wait)
+{
+  struct head_writer_s head; // the head forwarded to the server, only needed until it is sent
+  struct conn_s *connptr = wait->connptr;
+  pproxy_t proxy = wait->proxy;
+  int ret;
+
+  head_writer_init(&head);
+
+  if (server_connected(proxy, connptr, wait->request, &head) < 0)
   {
-    if (send_ssl_response(connptr) < 0)
+    request_finish(wait, -1);
+    return;
+  }
+
+  if (process_client_headers(proxy, connptr, wait->hashofheaders, &head, &wait->body) < 0)
+  {
+    if (can_send_again(connptr, wait->request))
     {
-      log_message(proxy->log, LOG_ERR,
-                  "handle_connection: Could not send SSL greeting "
-                  "to client.");
-      update_stats(STAT_BADCONN);
-      goto fail;
+      send_again(proxy, connptr, wait->request);
+      request_connect(wait);
+      return;
     }
+
+    update_stats(STAT_BADCONN);
+    request_finish(wait, -1);
+    return;
   }
 
-  relay_connection(proxy, connptr);
+  if (wait->body == 0)
+  {
+    request_sent(wait);
+    return;
+  }
 
-  log_message(proxy->log, LOG_INFO,
-              "Closed connection between local client (fd:%d) "
-              "and remote client (fd:%d)",
-              connptr->client_fd, connptr->server_fd);
+  wait->buffer = (char *)safemalloc(min(MAXBUFFSIZE, (unsigned long int)wait->body));
+  if (!wait->buffer)
+  {
+    request_finish(wait, -1);
+    return;
+  }
 
-  goto done;
+  if (socket_nonblocking(connptr->client_fd) != 0 || socket_nonblocking(connptr->server_fd) != 0)
+    ret = -1;
+  else
+    ret = body_copy(wait);
 
-fail:
-  /*
-   * First, get the body if there is one.
-   * If we don't read all there is from the socket first,
-   * it is still marked for reading and we won't be able
-   * to send our data properly.
-   */
-  if (get_request_entity(proxy, connptr) < 0)
+  if (ret != -EINPROGRESS)
+    body_copied(wait, ret);
+}
+
+/*
+ * The connection to the server (or upstream proxy) is made, or could not be.
+ */
+static void request_connected(int sockfd, void *data)
+{
+  struct request_wait_s *wait = (struct request_wait_s *)data;
+
+  wait->connptr->server_fd = sockfd;
+  if (sockfd < 0)
   {
-    log_message(proxy->log, LOG_WARNING, "Could not retrieve request entity");
-    indicate_http_error(connptr, 400, "Bad Request", "detail",
-                        "Could not retrieve the request entity "
-                        "the client.",
-                        NULL);
-    update_stats(STAT_BADCONN);
+    indicate_no_connection(wait->proxy, wait->connptr);
+    request_finish(wait, -1);
+    return;
   }
 
-  if (connptr->error_variables)
+  request_send(wait);
+}
+
+/*
+ * Take a connection to the server (or upstream proxy) from the pool, or
+ * open one, the loop waiting for the nameservers and for the connection.
+ */
+static void request_connect(struct request_wait_s *wait)
+{
+  struct conn_s *connptr = wait->connptr;
+  const char *host;
+  int port, ret;
+
+  if (reuse_server(wait->proxy, connptr, wait->request))
   {
-    send_http_error_message(connptr);
+    request_send(wait);
+    return;
   }
-  else if (connptr->show_stats)
+
+  host = server_host(connptr, wait->request, &port);
+  ret = opensock_start(wait->proxy, wait->loop, host, port, connptr->server_ip_addr,
+                       request_connected, wait);
+  if (ret != -EINPROGRESS)
+    request_connected(ret, wait);
+}
+
+/*
+ * Same as handle_connection(), but the head of the request has already been
+ * received (into the parser) by the event loop, and the rest is handed over
+ * to the loop: the connection to the server, the body of the request, the
+ * wait for the response, then the relay portion. We return as soon as the
+ * request is on its way. The connection was opened by open_connection()
+ * for a new client, otherwise it is the one "kept" handed back after the
+ * previous request.
+ *
+ * Still done in place, bounded by Timeout: the lookups without DNSCache (or
+ * of names not for the nameservers), the SOCKS handshakes, the reads of the
+ * head of the response once the server began to send it, and the writes of
+ * the heads (and of the error pages).
+ */
+void handle_connection_in_loop(pproxy_t proxy, struct conn_s *connptr, pevent_loop_t loop,
+                               prequest_parser_t parser, relay_kept_t kept, void *data)
+{
+  struct request_wait_s *wait;
+
+  wait = (struct request_wait_s *)safecalloc(1, sizeof(struct request_wait_s));
+  if (!wait)
   {
-    showstats(connptr);
+    destroy_conn(proxy, connptr);
+    return;
   }
 
-done:
-  free_request_struct(request);
-  hashmap_delete(hashofheaders);
-  destroy_conn(proxy, connptr);
-  return;
+  wait->proxy = proxy;
+  wait->loop = loop;
+  wait->connptr = connptr;
+  wait->kept = kept;
+  wait->data = data;
+
+  if (prepare_request(proxy, connptr, parser, wait) < 0)
+  {
+    safefree(wait);
+    destroy_conn(proxy, connptr);
+    return;
+  }
+
+  waiting_requests++;
+  request_connect(wait);
 }
 
 void handle_websocket_connection(pproxy_t proxy, int fd)
 {
   // todo: put libwebsocket here
   ssize_t i;
+  int allowed;
   struct conn_s *connptr;
   struct request_s *request = NULL;
-  phashmap_t hashofheaders = NULL;
+  pheaders_t hashofheaders = NULL;
 
   char sock_ipaddr[IP_LENGTH];
   char peer_ipaddr[IP_LENGTH];
@@ -2095,6 +2965,9 @@ void handle_websocket_connection(pproxy_t proxy, int fd)
                               : "Connect (file descriptor %d): %s [%s]",
               fd, peer_string, peer_ipaddr, sock_ipaddr);
 
+  allowed = check_acl(proxy->log, proxy->acl, peer_ipaddr, peer_string, sizeof(peer_string),
+                      lookup_peer_name, proxy);
+
   connptr = initialize_conn(fd, peer_ipaddr, peer_string, config.bindsame ? sock_ipaddr : NULL);
   if (!connptr)
   {
@@ -2102,7 +2975,7 @@ void handle_websocket_connection(pproxy_t proxy, int fd)
     return;
   }
 
-  if (check_acl(proxy->log, proxy->acl, peer_ipaddr, peer_string) <= 0)
+  if (allowed <= 0)
   {
     update_stats(STAT_DENIED);
     indicate_http_error(connptr, 403, "Access denied", "detail",
@@ -2149,7 +3022,7 @@ fail:
 
 done:
   free_request_struct(request);
-  hashmap_delete(hashofheaders);
+  headers_delete(hashofheaders);
   destroy_conn(proxy, connptr);
   return;
 }
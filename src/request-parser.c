@@ -0,0 +1,444 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* Resumable parser for the head of a client request. Everything received
+ * from the client goes into one contiguous buffer with a single recv() per
+ * call, and the parser remembers where it stopped, so a client sending its
+ * request byte by byte costs neither a stalled worker (in EventLoop mode)
+ * nor a pile of reads and copies.
+ *
+ * The line feeds and the colons of what is received are found in one pass
+ * (see scan_head()), and the parser notes where each header field starts
+ * and where its name ends as it goes. Once the blank line ending the head
+ * has been seen, the request line and the header fields are handed out as
+ * pointers into that buffer. The heads of the responses from the servers
+ * are parsed the same way, the status line standing for the request line.
+ */
+
+#include "main.h"
+
+#include "misc/heap.h"
+#include "misc/scan.h"
+#include "misc/text.h"
+#include "request-parser.h"
+#include "subservice/network.h"
+
+// the first allocation, the buffer is doubled from there on when full
+#define REQUEST_PARSER_INITIAL_SIZE (4 * 1024)
+#define REQUEST_PARSER_FIELDS       32 // same for the header fields
+#define REQUEST_PARSER_MARKS        64 // line feeds and colons taken from scan_head() at once
+
+// a header field, continuation lines included
+struct request_field_s
+{
+  size_t start; // offset of its first line
+  size_t colon; // offset of its first colon, 0 if it has none
+};
+
+struct request_parser_s
+{
+  char *data;
+  size_t len;      // bytes received so far
+  size_t capacity; // bytes allocated
+
+  size_t scan;       // the search for the next line ending resumes here
+  size_t line_start; // beginning of the line being parsed
+  size_t line_colon; // first colon of that line, 0 if none yet
+  size_t lines;      // header lines seen so far
+
+  struct request_field_s *fields;
+  size_t field_count, field_size;
+
+  size_t request_line; // offset of the request line
+  size_t blank;        // offset of the blank line ending the head
+  size_t end;          // offset right past that blank line
+
+  int error; // the first error is sticky
+
+  // booleans
+  unsigned int has_request_line;
+  unsigned int done;
+};
+
+prequest_parser_t request_parser_create(void)
+{
+  return (prequest_parser_t)safecalloc(1, sizeof(struct request_parser_s));
+}
+
+void request_parser_delete(prequest_parser_t parser)
+{
+  if (!parser)
+    return;
+
+  safefree(parser->data);
+  safefree(parser->fields);
+  safefree(parser);
+}
+
+void request_parser_reset(prequest_parser_t parser)
+{
+  char *data;
+  size_t capacity;
+  struct request_field_s *fields;
+  size_t field_size;
+
+  assert(parser != NULL);
+
+  data = parser->data;
+  capacity = parser->capacity;
+  fields = parser->fields;
+  field_size = parser->field_size;
+
+  memset(parser, 0, sizeof(struct request_parser_s));
+  parser->data = data;
+  parser->capacity = capacity;
+  parser->fields = fields;
+  parser->field_size = field_size;
+}
+
+/*
+ * Make room for at least "len" more bytes.
+ */
+static int request_parser_reserve(prequest_parser_t parser, size_t len)
+{
+  size_t capacity;
+  char *data;
+
+  if (parser->capacity - parser->len >= len)
+    return 0;
+
+  capacity = parser->capacity ? parser->capacity : REQUEST_PARSER_INITIAL_SIZE;
+  while (capacity - parser->len < len)
+    capacity *= 2;
+
+  data = (char *)saferealloc(parser->data, capacity);
+  if (!data)
+    return -ENOMEM;
+
+  parser->data = data;
+  parser->capacity = capacity;
+
+  return 0;
+}
+
+/*
+ * A line made of line endings only.
+ */
+static int is_blank_line(const char *line, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i != len; ++i)
+  {
+    if (line[i] != '\r' && line[i] != '\n')
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * A header line is complete: it starts a field, or continues the last one.
+ */
+static int request_parser_add_line(prequest_parser_t parser)
+{
+  struct request_field_s *fields;
+  size_t size;
+  char first = parser->data[parser->line_start];
+
+  if ((first == ' ' || first == '\t') && parser->field_count > 0)
+  {
+    if (parser->fields[parser->field_count - 1].colon == 0)
+      parser->fields[parser->field_count - 1].colon = parser->line_colon;
+    return 0;
+  }
+
+  if (parser->field_count == parser->field_size)
+  {
+    size = parser->field_size ? 2 * parser->field_size : REQUEST_PARSER_FIELDS;
+    fields = (struct request_field_s *)saferealloc(parser->fields,
+                                                   size * sizeof(struct request_field_s));
+    if (!fields)
+      return -ENOMEM;
+
+    parser->fields = fields;
+    parser->field_size = size;
+  }
+
+  parser->fields[parser->field_count].start = parser->line_start;
+  parser->fields[parser->field_count].colon = parser->line_colon;
+  ++parser->field_count;
+
+  return 0;
+}
+
+/*
+ * Consume the complete lines received so far.
+ */
+static int request_parser_feed(prequest_parser_t parser)
+{
+  uint32_t marks[REQUEST_PARSER_MARKS];
+  size_t count, i, pos, line_end, line_len;
+  char *nl;
+
+  while (!parser->done && parser->scan < parser->len)
+  {
+    count = scan_head(parser->data, parser->scan, parser->len, marks, REQUEST_PARSER_MARKS);
+    if (count == REQUEST_PARSER_MARKS)
+      parser->scan = (marks[count - 1] & ~SCAN_COLON) + 1;
+    else
+      parser->scan = parser->len;
+
+    for (i = 0; i != count && !parser->done; ++i)
+    {
+      pos = marks[i] & ~SCAN_COLON;
+      if (marks[i] & SCAN_COLON)
+      {
+        if (parser->line_colon == 0)
+          parser->line_colon = pos;
+        continue;
+      }
+
+      nl = parser->data + pos;
+      line_end = pos + 1;
+      line_len = line_end - parser->line_start;
+
+      if (!parser->has_request_line)
+      {
+        /* Blank lines in front of the request line are ignored */
+        if (!is_blank_line(parser->data + parser->line_start, line_len))
+        {
+          parser->request_line = parser->line_start;
+          parser->has_request_line = TRUE;
+
+          trim_ending_newlines(parser->data + parser->line_start, line_len);
+        }
+      }
+      else if ((line_len == 1 && nl[0] == '\n') || (line_len == 2 && nl[-1] == '\r'))
+      {
+        parser->blank = parser->line_start;
+        parser->end = line_end;
+        parser->done = TRUE;
+      }
+      else if (++parser->lines > REQUEST_HEAD_MAX_LINES)
+      {
+        return -ERANGE;
+      }
+      else if (request_parser_add_line(parser) < 0)
+      {
+        return -ENOMEM;
+      }
+
+      parser->line_start = line_end;
+      parser->line_colon = 0;
+    }
+  }
+
+  if (parser->done)
+    return REQUEST_PARSER_DONE;
+
+  /* Don't allow the head to grow without bound */
+  if (parser->len >= REQUEST_HEAD_MAX_LENGTH)
+    return -ERANGE;
+
+  return REQUEST_PARSER_MORE;
+}
+
+/*
+ * Nothing to read. A non-blocking socket says so until more arrives, the
+ * event loop waits for it, but a blocking one only says so once its read
+ * timeout (SO_RCVTIMEO) expired.
+ */
+static int request_parser_would_block(prequest_parser_t parser, int fd)
+{
+#ifndef MINGW
+  int flags = fcntl(fd, F_GETFL, 0);
+
+  if (flags >= 0 && !(flags & O_NONBLOCK))
+    return parser->error = -ETIMEDOUT;
+#else
+  (void)parser;
+  (void)fd;
+#endif
+
+  return REQUEST_PARSER_MORE;
+}
+
+int request_parser_read(prequest_parser_t parser, int fd)
+{
+  ssize_t ret;
+
+  assert(parser != NULL);
+  assert(fd >= 0);
+
+  if (parser->done)
+    return REQUEST_PARSER_DONE;
+  if (parser->error)
+    return parser->error;
+
+  if (parser->len == parser->capacity && request_parser_reserve(parser, 1) < 0)
+    return parser->error = -ENOMEM;
+
+  do
+  {
+    ret = recv(fd, parser->data + parser->len, parser->capacity - parser->len, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret == 0)
+    return parser->error = -ECONNRESET;
+
+  if (ret < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return request_parser_would_block(parser, fd);
+
+    return parser->error = -errno;
+  }
+
+  parser->len += (size_t)ret;
+
+  ret = request_parser_feed(parser);
+  if (ret < 0)
+    parser->error = (int)ret;
+
+  return (int)ret;
+}
+
+int request_parser_read_head(prequest_parser_t parser, int fd)
+{
+  char discard[REQUEST_PARSER_INITIAL_SIZE];
+  size_t len, taken;
+  ssize_t ret;
+  int status;
+
+  assert(parser != NULL);
+  assert(fd >= 0);
+
+  if (parser->done)
+    return REQUEST_PARSER_DONE;
+  if (parser->error)
+    return parser->error;
+
+  if (parser->len == parser->capacity && request_parser_reserve(parser, 1) < 0)
+    return parser->error = -ENOMEM;
+
+  do
+  {
+    ret = recv(fd, parser->data + parser->len, parser->capacity - parser->len, MSG_PEEK);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret == 0)
+    return parser->error = -ECONNRESET;
+
+  if (ret < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return request_parser_would_block(parser, fd);
+
+    return parser->error = -errno;
+  }
+
+  len = parser->len;
+  parser->len += (size_t)ret;
+
+  status = request_parser_feed(parser);
+  if (status < 0)
+    return parser->error = status;
+
+  /* What follows the head stays on the socket */
+  if (status == REQUEST_PARSER_DONE)
+    parser->len = parser->end;
+
+  /*
+   * Take the bytes of the head, which were just peeked at, off the socket.
+   * They are dropped: the parser may already have split them in place.
+   */
+  for (taken = len; taken < parser->len; taken += (size_t)ret)
+  {
+    do
+    {
+      ret = recv(fd, discard,
+                 parser->len - taken < sizeof(discard) ? parser->len - taken : sizeof(discard), 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0)
+      return parser->error = ret == 0 ? -ECONNRESET : -errno;
+  }
+
+  return status;
+}
+
+int request_parser_push(prequest_parser_t parser, const char *data, size_t len)
+{
+  int ret;
+
+  assert(parser != NULL);
+  assert(data != NULL || len == 0);
+
+  if (parser->error)
+    return parser->error;
+
+  /* Past a complete head it is all leftover, just keep it */
+  if (request_parser_reserve(parser, len) < 0)
+    return parser->error = -ENOMEM;
+
+  memcpy(parser->data + parser->len, data, len);
+  parser->len += len;
+
+  if (parser->done)
+    return REQUEST_PARSER_DONE;
+
+  ret = request_parser_feed(parser);
+  if (ret < 0)
+    parser->error = ret;
+
+  return ret;
+}
+
+const char *request_parser_request_line(prequest_parser_t parser)
+{
+  assert(parser != NULL && parser->done);
+
+  return parser->data + parser->request_line;
+}
+
+size_t request_parser_next_header(prequest_parser_t parser, size_t *iter, char **field,
+                                  char **colon)
+{
+  struct request_field_s *f;
+  size_t end;
+
+  assert(parser != NULL && parser->done);
+  assert(iter != NULL);
+  assert(field != NULL);
+  assert(colon != NULL);
+
+  if (*iter >= parser->field_count)
+    return 0;
+
+  f = &parser->fields[*iter];
+  end = ++*iter < parser->field_count ? parser->fields[*iter].start : parser->blank;
+
+  *field = parser->data + f->start;
+  *colon = f->colon ? parser->data + f->colon : NULL;
+
+  return end - f->start;
+}
+
+const char *request_parser_leftover(prequest_parser_t parser, size_t *len)
+{
+  assert(parser != NULL && parser->done);
+  assert(len != NULL);
+
+  *len = parser->len - parser->end;
+
+  return parser->data + parser->end;
+}
+
+size_t request_parser_received(prequest_parser_t parser)
+{
+  assert(parser != NULL);
+
+  return parser->len;
+}
@@ -0,0 +1,1292 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* Name resolution with a cache shared by all the children. With DNSCache,
+ * the names are looked up by sending the A and AAAA queries at once (over
+ * UDP, without blocking on either) to the nameservers of /etc/resolv.conf,
+ * and the answers, the missing names included, are kept for as long as
+ * their TTL allows in shared memory, where every child finds them.
+ *
+ * The numeric addresses, the names of /etc/hosts and the names without a
+ * dot are still left to getaddrinfo(), as is everything when the
+ * nameservers fail to answer. The children of the MINGW build are threads,
+ * the cache is not available there.
+ *
+ * The names of the clients are only looked up when an ACL rule needs them
+ * (PTR queries, cached the same way). A child running an event loop does
+ * not wait for those answers, the loop takes them in. Without DNSCache,
+ * getnameinfo() does it, and each child remembers the last few answers for
+ * a while.
+ */
+
+#include "main.h"
+
+#include "config/conf.h"
+#include "misc/heap.h"
+#include "misc/list.h"
+#include "misc/text.h"
+#include "resolver.h"
+#include "sock.h"
+#include "subservice/log.h"
+#include "subservice/network.h"
+
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+#define DNS_NAME_LENGTH  256  // longest name cached, with the terminating NUL
+#define DNS_MAX_ADDRS    8    // addresses kept per family
+#define DNS_CACHE_WAYS   4    // entries of a bucket
+#define DNS_MAX_SERVERS  3    // like the C library
+#define DNS_MAX_TTL      3600 // keep nothing longer, whatever the TTL says
+#define DNS_NEGATIVE_TTL 30   // for a missing name the nameserver did not give an SOA for
+#define DNS_MAX_NEGATIVE 300
+#define DNS_PACKET_SIZE  4096
+#define DNS_HEADER_SIZE  12
+#define ADDR_CACHE_SIZE  64  // names of addresses kept by each child without DNSCache
+#define ADDR_CACHE_TTL   300
+
+#define DNS_TYPE_A    1
+#define DNS_TYPE_SOA  6
+#define DNS_TYPE_PTR  12
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN  1
+#define DNS_NXDOMAIN  3
+
+// the addresses of a name, none at all if it does not resolve, or the name of an address (its
+// in-addr.arpa or ip6.arpa name), empty if it has none
+struct dns_cache_entry_s
+{
+  char name[DNS_NAME_LENGTH]; // lower case, empty if the entry is free
+  time_t expires;
+  time_t used;
+  unsigned int count4, count6;
+  struct in_addr addr4[DNS_MAX_ADDRS];
+  struct in6_addr addr6[DNS_MAX_ADDRS];
+  char host[DNS_NAME_LENGTH];
+};
+
+// the name of an address, as getnameinfo() gave it, empty if it has none
+struct addr_cache_entry_s
+{
+  char ip[IP_LENGTH];
+  char host[DNS_NAME_LENGTH];
+  time_t expires;
+};
+
+// the queries in flight: A and AAAA, or PTR
+struct dns_lookup_s
+{
+  unsigned int count;
+  int type[2];
+  unsigned char query[2][DNS_NAME_LENGTH + DNS_HEADER_SIZE + 6];
+  size_t query_len[2];
+  unsigned int answered[2]; // booleans
+  unsigned int failed;      // boolean, a nameserver could not answer
+  unsigned long ttl;
+  struct dns_cache_entry_s *entry;
+};
+
+// addresses handed out, in a struct addrinfo list
+struct resolver_node_s
+{
+  struct addrinfo ai; // first, it is what the caller frees
+  struct sockaddr_storage addr;
+};
+
+static struct addrinfo *resolver_node(const struct sockaddr *addr, socklen_t len, int port)
+{
+  struct resolver_node_s *node;
+
+  node = (struct resolver_node_s *)safecalloc(1, sizeof(struct resolver_node_s));
+  if (!node)
+    return NULL;
+
+  memcpy(&node->addr, addr, len);
+  if (addr->sa_family == AF_INET)
+    ((struct sockaddr_in *)&node->addr)->sin_port = htons(port);
+  else
+    ((struct sockaddr_in6 *)&node->addr)->sin6_port = htons(port);
+
+  node->ai.ai_family = addr->sa_family;
+  node->ai.ai_socktype = SOCK_STREAM;
+  node->ai.ai_protocol = IPPROTO_TCP;
+  node->ai.ai_addrlen = len;
+  node->ai.ai_addr = (struct sockaddr *)&node->addr;
+
+  return &node->ai;
+}
+
+void resolve_free(struct addrinfo *res)
+{
+  struct addrinfo *next;
+
+  for (; res; res = next)
+  {
+    next = res->ai_next;
+    safefree(res);
+  }
+}
+
+/*
+ * The usual getaddrinfo(), with the result copied into our own list.
+ */
+static int resolve_system(const char *host, int port, int family, struct addrinfo **res)
+{
+  struct addrinfo hints, *found, *ptr, **tail = res;
+  int ret;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+
+  *res = NULL;
+
+  ret = getaddrinfo(host, NULL, &hints, &found);
+  if (ret != 0)
+    return ret;
+
+  for (ptr = found; ptr; ptr = ptr->ai_next)
+  {
+    if (ptr->ai_family != AF_INET && ptr->ai_family != AF_INET6)
+      continue;
+
+    *tail = resolver_node(ptr->ai_addr, ptr->ai_addrlen, port);
+    if (!*tail)
+    {
+      freeaddrinfo(found);
+      resolve_free(*res);
+      *res = NULL;
+      return EAI_MEMORY;
+    }
+    tail = &(*tail)->ai_next;
+  }
+
+  freeaddrinfo(found);
+
+  return *res ? 0 : EAI_NONAME;
+}
+
+#ifndef MINGW
+
+static struct dns_cache_entry_s *cache = NULL;
+static size_t cache_buckets = 0;
+static int cache_lock_fd = -1;
+
+static struct sockaddr_storage servers[DNS_MAX_SERVERS];
+static socklen_t server_lens[DNS_MAX_SERVERS];
+static size_t server_count = 0;
+
+static plist_t hosts_names = NULL;
+
+static struct addr_cache_entry_s addr_cache[ADDR_CACHE_SIZE];
+
+/*
+ * The addresses of a cache entry, IPv4 first.
+ */
+static int entry_addrinfo(struct dns_cache_entry_s *entry, int port, int family,
+                          struct addrinfo **res)
+{
+  struct sockaddr_in sin;
+  struct sockaddr_in6 sin6;
+  struct addrinfo **tail = res;
+  unsigned int i;
+
+  *res = NULL;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  memset(&sin6, 0, sizeof(sin6));
+  sin6.sin6_family = AF_INET6;
+
+  for (i = 0; family != AF_INET6 && i < entry->count4; i++)
+  {
+    sin.sin_addr = entry->addr4[i];
+    *tail = resolver_node((struct sockaddr *)&sin, sizeof(sin), port);
+    if (!*tail)
+      goto nomem;
+    tail = &(*tail)->ai_next;
+  }
+
+  for (i = 0; family != AF_INET && i < entry->count6; i++)
+  {
+    sin6.sin6_addr = entry->addr6[i];
+    *tail = resolver_node((struct sockaddr *)&sin6, sizeof(sin6), port);
+    if (!*tail)
+      goto nomem;
+    tail = &(*tail)->ai_next;
+  }
+
+  return *res ? 0 : EAI_NONAME;
+
+nomem:
+  resolve_free(*res);
+  *res = NULL;
+  return EAI_MEMORY;
+}
+
+/* START OF THE SHARED CACHE */
+
+static void cache_lock(short type)
+{
+  struct flock lock;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+
+  while (fcntl(cache_lock_fd, F_SETLKW, &lock) < 0 && errno == EINTR)
+    continue;
+}
+
+static unsigned long name_hash(const char *name)
+{
+  unsigned long hash = 2166136261UL;
+
+  /* FNV-1a */
+  for (; *name; name++)
+    hash = ((hash ^ (unsigned char)*name) * 16777619UL) & 0xffffffffUL;
+
+  return hash;
+}
+
+static struct dns_cache_entry_s *cache_bucket(const char *name)
+{
+  return &cache[(name_hash(name) % cache_buckets) * DNS_CACHE_WAYS];
+}
+
+/*
+ * Fill in the entry from the cache if the name is there and still fresh.
+ * Lookups only take a read lock: the time of use is merely a hint for the
+ * replacement, so concurrent updates of it do not matter.
+ */
+static unsigned int cache_find(struct dns_cache_entry_s *entry)
+{
+  struct dns_cache_entry_s *bucket = cache_bucket(entry->name);
+  time_t now = time(NULL);
+  unsigned int found = FALSE;
+  size_t i;
+
+  cache_lock(F_RDLCK);
+  for (i = 0; i < DNS_CACHE_WAYS; i++)
+  {
+    if (bucket[i].expires > now && strcmp(bucket[i].name, entry->name) == 0)
+    {
+      bucket[i].used = now;
+      memcpy(entry, &bucket[i], sizeof(struct dns_cache_entry_s));
+      found = TRUE;
+      break;
+    }
+  }
+  cache_lock(F_UNLCK);
+
+  return found;
+}
+
+/*
+ * Store the entry over the same name, a free or expired entry, or else the
+ * least recently used one of the bucket.
+ */
+static void cache_store(struct dns_cache_entry_s *entry)
+{
+  struct dns_cache_entry_s *bucket = cache_bucket(entry->name);
+  time_t now = time(NULL);
+  size_t i, victim = 0;
+
+  cache_lock(F_WRLCK);
+  for (i = 0; i < DNS_CACHE_WAYS; i++)
+  {
+    if (strcmp(bucket[i].name, entry->name) == 0 || bucket[i].expires <= now)
+    {
+      victim = i;
+      break;
+    }
+
+    if (bucket[i].used < bucket[victim].used)
+      victim = i;
+  }
+
+  entry->used = now;
+  memcpy(&bucket[victim], entry, sizeof(struct dns_cache_entry_s));
+  cache_lock(F_UNLCK);
+}
+
+/* END OF THE SHARED CACHE */
+
+/*
+ * Without DNSCache, the names of the addresses are still remembered for a
+ * while by each child, in a table indexed by the hash of the address.
+ */
+static struct addr_cache_entry_s *addr_cache_slot(const char *ip)
+{
+  return &addr_cache[name_hash(ip) % ADDR_CACHE_SIZE];
+}
+
+/*
+ * The in-addr.arpa (or ip6.arpa) name to ask the nameservers for the name
+ * of an address. An IPv4-mapped address is asked as the IPv4 one.
+ */
+static void arpa_name(const struct sockaddr_storage *ss, char *name, size_t len)
+{
+  const unsigned char *b;
+  size_t out = 0;
+  int i;
+
+  if (ss->ss_family == AF_INET6)
+  {
+    b = ((const struct sockaddr_in6 *)ss)->sin6_addr.s6_addr;
+    if (!IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)ss)->sin6_addr))
+    {
+      for (i = 15; i >= 0; i--)
+        out += snprintf(&name[out], len - out, "%x.%x.", b[i] & 0x0f, b[i] >> 4);
+      snprintf(&name[out], len - out, "ip6.arpa");
+      return;
+    }
+    b += 12;
+  }
+  else
+  {
+    b = (const unsigned char *)&((const struct sockaddr_in *)ss)->sin_addr;
+  }
+
+  snprintf(name, len, "%u.%u.%u.%u.in-addr.arpa", b[3], b[2], b[1], b[0]);
+}
+
+/*
+ * Fill buf with random bytes, for the ids of the queries and the case of
+ * their names. An answer is only taken if it has both, so they must not be
+ * guessable by whoever would forge one: the bytes come from the kernel, and
+ * rand() is only a last resort.
+ */
+static void dns_random_bytes(unsigned char *buf, size_t len)
+{
+  static unsigned char pool[256];
+  static size_t left = 0;
+  static pid_t owner = 0;
+  size_t got = 0, i;
+  FILE *fp;
+
+  assert(len <= sizeof(pool));
+
+  /* The children all start from the pool of the parent */
+  if (owner != getpid())
+  {
+    owner = getpid();
+    left = 0;
+  }
+
+  if (left < len)
+  {
+#ifdef HAVE_GETRANDOM
+    ssize_t ret = getrandom(pool, sizeof(pool), 0);
+    got = ret > 0 ? (size_t)ret : 0;
+#endif
+    if (got < sizeof(pool) && (fp = fopen("/dev/urandom", "rb")) != NULL)
+    {
+      got += fread(pool + got, 1, sizeof(pool) - got, fp);
+      fclose(fp);
+    }
+    if (got < sizeof(pool))
+    {
+      srand((unsigned int)time(NULL) ^ ((unsigned int)owner << 16) ^ (unsigned int)clock());
+      for (i = got; i < sizeof(pool); i++)
+        pool[i] = (unsigned char)(rand() >> 4);
+    }
+    left = sizeof(pool);
+  }
+
+  /* Every byte is used once */
+  memcpy(buf, pool + sizeof(pool) - left, len);
+  left -= len;
+}
+
+/*
+ * Write a query for name (lower case, without the trailing dot).
+ * Returns its length, or 0 if the name can't be put in a query.
+ */
+static size_t dns_build_query(unsigned char *packet, const char *name, int type)
+{
+  unsigned char bits[2 + DNS_NAME_LENGTH / 8];
+  size_t pos = DNS_HEADER_SIZE, label, i, letter = 0;
+  const char *dot;
+
+  /* The id, then a bit for the case of each letter of the name */
+  if (strlen(name) >= DNS_NAME_LENGTH)
+    return 0;
+  dns_random_bytes(bits, 2 + (strlen(name) + 7) / 8);
+
+  memset(packet, 0, DNS_HEADER_SIZE);
+  packet[0] = bits[0];
+  packet[1] = bits[1];
+  packet[2] = 0x01; /* recursion desired */
+  packet[5] = 1;    /* one question */
+
+  while (*name)
+  {
+    dot = strchr(name, '.');
+    label = dot ? (size_t)(dot - name) : strlen(name);
+    if (label == 0 || label > 63)
+      return 0;
+
+    packet[pos++] = (unsigned char)label;
+    for (i = 0; i < label; i++, letter++)
+    {
+      /* Names are not case sensitive, but the nameserver echoes the case of the question back */
+      if (isalpha((unsigned char)name[i]) && (bits[2 + letter / 8] >> (letter % 8)) & 1)
+        packet[pos++] = (unsigned char)toupper((unsigned char)name[i]);
+      else
+        packet[pos++] = (unsigned char)name[i];
+    }
+    name += dot ? label + 1 : label;
+  }
+  packet[pos++] = 0;
+
+  packet[pos++] = 0;
+  packet[pos++] = (unsigned char)type;
+  packet[pos++] = 0;
+  packet[pos++] = DNS_CLASS_IN;
+
+  return pos;
+}
+
+/*
+ * Returns the position past the (possibly compressed) name at pos, or 0.
+ */
+static size_t dns_skip_name(const unsigned char *packet, size_t len, size_t pos)
+{
+  while (pos < len)
+  {
+    if ((packet[pos] & 0xc0) == 0xc0)
+      return pos + 2 <= len ? pos + 2 : 0;
+    if (packet[pos] == 0)
+      return pos + 1;
+
+    pos += packet[pos] + 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Copy the (possibly compressed) name at pos out of the packet.
+ * Returns FALSE if it is malformed or too long.
+ */
+static unsigned int dns_read_name(const unsigned char *packet, size_t len, size_t pos, char *name,
+                                  size_t size)
+{
+  size_t out = 0, label, jumps = 0;
+
+  while (pos < len)
+  {
+    label = packet[pos];
+
+    if ((label & 0xc0) == 0xc0)
+    {
+      /* A pointer back into the packet, which must not loop forever */
+      if (pos + 1 >= len || ++jumps > 16)
+        return FALSE;
+      pos = (label & 0x3f) << 8 | packet[pos + 1];
+      continue;
+    }
+
+    if (label == 0)
+    {
+      name[out > 0 ? out - 1 : 0] = '\0';
+      return out > 0;
+    }
+
+    if (pos + 1 + label > len || out + label + 1 > size)
+      return FALSE;
+
+    memcpy(&name[out], &packet[pos + 1], label);
+    out += label;
+    name[out++] = '.';
+    pos += label + 1;
+  }
+
+  return FALSE;
+}
+
+static unsigned long dns_uint32(const unsigned char *data)
+{
+  return ((unsigned long)data[0] << 24) | ((unsigned long)data[1] << 16) |
+         ((unsigned long)data[2] << 8) | (unsigned long)data[3];
+}
+
+/*
+ * Take the addresses (or the name) out of an answer to one of the queries.
+ * Answers to anything else are ignored.
+ */
+static void dns_parse_response(struct dns_lookup_s *lookup, const unsigned char *packet,
+                               size_t len)
+{
+  struct dns_cache_entry_s *entry = lookup->entry;
+  unsigned int q, records, i, type, rcode, found = FALSE;
+  unsigned long ttl, negative = DNS_NEGATIVE_TTL;
+  size_t pos, rdlen;
+
+  for (q = 0; q < lookup->count; q++)
+  {
+    /* Same id and same question, down to the case of the name, as an answer */
+    if (!lookup->answered[q] && len >= lookup->query_len[q] && (packet[2] & 0x80) &&
+        packet[0] == lookup->query[q][0] && packet[1] == lookup->query[q][1] &&
+        memcmp(packet + DNS_HEADER_SIZE, lookup->query[q] + DNS_HEADER_SIZE,
+               lookup->query_len[q] - DNS_HEADER_SIZE) == 0)
+    {
+      break;
+    }
+  }
+  if (q == lookup->count)
+    return;
+
+  lookup->answered[q] = TRUE;
+
+  rcode = packet[3] & 0x0f;
+  if (rcode != 0 && rcode != DNS_NXDOMAIN)
+  {
+    lookup->failed = TRUE;
+    return;
+  }
+
+  /* The answers, then the authority records */
+  records = ((unsigned int)packet[6] << 8 | packet[7]) + ((unsigned int)packet[8] << 8 | packet[9]);
+  pos = lookup->query_len[q];
+
+  for (i = 0; i < records; i++)
+  {
+    pos = dns_skip_name(packet, len, pos);
+    if (pos == 0 || pos + 10 > len)
+      break;
+
+    type = (unsigned int)packet[pos] << 8 | packet[pos + 1];
+    ttl = dns_uint32(&packet[pos + 4]);
+    rdlen = (size_t)packet[pos + 8] << 8 | packet[pos + 9];
+    pos += 10;
+    if (pos + rdlen > len)
+      break;
+
+    if (type == DNS_TYPE_SOA)
+    {
+      /* A missing name is remembered for the smaller of the TTL and the minimum */
+      if (rdlen >= 4)
+        negative = min(ttl, dns_uint32(&packet[pos + rdlen - 4]));
+    }
+    else if (type != (unsigned int)lookup->type[q])
+    {
+      /* A CNAME lasts no longer than what it points to */
+      if (i < ((unsigned int)packet[6] << 8 | packet[7]))
+        lookup->ttl = min(lookup->ttl, ttl);
+    }
+    else if (type == DNS_TYPE_A && rdlen == 4)
+    {
+      if (entry->count4 < DNS_MAX_ADDRS)
+        memcpy(&entry->addr4[entry->count4++], &packet[pos], 4);
+      lookup->ttl = min(lookup->ttl, ttl);
+      found = TRUE;
+    }
+    else if (type == DNS_TYPE_AAAA && rdlen == 16)
+    {
+      if (entry->count6 < DNS_MAX_ADDRS)
+        memcpy(&entry->addr6[entry->count6++], &packet[pos], 16);
+      lookup->ttl = min(lookup->ttl, ttl);
+      found = TRUE;
+    }
+    else if (type == DNS_TYPE_PTR && !found)
+    {
+      found = dns_read_name(packet, len, pos, entry->host, sizeof(entry->host));
+      lookup->ttl = min(lookup->ttl, ttl);
+    }
+
+    pos += rdlen;
+  }
+
+  if (!found)
+    lookup->ttl = min(lookup->ttl, min(negative, (unsigned long)DNS_MAX_NEGATIVE));
+}
+
+static unsigned int dns_all_answered(struct dns_lookup_s *lookup)
+{
+  unsigned int q;
+
+  for (q = 0; q < lookup->count; q++)
+  {
+    if (!lookup->answered[q])
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Send one nameserver the queries which are still unanswered, on a socket
+ * of their own. Returns the socket, or -1.
+ */
+static int dns_send(struct dns_lookup_s *lookup, size_t server)
+{
+  unsigned int q;
+  int sockfd;
+
+  sockfd = socket(servers[server].ss_family, SOCK_DGRAM, 0);
+  if (sockfd < 0)
+    return -1;
+
+  /* Only the nameserver may answer */
+  if (connect(sockfd, (struct sockaddr *)&servers[server], server_lens[server]) < 0 ||
+      socket_nonblocking(sockfd) != 0)
+  {
+    closesocket(sockfd);
+    return -1;
+  }
+
+  for (q = 0; q < lookup->count; q++)
+  {
+    /* The port of the nameserver may be found closed already: no answer is coming */
+    if (!lookup->answered[q] &&
+        send(sockfd, lookup->query[q], lookup->query_len[q], MSG_NOSIGNAL) < 0 && errno != EAGAIN &&
+        errno != EWOULDBLOCK)
+    {
+      closesocket(sockfd);
+      return -1;
+    }
+  }
+
+  return sockfd;
+}
+
+/*
+ * Take in the answers waiting on the socket. Returns -1 if the socket failed
+ * (e.g. the port of the nameserver is closed): no answer is coming from it.
+ */
+static int dns_receive(struct dns_lookup_s *lookup, int sockfd)
+{
+  unsigned char packet[DNS_PACKET_SIZE];
+  ssize_t len;
+
+  while ((len = recv(sockfd, packet, sizeof(packet), 0)) > 0)
+  {
+    if ((size_t)len >= DNS_HEADER_SIZE)
+      dns_parse_response(lookup, packet, (size_t)len);
+  }
+
+  if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Ask one nameserver the queries (whichever are still unanswered) and wait
+ * for the answers, at most for the given time.
+ */
+static void dns_ask(struct dns_lookup_s *lookup, size_t server, long msec)
+{
+  struct pollfd pfd;
+  time_t deadline;
+  int sockfd, ret;
+
+  sockfd = dns_send(lookup, server);
+  if (sockfd < 0)
+    return;
+
+  deadline = time(NULL) + (msec + 999) / 1000;
+
+  while (!dns_all_answered(lookup))
+  {
+    /* poll(), not select(): the socket can be past FD_SETSIZE in an EventLoop child */
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    ret = poll(&pfd, 1, (int)msec);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0 || dns_receive(lookup, sockfd) < 0)
+      break;
+
+    /* Not the answers yet, wait for what is left of the time */
+    msec = (long)difftime(deadline, time(NULL)) * 1000;
+    if (msec <= 0)
+      break;
+  }
+
+  closesocket(sockfd);
+}
+
+/*
+ * Get the queries of the given types for the name of the entry ready.
+ * Returns FALSE if they cannot be made.
+ */
+static unsigned int dns_lookup_init(struct dns_lookup_s *lookup, struct dns_cache_entry_s *entry,
+                                    int type1, int type2)
+{
+  unsigned int q;
+
+  memset(lookup, 0, sizeof(struct dns_lookup_s));
+  lookup->entry = entry;
+  lookup->ttl = DNS_MAX_TTL;
+  lookup->type[0] = type1;
+  lookup->type[1] = type2;
+  lookup->count = type2 ? 2 : 1;
+
+  for (q = 0; q < lookup->count; q++)
+  {
+    lookup->query_len[q] = dns_build_query(lookup->query[q], entry->name, lookup->type[q]);
+    if (lookup->query_len[q] == 0)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Two rounds over the nameservers, within RESOLVER_TIMEOUT: the number of
+ * attempts, and how long each one waits.
+ */
+static size_t dns_attempts(void)
+{
+  return server_count * 2;
+}
+
+static long dns_attempt_msec(void)
+{
+  return max(RESOLVER_TIMEOUT * 1000L / (long)dns_attempts(), 500L);
+}
+
+/*
+ * Returns TRUE if the queries were all answered, so the entry can be
+ * cached, and sets when it expires.
+ */
+static unsigned int dns_lookup_done(struct dns_lookup_s *lookup)
+{
+  if (lookup->failed || !dns_all_answered(lookup))
+    return FALSE;
+
+  lookup->entry->expires = time(NULL) + (time_t)lookup->ttl;
+
+  return lookup->ttl > 0;
+}
+
+/*
+ * Look the name of the entry up, with one or two queries of the given
+ * types. Returns TRUE if they were all answered, so the entry can be
+ * cached.
+ */
+static unsigned int dns_lookup(struct dns_cache_entry_s *entry, int type1, int type2)
+{
+  struct dns_lookup_s lookup;
+  size_t attempt, attempts = dns_attempts();
+  long msec = dns_attempt_msec();
+
+  if (!dns_lookup_init(&lookup, entry, type1, type2))
+    return FALSE;
+
+  for (attempt = 0; attempt < attempts && !lookup.failed; attempt++)
+  {
+    dns_ask(&lookup, attempt % server_count, msec);
+
+    if (dns_all_answered(&lookup))
+      break;
+  }
+
+  return dns_lookup_done(&lookup);
+}
+
+/*
+ * Is the name for the nameservers, rather than for getaddrinfo()?
+ */
+static unsigned int is_dns_name(const char *host)
+{
+  struct in6_addr addr6;
+  struct in_addr addr4;
+  ssize_t i;
+
+  if (strlen(host) >= DNS_NAME_LENGTH || !strchr(host, '.') ||
+      proxy_inet_pton(AF_INET, host, &addr4) == 1 || proxy_inet_pton(AF_INET6, host, &addr6) == 1)
+  {
+    return FALSE;
+  }
+
+  for (i = 0; i < list_length(hosts_names); i++)
+  {
+    if (strcasecmp((char *)list_getentry(hosts_names, i, NULL), host) == 0)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * The name of the entry for host: lower case, the trailing dot of a fully
+ * qualified name implied.
+ */
+static void host_entry(struct dns_cache_entry_s *entry, const char *host)
+{
+  size_t i;
+
+  memset(entry, 0, sizeof(struct dns_cache_entry_s));
+  for (i = 0; host[i]; i++)
+    entry->name[i] = (char)tolower((unsigned char)host[i]);
+
+  if (i > 0 && entry->name[i - 1] == '.')
+    entry->name[i - 1] = '\0';
+}
+
+static void read_resolv_conf(void)
+{
+  struct sockaddr_in *sin;
+  struct sockaddr_in6 *sin6;
+  char line[MAXLINE], address[IP_LENGTH];
+  FILE *fp;
+
+  fp = fopen("/etc/resolv.conf", "r");
+  if (fp)
+  {
+    while (server_count < DNS_MAX_SERVERS && fgets(line, sizeof(line), fp))
+    {
+      if (sscanf(line, " nameserver %47s", address) != 1)
+        continue;
+
+      memset(&servers[server_count], 0, sizeof(struct sockaddr_storage));
+      sin = (struct sockaddr_in *)&servers[server_count];
+      sin6 = (struct sockaddr_in6 *)&servers[server_count];
+
+      if (proxy_inet_pton(AF_INET, address, &sin->sin_addr) == 1)
+      {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(53);
+        server_lens[server_count++] = sizeof(struct sockaddr_in);
+      }
+      else if (proxy_inet_pton(AF_INET6, address, &sin6->sin6_addr) == 1)
+      {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(53);
+        server_lens[server_count++] = sizeof(struct sockaddr_in6);
+      }
+    }
+    fclose(fp);
+  }
+
+  /* Like the C library, fall back to the local nameserver */
+  if (server_count == 0)
+  {
+    memset(&servers[0], 0, sizeof(struct sockaddr_storage));
+    sin = (struct sockaddr_in *)&servers[0];
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(53);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_lens[server_count++] = sizeof(struct sockaddr_in);
+  }
+}
+
+static void read_hosts(void)
+{
+  char line[MAXLINE], *name, *save;
+  FILE *fp;
+
+  hosts_names = list_create();
+  if (!hosts_names)
+    return;
+
+  fp = fopen("/etc/hosts", "r");
+  if (!fp)
+    return;
+
+  while (fgets(line, sizeof(line), fp))
+  {
+    line[strcspn(line, "#")] = '\0';
+
+    /* The address, then its names */
+    if (!strtok_r(line, " \t\r\n", &save))
+      continue;
+
+    while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+      list_append(hosts_names, name, strlen(name) + 1);
+  }
+
+  fclose(fp);
+}
+
+#endif /* MINGW */
+
+void init_resolver(pproxy_t proxy)
+{
+#ifdef MINGW
+  (void)proxy;
+#else
+  char lock_file[] = "/tmp/tinyproxy.dns.lock.XXXXXX";
+  void *ptr;
+
+  if (config.dns_cache == 0)
+    return;
+
+  cache_buckets = (config.dns_cache + DNS_CACHE_WAYS - 1) / DNS_CACHE_WAYS;
+  ptr = calloc_shared_memory(cache_buckets * DNS_CACHE_WAYS, sizeof(struct dns_cache_entry_s));
+
+  cache_lock_fd = mkstemp(lock_file);
+  if (ptr == MAP_FAILED || cache_lock_fd < 0)
+  {
+    log_message(proxy->log, LOG_WARNING, "Could not create the DNS cache, using getaddrinfo().");
+    return;
+  }
+  unlink(lock_file);
+
+  read_resolv_conf();
+  read_hosts();
+
+  cache = (struct dns_cache_entry_s *)ptr;
+
+  log_message(proxy->log, LOG_INFO, "Caching up to %lu names for %lu nameserver(s).",
+              (unsigned long)(cache_buckets * DNS_CACHE_WAYS), (unsigned long)server_count);
+#endif
+}
+
+/*
+ * The socket address of the numeric address ip. Returns 0, or -1 if it is
+ * not one.
+ */
+static int numeric_addr(const char *ip, struct sockaddr_storage *ss, socklen_t *sslen)
+{
+  memset(ss, 0, sizeof(struct sockaddr_storage));
+  if (proxy_inet_pton(AF_INET, ip, &((struct sockaddr_in *)ss)->sin_addr) == 1)
+  {
+    ss->ss_family = AF_INET;
+    *sslen = sizeof(struct sockaddr_in);
+    return 0;
+  }
+
+  if (proxy_inet_pton(AF_INET6, ip, &((struct sockaddr_in6 *)ss)->sin6_addr) == 1)
+  {
+    ss->ss_family = AF_INET6;
+    *sslen = sizeof(struct sockaddr_in6);
+    return 0;
+  }
+
+  return -1;
+}
+
+int resolve_addr(pproxy_t proxy, const char *ip, char *name, size_t len)
+{
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+#ifndef MINGW
+  struct dns_cache_entry_s entry;
+  struct addr_cache_entry_s *slot;
+#endif
+
+  assert(ip != NULL);
+  assert(name != NULL);
+  assert(len > 0);
+
+  if (numeric_addr(ip, &ss, &sslen) < 0)
+    return -1;
+
+#ifdef MINGW
+  (void)proxy;
+
+  return getnameinfo((struct sockaddr *)&ss, sslen, name, len, NULL, 0, NI_NAMEREQD) == 0 ? 0 : -1;
+#else
+  if (cache)
+  {
+    memset(&entry, 0, sizeof(entry));
+    arpa_name(&ss, entry.name, sizeof(entry.name));
+
+    if (!cache_find(&entry))
+    {
+      if (dns_lookup(&entry, DNS_TYPE_PTR, 0))
+      {
+        cache_store(&entry);
+      }
+      else if (entry.host[0] == '\0')
+      {
+        log_message(proxy->log, LOG_INFO,
+                    "No answer from the nameservers for %s, trying getnameinfo()", ip);
+        return getnameinfo((struct sockaddr *)&ss, sslen, name, len, NULL, 0, NI_NAMEREQD) == 0
+                   ? 0
+                   : -1;
+      }
+    }
+
+    if (entry.host[0] == '\0')
+      return -1;
+
+    safe_string_copy(name, entry.host, len);
+    return 0;
+  }
+
+  slot = addr_cache_slot(ip);
+  if (slot->expires <= time(NULL) || strcmp(slot->ip, ip) != 0)
+  {
+    safe_string_copy(slot->ip, ip, sizeof(slot->ip));
+    if (getnameinfo((struct sockaddr *)&ss, sslen, slot->host, sizeof(slot->host), NULL, 0,
+                    NI_NAMEREQD) != 0)
+    {
+      slot->host[0] = '\0';
+    }
+    slot->expires = time(NULL) + ADDR_CACHE_TTL;
+  }
+
+  if (slot->host[0] == '\0')
+    return -1;
+
+  safe_string_copy(name, slot->host, len);
+  return 0;
+#endif
+}
+
+#ifndef MINGW
+
+/* START OF THE LOOKUPS DRIVEN BY AN EVENT LOOP */
+
+struct resolver_query_s
+{
+  struct dns_lookup_s lookup;
+  struct dns_cache_entry_s entry;
+  char ip[IP_LENGTH]; // of a reverse lookup
+  int port, family;   // of the addresses a lookup of a host hands out
+  size_t attempt;     // of the next nameserver to ask
+  int sockfd;         // to the nameserver being asked, or -1
+  time_t deadline;    // of its answers
+};
+
+/*
+ * Ask the next nameserver, on a socket of its own. Returns FALSE when none
+ * is left to ask.
+ */
+static unsigned int query_next_server(presolver_query_t query)
+{
+  if (query->sockfd >= 0)
+  {
+    closesocket(query->sockfd);
+    query->sockfd = -1;
+  }
+
+  while (query->attempt < dns_attempts() && !query->lookup.failed)
+  {
+    query->sockfd = dns_send(&query->lookup, query->attempt++ % server_count);
+    if (query->sockfd >= 0)
+    {
+      /* Whole seconds for the loop, rounded down to stay within RESOLVER_TIMEOUT */
+      query->deadline = time(NULL) + max(dns_attempt_msec() / 1000, 1L);
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+int resolve_addr_start(pproxy_t proxy, const char *ip, char *name, size_t len,
+                       presolver_query_t *query)
+{
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  presolver_query_t q;
+
+  assert(query != NULL);
+
+  *query = NULL;
+
+  if (!cache || numeric_addr(ip, &ss, &sslen) < 0)
+    return resolve_addr(proxy, ip, name, len);
+
+  q = (presolver_query_t)safecalloc(1, sizeof(struct resolver_query_s));
+  if (!q)
+    return resolve_addr(proxy, ip, name, len);
+
+  q->sockfd = -1;
+  safe_string_copy(q->ip, ip, sizeof(q->ip));
+  arpa_name(&ss, q->entry.name, sizeof(q->entry.name));
+
+  if (!cache_find(&q->entry))
+  {
+    if (dns_lookup_init(&q->lookup, &q->entry, DNS_TYPE_PTR, 0) && query_next_server(q))
+    {
+      *query = q;
+      return -EINPROGRESS;
+    }
+
+    /* No nameserver can be asked, it is up to getnameinfo() */
+    resolve_query_free(q);
+    return resolve_addr(proxy, ip, name, len);
+  }
+
+  if (q->entry.host[0] == '\0')
+  {
+    resolve_query_free(q);
+    return -1;
+  }
+
+  safe_string_copy(name, q->entry.host, len);
+  resolve_query_free(q);
+  return 0;
+}
+
+int resolve_query_fd(presolver_query_t query)
+{
+  return query->sockfd;
+}
+
+unsigned int resolve_query_timeout(presolver_query_t query)
+{
+  double left = difftime(query->deadline, time(NULL));
+
+  return left < 1 ? 1 : (unsigned int)left;
+}
+
+/*
+ * Take in the answers, or move on to the next nameserver. Returns
+ * -EINPROGRESS while the query waits, TRUE once its entry is known (and
+ * cached), or FALSE when no nameserver answered.
+ */
+static int query_receive(presolver_query_t query, unsigned int timed_out)
+{
+  /* A failed socket is no different from a silent nameserver */
+  if (!timed_out && dns_receive(&query->lookup, query->sockfd) < 0)
+    timed_out = TRUE;
+
+  if (!dns_all_answered(&query->lookup) && !query->lookup.failed)
+  {
+    /* Wait for what is left of the time, or ask the next nameserver */
+    if (!timed_out && time(NULL) < query->deadline)
+      return -EINPROGRESS;
+    if (query_next_server(query))
+      return -EINPROGRESS;
+  }
+
+  if (!dns_lookup_done(&query->lookup))
+    return FALSE;
+
+  cache_store(&query->entry);
+  return TRUE;
+}
+
+int resolve_query_event(pproxy_t proxy, presolver_query_t query, unsigned int timed_out,
+                        char *name, size_t len)
+{
+  int ret;
+
+  ret = query_receive(query, timed_out);
+  if (ret == -EINPROGRESS)
+    return ret;
+
+  if (!ret && query->entry.host[0] == '\0')
+  {
+    /* Unlike resolve_addr(), no getnameinfo() after the nameservers: it would block the loop */
+    log_message(proxy->log, LOG_INFO, "No answer from the nameservers for %s", query->ip);
+    return -1;
+  }
+
+  if (query->entry.host[0] == '\0')
+    return -1;
+
+  safe_string_copy(name, query->entry.host, len);
+  return 0;
+}
+
+int resolve_host_start(pproxy_t proxy, const char *host, int port, int family,
+                       struct addrinfo **res, presolver_query_t *query)
+{
+  presolver_query_t q;
+  int ret;
+
+  assert(host != NULL);
+  assert(query != NULL);
+
+  *query = NULL;
+
+  if (!cache || !is_dns_name(host))
+    return resolve_system(host, port, family, res);
+
+  q = (presolver_query_t)safecalloc(1, sizeof(struct resolver_query_s));
+  if (!q)
+    return resolve_host(proxy, host, port, family, res);
+
+  q->sockfd = -1;
+  q->port = port;
+  q->family = family;
+  host_entry(&q->entry, host);
+
+  if (!cache_find(&q->entry))
+  {
+    if (dns_lookup_init(&q->lookup, &q->entry, DNS_TYPE_A, DNS_TYPE_AAAA) && query_next_server(q))
+    {
+      *query = q;
+      return -EINPROGRESS;
+    }
+
+    /* No nameserver can be asked, it is up to getaddrinfo() */
+    resolve_query_free(q);
+    return resolve_host(proxy, host, port, family, res);
+  }
+
+  ret = entry_addrinfo(&q->entry, port, family, res);
+  resolve_query_free(q);
+  return ret;
+}
+
+int resolve_host_event(pproxy_t proxy, presolver_query_t query, unsigned int timed_out,
+                       struct addrinfo **res)
+{
+  int ret;
+
+  ret = query_receive(query, timed_out);
+  if (ret == -EINPROGRESS)
+    return ret;
+
+  if (!ret && query->entry.count4 == 0 && query->entry.count6 == 0)
+  {
+    /* Unlike resolve_host(), no getaddrinfo() after the nameservers: it would block the loop */
+    log_message(proxy->log, LOG_INFO, "No answer from the nameservers for %s", query->entry.name);
+    return EAI_AGAIN;
+  }
+
+  return entry_addrinfo(&query->entry, query->port, query->family, res);
+}
+
+void resolve_query_free(presolver_query_t query)
+{
+  if (!query)
+    return;
+
+  if (query->sockfd >= 0)
+    closesocket(query->sockfd);
+
+  safefree(query);
+}
+
+/* END OF THE LOOKUPS DRIVEN BY AN EVENT LOOP */
+
+#endif /* MINGW */
+
+int resolve_host(pproxy_t proxy, const char *host, int port, int family, struct addrinfo **res)
+{
+#ifdef MINGW
+  (void)proxy;
+
+  return resolve_system(host, port, family, res);
+#else
+  struct dns_cache_entry_s entry;
+
+  assert(host != NULL);
+
+  if (!cache || !is_dns_name(host))
+    return resolve_system(host, port, family, res);
+
+  host_entry(&entry, host);
+  if (cache_find(&entry))
+    return entry_addrinfo(&entry, port, family, res);
+
+  if (dns_lookup(&entry, DNS_TYPE_A, DNS_TYPE_AAAA))
+  {
+    cache_store(&entry);
+  }
+  else if (entry.count4 == 0 && entry.count6 == 0)
+  {
+    log_message(proxy->log, LOG_INFO, "No answer from the nameservers for %s, trying getaddrinfo()",
+                host);
+    return resolve_system(host, port, family, res);
+  }
+
+  return entry_addrinfo(&entry, port, family, res);
+#endif
+}
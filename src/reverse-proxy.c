@@ -115,7 +115,7 @@ void free_reversepath_list(struct reversepath *reverse)
 /*
  * Rewrite the URL for reverse proxying.
  */
-char *reverse_rewrite_url(pproxy_t proxy, struct conn_s *connptr, phashmap_t hashofheaders,
+char *reverse_rewrite_url(pproxy_t proxy, struct conn_s *connptr, pheaders_t hashofheaders,
                           char *url)
 {
   char *rewrite_url = NULL;
@@ -135,7 +135,7 @@ char *reverse_rewrite_url(pproxy_t proxy, struct conn_s *connptr, phashmap_t has
       strcat(rewrite_url, url + strlen(reverse->path));
     }
     else if (config.reversemagic &&
-             hashmap_entry_by_key(hashofheaders, "cookie", (void **)&cookie) > 0)
+             headers_entry_by_id(hashofheaders, HEADER_COOKIE, &cookie) > 0)
     {
 
       /* No match - try the magical tracking cookie next */
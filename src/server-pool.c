@@ -0,0 +1,182 @@
+//
+// Created by sr9000 on 17/10/2026.
+//
+
+/* Pool of the idle persistent connections to the web servers (and upstream
+ * proxies). Once a response with a known end has been relayed, the server
+ * connection is parked here instead of being closed, and the next request
+ * to the same host, port and upstream proxy, from the same local address,
+ * skips the connect (and the SOCKS handshake).
+ *
+ * The pool belongs to the process: each child has its own, nothing is
+ * shared and nothing needs to be locked. The children of the MINGW build
+ * are threads, so the pool is not available there.
+ */
+
+#include "main.h"
+
+#include "config/conf.h"
+#include "misc/heap.h"
+#include "server-pool.h"
+#include "sock.h"
+#include "subservice/network.h"
+
+struct server_pool_entry_s
+{
+  int fd;
+  char *host;
+  int port;
+  struct upstream *upstream;
+  char *bind_addr; // NULL unless BindSame chose it
+  time_t since;    // when it went idle
+};
+
+// the oldest entries come first
+static struct server_pool_entry_s *pool = NULL;
+static size_t pool_len = 0;
+static size_t pool_capacity = 0;
+
+unsigned int server_pool_enabled(void)
+{
+#ifdef MINGW
+  return FALSE;
+#else
+  return config.server_keepalive > 0;
+#endif
+}
+
+/*
+ * Remove an entry, handing its socket over to the caller.
+ */
+static int pool_take(size_t i)
+{
+  int fd = pool[i].fd;
+
+  safefree(pool[i].host);
+  if (pool[i].bind_addr)
+    safefree(pool[i].bind_addr);
+
+  pool_len--;
+  memmove(&pool[i], &pool[i + 1], (pool_len - i) * sizeof(struct server_pool_entry_s));
+
+  return fd;
+}
+
+static void pool_remove(size_t i)
+{
+  closesocket(pool_take(i));
+}
+
+/*
+ * An idle connection must have nothing to read: the server either closed it
+ * (end of file) or sent something it should not have.
+ */
+static unsigned int is_still_idle(int fd)
+{
+#ifdef MINGW
+  return FALSE;
+#else
+  char c;
+  ssize_t ret;
+
+  ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+}
+
+void server_pool_expire(void)
+{
+  time_t now = time(NULL);
+
+  /* The oldest are first, stop at the first one still fresh */
+  while (pool_len > 0 && difftime(now, pool[0].since) >= config.server_keepalive_timeout)
+    pool_remove(0);
+}
+
+/*
+ * Was the connection made from the local address? Either none was chosen,
+ * or the same one.
+ */
+static unsigned int is_same_bind(const char *a, const char *b)
+{
+  if (!a || !b)
+    return a == b;
+
+  return strcmp(a, b) == 0;
+}
+
+int server_pool_get(const char *host, int port, struct upstream *up, const char *bind_addr)
+{
+  size_t i;
+
+  assert(host != NULL);
+
+  server_pool_expire();
+
+  /* The most recently used connection is the least likely to be closed */
+  for (i = pool_len; i-- > 0;)
+  {
+    if (pool[i].port != port || pool[i].upstream != up || strcasecmp(pool[i].host, host) != 0 ||
+        !is_same_bind(pool[i].bind_addr, bind_addr))
+      continue;
+
+    if (is_still_idle(pool[i].fd))
+      return pool_take(i);
+
+    pool_remove(i);
+  }
+
+  return -1;
+}
+
+int server_pool_put(int fd, const char *host, int port, struct upstream *up, const char *bind_addr)
+{
+  struct server_pool_entry_s *entry;
+  char *host_copy, *bind_copy = NULL;
+
+  assert(fd >= 0);
+  assert(host != NULL);
+
+  if (!server_pool_enabled())
+    return -1;
+
+  server_pool_expire();
+
+  if (!pool)
+  {
+    pool = (struct server_pool_entry_s *)safecalloc(config.server_keepalive,
+                                                    sizeof(struct server_pool_entry_s));
+    if (!pool)
+      return -1;
+
+    pool_capacity = config.server_keepalive;
+  }
+
+  if (socket_blocking(fd) != 0)
+    return -1;
+
+  host_copy = safestrdup(host);
+  if (!host_copy)
+    return -1;
+
+  if (bind_addr && !(bind_copy = safestrdup(bind_addr)))
+  {
+    safefree(host_copy);
+    return -1;
+  }
+
+  /* Make room by dropping the oldest one */
+  if (pool_len == pool_capacity)
+    pool_remove(0);
+
+  entry = &pool[pool_len++];
+  entry->fd = fd;
+  entry->host = host_copy;
+  entry->port = port;
+  entry->upstream = up;
+  entry->bind_addr = bind_copy;
+  entry->since = time(NULL);
+
+  return 0;
+}
@@ -27,10 +27,12 @@
 
 #include "main.h"
 #include <child.h>
+#include <sys/time.h>
 
 #include "config/conf.h"
 #include "misc/heap.h"
 #include "misc/text.h"
+#include "resolver.h"
 #include "sock.h"
 #include "subservice/log.h"
 #include "subservice/network.h"
@@ -71,82 +73,522 @@ static int bind_socket(int sockfd, const char *addr, int family)
   return sockfd;
 }
 
+#ifdef HAVE_WSOCK32
+#define CONNECT_IN_PROGRESS() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#define CONNECT_IN_PROGRESS() (errno == EINPROGRESS)
+#endif
+
+/*
+ * Milliseconds elapsed since the given time.
+ */
+static long elapsed_msec(const struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return (now.tv_sec - since->tv_sec) * 1000L + (now.tv_usec - since->tv_usec) / 1000L;
+}
+
+/*
+ * Put the addresses in the order they are tried: the families take turns,
+ * starting with the one the resolver put first (RFC 8305, section 4).
+ */
+static size_t interleave_families(struct addrinfo *res, struct addrinfo **order, size_t size)
+{
+  struct addrinfo *first = res, *second = res;
+  int family = res->ai_family;
+  size_t n = 0;
+
+  while (n < size)
+  {
+    while (first && first->ai_family != family)
+      first = first->ai_next;
+    while (second && second->ai_family == family)
+      second = second->ai_next;
+
+    if (!first && !second)
+      break;
+
+    if (first)
+    {
+      order[n++] = first;
+      first = first->ai_next;
+    }
+    if (second && n < size)
+    {
+      order[n++] = second;
+      second = second->ai_next;
+    }
+  }
+
+  return n;
+}
+
+/*
+ * Start a non-blocking connect to the address.
+ * Returns the socket, or -1 if this address can't be used.
+ */
+static int start_connect(struct addrinfo *res, const char *bind_to, unsigned int *connected)
+{
+  int sockfd;
+
+  *connected = FALSE;
+
+  sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (sockfd < 0)
+    return -1;
+
+  /* Bind to the specified address */
+  if (bind_to && bind_socket(sockfd, bind_to, res->ai_family) < 0)
+  {
+    closesocket(sockfd);
+    return -1;
+  }
+
+  if (socket_nonblocking(sockfd) != 0)
+  {
+    closesocket(sockfd);
+    return -1;
+  }
+
+  if (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0)
+    *connected = TRUE;
+  else if (!CONNECT_IN_PROGRESS())
+  {
+    closesocket(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
+
+/*
+ * The attempts are over: get the socket which connected ready for the
+ * reads and writes in place. Returns it, or -1 with errno set (to err if
+ * none connected).
+ */
+static int opensock_made(pproxy_t proxy, const char *host, int sockfd, int err)
+{
+  if (sockfd < 0 || socket_blocking(sockfd) != 0 || socket_timeout(sockfd, config.idletimeout) != 0)
+  {
+    if (sockfd >= 0)
+    {
+      err = errno;
+      closesocket(sockfd);
+    }
+
+    log_message(proxy->log, LOG_ERR, "opensock: Could not establish a connection to %s: %s", host,
+                strerror(err));
+    errno = err;
+    return -1;
+  }
+
+  return sockfd;
+}
+
 /*
- * Open a connection to a remote host.  It's been re-written to use
- * the getaddrinfo() library function, which allows for a protocol
- * independent implementation (mostly for IPv4 and IPv6 addresses.)
+ * Open a connection to a remote host.  The addresses come from
+ * resolve_host() (getaddrinfo(), or the shared DNS cache), which allows
+ * for a protocol independent implementation (mostly for IPv4 and IPv6
+ * addresses.)
+ *
+ * The addresses are tried the Happy Eyeballs way: a new attempt starts
+ * every CONNECT_ATTEMPT_DELAY milliseconds (or as soon as the previous
+ * one failed), alternating between IPv6 and IPv4, while the earlier ones
+ * keep going. The first to connect wins, the others are dropped, and
+ * everything is given up after ConnectTimeout seconds.
+ *
+ * The socket returned is blocking, but its reads and writes give up after
+ * Timeout seconds: a server which stops answering does not hold the child
+ * (and everything else its event loop carries) forever.
  */
 int opensock(pproxy_t proxy, const char *host, int port, const char *bind_to)
 {
-  int sockfd, n;
-  struct addrinfo hints, *res, *ressave;
-  char portstr[6];
+  struct addrinfo *res, *order[OPENSOCK_MAX_ADDRS];
+  int pending[OPENSOCK_MAX_ADDRS];
+  struct pollfd pfd[OPENSOCK_MAX_ADDRS];
+  size_t count, next = 0, npending = 0, i;
+  struct timeval start, last_attempt;
+  long wait, left;
+  unsigned int connected;
+  int sockfd = -1, err, n;
+  socklen_t errlen;
 
   assert(host != NULL);
   assert(port > 0);
 
   log_message(proxy->log, LOG_INFO, "opensock: opening connection to %s:%d", host, port);
 
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-
-  snprintf(portstr, sizeof(portstr), "%d", port);
-
-  n = getaddrinfo(host, portstr, &hints, &res);
+  n = resolve_host(proxy, host, port, AF_UNSPEC, &res);
   if (n != 0)
   {
     log_message(proxy->log, LOG_ERR, "opensock: Could not retrieve info for %s", host);
     return -1;
   }
 
-  log_message(proxy->log, LOG_INFO, "opensock: getaddrinfo returned for %s:%d", host, port);
+  log_message(proxy->log, LOG_INFO, "opensock: resolve_host returned for %s:%d", host, port);
 
-  ressave = res;
-  do
+  if (!bind_to)
+    bind_to = config.bind_address;
+
+  count = interleave_families(res, order, OPENSOCK_MAX_ADDRS);
+  gettimeofday(&start, NULL);
+  last_attempt = start;
+  err = ECONNREFUSED;
+
+  while (sockfd < 0)
   {
-    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sockfd < 0)
+    /* Start the next attempt once the delay is over, or nothing is going on */
+    if (next < count && (npending == 0 || elapsed_msec(&last_attempt) >= CONNECT_ATTEMPT_DELAY))
     {
-      continue; /* ignore this one */
-    }
+      n = start_connect(order[next++], bind_to, &connected);
+      gettimeofday(&last_attempt, NULL);
 
-    /* Bind to the specified address */
-    if (bind_to)
-    {
-      if (bind_socket(sockfd, bind_to, res->ai_family) < 0)
+      if (n >= 0 && connected)
       {
-        closesocket(sockfd);
-        continue; /* can't bind, so try again */
+        sockfd = n;
+        break;
       }
+      if (n >= 0)
+        pending[npending++] = n;
+      else
+        err = errno;
+
+      continue;
+    }
+
+    if (npending == 0)
+      break;
+
+    left = config.connect_timeout * 1000L - elapsed_msec(&start);
+    if (left <= 0)
+    {
+      err = ETIMEDOUT;
+      break;
+    }
+
+    wait = left;
+    if (next < count)
+      wait = min(wait, max(CONNECT_ATTEMPT_DELAY - elapsed_msec(&last_attempt), 0L));
+
+    /* poll(), not select(): an EventLoop child has descriptors past FD_SETSIZE */
+    for (i = 0; i < npending; i++)
+    {
+      pfd[i].fd = pending[i];
+      pfd[i].events = POLLOUT;
+      pfd[i].revents = 0;
+    }
+
+    n = poll(pfd, npending, (int)wait);
+    if (n < 0 && errno != EINTR)
+    {
+      err = errno;
+      break;
     }
-    else if (config.bind_address)
+    if (n <= 0)
+      continue;
+
+    /*
+     * Writable (or in error): either connected, or failed. Backwards, so
+     * that removing an attempt leaves the ones still to check in place.
+     */
+    for (i = npending; i-- > 0 && sockfd < 0;)
     {
-      if (bind_socket(sockfd, config.bind_address, res->ai_family) < 0)
+      if (!(pfd[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+        continue;
+
+      errlen = sizeof(n);
+      if (getsockopt(pending[i], SOL_SOCKET, SO_ERROR, (char *)&n, &errlen) < 0)
+        n = errno;
+
+      if (n == 0)
+        sockfd = pending[i];
+      else
       {
-        closesocket(sockfd);
-        continue; /* can't bind, so try again */
+        err = n;
+        closesocket(pending[i]);
       }
+
+      pending[i] = pending[--npending];
+    }
+  }
+
+  /* Cancel the attempts which lost */
+  for (i = 0; i < npending; i++)
+  {
+    if (pending[i] != sockfd)
+      closesocket(pending[i]);
+  }
+
+  resolve_free(res);
+
+  return opensock_made(proxy, host, sockfd, err);
+}
+
+/* START OF THE CONNECTIONS OPENED BY AN EVENT LOOP */
+
+struct opensock_s
+{
+  pproxy_t proxy;
+  pevent_loop_t loop;
+  opensock_done_t done;
+  void *data;
+  char *host;
+  const char *bind_to;
+#ifndef MINGW
+  presolver_query_t query; // while the nameservers are asked
+#endif
+  struct addrinfo *res, *order[OPENSOCK_MAX_ADDRS];
+  int pending[OPENSOCK_MAX_ADDRS];
+  size_t count, next, npending;
+  struct timeval start;
+  int err; // of the last attempt which failed
+};
+
+static void opensock_connect_event(pevent_loop_t loop, int fd, unsigned int events, void *data);
+
+/*
+ * Start the next attempts, until one is pending in the loop or connected
+ * at once. Returns the socket which connected, -EINPROGRESS while attempts
+ * are pending, or -1 when they all failed.
+ */
+static int opensock_attempt(struct opensock_s *op)
+{
+  unsigned int connected;
+  int sockfd;
+
+  while (op->next < op->count)
+  {
+    sockfd = start_connect(op->order[op->next++], op->bind_to, &connected);
+    if (sockfd >= 0 && connected)
+      return sockfd;
+
+    if (sockfd < 0)
+    {
+      op->err = errno;
+      continue;
     }
 
-    if (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0)
+    if (event_loop_add(op->loop, sockfd, EVENT_WRITE, opensock_connect_event, op) < 0)
     {
-      break; /* success */
+      op->err = ENOMEM;
+      closesocket(sockfd);
+      continue;
     }
 
-    closesocket(sockfd);
-  } while ((res = res->ai_next) != NULL);
+    /* The loop has deadlines of whole seconds: the delay before the next address is one */
+    event_loop_set_timeout(op->loop, sockfd, 1);
+    op->pending[op->npending++] = sockfd;
+    return -EINPROGRESS;
+  }
 
-  freeaddrinfo(ressave);
-  if (res == NULL)
+  return op->npending > 0 ? -EINPROGRESS : -1;
+}
+
+/*
+ * The attempts are over, with the socket which connected or -1 (none was
+ * made, or the host was not found): hand it to the caller, and release the
+ * rest.
+ */
+static void opensock_finish(struct opensock_s *op, int sockfd)
+{
+  size_t i;
+
+  for (i = 0; i < op->npending; i++)
   {
-    log_message(proxy->log, LOG_ERR, "opensock: Could not establish a connection to %s", host);
+    event_loop_remove(op->loop, op->pending[i]);
+    if (op->pending[i] != sockfd)
+      closesocket(op->pending[i]);
+  }
+
+  if (op->res)
+    sockfd = opensock_made(op->proxy, op->host, sockfd, op->err);
+  else
+    errno = op->err;
+  op->done(sockfd, op->data);
+
+  resolve_free(op->res);
+  safefree(op->host);
+  safefree(op);
+}
+
+/*
+ * One of the attempts connected, or failed, or it is time for the next
+ * address to be tried as well.
+ */
+static void opensock_connect_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct opensock_s *op = (struct opensock_s *)data;
+  socklen_t errlen;
+  size_t i;
+  int ret, err;
+
+  if (events & EVENT_TIMEOUT)
+  {
+    if (elapsed_msec(&op->start) >= config.connect_timeout * 1000L)
+    {
+      op->err = ETIMEDOUT;
+      opensock_finish(op, -1);
+      return;
+    }
+
+    /* This one keeps going, next to the new one */
+    event_loop_set_timeout(loop, fd, 1);
+    ret = opensock_attempt(op);
+    if (ret >= 0)
+      opensock_finish(op, ret);
+    return;
+  }
+
+  errlen = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) < 0)
+    err = errno;
+
+  if (err == 0)
+  {
+    opensock_finish(op, fd);
+    return;
+  }
+
+  /* Failed, the next address is tried at once */
+  op->err = err;
+  event_loop_remove(loop, fd);
+  closesocket(fd);
+  for (i = 0; i < op->npending; i++)
+  {
+    if (op->pending[i] == fd)
+      op->pending[i] = op->pending[--op->npending];
+  }
+
+  ret = opensock_attempt(op);
+  if (ret != -EINPROGRESS)
+    opensock_finish(op, ret);
+}
+
+/*
+ * The addresses of the host are known: start trying them.
+ */
+static int opensock_resolved(struct opensock_s *op)
+{
+  log_message(op->proxy->log, LOG_INFO, "opensock: resolve_host returned for %s", op->host);
+
+  op->count = interleave_families(op->res, op->order, OPENSOCK_MAX_ADDRS);
+  op->err = ECONNREFUSED;
+  gettimeofday(&op->start, NULL);
+
+  return opensock_attempt(op);
+}
+
+#ifndef MINGW
+/*
+ * The nameservers answered the lookup of the host, or are too slow.
+ */
+static void opensock_lookup_event(pevent_loop_t loop, int fd, unsigned int events, void *data)
+{
+  struct opensock_s *op = (struct opensock_s *)data;
+  int ret;
+
+  event_loop_remove(loop, fd);
+
+  ret = resolve_host_event(op->proxy, op->query, (events & EVENT_TIMEOUT) != 0, &op->res);
+  if (ret == -EINPROGRESS)
+  {
+    /* The next nameserver is asked on a socket of its own */
+    fd = resolve_query_fd(op->query);
+    if (event_loop_add(loop, fd, EVENT_READ, opensock_lookup_event, op) == 0)
+    {
+      event_loop_set_timeout(loop, fd, resolve_query_timeout(op->query));
+      return;
+    }
+    ret = EAI_MEMORY;
+  }
+
+  resolve_query_free(op->query);
+  op->query = NULL;
+
+  if (ret != 0)
+  {
+    log_message(op->proxy->log, LOG_ERR, "opensock: Could not retrieve info for %s", op->host);
+    op->res = NULL;
+    op->err = EHOSTUNREACH;
+    opensock_finish(op, -1);
+    return;
+  }
+
+  ret = opensock_resolved(op);
+  if (ret != -EINPROGRESS)
+    opensock_finish(op, ret);
+}
+#endif /* MINGW */
+
+int opensock_start(pproxy_t proxy, pevent_loop_t loop, const char *host, int port,
+                   const char *bind_to, opensock_done_t done, void *data)
+{
+  struct opensock_s *op;
+  int ret;
+
+  assert(host != NULL);
+  assert(port > 0);
+
+  op = (struct opensock_s *)safecalloc(1, sizeof(struct opensock_s));
+  if (!op || !(op->host = safestrdup(host)))
+  {
+    safefree(op);
+    return opensock(proxy, host, port, bind_to);
+  }
+
+  op->proxy = proxy;
+  op->loop = loop;
+  op->done = done;
+  op->data = data;
+  op->bind_to = bind_to ? bind_to : config.bind_address;
+
+  log_message(proxy->log, LOG_INFO, "opensock: opening connection to %s:%d", host, port);
+
+#ifdef MINGW
+  ret = resolve_host(proxy, host, port, AF_UNSPEC, &op->res);
+#else
+  ret = resolve_host_start(proxy, host, port, AF_UNSPEC, &op->res, &op->query);
+  if (ret == -EINPROGRESS)
+  {
+    if (event_loop_add(loop, resolve_query_fd(op->query), EVENT_READ, opensock_lookup_event, op) ==
+        0)
+    {
+      event_loop_set_timeout(loop, resolve_query_fd(op->query), resolve_query_timeout(op->query));
+      return -EINPROGRESS;
+    }
+
+    resolve_query_free(op->query);
+    safefree(op->host);
+    safefree(op);
+    return opensock(proxy, host, port, bind_to);
+  }
+#endif
+
+  if (ret != 0)
+  {
+    log_message(proxy->log, LOG_ERR, "opensock: Could not retrieve info for %s", host);
+    safefree(op->host);
+    safefree(op);
     return -1;
   }
 
-  return sockfd;
+  ret = opensock_resolved(op);
+  if (ret == -EINPROGRESS)
+    return ret;
+
+  /* Over at once: not handed to done() */
+  ret = opensock_made(proxy, host, ret, op->err);
+  resolve_free(op->res);
+  safefree(op->host);
+  safefree(op);
+  return ret;
 }
 
+/* END OF THE CONNECTIONS OPENED BY AN EVENT LOOP */
+
 /*
  * Set the socket to non blocking -rjkaes
  */
@@ -183,6 +625,29 @@ int socket_blocking(int sock)
 #endif /* HAVE_WSOCK32 */
 }
 
+/*
+ * Give up the blocking reads and writes of the socket after the given
+ * time, or never with 0 seconds.
+ */
+int socket_timeout(int sock, unsigned int seconds)
+{
+#ifdef HAVE_WSOCK32
+  DWORD tv = seconds * 1000;
+#else  /* HAVE_WSOCK32 */
+  struct timeval tv;
+
+  tv.tv_sec = seconds;
+  tv.tv_usec = 0;
+#endif /* HAVE_WSOCK32 */
+
+  assert(sock >= 0);
+
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv)) != 0)
+    return -1;
+
+  return setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof(tv));
+}
+
 #ifdef HAVE_WSOCK32
 typedef const char *setsockopt_on_t;
 #else /* HAVE_WSOCK32 */
@@ -190,32 +655,20 @@ typedef const int *setsockopt_on_t;
 #endif /* HAVE_WSOCK32 */
 
 /**
- * Try to listen on one socket based on the addrinfo
- * as returned from getaddrinfo.
+ * Create a socket and bind it to the address. With "reuseport" set the
+ * socket may share the address with the other SO_REUSEPORT sockets of
+ * the same user (see listen_sock_reuseport()).
  *
  * Return the file descriptor upon success, -1 upon error.
  */
-static int listen_on_one_socket(pproxy_t proxy, struct addrinfo *ad)
+static int bind_one_socket(pproxy_t proxy, int family, int socktype, int protocol,
+                           const struct sockaddr *addr, socklen_t addrlen, unsigned int reuseport)
 {
   int listenfd;
   int ret;
   const int on = 1;
-  char numerichost[NI_MAXHOST];
-  int flags = NI_NUMERICHOST;
 
-  ret = getnameinfo(ad->ai_addr, ad->ai_addrlen, numerichost, NI_MAXHOST, NULL, 0, flags);
-  if (ret != 0)
-  {
-    log_message(proxy->log, LOG_ERR, "error calling getnameinfo: %s", gai_strerror(errno));
-    return -1;
-  }
-
-  log_message(proxy->log, LOG_INFO,
-              "trying to listen on host[%s], family[%d], "
-              "socktype[%d], proto[%d]",
-              numerichost, ad->ai_family, ad->ai_socktype, ad->ai_protocol);
-
-  listenfd = socket(ad->ai_family, ad->ai_socktype, ad->ai_protocol);
+  listenfd = socket(family, socktype, protocol);
   if (listenfd == -1)
   {
     log_message(proxy->log, LOG_ERR, "socket() failed: %s", strerror(errno));
@@ -230,7 +683,23 @@ static int listen_on_one_socket(pproxy_t proxy, struct addrinfo *ad)
     return -1;
   }
 
-  if (ad->ai_family == AF_INET6)
+#ifdef SO_REUSEPORT
+  if (reuseport)
+  {
+    ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (setsockopt_on_t)&on, sizeof(on));
+    if (ret != 0)
+    {
+      log_message(proxy->log, LOG_ERR, "setsockopt failed to set SO_REUSEPORT: %s",
+                  strerror(errno));
+      closesocket(listenfd);
+      return -1;
+    }
+  }
+#else
+  assert(!reuseport);
+#endif /* SO_REUSEPORT */
+
+  if (family == AF_INET6)
   {
     ret = setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, (setsockopt_on_t)&on, sizeof(on));
     if (ret != 0)
@@ -241,7 +710,7 @@ static int listen_on_one_socket(pproxy_t proxy, struct addrinfo *ad)
     }
   }
 
-  ret = bind(listenfd, ad->ai_addr, ad->ai_addrlen);
+  ret = bind(listenfd, addr, addrlen);
   if (ret != 0)
   {
     log_message(proxy->log, LOG_ERR, "bind failed: %s", strerror(errno));
@@ -249,6 +718,49 @@ static int listen_on_one_socket(pproxy_t proxy, struct addrinfo *ad)
     return -1;
   }
 
+  return listenfd;
+}
+
+/**
+ * Try to listen on one socket based on the addrinfo
+ * as returned from getaddrinfo.
+ *
+ * With "reuseport" set the socket is only bound: it reserves the address
+ * for the listeners the children open with listen_sock_reuseport().
+ *
+ * Return the file descriptor upon success, -1 upon error.
+ */
+static int listen_on_one_socket(pproxy_t proxy, struct addrinfo *ad, unsigned int reuseport)
+{
+  int listenfd;
+  int ret;
+  char numerichost[NI_MAXHOST];
+  int flags = NI_NUMERICHOST;
+
+  ret = getnameinfo(ad->ai_addr, ad->ai_addrlen, numerichost, NI_MAXHOST, NULL, 0, flags);
+  if (ret != 0)
+  {
+    log_message(proxy->log, LOG_ERR, "error calling getnameinfo: %s", gai_strerror(errno));
+    return -1;
+  }
+
+  log_message(proxy->log, LOG_INFO,
+              "trying to listen on host[%s], family[%d], "
+              "socktype[%d], proto[%d]",
+              numerichost, ad->ai_family, ad->ai_socktype, ad->ai_protocol);
+
+  listenfd = bind_one_socket(proxy, ad->ai_family, ad->ai_socktype, ad->ai_protocol, ad->ai_addr,
+                             ad->ai_addrlen, reuseport);
+  if (listenfd == -1)
+    return -1;
+
+  if (reuseport)
+  {
+    log_message(proxy->log, LOG_INFO, "bound fd [%d], the children listen on their own",
+                listenfd);
+    return listenfd;
+  }
+
   ret = listen(listenfd, MAXLISTEN);
   if (ret != 0)
   {
@@ -271,8 +783,12 @@ static int listen_on_one_socket(pproxy_t proxy, struct addrinfo *ad)
  *
  * Upon success, the listen-fds are added to the listen_fds list
  * and 0 is returned. Upon error,  -1 is returned.
+ *
+ * With "reuseport" set the fds are bound but not listening, see
+ * listen_sock_reuseport().
  */
-int listen_sock(pproxy_t proxy, const char *addr, uint16_t port, plist_t listen_fds)
+int listen_sock(pproxy_t proxy, const char *addr, uint16_t port, plist_t listen_fds,
+                unsigned int reuseport)
 {
   struct addrinfo hints, *result, *rp;
   char portstr[6];
@@ -301,7 +817,7 @@ int listen_sock(pproxy_t proxy, const char *addr, uint16_t port, plist_t listen_
   {
     int listenfd;
 
-    listenfd = listen_on_one_socket(proxy, rp);
+    listenfd = listen_on_one_socket(proxy, rp, reuseport);
     if (listenfd == -1)
     {
       continue;
@@ -332,6 +848,48 @@ int listen_sock(pproxy_t proxy, const char *addr, uint16_t port, plist_t listen_
   return ret;
 }
 
+/*
+ * Open a listening socket of our own on the address the (bound only) fd
+ * returned by listen_sock() reserves. The kernel spreads the incoming
+ * connections over all the sockets listening on the same address, so
+ * every child can accept on its own socket without waking the others.
+ *
+ * Return the file descriptor upon success, -1 upon error (always -1 on
+ * systems without SO_REUSEPORT).
+ */
+int listen_sock_reuseport(pproxy_t proxy, int fd)
+{
+#ifdef SO_REUSEPORT
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  int listenfd;
+
+  if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) != 0)
+  {
+    log_message(proxy->log, LOG_ERR, "getsockname() failed: %s", strerror(errno));
+    return -1;
+  }
+
+  listenfd = bind_one_socket(proxy, addr.ss_family, SOCK_STREAM, 0, (struct sockaddr *)&addr,
+                             addrlen, TRUE);
+  if (listenfd == -1)
+    return -1;
+
+  if (listen(listenfd, MAXLISTEN) != 0)
+  {
+    log_message(proxy->log, LOG_ERR, "listen failed: %s", strerror(errno));
+    closesocket(listenfd);
+    return -1;
+  }
+
+  return listenfd;
+#else  /* SO_REUSEPORT */
+  (void)fd;
+  log_message(proxy->log, LOG_ERR, "SO_REUSEPORT is not supported on this system");
+  return -1;
+#endif /* SO_REUSEPORT */
+}
+
 /*
  * Takes a socket descriptor and returns the socket's IP address.
  */
@@ -355,7 +913,8 @@ int getsock_ip(pproxy_t proxy, int fd, char *ipaddr)
 }
 
 /*
- * Return the peer's socket information.
+ * Return the peer's socket information. The name is the address as well:
+ * it is only looked up (resolve_addr()) when an ACL rule needs it.
  */
 int getpeer_information(int fd, char *ipaddr, char *string_addr)
 {
@@ -377,6 +936,6 @@ int getpeer_information(int fd, char *ipaddr, char *string_addr)
   if (get_ip_string((struct sockaddr *)&sa, ipaddr, IP_LENGTH) == NULL)
     return -1;
 
-  /* Get the full host name */
-  return getnameinfo((struct sockaddr *)&sa, salen, string_addr, HOSTNAME_LENGTH, NULL, 0, 0);
+  safe_string_copy(string_addr, ipaddr, HOSTNAME_LENGTH);
+  return 0;
 }
@@ -41,6 +41,8 @@ struct stat_s
   unsigned long int num_open;
   unsigned long int num_refused;
   unsigned long int num_denied;
+  unsigned long int num_filter_hits;
+  unsigned long int num_filter_misses;
 };
 
 static struct stat_s *stats;
@@ -64,6 +66,7 @@ int showstats(struct conn_s *connptr)
 {
   char *message_buffer;
   char opens[16], reqs[16], badconns[16], denied[16], refused[16];
+  char filterhits[16], filtermisses[16];
   FILE *statfile;
 
   snprintf(opens, sizeof(opens), "%lu", stats->num_open);
@@ -71,6 +74,8 @@ int showstats(struct conn_s *connptr)
   snprintf(badconns, sizeof(badconns), "%lu", stats->num_badcons);
   snprintf(denied, sizeof(denied), "%lu", stats->num_denied);
   snprintf(refused, sizeof(refused), "%lu", stats->num_refused);
+  snprintf(filterhits, sizeof(filterhits), "%lu", stats->num_filter_hits);
+  snprintf(filtermisses, sizeof(filtermisses), "%lu", stats->num_filter_misses);
 
   if (!config.statpage || (!(statfile = fopen(config.statpage, "r"))))
   {
@@ -91,14 +96,17 @@ int showstats(struct conn_s *connptr)
              "Number of requests: %lu<br />\n"
              "Number of bad connections: %lu<br />\n"
              "Number of denied connections: %lu<br />\n"
-             "Number of refused connections due to high load: %lu\n"
+             "Number of refused connections due to high load: %lu<br />\n"
+             "Filter cache hits: %lu<br />\n"
+             "Filter cache misses: %lu\n"
              "</p>\n"
              "<hr />\n"
              "<p><em>Generated by %s version %s.</em></p>\n"
              "</body>\n"
              "</html>\n",
              PACKAGE, VERSION, PACKAGE, VERSION, stats->num_open, stats->num_reqs,
-             stats->num_badcons, stats->num_denied, stats->num_refused, PACKAGE, VERSION);
+             stats->num_badcons, stats->num_denied, stats->num_refused, stats->num_filter_hits,
+             stats->num_filter_misses, PACKAGE, VERSION);
 
     if (send_http_message(connptr, 200, "OK", message_buffer) < 0)
     {
@@ -115,6 +123,8 @@ int showstats(struct conn_s *connptr)
   add_error_variable(connptr, "badconns", badconns);
   add_error_variable(connptr, "deniedconns", denied);
   add_error_variable(connptr, "refusedconns", refused);
+  add_error_variable(connptr, "filterhits", filterhits);
+  add_error_variable(connptr, "filtermisses", filtermisses);
   add_standard_vars(connptr);
   send_http_headers(connptr, 200, "Statistic requested");
   send_html_file(statfile, connptr);
@@ -147,6 +157,12 @@ int update_stats(status_t update_level)
   case STAT_DENIED:
     ++stats->num_denied;
     break;
+  case STAT_FILTER_HIT:
+    ++stats->num_filter_hits;
+    break;
+  case STAT_FILTER_MISS:
+    ++stats->num_filter_misses;
+    break;
   default:
     return -1;
   }
@@ -19,18 +19,44 @@
 /* This system handles Access Control for use of this daemon. A list of
  * domains, or IP addresses (including IP blocks) are stored in a list
  * which is then used to compare incoming connections.
+ *
+ * The numeric rules are also compiled, as they are inserted, into a binary
+ * trie over the bits of the address (IPv4 mapped into IPv6). Every node of
+ * a prefix remembers the first rule given for it, so the first rule which
+ * matches an address is the smallest one met on its path: a lookup takes
+ * at most 128 steps, whatever the number of rules. Only the string rules
+ * coming before that one still have to be tried, in order.
+ *
+ * The names of the string rules are looked up by the parent, at startup
+ * and every ACL_HOST_REFRESH seconds after that, into shared memory. Each
+ * child puts their addresses into a second trie the same way, rebuilt when
+ * the parent has looked them up again, so a connection never waits for
+ * the DNS to match a rule: only the suffix of the name of the client is
+ * compared at the time of the check.
+ *
+ * With ACLCache, the verdicts are also kept for ACL_CACHE_TTL seconds in a
+ * table shared by the children, by client address, so that a client which
+ * comes back is not looked up again. An entry belongs to the ACL it was
+ * decided with and to the addresses of the names it was decided with, it
+ * is ignored when either changes.
  */
 
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#ifndef MINGW
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "subservice/acl.h"
 
 #include "misc/heap.h"
-#include "misc/list.h"
 #include "self_contained/safecall.h"
 #include "subservice/log.h"
 #include "subservice/network.h"
@@ -38,6 +64,14 @@
 /* Define how long an IPv6 address is in bytes (128 bits, 16 bytes) */
 #define IPV6_LEN 16
 
+/* No rule for the prefix of a trie node */
+#define ACL_NO_RULE UINT32_MAX
+
+#define ACL_HOST_ADDRS   8  // addresses kept for the name of a rule
+#define ACL_HOST_REFRESH 60 // seconds between two lookups of the names of the rules
+#define ACL_CACHE_WAYS   4  // entries of a bucket of the verdicts
+#define ACL_CACHE_TTL    60
+
 enum acl_type
 {
   ACL_STRING,
@@ -64,32 +98,129 @@ struct acl_rule_s
   } address;
 };
 
+/*
+ * A node of the trie of the numeric rules. The children are indexes into
+ * the nodes (0, the root, is nobody's child), the rule an index into the
+ * rules.
+ */
+struct acl_node_s
+{
+  uint32_t child[2];
+  uint32_t rule;
+};
+
+struct acl_trie_s
+{
+  struct acl_node_s *nodes;
+  size_t node_count, node_size;
+};
+
+/*
+ * The addresses of the name of a string rule. The parent writes the buffer
+ * which is not in use, then switches the children over to it.
+ */
+struct acl_host_s
+{
+  size_t rule;
+  unsigned int count[2];
+  unsigned char addr[2][ACL_HOST_ADDRS][IPV6_LEN];
+};
+
+// in shared memory
+struct acl_hosts_s
+{
+  volatile unsigned int generation; // the buffer in use is generation % 2
+  size_t count;
+  struct acl_host_s host[];
+};
+
+// the verdict for a client address, in shared memory
+struct acl_verdict_s
+{
+  unsigned char addr[IPV6_LEN];
+  unsigned long acl;     // the generation of the ACL, 0 if the entry is free
+  unsigned int hosts;    // and of the addresses of its names
+  time_t expires;
+  time_t used;
+  int allowed;
+};
+
 struct acl_s
 {
-  plist_t rules;
+  struct acl_rule_s *rules; // all of them, in order
+  size_t count, size;
+
+  size_t *strings; // the indexes of the string rules
+  size_t string_count;
+
+  struct acl_trie_s numeric;
+
+  struct acl_hosts_s *hosts; // NULL if no rule has a name to look up
+  size_t hosts_size;
+  struct acl_trie_s host_trie; // the addresses of the names
+  unsigned int generation;     // of host_trie
+  time_t refresh;              // of the names, in the parent
+
+  unsigned long id; // the generation of the ACL, for the verdicts
+  struct acl_verdict_s *cache;
+  size_t cache_buckets;
+  int cache_lock_fd;
 };
 
 CREATE_IMPL(pacl_t, {
-  obj->rules = NULL;
-  TRACE_SAFE_FIN(NULL == (obj->rules = list_create()), NULL, delete_pacl_t(&obj));
+  memset(obj, 0, sizeof(*obj));
+  obj->cache_lock_fd = -1;
 })
 
-void flush_access_list(plist_t access_list);
-DELETE_IMPL(pacl_t, { flush_access_list(obj->rules); })
+void flush_access_list(pacl_t acl);
+DELETE_IMPL(pacl_t, { flush_access_list(obj); })
 
-int insert_acl(char *location, acl_access_t access_type, plist_t access_list);
+static int insert_acl(char *location, acl_access_t access_type, pacl_t acl);
+static int acl_cache_create(pacl_t acl, unsigned int entries);
 
 pacl_t create_configured_acl(pconf_acl_t acl_config)
 {
   TRACE_CALL_X(create_configured_acl, "acl_config = %p", (void *)acl_config);
   TRACE_SAFE_X(NULL == acl_config, NULL, "%s", "there is no acl config");
 
+  static unsigned long generation = 0;
+
   pacl_t obj;
   TRACE_SAFE_R(NULL == (obj = create_pacl_t()), NULL);
+  obj->id = ++generation;
 
   for (size_t i = 0; i < acl_config->count; ++i)
   {
-    insert_acl(acl_config->rules[i].location, acl_config->rules[i].access, obj->rules);
+    insert_acl(acl_config->rules[i].location, acl_config->rules[i].access, obj);
+  }
+
+  /* The rules whose name is looked up, see refresh_acl_hosts() */
+  size_t count = 0;
+  for (size_t i = 0; i < obj->string_count; ++i)
+  {
+    count += obj->rules[obj->strings[i]].address.string[0] != '.';
+  }
+
+  if (count > 0)
+  {
+    void *ptr;
+
+    obj->hosts_size = sizeof(struct acl_hosts_s) + count * sizeof(struct acl_host_s);
+    TRACE_SAFE_FIN(MAP_FAILED == (ptr = calloc_shared_memory(1, obj->hosts_size)), NULL,
+                   delete_pacl_t(&obj));
+    obj->hosts = (struct acl_hosts_s *)ptr;
+
+    for (size_t i = 0; i < obj->string_count; ++i)
+    {
+      if (obj->rules[obj->strings[i]].address.string[0] != '.')
+        obj->hosts->host[obj->hosts->count++].rule = obj->strings[i];
+    }
+  }
+
+  /* Only a string rule may take long to check */
+  if (acl_config->cache > 0 && obj->string_count > 0)
+  {
+    TRACE_SAFE_FIN(acl_cache_create(obj, acl_config->cache), NULL, delete_pacl_t(&obj));
   }
 
   TRACE_RETURN(obj);
@@ -153,6 +284,227 @@ static int fill_netmask_array(char *bitmask_string, int v6, unsigned char array[
   return 0;
 }
 
+/*
+ * Returns a new node of the trie, or 0 if there is no memory left.
+ */
+static uint32_t acl_new_node(struct acl_trie_s *trie)
+{
+  struct acl_node_s *nodes;
+  size_t size;
+
+  if (trie->node_count == trie->node_size)
+  {
+    size = trie->node_size ? trie->node_size * 2 : 256;
+    if (size > UINT32_MAX || !(nodes = saferealloc(trie->nodes, size * sizeof(*nodes))))
+      return 0;
+    trie->nodes = nodes;
+    trie->node_size = size;
+  }
+
+  trie->nodes[trie->node_count].child[0] = 0;
+  trie->nodes[trie->node_count].child[1] = 0;
+  trie->nodes[trie->node_count].rule = ACL_NO_RULE;
+
+  return (uint32_t)trie->node_count++;
+}
+
+static unsigned int acl_bit(const unsigned char *addr, size_t bit)
+{
+  return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/*
+ * Adds the prefix of the given number of bits of network to the trie, for
+ * the rule, unless an earlier rule has the same prefix.
+ *
+ * Returns:
+ *    -1 on failure
+ *     0 otherwise.
+ */
+static int acl_trie_insert(struct acl_trie_s *trie, const unsigned char *network, size_t bits,
+                           size_t index)
+{
+  uint32_t node, next;
+  size_t bit;
+
+  /* The root */
+  if (trie->node_count == 0 && (acl_new_node(trie), trie->node_count == 0))
+    return -1;
+
+  for (node = 0, bit = 0; bit < bits; bit++, node = next)
+  {
+    next = trie->nodes[node].child[acl_bit(network, bit)];
+    if (next == 0)
+    {
+      if ((next = acl_new_node(trie)) == 0)
+        return -1;
+      trie->nodes[node].child[acl_bit(network, bit)] = next;
+    }
+  }
+
+  if (trie->nodes[node].rule == ACL_NO_RULE || trie->nodes[node].rule > index)
+    trie->nodes[node].rule = (uint32_t)index;
+
+  return 0;
+}
+
+/*
+ * Returns the index of the first rule of the trie matching the address, or
+ * ACL_NO_RULE.
+ */
+static uint32_t acl_trie_lookup(const struct acl_trie_s *trie, const unsigned char *addr)
+{
+  uint32_t node = 0, first = ACL_NO_RULE;
+  size_t bit;
+
+  if (trie->node_count == 0)
+    return ACL_NO_RULE;
+
+  for (bit = 0;; bit++)
+  {
+    if (trie->nodes[node].rule < first)
+      first = trie->nodes[node].rule;
+
+    if (bit == IPV6_LEN * 8 || (node = trie->nodes[node].child[acl_bit(addr, bit)]) == 0)
+      break;
+  }
+
+  return first;
+}
+
+/*
+ * Puts the addresses the parent looked up last into the trie of the names,
+ * if they changed since the trie was built.
+ */
+static void acl_sync_hosts(pacl_t acl)
+{
+  unsigned int generation, buffer, i;
+  struct acl_host_s *host;
+  size_t h;
+
+  if (!acl->hosts || acl->generation == (generation = acl->hosts->generation))
+    return;
+
+  buffer = generation % 2;
+  acl->host_trie.node_count = 0;
+
+  for (h = 0; h != acl->hosts->count; ++h)
+  {
+    host = &acl->hosts->host[h];
+    for (i = 0; i != host->count[buffer]; ++i)
+      acl_trie_insert(&acl->host_trie, host->addr[buffer][i], IPV6_LEN * 8, host->rule);
+  }
+
+  acl->generation = generation;
+}
+
+/*
+ * Is every address of the buffer "from" of the host also in the buffer
+ * "to"? The names may resolve to the same addresses in another order.
+ */
+static bool acl_host_addrs_within(const struct acl_host_s *host, unsigned int from,
+                                  unsigned int to)
+{
+  unsigned int i, j;
+
+  for (i = 0; i != host->count[from]; ++i)
+  {
+    for (j = 0; j != host->count[to]; ++j)
+    {
+      if (memcmp(host->addr[from][i], host->addr[to][j], IPV6_LEN) == 0)
+        break;
+    }
+
+    if (j == host->count[to])
+      return false;
+  }
+
+  return true;
+}
+
+void refresh_acl_hosts(plog_t log, pacl_t acl)
+{
+  struct addrinfo hints, *res, *ai;
+  struct acl_host_s *host;
+  unsigned int current, next, count;
+  bool changed = false;
+  unsigned char *addr;
+  const char *name;
+  size_t h;
+
+  if (!acl || !acl->hosts || time(NULL) < acl->refresh)
+    return;
+
+#ifdef MINGW
+  /* The children are threads sharing the ACL: the names are only looked up before they start */
+  if (acl->refresh != 0)
+    return;
+#endif
+
+  current = acl->hosts->generation % 2;
+  next = (current + 1) % 2;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  for (h = 0; h != acl->hosts->count; ++h)
+  {
+    host = &acl->hosts->host[h];
+    name = acl->rules[host->rule].address.string;
+
+    if (getaddrinfo(name, NULL, &hints, &res) != 0)
+    {
+      /* Keep the addresses of the last time */
+      log_message(log, LOG_WARNING, "Could not look up \"%s\" of the access controls.", name);
+      host->count[next] = host->count[current];
+      memcpy(host->addr[next], host->addr[current], sizeof(host->addr[next]));
+      continue;
+    }
+
+    count = 0;
+    for (ai = res; ai && count != ACL_HOST_ADDRS; ai = ai->ai_next)
+    {
+      addr = host->addr[next][count];
+
+      /* As in the trie: IPv4 mapped into IPv6 */
+      if (ai->ai_family == AF_INET)
+      {
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xff;
+        memcpy(&addr[12], &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+        count++;
+      }
+      else if (ai->ai_family == AF_INET6)
+      {
+        memcpy(addr, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, IPV6_LEN);
+        count++;
+      }
+    }
+    host->count[next] = count;
+
+    freeaddrinfo(res);
+
+    if (count != host->count[current] || !acl_host_addrs_within(host, next, current) ||
+        !acl_host_addrs_within(host, current, next))
+    {
+      changed = true;
+    }
+  }
+
+  acl->refresh = time(NULL) + ACL_HOST_REFRESH;
+
+  /* The children rebuild their trie, and forget their verdicts, only when the addresses changed */
+  if (!changed)
+    return;
+
+  acl->hosts->generation++;
+
+#ifdef MINGW
+  acl_sync_hosts(acl);
+#endif
+}
+
 /*
  * Inserts a new access control into the list. The function will figure out
  * whether the location is an IP address (with optional netmask) or a
@@ -162,10 +514,10 @@ static int fill_netmask_array(char *bitmask_string, int v6, unsigned char array[
  *    -1 on failure
  *     0 otherwise.
  */
-int insert_acl(char *location, acl_access_t access_type, plist_t access_list)
+static int insert_acl(char *location, acl_access_t access_type, pacl_t access_list)
 {
-  struct acl_rule_s acl;
-  int ret;
+  struct acl_rule_s acl, *rules;
+  size_t *strings, size;
   char *p, ip_dst[IPV6_LEN];
 
   // start populating the access control structure
@@ -231,68 +583,216 @@ int insert_acl(char *location, acl_access_t access_type, plist_t access_list)
     }
   }
 
-  ret = list_append(access_list, &acl, sizeof(struct acl_rule_s));
-  return ret;
+  if (access_list->count == access_list->size)
+  {
+    size = access_list->size ? access_list->size * 2 : 16;
+    if (!(rules = saferealloc(access_list->rules, size * sizeof(*rules))))
+      goto fail;
+    access_list->rules = rules;
+    if (!(strings = saferealloc(access_list->strings, size * sizeof(*strings))))
+      goto fail;
+    access_list->strings = strings;
+    access_list->size = size;
+  }
+
+  if (acl.type == ACL_STRING)
+    access_list->strings[access_list->string_count++] = access_list->count;
+
+  access_list->rules[access_list->count++] = acl;
+
+  if (acl.type == ACL_NUMERIC)
+  {
+    size_t bits = 0;
+
+    /* The masks are contiguous, so the prefix is as long as the set bits */
+    while (bits < IPV6_LEN * 8 && acl_bit(acl.address.ip.mask, bits))
+      bits++;
+
+    if (acl_trie_insert(&access_list->numeric, acl.address.ip.network, bits,
+                        access_list->count - 1) < 0)
+      return -1;
+  }
+
+  return 0;
+
+fail:
+  if (acl.type == ACL_STRING)
+    safefree(acl.address.string);
+  return -1;
+}
+/* START OF THE VERDICTS */
+
+/*
+ * Returns:
+ *    -1 on failure
+ *     0 otherwise.
+ */
+static int acl_cache_create(pacl_t acl, unsigned int entries)
+{
+#ifdef MINGW
+  /* The children are threads, the lock below is for processes */
+  (void)acl;
+  (void)entries;
+  return 0;
+#else
+  char lock_file[] = "/tmp/tinyproxy.acl.lock.XXXXXX";
+  void *ptr;
+
+  acl->cache_buckets = (entries + ACL_CACHE_WAYS - 1) / ACL_CACHE_WAYS;
+  ptr = calloc_shared_memory(acl->cache_buckets * ACL_CACHE_WAYS, sizeof(struct acl_verdict_s));
+  if (ptr == MAP_FAILED)
+    return -1;
+  acl->cache = (struct acl_verdict_s *)ptr;
+
+  if ((acl->cache_lock_fd = mkstemp(lock_file)) < 0)
+    return -1;
+  unlink(lock_file);
+
+  return 0;
+#endif
+}
+
+#ifndef MINGW
+
+static void acl_cache_lock(pacl_t acl, short type)
+{
+  struct flock lock;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+
+  while (fcntl(acl->cache_lock_fd, F_SETLKW, &lock) < 0 && errno == EINTR)
+    continue;
+}
+
+static struct acl_verdict_s *acl_cache_bucket(pacl_t acl, const unsigned char *addr)
+{
+  unsigned long hash = 2166136261UL;
+  size_t i;
+
+  /* FNV-1a */
+  for (i = 0; i != IPV6_LEN; ++i)
+    hash = ((hash ^ addr[i]) * 16777619UL) & 0xffffffffUL;
+
+  return &acl->cache[(hash % acl->cache_buckets) * ACL_CACHE_WAYS];
+}
+
+static unsigned int acl_hosts_generation(pacl_t acl)
+{
+  return acl->hosts ? acl->hosts->generation : 0;
+}
+
+/*
+ * Returns the verdict kept for the address: 1 if allowed, 0 if denied,
+ * or -1 if there is none.
+ */
+static int acl_cache_find(pacl_t acl, const unsigned char *addr)
+{
+  struct acl_verdict_s *bucket = acl_cache_bucket(acl, addr);
+  unsigned int hosts = acl_hosts_generation(acl);
+  time_t now = time(NULL);
+  int allowed = -1;
+  size_t i;
+
+  acl_cache_lock(acl, F_RDLCK);
+  for (i = 0; i != ACL_CACHE_WAYS; ++i)
+  {
+    if (bucket[i].acl == acl->id && bucket[i].hosts == hosts && bucket[i].expires > now &&
+        memcmp(bucket[i].addr, addr, IPV6_LEN) == 0)
+    {
+      /* Only a hint for the replacement, racing updates do not matter */
+      bucket[i].used = now;
+      allowed = bucket[i].allowed;
+      break;
+    }
+  }
+  acl_cache_lock(acl, F_UNLCK);
+
+  return allowed;
+}
+
+/*
+ * Keeps the verdict over the one for the same address, a stale entry, or
+ * else the least recently used one of the bucket.
+ */
+static void acl_cache_store(pacl_t acl, const unsigned char *addr, int allowed)
+{
+  struct acl_verdict_s *bucket = acl_cache_bucket(acl, addr);
+  time_t now = time(NULL);
+  size_t i, victim = 0;
+
+  acl_cache_lock(acl, F_WRLCK);
+  for (i = 0; i != ACL_CACHE_WAYS; ++i)
+  {
+    if (memcmp(bucket[i].addr, addr, IPV6_LEN) == 0 || bucket[i].acl != acl->id ||
+        bucket[i].expires <= now)
+    {
+      victim = i;
+      break;
+    }
+
+    if (bucket[i].used < bucket[victim].used)
+      victim = i;
+  }
+
+  memcpy(bucket[victim].addr, addr, IPV6_LEN);
+  bucket[victim].acl = acl->id;
+  bucket[victim].hosts = acl_hosts_generation(acl);
+  bucket[victim].expires = now + ACL_CACHE_TTL;
+  bucket[victim].used = now;
+  bucket[victim].allowed = allowed;
+  acl_cache_lock(acl, F_UNLCK);
 }
+
+#endif /* MINGW */
+
+/* END OF THE VERDICTS */
+
+/*
+ * The client being checked. Its name is only looked up (once) when a
+ * string rule has to be compared with it; until then it is the address.
+ */
+struct acl_peer_s
+{
+  const char *ip;
+  char *host;
+  size_t hostlen;
+  acl_lookup_t lookup;
+  void *data;
+  bool looked_up;
+};
+
 /*
  * This function is called whenever a "string" access control is found in
- * the ACL.  From here we do both a text based string comparison, along with
- * a reverse name lookup comparison of the IP addresses.
+ * the ACL, for a text based string comparison with the name of the client.
+ * The reverse test, of its address with the addresses of the name of the
+ * control, was already done with the trie of the names.
  *
  * Return: 0 if host is denied
  *         1 if host is allowed
  *        -1 if no tests match, so skip
+ *        -EINPROGRESS if the name is still being looked up
  */
-static int acl_string_processing(struct acl_rule_s *acl, const char *ip_address,
-                                 const char *string_address)
+static int acl_string_processing(struct acl_rule_s *acl, struct acl_peer_s *peer)
 {
-  bool match;
-  struct addrinfo hints, *res, *ressave;
   size_t test_length, match_length;
-  char ipbuf[512];
+  const char *string_address;
 
   assert(acl && acl->type == ACL_STRING);
-  assert(ip_address && strlen(ip_address) > 0);
-  assert(string_address && strlen(string_address) > 0);
+  assert(peer->ip && strlen(peer->ip) > 0);
 
-  /*
-   * If the first character of the ACL string is a period, we need to
-   * do a string based test only; otherwise, we can do a reverse
-   * lookup test as well.
-   */
-  if (acl->address.string[0] != '.')
+  if (!peer->looked_up)
   {
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    if (getaddrinfo(acl->address.string, NULL, &hints, &res) != 0)
-      goto STRING_TEST;
-
-    ressave = res;
-
-    match = false;
-    do
-    {
-      get_ip_string(res->ai_addr, ipbuf, sizeof(ipbuf));
-      if (strcmp(ip_address, ipbuf) == 0)
-      {
-        match = true;
-        break;
-      }
-    } while ((res = res->ai_next) != NULL);
-
-    freeaddrinfo(ressave);
-
-    if (match)
-    {
-      if (acl->access == ACL_DENY)
-        return 0;
-      else
-        return 1;
-    }
+    peer->looked_up = true;
+    if (peer->lookup &&
+        peer->lookup(peer->ip, peer->host, peer->hostlen, peer->data) == -EINPROGRESS)
+      return -EINPROGRESS;
   }
 
-STRING_TEST:
+  string_address = peer->host;
+  assert(string_address && strlen(string_address) > 0);
+
   test_length = strlen(string_address);
   match_length = strlen(acl->address.string);
 
@@ -316,125 +816,148 @@ STRING_TEST:
 }
 
 /*
- * Compare the supplied numeric IP address with the supplied ACL structure.
+ * Checks whether a connection is allowed.
  *
- * Return:
- *   1  IP address is allowed
- *   0  IP address is denied
- *  -1  neither allowed nor denied.
+ * Returns:
+ *     1 if allowed
+ *     0 if denied
+ *     -EINPROGRESSif the lookup of the name is not done
  */
-static int check_numeric_acl(const struct acl_rule_s *acl, const char *ip)
-{
-  uint8_t addr[IPV6_LEN], x, y;
-  int i;
-
-  assert(acl && acl->type == ACL_NUMERIC);
-  assert(ip && strlen(ip) > 0);
+int internal_check_acl(plog_t log, struct acl_peer_s *peer, pacl_t access_list);
 
-  if (full_inet_pton(ip, &addr) <= 0)
-    return -1;
+int check_acl(plog_t log, pacl_t acl, const char *ip, char *host, size_t hostlen,
+              acl_lookup_t lookup, void *data)
+{
+  struct acl_peer_s peer;
 
-  for (i = 0; i != IPV6_LEN; ++i)
-  {
-    x = addr[i] & acl->address.ip.mask[i];
-    y = acl->address.ip.network[i];
+  assert(ip != NULL);
+  assert(host != NULL);
 
-    /* If x and y don't match, the IP addresses don't match */
-    if (x != y)
-      return -1;
-  }
+  peer.ip = ip;
+  peer.host = host;
+  peer.hostlen = hostlen;
+  peer.lookup = lookup;
+  peer.data = data;
+  peer.looked_up = false;
 
-  /* The addresses match, return the permission */
-  return (acl->access == ACL_ALLOW);
+  return internal_check_acl(log, &peer, acl);
 }
 
 /*
- * Checks whether a connection is allowed.
+ * The first rule which matches the client decides. addr is its address,
+ * or NULL.
  *
  * Returns:
  *     1 if allowed
  *     0 if denied
+ *     -EINPROGRESS if the name of the client is needed but not known yet
  */
-int internal_check_acl(plog_t log, const char *ip, const char *host, plist_t access_list);
-
-int check_acl(plog_t log, pacl_t acl, const char *ip, const char *host)
+static int acl_decide(struct acl_peer_s *peer, pacl_t access_list, const uint8_t *addr)
 {
-  return internal_check_acl(log, ip, host, acl->rules);
-}
-
-int internal_check_acl(plog_t log, const char *ip, const char *host, plist_t access_list)
-{
-  struct acl_rule_s *acl;
-  int perm = 0;
+  uint32_t first = ACL_NO_RULE, named;
+  int perm;
   size_t i;
 
-  assert(ip != NULL);
-  assert(host != NULL);
-
-  /*
-   * If there is no access list allow everything.
-   */
-  if (list_length(access_list) == 0)
+  if (addr)
   {
-    return 1;
+    first = acl_trie_lookup(&access_list->numeric, addr);
+    named = acl_trie_lookup(&access_list->host_trie, addr);
+    if (named < first)
+      first = named;
   }
 
-  for (i = 0; i != (size_t)list_length(access_list); ++i)
+  /* The string rules before the first rule which matches the address */
+  for (i = 0; i != access_list->string_count && access_list->strings[i] < first; ++i)
   {
-    acl = (struct acl_rule_s *)list_getentry(access_list, i, NULL);
-    switch (acl->type)
-    {
-    case ACL_STRING:
-      perm = acl_string_processing(acl, ip, host);
-      break;
-
-    case ACL_NUMERIC:
-      if (ip[0] == '\0')
-        continue;
-      perm = check_numeric_acl(acl, ip);
-      break;
-    }
+    perm = acl_string_processing(&access_list->rules[access_list->strings[i]], peer);
 
     /*
      * Check the return value too see if the IP address is
      * allowed or denied.
      */
-    if (perm == 0)
-      break;
-    else if (perm == 1)
+    if (perm == 0 || perm == 1 || perm == -EINPROGRESS)
       return perm;
   }
 
   /*
-   * Deny all connections by default.
+   * Then the rule which matched the address, if any. Deny all connections
+   * by default.
    */
-  log_message(log, LOG_NOTICE, "Unauthorized connection from \"%s\" [%s].", host, ip);
-  return 0;
+  return first != ACL_NO_RULE && access_list->rules[first].access == ACL_ALLOW;
 }
 
-void flush_access_list(plist_t access_list)
+int internal_check_acl(plog_t log, struct acl_peer_s *peer, pacl_t access_list)
 {
-  struct acl_rule_s *acl;
-  size_t i;
+  uint8_t addr[IPV6_LEN];
+  const char *ip = peer->ip;
+  int allowed = -1, have_addr;
+
+  /*
+   * If there is no access list allow everything.
+   */
+  if (access_list->count == 0)
+  {
+    return 1;
+  }
+
+  have_addr = ip[0] != '\0' && full_inet_pton(ip, &addr) > 0;
+
+#ifndef MINGW
+  acl_sync_hosts(access_list);
+
+  if (access_list->cache && have_addr)
+    allowed = acl_cache_find(access_list, addr);
+#endif
 
-  if (!access_list)
+  if (allowed < 0)
   {
-    return;
+    allowed = acl_decide(peer, access_list, have_addr ? addr : NULL);
+    if (allowed == -EINPROGRESS)
+      return allowed;
+
+#ifndef MINGW
+    if (access_list->cache && have_addr)
+      acl_cache_store(access_list, addr, allowed);
+#endif
   }
 
+  if (allowed)
+    return 1;
+
+  log_message(log, LOG_NOTICE, "Unauthorized connection from \"%s\" [%s].", peer->host, ip);
+  return 0;
+}
+
+void flush_access_list(pacl_t acl)
+{
+  size_t i;
+
   /*
    * We need to free allocated data hanging off the acl entries
    * before we can free the acl entries themselves.
    * A hierarchical memory system would be great...
    */
-  for (i = 0; i != (size_t)list_length(access_list); ++i)
+  for (i = 0; i != acl->count; ++i)
   {
-    acl = (struct acl_rule_s *)list_getentry(access_list, i, NULL);
-    if (acl->type == ACL_STRING)
+    if (acl->rules[i].type == ACL_STRING)
     {
-      safefree(acl->address.string);
+      safefree(acl->rules[i].address.string);
     }
   }
 
-  list_delete(access_list);
+  safefree(acl->rules);
+  safefree(acl->strings);
+  safefree(acl->numeric.nodes);
+  safefree(acl->host_trie.nodes);
+  if (acl->hosts)
+    free_shared_memory(acl->hosts, acl->hosts_size);
+  if (acl->cache)
+    free_shared_memory(acl->cache,
+                       acl->cache_buckets * ACL_CACHE_WAYS * sizeof(struct acl_verdict_s));
+#ifndef MINGW
+  if (acl->cache_lock_fd >= 0)
+    close(acl->cache_lock_fd);
+#endif
+  memset(acl, 0, sizeof(*acl));
+  acl->cache_lock_fd = -1;
 }
@@ -32,6 +32,7 @@
 struct anon_s
 {
   phashmap_t headers;
+  uint32_t known_headers; // bits of the well-known headers among them
   bool enabled;
 };
 
@@ -71,6 +72,12 @@ int add_header_anon(panon_t anon, const char *header)
   int r = hashmap_insert(anon->headers, header, &data, sizeof(data));
   TRACE_SAFE_X(r, -1, "cannot insert key \"%s\"", header);
 
+  const header_id_t id = header_id_of(header);
+  if (HEADER_OTHER != id)
+  {
+    anon->known_headers |= HEADER_BIT(id);
+  }
+
   TRACE_SUCCESS;
 }
 
@@ -133,3 +140,17 @@ ssize_t anonymous_search(plog_t log, panon_t anon, const char *s)
 
   return r;
 }
+
+/*
+ * Is the header let through? A well-known header is tested against the
+ * bits of those in the list, the others are searched for by name.
+ */
+bool is_anonymous_allowed(plog_t log, panon_t anon, header_id_t id, const char *name)
+{
+  if (NULL != anon && HEADER_OTHER != id)
+  {
+    return anon->known_headers & HEADER_BIT(id);
+  }
+
+  return anonymous_search(log, anon, name) > 0;
+}
@@ -20,55 +20,236 @@
 
 /* A substring of the domain to be filtered goes into the file
  * pointed at by DEFAULT_FILTER.
+ *
+ * A request is filtered if any of the rules matches, so the order of the
+ * rules does not matter. The rules which are plain strings (maybe with
+ * escaped special characters, and anchored with ^ and $) are all put into
+ * one Aho-Corasick automaton when the filter is activated: it finds
+ * whether any of them occurs in a single pass over the host or url. Only
+ * the genuine regular expressions are still tried one by one with
+ * regexec().
+ *
+ * The automaton is made of arrays of nodes and edges, which refer to each
+ * other by index: a trie of the strings, with the longest proper suffix of
+ * every node which is also in the trie (the failure link). The edges are
+ * kept in an open addressing hash table keyed by node and character.
+ *
+ * When only the hosts are filtered, the rules which name a domain and its
+ * subdomains, like \.example\.com$ or ^example\.com$, go into a trie of
+ * the labels instead, from the last one: a host is checked with one step
+ * per label. Both are built by the parent before the children are forked
+ * and never written after, so all the children share the same pages.
+ *
+ * The arrays can be compiled ahead of time by tinyproxy-filtc into a filter
+ * database: a header followed by the arrays, as they are in memory. When
+ * the filter file is such a database, it is mapped read only instead of
+ * parsed, and only the regexes are compiled at startup.
+ *
+ * Unless FilterCaseSensitive is on, the host or url is lower cased once,
+ * and everything is matched against that: the automaton and the domain
+ * trie hold lower case strings, and the regexes are compiled lower cased
+ * too, without REG_ICASE, whose matching is much slower. Only the regexes
+ * whose meaning would change (escaped letters like \W, upper case letters
+ * in brackets like [A-z] or [[:upper:]]) keep REG_ICASE.
+ *
+ * With FilterCache, every child also remembers the verdicts of the last
+ * hosts (or urls) it checked, least recently used first out. The cache
+ * belongs to the filter object: the verdicts go with it when the filter is
+ * activated again, or replaced by a reload.
  */
 
 #include <ctype.h>
 #include <regex.h> // mingw +libsystre
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifndef MINGW
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "misc/heap.h"
-#include "misc/list.h"
 #include "self_contained/safecall.h"
 #include "subservice/filter.h"
 #include "subservice/log.h"
 
 #define FILTER_MAX_REGEX_LEN (500)
 
+// the regexes of a filter are compiled by a thread per processor, at most, but each thread takes
+// FILTER_REGEXES_PER_THREAD of them at least, FILTER_REGEX_CHUNK at a time
+#define FILTER_MAX_THREADS        (64)
+#define FILTER_REGEXES_PER_THREAD (64)
+#define FILTER_REGEX_CHUNK        (16)
+
+// the longest host or url whose verdict is cached, with the '\0'
+#define FILTER_CACHE_KEY_MAX (1024)
+
+// where a literal rule has to be found, bits of filter_node_t.anchors
+#define FILTER_ANYWHERE 0x01
+#define FILTER_AT_START 0x02 // ^string
+#define FILTER_AT_END   0x04 // string$
+#define FILTER_WHOLE    0x08 // ^string$
+
+// a state of the automaton, 0 is the root
 typedef struct
 {
-  char *regex_str;
-  regex_t *compiled;
-} filter_rule_t;
+  uint32_t fail;   // the node of the longest proper suffix
+  uint32_t output; // the nearest node with anchors on the failure path, 0 if none
+  uint16_t depth;  // the length of the string of the node
+  uint8_t anchors; // the literal rules ending here
+} filter_node_t;
 
-void clean_filter_rule_t(filter_rule_t *rule)
+// an edge of the trie, free if "to" is 0 (the root is nobody's child)
+typedef struct
 {
-  safefree(rule->regex_str);
-  safefree(rule->compiled);
-}
+  uint32_t from;
+  uint32_t to;
+  unsigned char c;
+} filter_edge_t;
+
+// where a domain rule matches, bits of filter_domain_t.match
+#define FILTER_DOMAIN_EXACT 0x01 // ^example\.com$
+#define FILTER_DOMAIN_BELOW 0x02 // \.example\.com$
+
+// a label of the domain trie, 0 is the root (the empty name)
+typedef struct
+{
+  uint32_t parent;
+  uint32_t label; // the offset of the label in filter_s.labels
+  uint16_t len;
+  uint8_t match; // the domain rules ending here
+} filter_domain_t;
+
+#define FILTER_DB_MAGIC      "TPFILTDB"
+#define FILTER_DB_VERSION    1
+#define FILTER_DB_BYTE_ORDER 0x01020304U
+
+// bits of filter_db_header_t.options, those of the config the database was compiled for
+#define FILTER_DB_EXTENDED       0x01
+#define FILTER_DB_CASE_SENSITIVE 0x02
+#define FILTER_DB_FULL_URL       0x04
+
+// the start of a filter database, followed by the arrays, each padded to 8 bytes: the nodes,
+// the edges, the domains, the domain index, the labels, and the regexes ('\0' terminated)
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t options;
+  uint32_t reserved;
+  uint64_t node_count, edge_size, edge_count, literal_count;
+  uint64_t domain_count, domain_index_size, label_count, domain_rule_count;
+  uint64_t regex_count, source_count;
+} filter_db_header_t;
+
+// a cached verdict, in the chain of its bucket and in the list of recent use (0 ends both)
+typedef struct
+{
+  char *key; // the host or url, folded when the rules ignore the case
+  uint32_t hash;
+  uint32_t next;
+  uint32_t newer, older;
+  bool pass;
+} filter_verdict_t;
 
 struct filter_s
 {
   pconf_filt_t config;
-  plist_t rules;
+
+  regex_t *regexes; // the rules which are not plain strings
+  size_t regex_count;
+  char *sources; // the text of the regexes, '\0' terminated
+  size_t source_count, source_size;
+
+  filter_node_t *nodes;
+  size_t node_count, node_size;
+  filter_edge_t *edges; // a power of two of them
+  size_t edge_count, edge_size;
+  size_t literal_count;
+
+  filter_domain_t *domains;
+  size_t domain_count, domain_size;
+  uint32_t *domain_index; // a power of two of them, the hash table of the labels, 0 if free
+  size_t domain_index_size;
+  char *labels;
+  size_t label_count, label_size;
+  size_t domain_rule_count;
+
+  void *db; // the mapped database the arrays are in, if they were loaded
+  size_t db_size;
+
+  filter_verdict_t *verdicts; // the verdict cache of this process, 0 is not used
+  uint32_t *verdict_index;    // a power of two of them, the first verdict of each bucket
+  size_t verdict_count, verdict_index_size;
+  uint32_t newest, oldest;
 };
 
+static void flush_verdicts(pfilter_t filter)
+{
+  for (size_t i = 1; i <= filter->verdict_count; ++i)
+  {
+    safefree(filter->verdicts[i].key);
+  }
+  safefree(filter->verdicts);
+  safefree(filter->verdict_index);
+  filter->verdict_count = filter->verdict_index_size = 0;
+  filter->newest = filter->oldest = 0;
+}
+
+static void flush_filter(pfilter_t filter)
+{
+  flush_verdicts(filter);
+
+  for (size_t i = 0; i < filter->regex_count; ++i)
+  {
+    regfree(&filter->regexes[i]);
+  }
+  safefree(filter->regexes);
+  safefree(filter->sources);
+  if (NULL != filter->db)
+  {
+#ifdef MINGW
+    safefree(filter->db);
+#else
+    munmap(filter->db, filter->db_size);
+    filter->db = NULL;
+#endif
+    filter->db_size = 0;
+    filter->nodes = NULL;
+    filter->edges = NULL;
+    filter->domains = NULL;
+    filter->domain_index = NULL;
+    filter->labels = NULL;
+  }
+  safefree(filter->nodes);
+  safefree(filter->edges);
+  safefree(filter->domains);
+  safefree(filter->domain_index);
+  safefree(filter->labels);
+  filter->regex_count = 0;
+  filter->source_count = filter->source_size = 0;
+  filter->node_count = filter->node_size = 0;
+  filter->edge_count = filter->edge_size = 0;
+  filter->literal_count = 0;
+  filter->domain_count = filter->domain_size = filter->domain_index_size = 0;
+  filter->label_count = filter->label_size = 0;
+  filter->domain_rule_count = 0;
+}
+
 CREATE_IMPL(pfilter_t, {
-  obj->config = NULL;
-  obj->rules = NULL;
-  TRACE_SAFE_FIN(NULL == (obj->rules = list_create()), NULL, { delete_pfilter_t(&obj); });
+  memset(obj, 0, sizeof(*obj));
   TRACE_SAFE_FIN(NULL == (obj->config = create_pconf_filt_t()), NULL, { delete_pfilter_t(&obj); });
 })
 
 DELETE_IMPL(pfilter_t, {
-  ssize_t l = list_length(obj->rules);
-  TRACE_SAFE_X(l < 0, -1, "%s", "assert l >= 0");
-  for (size_t i = 0; i < ((size_t)(l)); ++i)
-  {
-    filter_rule_t *prule = list_getentry(obj->rules, i, NULL);
-    clean_filter_rule_t(prule);
-  }
-  TRACE_SAFE_X(list_delete(obj->rules), -1, "%s", "list_delete");
+  flush_filter(obj);
   TRACE_SAFE_X(delete_pconf_filt_t(&obj->config), -1, "%s", "delete_pconf_filt_t");
 })
 
@@ -91,172 +272,1559 @@ pfilter_t create_configured_filter(pconf_filt_t filt_config)
   TRACE_RETURN(obj);
 }
 
-int bad_filter_init(filter_rule_t **bad_pprule, FILE *bad_file)
+static size_t edge_slot(const pfilter_t filter, uint32_t from, unsigned char c)
 {
-  clean_filter_rule_t(*bad_pprule);
-  safefree(*bad_pprule);
-  fclose(bad_file);
-  return -1;
+  size_t i = (((size_t)from * 2654435761UL) ^ ((size_t)c * 40503UL)) & (filter->edge_size - 1);
+
+  /* Linear probing, the table is never more than half full */
+  while (filter->edges[i].to != 0 && (filter->edges[i].from != from || filter->edges[i].c != c))
+  {
+    i = (i + 1) & (filter->edge_size - 1);
+  }
+
+  return i;
 }
 
-// initializes a linked list of strings containing hosts/urls to be filtered
-int activate_filtering(plog_t log, pfilter_t filter)
+// the child of the node for the character, 0 if none
+static uint32_t edge_get(const pfilter_t filter, uint32_t from, unsigned char c)
 {
-  if (NULL == filter)
+  return filter->edges[edge_slot(filter, from, c)].to;
+}
+
+static int grow_edges(pfilter_t filter)
+{
+  filter_edge_t *old = filter->edges;
+  size_t old_size = filter->edge_size;
+
+  filter->edge_size = old_size ? old_size * 2 : 1024;
+  filter->edges = (filter_edge_t *)safecalloc(filter->edge_size, sizeof(filter_edge_t));
+  if (NULL == filter->edges)
   {
-    log_message(log, LOG_ERR, "%s", "there is no filter to activate");
+    filter->edges = old;
+    filter->edge_size = old_size;
     return -1;
   }
-  if (!filter->config->enabled)
+
+  for (size_t i = 0; i < old_size; ++i)
   {
-    log_message(log, LOG_INFO, "%s", "filtering is not enabled by config");
-    return 0;
+    if (old[i].to != 0)
+    {
+      filter->edges[edge_slot(filter, old[i].from, old[i].c)] = old[i];
+    }
   }
-  { // check if list was already initialized
-    ssize_t l = list_length(filter->rules);
-    if (l > 0)
+  safefree(old);
+
+  return 0;
+}
+
+static uint32_t new_node(pfilter_t filter, uint16_t depth)
+{
+  if (filter->node_count == filter->node_size)
+  {
+    size_t size = filter->node_size ? filter->node_size * 2 : 1024;
+    filter_node_t *nodes;
+
+    if (size > UINT32_MAX ||
+        NULL == (nodes = (filter_node_t *)saferealloc(filter->nodes, size * sizeof(filter_node_t))))
     {
-      log_message(log, LOG_WARNING,
-                  "filter is already activated "
-                  "{file: \"%s\", rules_count: %z}",
-                  filter->config->file_path, l);
       return 0;
     }
+    filter->nodes = nodes;
+    filter->node_size = size;
   }
 
-  FILE *file;
-  char line[FILTER_MAX_REGEX_LEN];
-  int regex_flags;
+  memset(&filter->nodes[filter->node_count], 0, sizeof(filter_node_t));
+  filter->nodes[filter->node_count].depth = depth;
 
-  file = fopen(filter->config->file_path, "r");
-  if (NULL == file)
+  return (uint32_t)filter->node_count++;
+}
+
+// adds the string to the trie, returns -1 if there is no memory left
+static int insert_literal(pfilter_t filter, const char *literal, uint8_t anchors)
+{
+  uint32_t node = 0, next;
+  size_t i, slot;
+
+  if (filter->node_count == 0 && (new_node(filter, 0), filter->node_count == 0))
   {
-    log_message(log, LOG_ERR, "cannot open file with filter rules \"%s\"",
-                filter->config->file_path);
     return -1;
   }
 
-  regex_flags = REG_NEWLINE | REG_NOSUB;
-  if (filter->config->is_extended)
+  for (i = 0; literal[i]; ++i)
   {
-    regex_flags |= REG_EXTENDED;
+    unsigned char c = (unsigned char)literal[i];
+
+    if (!filter->config->is_case_sensitive)
+    {
+      c = (unsigned char)tolower(c);
+    }
+
+    if (2 * (filter->edge_count + 1) > filter->edge_size && grow_edges(filter))
+    {
+      return -1;
+    }
+
+    slot = edge_slot(filter, node, c);
+    if (0 == (next = filter->edges[slot].to))
+    {
+      if (0 == (next = new_node(filter, (uint16_t)(i + 1))))
+      {
+        return -1;
+      }
+      filter->edges[slot].from = node;
+      filter->edges[slot].to = next;
+      filter->edges[slot].c = c;
+      ++filter->edge_count;
+    }
+    node = next;
   }
 
-  // ATTENTION: inverse condition
-  if (!filter->config->is_case_sensitive)
+  filter->nodes[node].anchors |= anchors;
+  ++filter->literal_count;
+
+  return 0;
+}
+
+/*
+ * Computes the failure links, going through the edges by the depth of the
+ * node they start from: the links of all the shorter strings are known by
+ * then.
+ */
+static int link_automaton(pfilter_t filter)
+{
+  size_t *start, *order, depth, i;
+  filter_node_t *nodes = filter->nodes;
+
+  if (filter->node_count == 0)
   {
-    regex_flags |= REG_ICASE;
+    return 0;
   }
 
-  while (fgets(line, FILTER_MAX_REGEX_LEN, file))
+  start = (size_t *)safecalloc(FILTER_MAX_REGEX_LEN + 2, sizeof(size_t));
+  order = (size_t *)safemalloc((filter->edge_count + 1) * sizeof(size_t));
+  if (NULL == start || NULL == order)
   {
-    { // forget any trailing white space and comments
-      char *s = line;
-      while (*s && (!(isspace((unsigned char)*s))) && *s != '#')
-      {
-        // break at first whitespace or '#'
-        // note: not url or host can have spaces (it is always encoded)
-        // note: not url or host can have '#' (it is always encoded)
-        ++s;
-      }
-      *s = '\0';
-    }
+    safefree(start);
+    safefree(order);
+    return -1;
+  }
 
-    // skip blank or comment line
-    if (*line == '\0')
+  /* Counting sort of the edges */
+  for (i = 0; i < filter->edge_size; ++i)
+  {
+    if (filter->edges[i].to != 0)
     {
-      continue;
+      ++start[nodes[filter->edges[i].from].depth + 1];
     }
-
-    filter_rule_t *prule = NULL;
-    prule = (filter_rule_t *)safemalloc(sizeof(filter_rule_t));
-    if (NULL == prule)
+  }
+  for (depth = 1; depth < FILTER_MAX_REGEX_LEN + 2; ++depth)
+  {
+    start[depth] += start[depth - 1];
+  }
+  for (i = 0; i < filter->edge_size; ++i)
+  {
+    if (filter->edges[i].to != 0)
     {
-      log_message(log, LOG_ERR, "cannot alloc memory for filter rule (%s)", line);
-      fclose(file);
-      return -1;
+      order[start[nodes[filter->edges[i].from].depth]++] = i;
     }
+  }
 
-    prule->regex_str = NULL;
-    prule->compiled = NULL;
+  for (i = 0; i < filter->edge_count; ++i)
+  {
+    const filter_edge_t *edge = &filter->edges[order[i]];
+    uint32_t fail = 0, f;
 
-    prule->regex_str = safestrdup(line);
-    if (NULL == prule->regex_str)
+    if (edge->from != 0)
     {
-      log_message(log, LOG_ERR, "cannot alloc memory for filter rule.regex_str (%s)", line);
-      return bad_filter_init(&prule, file);
+      for (f = nodes[edge->from].fail; f != 0 && 0 == edge_get(filter, f, edge->c);
+           f = nodes[f].fail)
+      {
+      }
+      fail = edge_get(filter, f, edge->c);
     }
 
-    prule->compiled = (regex_t *)safemalloc(sizeof(regex_t));
-    if (NULL == prule->compiled)
+    nodes[edge->to].fail = fail;
+    nodes[edge->to].output = nodes[fail].anchors ? fail : nodes[fail].output;
+  }
+
+  safefree(start);
+  safefree(order);
+  return 0;
+}
+
+/*
+ * Tells whether the rule is a plain string and if so, puts the string (the
+ * characters unescaped, without the anchors) into literal.
+ *
+ * Returns: the anchors of the string, or 0 if it is a regular expression
+ */
+static uint8_t parse_literal(const char *rule, bool extended, char *literal)
+{
+  const char *special = extended ? ".[]\\*^$+?(){}|" : ".[]\\*^$";
+  size_t len = strlen(rule), n = 0;
+  bool at_start = false, at_end = false;
+
+  if (len > 0 && rule[0] == '^')
+  {
+    at_start = true;
+    ++rule;
+    --len;
+  }
+  if (len > 0 && rule[len - 1] == '$' && (len < 2 || rule[len - 2] != '\\'))
+  {
+    at_end = true;
+    --len;
+  }
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (rule[i] == '\\')
+    {
+      /* Only an escaped special character stands for itself */
+      if (i + 1 == len || NULL == strchr(special, rule[i + 1]))
+      {
+        return 0;
+      }
+      literal[n++] = rule[++i];
+    }
+    else if (NULL != strchr(special, rule[i]) || NULL != strchr("]}", rule[i]))
     {
-      log_message(log, LOG_ERR, "cannot alloc memory for filter rule.compiled (%s)", line);
-      return bad_filter_init(&prule, file);
+      return 0;
     }
-
-    if (regcomp(prule->compiled, prule->regex_str, regex_flags))
+    else
     {
-      log_message(log, LOG_ERR, "bad regex in %s (%s)", filter->config->file_path, line);
-      return bad_filter_init(&prule, file);
+      literal[n++] = rule[i];
     }
+  }
+  literal[n] = '\0';
+
+  if (n == 0)
+  {
+    return 0;
+  }
+
+  if (at_start && at_end)
+  {
+    return FILTER_WHOLE;
+  }
+  return at_start ? FILTER_AT_START : at_end ? FILTER_AT_END : FILTER_ANYWHERE;
+}
+
+static uint32_t label_hash(const pfilter_t filter, uint32_t parent, const char *label, size_t len)
+{
+  uint32_t hash = 2166136261U ^ parent;
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    unsigned char c = (unsigned char)label[i];
+
+    hash = (hash ^ (filter->config->is_case_sensitive ? c : (unsigned char)tolower(c))) * 16777619U;
+  }
+
+  return hash;
+}
 
-    if (list_append(filter->rules, prule, sizeof(filter_rule_t)))
+static bool is_same_label(const pfilter_t filter, const filter_domain_t *domain, const char *label,
+                          size_t len)
+{
+  if (domain->len != len)
+  {
+    return false;
+  }
+  if (filter->config->is_case_sensitive)
+  {
+    return 0 == memcmp(filter->labels + domain->label, label, len);
+  }
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (tolower((unsigned char)filter->labels[domain->label + i]) != tolower((unsigned char)label[i]))
     {
-      log_message(log, LOG_ERR, "cannot add rule %s (%s)", filter->config->file_path, line);
-      return bad_filter_init(&prule, file);
+      return false;
     }
   }
+  return true;
+}
 
-  if (ferror(file))
+static size_t domain_slot(const pfilter_t filter, uint32_t parent, const char *label, size_t len)
+{
+  size_t i = label_hash(filter, parent, label, len) & (filter->domain_index_size - 1);
+  uint32_t node;
+
+  /* Linear probing, the table is never more than half full */
+  while (0 != (node = filter->domain_index[i]) &&
+         (filter->domains[node].parent != parent ||
+          !is_same_label(filter, &filter->domains[node], label, len)))
   {
-    log_message(log, LOG_ERR, "fgets error with file \"%s\"", filter->config->file_path);
+    i = (i + 1) & (filter->domain_index_size - 1);
+  }
+
+  return i;
+}
+
+static int grow_domain_index(pfilter_t filter)
+{
+  uint32_t *old = filter->domain_index;
+  size_t old_size = filter->domain_index_size;
+
+  filter->domain_index_size = old_size ? old_size * 2 : 1024;
+  filter->domain_index = (uint32_t *)safecalloc(filter->domain_index_size, sizeof(uint32_t));
+  if (NULL == filter->domain_index)
+  {
+    filter->domain_index = old;
+    filter->domain_index_size = old_size;
     return -1;
   }
 
-  log_message(log, LOG_INFO, "successfully activated %z filter rules from \"%s\"",
-              list_length(filter->rules), filter->config->file_path);
-  fclose(file);
+  for (size_t i = 0; i < old_size; ++i)
+  {
+    if (old[i] != 0)
+    {
+      const filter_domain_t *domain = &filter->domains[old[i]];
+
+      filter->domain_index[domain_slot(filter, domain->parent, filter->labels + domain->label,
+                                       domain->len)] = old[i];
+    }
+  }
+  safefree(old);
+
   return 0;
 }
 
-// return true to allow, false to block
-bool does_string_pass_filter(plog_t log, pfilter_t filter, const char *s)
+static uint32_t new_domain(pfilter_t filter, uint32_t parent, const char *label, size_t len)
 {
-  if (NULL == s)
+  if (filter->domain_count == filter->domain_size)
   {
-    log_message(log, LOG_ERR, "%s", "cannot applying rule to empty string");
-    return false;
+    size_t size = filter->domain_size ? filter->domain_size * 2 : 1024;
+    filter_domain_t *domains;
+
+    if (size > UINT32_MAX ||
+        NULL ==
+            (domains = (filter_domain_t *)saferealloc(filter->domains, size * sizeof(filter_domain_t))))
+    {
+      return 0;
+    }
+    filter->domains = domains;
+    filter->domain_size = size;
   }
 
-  ssize_t l = list_length(filter->rules);
-  if (l < 0)
+  if (NULL == filter->labels || filter->label_count + len > filter->label_size)
   {
-    log_message(log, LOG_ERR, "cannot get rule's list length (%z)", l);
-    return false;
+    size_t size = filter->label_size ? filter->label_size : 4096;
+    char *labels;
+
+    while (filter->label_count + len > size)
+    {
+      size *= 2;
+    }
+    if (size > UINT32_MAX || NULL == (labels = (char *)saferealloc(filter->labels, size)))
+    {
+      return 0;
+    }
+    filter->labels = labels;
+    filter->label_size = size;
+  }
+
+  memcpy(filter->labels + filter->label_count, label, len);
+  filter->domains[filter->domain_count].parent = parent;
+  filter->domains[filter->domain_count].label = (uint32_t)filter->label_count;
+  filter->domains[filter->domain_count].len = (uint16_t)len;
+  filter->domains[filter->domain_count].match = 0;
+  filter->label_count += len;
+
+  return (uint32_t)filter->domain_count++;
+}
+
+// adds the domain to the trie, label by label from the last one, returns -1 if there is no memory
+static int insert_domain(pfilter_t filter, const char *domain, uint8_t match)
+{
+  size_t end = strlen(domain), start, slot;
+  uint32_t node = 0, next;
+
+  if (filter->domain_count == 0 && (new_domain(filter, 0, "", 0), filter->domain_count == 0))
+  {
+    return -1;
   }
 
-  for (size_t i = 0; i < ((size_t)(l)); ++i)
+  while (true)
   {
-    filter_rule_t *prule = list_getentry(filter->rules, i, NULL);
+    for (start = end; start > 0 && domain[start - 1] != '.'; --start)
+    {
+    }
+
+    if (2 * filter->domain_count > filter->domain_index_size && grow_domain_index(filter))
+    {
+      return -1;
+    }
+
+    slot = domain_slot(filter, node, domain + start, end - start);
+    if (0 == (next = filter->domain_index[slot]))
+    {
+      if (0 == (next = new_domain(filter, node, domain + start, end - start)))
+      {
+        return -1;
+      }
+      filter->domain_index[slot] = next;
+    }
+    node = next;
 
-    if (!regexec(prule->compiled, s, 0, NULL, 0))
+    if (start == 0)
     {
-      return filter->config->policy == FILTER_WHITE_LIST;
+      break;
     }
+    end = start - 1;
   }
 
-  return filter->config->policy != FILTER_WHITE_LIST;
+  filter->domains[node].match |= match;
+  ++filter->domain_rule_count;
+
+  return 0;
 }
 
-// return true to allow, false to block
-bool does_pass_filter(plog_t log, pfilter_t filter, const char *host, const char *url)
+/*
+ * Tells whether the rule names a domain: \.example\.com$ (the subdomains),
+ * ^example\.com$ (the domain itself), or in extended mode (^|\.)example\.com$
+ * and ^(.*\.)?example\.com$ (both). If so, puts the domain into literal.
+ *
+ * Returns: the FILTER_DOMAIN_* bits of the rule, or 0 if it is something else
+ */
+static uint8_t parse_domain(const char *rule, bool extended, char *literal)
 {
-  if (filter->config->does_full_url_filtering)
+  static const char *prefixes[] = {"(^|\\.)", "^(.*\\.)?"};
+  uint8_t anchors;
+
+  if (extended)
   {
-    return does_string_pass_filter(log, filter, url);
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i)
+    {
+      size_t len = strlen(prefixes[i]);
+
+      if (0 == strncmp(rule, prefixes[i], len))
+      {
+        anchors = parse_literal(rule + len, extended, literal);
+        return anchors == FILTER_AT_END ? FILTER_DOMAIN_EXACT | FILTER_DOMAIN_BELOW : 0;
+      }
+    }
   }
-  else
+
+  anchors = parse_literal(rule, extended, literal);
+  if (anchors == FILTER_WHOLE)
   {
-    return does_string_pass_filter(log, filter, host);
+    return FILTER_DOMAIN_EXACT;
   }
+  if (anchors == FILTER_AT_END && literal[0] == '.' && literal[1] != '\0')
+  {
+    memmove(literal, literal + 1, strlen(literal));
+    return FILTER_DOMAIN_BELOW;
+  }
+
+  return 0;
+}
+
+/* Lower case the ASCII letters of src into dst (which may be src), eight
+ * bytes at a time: adding to each byte its distance from 0x80 to 'A' and to
+ * past 'Z' tells in its top bit whether it is an upper case letter, which is
+ * then moved down to the 0x20 bit of that letter.
+ */
+static void fold_ascii(char *dst, const char *src, size_t len)
+{
+  const uint64_t ones = 0x0101010101010101ULL, tops = 0x8080808080808080ULL;
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+  {
+    uint64_t word, low, from_a, past_z;
+
+    memcpy(&word, src + i, sizeof(word));
+    low = word & ~tops;
+    from_a = low + ones * (0x80 - 'A');
+    past_z = low + ones * (0x80 - 'Z' - 1);
+    word ^= ((from_a ^ past_z) & ~word & tops) >> 2;
+    memcpy(dst + i, &word, sizeof(word));
+  }
+
+  for (; i < len; ++i)
+  {
+    dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ? (char)(src[i] - 'A' + 'a') : src[i];
+  }
+}
+
+/* Is a range of a bracket expression the same lower cased? Only if its ends
+ * are letters of the same case, or if there is no letter in between: glibc
+ * leaves [\]^_` out of [0-z] with REG_ICASE.
+ */
+static bool is_foldable_range(unsigned char lo, unsigned char hi)
+{
+  return (islower(lo) && islower(hi)) || (isupper(lo) && isupper(hi)) || hi < 'A' || lo > 'z' ||
+         (lo > 'Z' && hi < 'a');
+}
+
+/* Checks the bracket expression *p starts, and moves *p to its ']'. */
+static bool is_foldable_bracket(const char **p)
+{
+  const char *c = *p + 1;
+  bool first = true;
+
+  if (*c == '^')
+  {
+    ++c;
+  }
+
+  /* A leading ] belongs to the expression */
+  while (*c != '\0' && (first || *c != ']'))
+  {
+    first = false;
+
+    if (c[0] == '[' && (c[1] == ':' || c[1] == '=' || c[1] == '.'))
+    {
+      const char *end = strstr(c + 2, ":]");
+
+      /* The collating elements and equivalence classes are left to REG_ICASE */
+      if (c[1] != ':' || NULL == end || 0 == strncmp(c + 2, "upper:]", 7) ||
+          0 == strncmp(c + 2, "lower:]", 7))
+      {
+        return false;
+      }
+      c = end + 2;
+    }
+    else if (c[1] == '-' && c[2] != ']' && c[2] != '\0')
+    {
+      if (c[2] == '[' || !is_foldable_range((unsigned char)c[0], (unsigned char)c[2]))
+      {
+        return false;
+      }
+      c += 3;
+    }
+    else
+    {
+      ++c;
+    }
+  }
+
+  *p = c;
+  return *c == ']';
+}
+
+/* Does the regex match the same lower cased strings once its own letters
+ * are lower cased, without REG_ICASE? Not with escaped letters (the GNU \w,
+ * \B...), nor with some bracket expressions, like [0-Z] or [[:upper:]].
+ */
+static bool is_foldable_regex(const char *re)
+{
+  for (const char *p = re; *p != '\0'; ++p)
+  {
+    if (*p == '\\')
+    {
+      if (isalpha((unsigned char)p[1]))
+      {
+        return false;
+      }
+      if (p[1] != '\0')
+      {
+        ++p;
+      }
+    }
+    else if (*p == '[' && !is_foldable_bracket(&p))
+    {
+      /* regcomp() tells what is wrong with the original */
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static int regex_flags_of(const pfilter_t filter)
+{
+  int regex_flags = REG_NEWLINE | REG_NOSUB;
+
+  if (filter->config->is_extended)
+  {
+    regex_flags |= REG_EXTENDED;
+  }
+
+  // ATTENTION: inverse condition
+  if (!filter->config->is_case_sensitive)
+  {
+    regex_flags |= REG_ICASE;
+  }
+
+  return regex_flags;
+}
+
+/* Keep the text of a regex, which compile_regexes() compiles with the others.
+ * The text stays for save_filtering().
+ */
+static int add_regex(plog_t log, pfilter_t filter, const char *line)
+{
+  size_t len = strlen(line) + 1;
+
+  if (filter->source_count + len > filter->source_size)
+  {
+    size_t size = filter->source_size ? filter->source_size : 1024;
+    char *sources;
+
+    while (filter->source_count + len > size)
+    {
+      size *= 2;
+    }
+    if (NULL == (sources = (char *)saferealloc(filter->sources, size)))
+    {
+      log_message(log, LOG_ERR, "cannot alloc memory for filter rule (%s)", line);
+      return -1;
+    }
+    filter->sources = sources;
+    filter->source_size = size;
+  }
+
+  memcpy(filter->sources + filter->source_count, line, len);
+  filter->source_count += len;
+
+  return 0;
+}
+
+static int compile_regex(regex_t *regex, const char *source, int regex_flags)
+{
+  char *folded = NULL;
+  int ret;
+
+  /* The strings are lower cased when the case is ignored, the regex can be as well */
+  if ((regex_flags & REG_ICASE) && is_foldable_regex(source) &&
+      NULL != (folded = safestrdup(source)))
+  {
+    fold_ascii(folded, folded, strlen(folded));
+    regex_flags &= ~REG_ICASE;
+  }
+
+  ret = regcomp(regex, folded ? folded : source, regex_flags);
+  safefree(folded);
+
+  return ret;
+}
+
+// the regexes of a filter being compiled, taken FILTER_REGEX_CHUNK at a time by the threads
+struct filter_compile_s
+{
+  const char **sources;
+  regex_t *regexes;
+  int *errors; // what regcomp() returned for each of them
+  size_t count, next;
+  int regex_flags;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+};
+
+static void *compile_regex_chunks(void *data)
+{
+  struct filter_compile_s *job = (struct filter_compile_s *)data;
+  size_t from, to;
+
+  while (true)
+  {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&job->lock);
+#endif
+    from = job->next;
+    to = job->count - from > FILTER_REGEX_CHUNK ? from + FILTER_REGEX_CHUNK : job->count;
+    job->next = to;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&job->lock);
+#endif
+
+    if (from == to)
+    {
+      return NULL;
+    }
+    for (size_t i = from; i < to; ++i)
+    {
+      job->errors[i] = compile_regex(&job->regexes[i], job->sources[i], job->regex_flags);
+    }
+  }
+}
+
+/*
+ * Compile the regexes kept by add_regex(), in the order of the file. A long
+ * list is shared by a thread per processor, so that the startup does not
+ * wait for the regexes one by one.
+ */
+static int compile_regexes(plog_t log, pfilter_t filter)
+{
+  struct filter_compile_s job;
+  const char *source;
+  size_t i;
+
+  memset(&job, 0, sizeof(job));
+  for (source = filter->sources; source < filter->sources + filter->source_count;
+       source += strlen(source) + 1)
+  {
+    ++job.count;
+  }
+  if (0 == job.count)
+  {
+    return 0;
+  }
+
+  job.sources = (const char **)safecalloc(job.count, sizeof(const char *));
+  job.regexes = (regex_t *)safecalloc(job.count, sizeof(regex_t));
+  job.errors = (int *)safecalloc(job.count, sizeof(int));
+  if (NULL == job.sources || NULL == job.regexes || NULL == job.errors)
+  {
+    log_message(log, LOG_ERR, "cannot alloc memory for the regexes of \"%s\"",
+                filter->config->file_path);
+    safefree(job.sources);
+    safefree(job.regexes);
+    safefree(job.errors);
+    return -1;
+  }
+  job.regex_flags = regex_flags_of(filter);
+  for (i = 0, source = filter->sources; i < job.count; ++i, source += strlen(source) + 1)
+  {
+    job.sources[i] = source;
+  }
+
+#ifdef HAVE_PTHREAD
+  {
+    pthread_t threads[FILTER_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t wanted = job.count / FILTER_REGEXES_PER_THREAD, started;
+
+    if (cpus > 0 && wanted > (size_t)cpus)
+    {
+      wanted = (size_t)cpus;
+    }
+    if (wanted > FILTER_MAX_THREADS)
+    {
+      wanted = FILTER_MAX_THREADS;
+    }
+
+    /* We are one of them, and compile all of them if no thread can be started */
+    pthread_mutex_init(&job.lock, NULL);
+    for (started = 0; started + 1 < wanted &&
+                      0 == pthread_create(&threads[started], NULL, compile_regex_chunks, &job);
+         ++started)
+    {
+    }
+    compile_regex_chunks(&job);
+    for (i = 0; i < started; ++i)
+    {
+      pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+  }
+#else
+  compile_regex_chunks(&job);
+#endif
+
+  for (i = 0; i < job.count && 0 == job.errors[i]; ++i)
+  {
+  }
+  if (i < job.count)
+  {
+    log_message(log, LOG_ERR, "bad regex in %s (%s)", filter->config->file_path,
+                job.sources[i]);
+    for (i = 0; i < job.count; ++i)
+    {
+      if (0 == job.errors[i])
+      {
+        regfree(&job.regexes[i]);
+      }
+    }
+    safefree(job.regexes);
+  }
+  else
+  {
+    filter->regexes = job.regexes;
+    filter->regex_count = job.count;
+  }
+
+  safefree(job.sources);
+  safefree(job.errors);
+
+  return NULL == filter->regexes ? -1 : 0;
+}
+
+static int bad_filter_init(pfilter_t filter, FILE *bad_file)
+{
+  flush_filter(filter);
+  fclose(bad_file);
+  return -1;
+}
+
+static void log_activated(plog_t log, pfilter_t filter, const char *how)
+{
+  log_message(log, LOG_INFO,
+              "successfully %s %lu filter rules "
+              "(%lu domains, %lu strings, %lu regexes) from \"%s\"",
+              how,
+              (unsigned long)(filter->domain_rule_count + filter->literal_count +
+                              filter->regex_count),
+              (unsigned long)filter->domain_rule_count, (unsigned long)filter->literal_count,
+              (unsigned long)filter->regex_count, filter->config->file_path);
+}
+
+static uint32_t db_options_of(const pfilter_t filter)
+{
+  return (filter->config->is_extended ? FILTER_DB_EXTENDED : 0) |
+         (filter->config->is_case_sensitive ? FILTER_DB_CASE_SENSITIVE : 0) |
+         (filter->config->does_full_url_filtering ? FILTER_DB_FULL_URL : 0);
+}
+
+static size_t db_padded(size_t size)
+{
+  return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Finds where the next array of the database is, checking that it fits in
+ * the file.
+ *
+ * Returns: the offset of the array, or 0 if the database is too short
+ */
+static size_t db_section(size_t *offset, uint64_t count, size_t item, size_t db_size)
+{
+  size_t start = *offset;
+
+  if (count > (db_size - start) / item)
+  {
+    return 0;
+  }
+  *offset = start + db_padded((size_t)count * item);
+
+  return *offset <= db_size ? start : 0;
+}
+
+static bool is_power_of_two(uint64_t n)
+{
+  return n == 0 || (n & (n - 1)) == 0;
+}
+
+/*
+ * Checks that the arrays of a loaded database only refer to what is in
+ * them, that the failure and output links lead back to the root, and that
+ * the hash tables have free slots: a damaged file must not make a lookup
+ * read past the mapping, or probe and follow links forever.
+ */
+static bool is_db_sound(const pfilter_t filter)
+{
+  const filter_node_t *node;
+  const filter_edge_t *edge;
+  const filter_domain_t *domain;
+  size_t i, used;
+
+  for (i = 0; i < filter->node_count; ++i)
+  {
+    node = &filter->nodes[i];
+    if (node->fail >= filter->node_count || node->output >= filter->node_count)
+    {
+      return false;
+    }
+    /* Each link goes to a shorter string */
+    if (i == 0 ? node->fail != 0 || node->output != 0
+               : filter->nodes[node->fail].depth >= node->depth ||
+                     (node->output != 0 && filter->nodes[node->output].depth >= node->depth))
+    {
+      return false;
+    }
+  }
+
+  for (i = 0, used = 0; i < filter->edge_size; ++i)
+  {
+    edge = &filter->edges[i];
+    if (edge->to == 0)
+    {
+      continue;
+    }
+    if (edge->from >= filter->node_count || edge->to >= filter->node_count)
+    {
+      return false;
+    }
+    ++used;
+  }
+  if (used != filter->edge_count)
+  {
+    return false;
+  }
+
+  for (i = 0; i < filter->domain_count; ++i)
+  {
+    domain = &filter->domains[i];
+    if (domain->parent >= filter->domain_count ||
+        (uint64_t)domain->label + domain->len > filter->label_count)
+    {
+      return false;
+    }
+  }
+
+  for (i = 0, used = 0; i < filter->domain_index_size; ++i)
+  {
+    if (filter->domain_index[i] >= filter->domain_count)
+    {
+      return false;
+    }
+    used += filter->domain_index[i] != 0;
+  }
+
+  return 2 * used <= filter->domain_index_size;
+}
+
+/*
+ * Maps the database which was compiled by tinyproxy-filtc, instead of
+ * parsing the rules. The arrays stay in the mapping, only the regexes are
+ * compiled.
+ */
+static int load_filter_db(plog_t log, pfilter_t filter, FILE *file)
+{
+  filter_db_header_t header;
+  size_t nodes, edges, domains, domain_index, labels, sources, offset, size;
+  long end;
+  char *db, *source;
+
+  if (fseek(file, 0, SEEK_END) || (end = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) ||
+      1 != fread(&header, sizeof(header), 1, file))
+  {
+    log_message(log, LOG_ERR, "cannot read the filter database \"%s\"",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+  size = (size_t)end;
+
+  if (header.version != FILTER_DB_VERSION || header.byte_order != FILTER_DB_BYTE_ORDER)
+  {
+    log_message(log, LOG_ERR,
+                "the filter database \"%s\" was made by another version of tinyproxy-filtc",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+  if (header.options != db_options_of(filter))
+  {
+    log_message(log, LOG_ERR,
+                "the filter database \"%s\" was compiled for other FilterURLs, "
+                "FilterExtended or FilterCaseSensitive options",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+
+  offset = sizeof(header);
+  nodes = db_section(&offset, header.node_count, sizeof(filter_node_t), size);
+  edges = db_section(&offset, header.edge_size, sizeof(filter_edge_t), size);
+  domains = db_section(&offset, header.domain_count, sizeof(filter_domain_t), size);
+  domain_index = db_section(&offset, header.domain_index_size, sizeof(uint32_t), size);
+  labels = db_section(&offset, header.label_count, 1, size);
+  sources = db_section(&offset, header.source_count, 1, size);
+  if (!nodes || !edges || !domains || !domain_index || !labels || !sources || offset != size ||
+      !is_power_of_two(header.edge_size) || 2 * header.edge_count > header.edge_size ||
+      (header.node_count > 0 && header.edge_size == 0) ||
+      !is_power_of_two(header.domain_index_size) ||
+      (header.domain_count > 0 && header.domain_index_size == 0))
+  {
+    log_message(log, LOG_ERR, "the filter database \"%s\" is damaged",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+
+#ifdef MINGW
+  if (NULL == (db = (char *)safemalloc(size)) || fseek(file, 0, SEEK_SET) ||
+      1 != fread(db, size, 1, file))
+  {
+    safefree(db);
+    log_message(log, LOG_ERR, "cannot read the filter database \"%s\"",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+#else
+  if (MAP_FAILED == (db = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(file), 0)))
+  {
+    log_message(log, LOG_ERR, "cannot map the filter database \"%s\"",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+#endif
+  filter->db = db;
+  filter->db_size = size;
+
+  filter->nodes = (filter_node_t *)(db + nodes);
+  filter->node_count = filter->node_size = (size_t)header.node_count;
+  filter->edges = (filter_edge_t *)(db + edges);
+  filter->edge_size = (size_t)header.edge_size;
+  filter->edge_count = (size_t)header.edge_count;
+  filter->literal_count = (size_t)header.literal_count;
+  filter->domains = (filter_domain_t *)(db + domains);
+  filter->domain_count = filter->domain_size = (size_t)header.domain_count;
+  filter->domain_index = (uint32_t *)(db + domain_index);
+  filter->domain_index_size = (size_t)header.domain_index_size;
+  filter->labels = db + labels;
+  filter->label_count = filter->label_size = (size_t)header.label_count;
+  filter->domain_rule_count = (size_t)header.domain_rule_count;
+
+  if (!is_db_sound(filter) ||
+      (header.source_count > 0 && db[sources + header.source_count - 1] != '\0'))
+  {
+    log_message(log, LOG_ERR, "the filter database \"%s\" is damaged",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+  for (source = db + sources; source < db + sources + header.source_count;
+       source += strlen(source) + 1)
+  {
+    if (add_regex(log, filter, source))
+    {
+      return bad_filter_init(filter, file);
+    }
+  }
+  if (compile_regexes(log, filter))
+  {
+    return bad_filter_init(filter, file);
+  }
+
+  log_activated(log, filter, "loaded");
+  fclose(file);
+  return 0;
+}
+
+static int write_db_section(FILE *file, const void *data, size_t size)
+{
+  static const char padding[8];
+
+  if (size > 0 && 1 != fwrite(data, size, 1, file))
+  {
+    return -1;
+  }
+  if (db_padded(size) != size && 1 != fwrite(padding, db_padded(size) - size, 1, file))
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+int save_filtering(plog_t log, pfilter_t filter, const char *path)
+{
+  filter_db_header_t header;
+  FILE *file;
+  char *temp;
+  bool failed;
+
+  /* The proxies which mapped the old file keep it, it is replaced only when complete */
+  if (NULL == (temp = (char *)safemalloc(strlen(path) + sizeof(".tmp"))))
+  {
+    log_message(log, LOG_ERR, "cannot alloc memory to save \"%s\"", path);
+    return -1;
+  }
+  strcpy(temp, path);
+  strcat(temp, ".tmp");
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FILTER_DB_MAGIC, sizeof(header.magic));
+  header.version = FILTER_DB_VERSION;
+  header.byte_order = FILTER_DB_BYTE_ORDER;
+  header.options = db_options_of(filter);
+  header.node_count = filter->node_count;
+  header.edge_size = filter->edge_size;
+  header.edge_count = filter->edge_count;
+  header.literal_count = filter->literal_count;
+  header.domain_count = filter->domain_count;
+  header.domain_index_size = filter->domain_index_size;
+  header.label_count = filter->label_count;
+  header.domain_rule_count = filter->domain_rule_count;
+  header.regex_count = filter->regex_count;
+  header.source_count = filter->source_count;
+
+  if (NULL == (file = fopen(temp, "wb")))
+  {
+    log_message(log, LOG_ERR, "cannot create the filter database \"%s\"", temp);
+    safefree(temp);
+    return -1;
+  }
+
+  failed = write_db_section(file, &header, sizeof(header)) ||
+           write_db_section(file, filter->nodes, filter->node_count * sizeof(filter_node_t)) ||
+           write_db_section(file, filter->edges, filter->edge_size * sizeof(filter_edge_t)) ||
+           write_db_section(file, filter->domains,
+                            filter->domain_count * sizeof(filter_domain_t)) ||
+           write_db_section(file, filter->domain_index,
+                            filter->domain_index_size * sizeof(uint32_t)) ||
+           write_db_section(file, filter->labels, filter->label_count) ||
+           write_db_section(file, filter->sources, filter->source_count);
+  if (fclose(file))
+  {
+    failed = true;
+  }
+
+  if (failed || rename(temp, path))
+  {
+    log_message(log, LOG_ERR, "cannot write the filter database \"%s\"", path);
+    remove(temp);
+    safefree(temp);
+    return -1;
+  }
+
+  log_message(log, LOG_INFO, "saved %lu filter rules into \"%s\"",
+              (unsigned long)(filter->domain_rule_count + filter->literal_count +
+                              filter->regex_count),
+              path);
+  safefree(temp);
+  return 0;
+}
+
+// builds the matcher of the hosts/urls to be filtered
+int activate_filtering(plog_t log, pfilter_t filter)
+{
+  if (NULL == filter)
+  {
+    log_message(log, LOG_ERR, "%s", "there is no filter to activate");
+    return -1;
+  }
+  if (!filter->config->enabled)
+  {
+    log_message(log, LOG_INFO, "%s", "filtering is not enabled by config");
+    return 0;
+  }
+  // check if the filter was already activated
+  if (filter->domain_rule_count + filter->literal_count + filter->regex_count > 0)
+  {
+    log_message(log, LOG_WARNING,
+                "filter is already activated "
+                "{file: \"%s\", rules_count: %lu}",
+                filter->config->file_path,
+                (unsigned long)(filter->domain_rule_count + filter->literal_count +
+                                filter->regex_count));
+    return 0;
+  }
+
+  FILE *file;
+  char line[FILTER_MAX_REGEX_LEN];
+  char literal[FILTER_MAX_REGEX_LEN];
+  uint8_t anchors, match;
+
+  file = fopen(filter->config->file_path, "rb");
+  if (NULL == file)
+  {
+    log_message(log, LOG_ERR, "cannot open file with filter rules \"%s\"",
+                filter->config->file_path);
+    return -1;
+  }
+
+  // a database compiled by tinyproxy-filtc
+  if (sizeof(FILTER_DB_MAGIC) - 1 == fread(line, 1, sizeof(FILTER_DB_MAGIC) - 1, file) &&
+      0 == memcmp(line, FILTER_DB_MAGIC, sizeof(FILTER_DB_MAGIC) - 1))
+  {
+    return load_filter_db(log, filter, file);
+  }
+  rewind(file);
+
+  while (fgets(line, FILTER_MAX_REGEX_LEN, file))
+  {
+    { // forget any trailing white space and comments
+      char *s = line;
+      while (*s && (!(isspace((unsigned char)*s))) && *s != '#')
+      {
+        // break at first whitespace or '#'
+        // note: not url or host can have spaces (it is always encoded)
+        // note: not url or host can have '#' (it is always encoded)
+        ++s;
+      }
+      *s = '\0';
+    }
+
+    // skip blank or comment line
+    if (*line == '\0')
+    {
+      continue;
+    }
+
+    // only the hosts are made of labels
+    if (!filter->config->does_full_url_filtering &&
+        (match = parse_domain(line, filter->config->is_extended, literal)))
+    {
+      if (insert_domain(filter, literal, match))
+      {
+        log_message(log, LOG_ERR, "cannot alloc memory for filter rule (%s)", line);
+        return bad_filter_init(filter, file);
+      }
+    }
+    else if ((anchors = parse_literal(line, filter->config->is_extended, literal)))
+    {
+      if (insert_literal(filter, literal, anchors))
+      {
+        log_message(log, LOG_ERR, "cannot alloc memory for filter rule (%s)", line);
+        return bad_filter_init(filter, file);
+      }
+    }
+    else if (add_regex(log, filter, line))
+    {
+      return bad_filter_init(filter, file);
+    }
+  }
+
+  if (ferror(file))
+  {
+    log_message(log, LOG_ERR, "fgets error with file \"%s\"", filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+
+  if (link_automaton(filter))
+  {
+    log_message(log, LOG_ERR, "cannot alloc memory for the filter of \"%s\"",
+                filter->config->file_path);
+    return bad_filter_init(filter, file);
+  }
+
+  if (compile_regexes(log, filter))
+  {
+    return bad_filter_init(filter, file);
+  }
+
+  log_activated(log, filter, "activated");
+  fclose(file);
+  return 0;
+}
+
+/*
+ * Runs the automaton over one line of the (lower cased) string: the anchors
+ * are those of REG_NEWLINE.
+ */
+static bool does_line_match_literals(pfilter_t filter, const char *s, size_t len)
+{
+  const filter_node_t *nodes = filter->nodes;
+  uint32_t state = 0, next, out;
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+
+    while (0 == (next = edge_get(filter, state, c)) && state != 0)
+    {
+      state = nodes[state].fail;
+    }
+    state = next;
+
+    for (out = nodes[state].anchors ? state : nodes[state].output; out != 0;
+         out = nodes[out].output)
+    {
+      bool at_start = nodes[out].depth == i + 1, at_end = i + 1 == len;
+      uint8_t anchors = nodes[out].anchors;
+
+      if ((anchors & FILTER_ANYWHERE) || ((anchors & FILTER_AT_START) && at_start) ||
+          ((anchors & FILTER_AT_END) && at_end) || ((anchors & FILTER_WHOLE) && at_start && at_end))
+      {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Walks down the domain trie with the labels of one line of the host, from
+ * the last one.
+ */
+static bool does_line_match_domains(pfilter_t filter, const char *s, size_t len)
+{
+  size_t end = len, start;
+  uint32_t node = 0;
+
+  while (true)
+  {
+    for (start = end; start > 0 && s[start - 1] != '.'; --start)
+    {
+    }
+
+    if (0 == (node = filter->domain_index[domain_slot(filter, node, s + start, end - start)]))
+    {
+      return false;
+    }
+
+    if (((filter->domains[node].match & FILTER_DOMAIN_EXACT) && start == 0) ||
+        ((filter->domains[node].match & FILTER_DOMAIN_BELOW) && start > 0))
+    {
+      return true;
+    }
+
+    if (start == 0)
+    {
+      return false;
+    }
+    end = start - 1;
+  }
+}
+
+/*
+ * Is any rule matching the string, already lower cased unless
+ * FilterCaseSensitive is on?
+ */
+static bool does_string_match(pfilter_t filter, const char *s)
+{
+  if (filter->domain_count > 0 || filter->node_count > 0)
+  {
+    const char *line = s, *end;
+    size_t len;
+
+    /* The strings do not contain newlines, so they do not match across lines */
+    while (true)
+    {
+      end = strchr(line, '\n');
+      len = end ? (size_t)(end - line) : strlen(line);
+      if ((filter->domain_count > 0 && does_line_match_domains(filter, line, len)) ||
+          (filter->node_count > 0 && does_line_match_literals(filter, line, len)))
+      {
+        return true;
+      }
+      if (NULL == end)
+      {
+        break;
+      }
+      line = end + 1;
+    }
+  }
+
+  for (size_t i = 0; i < filter->regex_count; ++i)
+  {
+    if (!regexec(&filter->regexes[i], s, 0, NULL, 0))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool is_passing(const pfilter_t filter, bool matched)
+{
+  return matched == (filter->config->policy == FILTER_WHITE_LIST);
+}
+
+// return true to allow, false to block
+bool does_string_pass_filter(plog_t log, pfilter_t filter, const char *s)
+{
+  char buffer[FILTER_CACHE_KEY_MAX], *folded;
+  size_t len;
+  bool matched;
+
+  if (NULL == s)
+  {
+    log_message(log, LOG_ERR, "%s", "cannot applying rule to empty string");
+    return false;
+  }
+
+  if (filter->config->is_case_sensitive)
+  {
+    return is_passing(filter, does_string_match(filter, s));
+  }
+
+  len = strlen(s);
+  folded = len < sizeof(buffer) ? buffer : (char *)safemalloc(len + 1);
+  if (NULL == folded)
+  {
+    log_message(log, LOG_ERR, "cannot alloc memory for applying rule to \"%s\"", s);
+    return false;
+  }
+  fold_ascii(folded, s, len + 1);
+
+  matched = does_string_match(filter, folded);
+  if (folded != buffer)
+  {
+    safefree(folded);
+  }
+
+  return is_passing(filter, matched);
+}
+
+/* Copy s into the key of its verdict, lower cased as the rules see it: two
+ * strings with the same key get the same verdict. Returns false if s is too
+ * long to be cached.
+ */
+static bool verdict_key(const pfilter_t filter, const char *s, char *key, uint32_t *hash)
+{
+  uint32_t h = 2166136261U;
+  size_t len = strlen(s);
+
+  if (len >= FILTER_CACHE_KEY_MAX)
+  {
+    return false;
+  }
+
+  if (filter->config->is_case_sensitive)
+  {
+    memcpy(key, s, len + 1);
+  }
+  else
+  {
+    fold_ascii(key, s, len + 1);
+  }
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    h = (h ^ (unsigned char)key[i]) * 16777619U;
+  }
+  *hash = h;
+
+  return true;
+}
+
+static uint32_t *verdict_bucket(const pfilter_t filter, uint32_t hash)
+{
+  return &filter->verdict_index[hash & (filter->verdict_index_size - 1)];
+}
+
+static void unlink_verdict(pfilter_t filter, uint32_t v)
+{
+  filter_verdict_t *verdict = &filter->verdicts[v];
+
+  if (verdict->newer)
+  {
+    filter->verdicts[verdict->newer].older = verdict->older;
+  }
+  else
+  {
+    filter->newest = verdict->older;
+  }
+  if (verdict->older)
+  {
+    filter->verdicts[verdict->older].newer = verdict->newer;
+  }
+  else
+  {
+    filter->oldest = verdict->newer;
+  }
+}
+
+static void push_verdict(pfilter_t filter, uint32_t v)
+{
+  filter->verdicts[v].newer = 0;
+  filter->verdicts[v].older = filter->newest;
+  if (filter->newest)
+  {
+    filter->verdicts[filter->newest].newer = v;
+  }
+  else
+  {
+    filter->oldest = v;
+  }
+  filter->newest = v;
+}
+
+/* Returns the cached verdict of the key, made the most recently used one,
+ * or NULL.
+ */
+static filter_verdict_t *find_verdict(pfilter_t filter, const char *key, uint32_t hash)
+{
+  uint32_t v;
+
+  if (NULL == filter->verdicts)
+  {
+    return NULL;
+  }
+
+  for (v = *verdict_bucket(filter, hash); v != 0; v = filter->verdicts[v].next)
+  {
+    if (filter->verdicts[v].hash == hash && 0 == strcmp(filter->verdicts[v].key, key))
+    {
+      unlink_verdict(filter, v);
+      push_verdict(filter, v);
+      return &filter->verdicts[v];
+    }
+  }
+
+  return NULL;
+}
+
+/* Cache the verdict of the key, in place of the least recently used one
+ * once the cache is full. The cache is allocated by the first verdict, so
+ * that it is made by each child, not by the parent.
+ */
+static void keep_verdict(pfilter_t filter, const char *key, uint32_t hash, bool pass)
+{
+  uint32_t v, *link;
+  char *copy;
+
+  if (NULL == filter->verdicts)
+  {
+    size_t size = 1;
+
+    while (size < filter->config->cache)
+    {
+      size *= 2;
+    }
+    filter->verdicts =
+        (filter_verdict_t *)safecalloc((size_t)filter->config->cache + 1, sizeof(filter_verdict_t));
+    filter->verdict_index = (uint32_t *)safecalloc(size, sizeof(uint32_t));
+    if (NULL == filter->verdicts || NULL == filter->verdict_index)
+    {
+      flush_verdicts(filter);
+      return;
+    }
+    filter->verdict_index_size = size;
+  }
+
+  if (NULL == (copy = safestrdup(key)))
+  {
+    return;
+  }
+
+  if (filter->verdict_count < filter->config->cache)
+  {
+    v = (uint32_t)++filter->verdict_count;
+  }
+  else
+  {
+    v = filter->oldest;
+    for (link = verdict_bucket(filter, filter->verdicts[v].hash); *link != v;
+         link = &filter->verdicts[*link].next)
+    {
+    }
+    *link = filter->verdicts[v].next;
+    unlink_verdict(filter, v);
+    safefree(filter->verdicts[v].key);
+  }
+
+  filter->verdicts[v].key = copy;
+  filter->verdicts[v].hash = hash;
+  filter->verdicts[v].pass = pass;
+  link = verdict_bucket(filter, hash);
+  filter->verdicts[v].next = *link;
+  *link = v;
+  push_verdict(filter, v);
+}
+
+// return true to allow, false to block
+bool does_pass_filter(plog_t log, pfilter_t filter, const char *host, const char *url,
+                      filter_cache_result_t *cached)
+{
+  const char *s = filter->config->does_full_url_filtering ? url : host;
+  char key[FILTER_CACHE_KEY_MAX];
+  filter_verdict_t *verdict;
+  uint32_t hash;
+  bool pass;
+
+  if (NULL != cached)
+  {
+    *cached = FILTER_CACHE_OFF;
+  }
+
+  if (0 == filter->config->cache || NULL == s || !verdict_key(filter, s, key, &hash))
+  {
+    return does_string_pass_filter(log, filter, s);
+  }
+
+  if (NULL != (verdict = find_verdict(filter, key, hash)))
+  {
+    pass = verdict->pass;
+    if (NULL != cached)
+    {
+      *cached = FILTER_CACHE_HIT;
+    }
+  }
+  else
+  {
+    /* The key is the string to match */
+    pass = is_passing(filter, does_string_match(filter, key));
+    keep_verdict(filter, key, hash, pass);
+    if (NULL != cached)
+    {
+      *cached = FILTER_CACHE_MISS;
+    }
+  }
+
+  return pass;
 }
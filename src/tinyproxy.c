@@ -4,6 +4,7 @@
 
 #include "tinyproxy.h"
 
+#include "common.h"
 #include "self_contained/safecall.h"
 
 CREATE_IMPL(pproxy_t, {
@@ -12,6 +13,12 @@ CREATE_IMPL(pproxy_t, {
   obj->acl = NULL;
   obj->auth = NULL;
   obj->filter = NULL;
+  obj->generation = 0;
+  obj->published = NULL;
+
+  obj->published = calloc_shared_memory(1, sizeof(*obj->published));
+  TRACE_SAFE_FIN(MAP_FAILED == obj->published, NULL, obj->published = NULL;
+                 delete_pproxy_t(&obj));
 
   obj->log = create_plog_t();
   TRACE_SAFE_FIN(NULL == obj->log, NULL, delete_pproxy_t(&obj));
@@ -35,6 +42,11 @@ DELETE_IMPL(pproxy_t, {
   TRACE_SAFE(delete_pacl_t(&obj->acl));
   TRACE_SAFE(delete_pauth_t(&obj->auth));
   TRACE_SAFE(delete_pfilter_t(&obj->filter));
+
+  if (obj->published)
+  {
+    free_shared_memory((void *)obj->published, sizeof(*obj->published));
+  }
 })
 
 int configure_proxy(pproxy_t proxy, pconf_log_t log_config, pconf_anon_t anon_config,
@@ -71,3 +83,51 @@ int configure_proxy(pproxy_t proxy, pconf_log_t log_config, pconf_anon_t anon_co
 
   TRACE_SUCCESS;
 }
+
+int reconfigure_proxy(pproxy_t proxy, pconf_anon_t anon_config, pconf_acl_t acl_config,
+                      pconf_auth_t auth_config, pconf_filt_t filt_config)
+{
+  TRACE_CALL_X(reconfigure_proxy, "proxy = %p", (void *)proxy);
+
+  TRACE_SAFE_X(NULL == proxy, -1, "%s", "there is no proxy object to reconfigure");
+  TRACE_SAFE_X(NULL == anon_config || NULL == acl_config || NULL == auth_config ||
+                   NULL == filt_config,
+               -1, "%s", "there is no configuration to reconfigure proxy with");
+
+  panon_t anon = create_configured_anon(anon_config);
+  pacl_t acl = create_configured_acl(acl_config);
+  pauth_t auth = create_configured_auth(auth_config);
+  pfilter_t filter = create_configured_filter(filt_config);
+
+  // build everything aside, so that a broken file keeps the proxy as it was
+  if (NULL == anon || NULL == acl || NULL == auth || NULL == filter ||
+      activate_filtering(proxy->log, filter))
+  {
+    delete_panon_t(&anon);
+    delete_pacl_t(&acl);
+    delete_pauth_t(&auth);
+    delete_pfilter_t(&filter);
+    TRACE_RETURN_X(-1, "%s", "could not build the new proxy objects");
+  }
+
+  refresh_acl_hosts(proxy->log, acl);
+
+  TRACE_SAFE(delete_panon_t(&proxy->anon));
+  TRACE_SAFE(delete_pacl_t(&proxy->acl));
+  TRACE_SAFE(delete_pauth_t(&proxy->auth));
+  TRACE_SAFE(delete_pfilter_t(&proxy->filter));
+
+  proxy->anon = anon;
+  proxy->acl = acl;
+  proxy->auth = auth;
+  proxy->filter = filter;
+
+  *proxy->published = ++proxy->generation;
+
+  TRACE_SUCCESS;
+}
+
+unsigned int is_proxy_outdated(pproxy_t proxy)
+{
+  return proxy->published && *proxy->published != proxy->generation;
+}
@@ -54,7 +54,7 @@ static int build_url(char **url, const char *host, int port, const char *path)
   return snprintf(*url, len, "http://%s:%d%s", host, port, path);
 }
 
-int do_transparent_proxy(pproxy_t proxy, struct conn_s *connptr, phashmap_t hashofheaders,
+int do_transparent_proxy(pproxy_t proxy, struct conn_s *connptr, pheaders_t hashofheaders,
                          struct request_s *request, struct config_s *conf, char **url)
 {
   socklen_t length;
@@ -62,7 +62,7 @@ int do_transparent_proxy(pproxy_t proxy, struct conn_s *connptr, phashmap_t hash
   size_t ulen = strlen(*url);
   ssize_t i;
 
-  length = hashmap_entry_by_key(hashofheaders, "host", (void **)&data);
+  length = headers_entry_by_id(hashofheaders, HEADER_HOST, &data);
   if (length <= 0)
   {
     struct sockaddr_in dest_addr;